@@ -0,0 +1,294 @@
+/*------------------------------------------------------------------------------
+    Tune Land - Sandbox RPG
+    Copyright (C) 2012-2013
+        Antony Martin <antony(dot)martin(at)scengine(dot)org>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ -----------------------------------------------------------------------------*/
+
+#include "availmap.h"
+
+#define AMAP_MIN_SIZE 256
+#define AMAP_MASK (AMAP_BRICK_SIZE - 1)
+
+void AMap_Init (AvailMap *am)
+{
+    am->bricks = NULL;
+    am->size = 0;
+    am->n_bricks = 0;
+    memset (am->n_set, 0, sizeof am->n_set);
+}
+void AMap_Clear (AvailMap *am)
+{
+    SCE_free (am->bricks);
+}
+
+/* rounds towards minus infinity, cell coordinates can be negative */
+static long AMap_FloorDiv (long v, long d)
+{
+    return v >= 0 ? v / d : -((-v + d - 1) / d);
+}
+static long AMap_Brick (long v)
+{
+    return AMap_FloorDiv (v, AMAP_BRICK_SIZE);
+}
+
+static SCEuint AMap_Hash (int layer, long x, long y, long z)
+{
+    unsigned long h = (unsigned long)x * 73856093UL ^
+        (unsigned long)y * 19349663UL ^ (unsigned long)z * 83492791UL ^
+        (unsigned long)layer * 2654435761UL;
+    return h ^ (h >> 16);
+}
+
+static AMapBrick* AMap_Find (const AvailMap *am, int layer, long x, long y,
+                             long z)
+{
+    SCEuint i;
+
+    if (!am->size)
+        return NULL;
+    i = AMap_Hash (layer, x, y, z) & (am->size - 1);
+    while (am->bricks[i].layer >= 0) {
+        AMapBrick *b = &am->bricks[i];
+        if (b->layer == layer && b->x == x && b->y == y && b->z == z)
+            return b;
+        i = (i + 1) & (am->size - 1);
+    }
+    return NULL;
+}
+
+static int AMap_Grow (AvailMap *am)
+{
+    AMapBrick *old = am->bricks;
+    SCEuint i, j, old_size = am->size;
+    SCEuint size = old_size ? old_size * 2 : AMAP_MIN_SIZE;
+
+    if (!(am->bricks = SCE_malloc (size * sizeof *am->bricks))) {
+        am->bricks = old;
+        SCEE_LogSrc ();
+        return SCE_ERROR;
+    }
+    for (i = 0; i < size; i++)
+        am->bricks[i].layer = -1;
+    am->size = size;
+    for (i = 0; i < old_size; i++) {
+        if (old[i].layer < 0)
+            continue;
+        j = AMap_Hash (old[i].layer, old[i].x, old[i].y, old[i].z) &
+            (size - 1);
+        while (am->bricks[j].layer >= 0)
+            j = (j + 1) & (size - 1);
+        am->bricks[j] = old[i];
+    }
+    SCE_free (old);
+    return SCE_OK;
+}
+
+/* adds an empty brick, which must not be in the table yet */
+static AMapBrick* AMap_Insert (AvailMap *am, int layer, long x, long y,
+                               long z)
+{
+    AMapBrick *b = NULL;
+    SCEuint i;
+
+    if ((am->n_bricks + 1) * 2 > am->size && AMap_Grow (am) < 0) {
+        SCEE_LogSrc ();
+        return NULL;
+    }
+    i = AMap_Hash (layer, x, y, z) & (am->size - 1);
+    while (am->bricks[i].layer >= 0)
+        i = (i + 1) & (am->size - 1);
+    b = &am->bricks[i];
+    b->layer = layer;
+    b->x = x;
+    b->y = y;
+    b->z = z;
+    b->bits = 0;
+    am->n_bricks++;
+    return b;
+}
+
+/**
+ * \brief Sets or clears the bit of a cell
+ * \param layer layer of the cell, below AMAP_MAX_LAYERS
+ * \param x,y,z coordinates of the cell
+ *
+ * Bricks are never removed, a brick whose bits are all cleared stays in
+ * the table for when its cells are set again.
+ */
+int AMap_Set (AvailMap *am, int layer, long x, long y, long z, int set)
+{
+    AMapBrick *b = NULL;
+    long bx = AMap_Brick (x), by = AMap_Brick (y), bz = AMap_Brick (z);
+    uint64_t bit;
+
+    if (!(b = AMap_Find (am, layer, bx, by, bz))) {
+        if (!set)
+            return SCE_OK;
+        if (!(b = AMap_Insert (am, layer, bx, by, bz))) {
+            SCEE_LogSrc ();
+            return SCE_ERROR;
+        }
+    }
+
+    bit = (uint64_t)1 << ((x & AMAP_MASK) |
+                          (y & AMAP_MASK) << AMAP_BRICK_SHIFT |
+                          (z & AMAP_MASK) << (2 * AMAP_BRICK_SHIFT));
+    if (set && !(b->bits & bit)) {
+        b->bits |= bit;
+        am->n_set[layer]++;
+    } else if (!set && (b->bits & bit)) {
+        b->bits &= ~bit;
+        am->n_set[layer]--;
+    }
+    return SCE_OK;
+}
+int AMap_Get (const AvailMap *am, int layer, long x, long y, long z)
+{
+    const AMapBrick *b = NULL;
+
+    b = AMap_Find (am, layer, AMap_Brick (x), AMap_Brick (y), AMap_Brick (z));
+    if (!b)
+        return SCE_FALSE;
+    return (b->bits >> ((x & AMAP_MASK) |
+                        (y & AMAP_MASK) << AMAP_BRICK_SHIFT |
+                        (z & AMAP_MASK) << (2 * AMAP_BRICK_SHIFT))) & 1;
+}
+
+/* bits of the cells [x1, x2] x [y1, y2] x [z1, z2] of a brick */
+static uint64_t AMap_Mask (int x1, int x2, int y1, int y2, int z1, int z2)
+{
+    uint64_t row, mask = 0;
+    int y, z;
+
+    row = (((uint64_t)1 << (x2 - x1 + 1)) - 1) << x1;
+    for (z = z1; z <= z2; z++) {
+        for (y = y1; y <= y2; y++)
+            mask |= row << (y * AMAP_BRICK_SIZE + z * AMAP_BRICK_SIZE *
+                            AMAP_BRICK_SIZE);
+    }
+    return mask;
+}
+
+/**
+ * \brief Sets or clears the bits of all the cells overlapping a region
+ * \param r the region, p2 excluded
+ * \param cell_size size of a cell in the units of \p r
+ * \sa AMap_Set()
+ */
+int AMap_SetRegion (AvailMap *am, int layer, const SCE_SLongRect3 *r,
+                    long cell_size, int set)
+{
+    long p1[3], p2[3], c1[3], c2[3], b1[3], b2[3], b[3];
+    int i;
+
+    SCE_Rectangle3_GetPointslv (r, p1, p2);
+    for (i = 0; i < 3; i++) {
+        c1[i] = AMap_FloorDiv (p1[i], cell_size);
+        c2[i] = AMap_FloorDiv (p2[i] - 1, cell_size);
+        if (c2[i] < c1[i])
+            return SCE_OK;
+        b1[i] = AMap_Brick (c1[i]);
+        b2[i] = AMap_Brick (c2[i]);
+    }
+
+    for (b[2] = b1[2]; b[2] <= b2[2]; b[2]++) {
+        for (b[1] = b1[1]; b[1] <= b2[1]; b[1]++) {
+            for (b[0] = b1[0]; b[0] <= b2[0]; b[0]++) {
+                AMapBrick *brick = NULL;
+                int lo[3], hi[3];
+                uint64_t mask;
+
+                brick = AMap_Find (am, layer, b[0], b[1], b[2]);
+                if (!brick) {
+                    if (!set)
+                        continue;
+                    brick = AMap_Insert (am, layer, b[0], b[1], b[2]);
+                    if (!brick) {
+                        SCEE_LogSrc ();
+                        return SCE_ERROR;
+                    }
+                }
+                for (i = 0; i < 3; i++) {
+                    lo[i] = b[i] == b1[i] ? c1[i] & AMAP_MASK : 0;
+                    hi[i] = b[i] == b2[i] ? c2[i] & AMAP_MASK : AMAP_MASK;
+                }
+                mask = AMap_Mask (lo[0], hi[0], lo[1], hi[1], lo[2], hi[2]);
+                if (set) {
+                    am->n_set[layer] += __builtin_popcountll (mask &
+                                                              ~brick->bits);
+                    brick->bits |= mask;
+                } else {
+                    am->n_set[layer] -= __builtin_popcountll (mask &
+                                                              brick->bits);
+                    brick->bits &= ~mask;
+                }
+            }
+        }
+    }
+    return SCE_OK;
+}
+
+/**
+ * \brief Checks that no cell overlapping a region is set
+ * \param r the region, p2 excluded
+ * \param cell_size size of a cell in the units of \p r
+ */
+int AMap_IsRegionClear (const AvailMap *am, int layer,
+                        const SCE_SLongRect3 *r, long cell_size)
+{
+    long p1[3], p2[3], c1[3], c2[3], b1[3], b2[3], b[3];
+    int i;
+
+    if (am->n_set[layer] == 0)
+        return SCE_TRUE;
+
+    SCE_Rectangle3_GetPointslv (r, p1, p2);
+    for (i = 0; i < 3; i++) {
+        c1[i] = AMap_FloorDiv (p1[i], cell_size);
+        c2[i] = AMap_FloorDiv (p2[i] - 1, cell_size);
+        if (c2[i] < c1[i])
+            return SCE_TRUE;
+        b1[i] = AMap_Brick (c1[i]);
+        b2[i] = AMap_Brick (c2[i]);
+    }
+
+    for (b[2] = b1[2]; b[2] <= b2[2]; b[2]++) {
+        for (b[1] = b1[1]; b[1] <= b2[1]; b[1]++) {
+            for (b[0] = b1[0]; b[0] <= b2[0]; b[0]++) {
+                const AMapBrick *brick = NULL;
+                int lo[3], hi[3];
+
+                brick = AMap_Find (am, layer, b[0], b[1], b[2]);
+                if (!brick || !brick->bits)
+                    continue;
+                /* part of the brick within the region */
+                for (i = 0; i < 3; i++) {
+                    lo[i] = b[i] == b1[i] ? c1[i] & AMAP_MASK : 0;
+                    hi[i] = b[i] == b2[i] ? c2[i] & AMAP_MASK : AMAP_MASK;
+                }
+                if (brick->bits & AMap_Mask (lo[0], hi[0], lo[1], hi[1],
+                                             lo[2], hi[2]))
+                    return SCE_FALSE;
+            }
+        }
+    }
+    return SCE_TRUE;
+}
+
+SCEulong AMap_GetNumSet (const AvailMap *am, int layer)
+{
+    return am->n_set[layer];
+}
@@ -0,0 +1,60 @@
+/*------------------------------------------------------------------------------
+    Tune Land - Sandbox RPG
+    Copyright (C) 2012-2013
+        Antony Martin <antony(dot)martin(at)scengine(dot)org>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ -----------------------------------------------------------------------------*/
+
+#ifndef H_AVAILMAP
+#define H_AVAILMAP
+
+#include <stdint.h>
+#include <SCE/utils/SCEUtils.h>
+
+#define AMAP_MAX_LAYERS 32
+
+/* bricks of 4x4x4 cells, one bit per cell */
+#define AMAP_BRICK_SHIFT 2
+#define AMAP_BRICK_SIZE (1 << AMAP_BRICK_SHIFT)
+
+typedef struct amapbrick AMapBrick;
+struct amapbrick {
+    long x, y, z;               /* brick coordinates */
+    int layer;                  /* -1 if the slot is free */
+    uint64_t bits;
+};
+
+/* sparse bitmap over an integer grid, one per layer (eg. level of detail),
+   stored as bricks in a hash table. cells are typically nodes, a set bit
+   meaning the node is not available yet: testing a region for availability
+   only looks at the bricks it overlaps */
+typedef struct availmap AvailMap;
+struct availmap {
+    AMapBrick *bricks;
+    SCEuint size;               /* number of slots, power of two */
+    SCEuint n_bricks;
+    SCEulong n_set[AMAP_MAX_LAYERS]; /* number of bits set per layer */
+};
+
+void AMap_Init (AvailMap*);
+void AMap_Clear (AvailMap*);
+
+int AMap_Set (AvailMap*, int, long, long, long, int);
+int AMap_Get (const AvailMap*, int, long, long, long);
+int AMap_SetRegion (AvailMap*, int, const SCE_SLongRect3*, long, int);
+int AMap_IsRegionClear (const AvailMap*, int, const SCE_SLongRect3*, long);
+SCEulong AMap_GetNumSet (const AvailMap*, int);
+
+#endif /* guard */
@@ -0,0 +1,304 @@
+/*------------------------------------------------------------------------------
+    Tune Land - Sandbox RPG
+    Copyright (C) 2012-2013
+        Antony Martin <antony(dot)martin(at)scengine(dot)org>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ -----------------------------------------------------------------------------*/
+
+#include "cachebudget.h"
+
+/* limits are never set below that, whatever the budget */
+#define CBUDGET_MIN_ENTRIES 32
+/* a new limit is only applied when it differs by more than 1/8 from the
+   current one, so that the average file size wobbling doesn't resize the
+   cache every frame */
+#define CBUDGET_HYSTERESIS 8
+/* guess of the size of a cached file until we have read some: chunks
+   compress well */
+#define CBUDGET_DEFAULT_FILE_SIZE 4096
+
+
+/* counting file system */
+
+typedef struct countfile CountFile;
+struct countfile {
+    CountFS *cfs;
+    SCE_SFile sub;
+};
+
+static void* CountFS_xopen (SCE_SFileSystem *fs, const char *fname, int flags)
+{
+    CountFS *cfs = fs->udata;
+    CountFile *cf = NULL;
+
+    if (!(cf = SCE_malloc (sizeof *cf))) {
+        SCEE_LogSrc ();
+        return NULL;
+    }
+    cf->cfs = cfs;
+    SCE_File_Init (&cf->sub);
+    if (SCE_File_Open (&cf->sub, cfs->subfs, fname, flags) < 0) {
+        SCE_free (cf);
+        SCEE_LogSrc ();
+        return NULL;
+    }
+    if (flags & (SCE_FILE_WRITE | SCE_FILE_CREATE | SCE_FILE_APPEND))
+        cfs->n_writes++;
+    else
+        cfs->n_reads++;
+    return cf;
+}
+static int CountFS_xclose (SCE_SFileSystem *fs, void *fd)
+{
+    CountFile *cf = fd;
+    (void)fs;
+    SCE_File_Close (&cf->sub);
+    SCE_free (cf);
+    return 0;
+}
+static size_t CountFS_xread (void *data, size_t size, size_t nmemb, void *fd)
+{
+    CountFile *cf = fd;
+    size_t n = SCE_File_Read (data, size, nmemb, &cf->sub);
+    cf->cfs->bytes_read += n * size;
+    return n;
+}
+static size_t CountFS_xwrite (const void *data, size_t size, size_t nmemb,
+                              void *fd)
+{
+    CountFile *cf = fd;
+    size_t n = SCE_File_Write (data, size, nmemb, &cf->sub);
+    cf->cfs->bytes_written += n * size;
+    return n;
+}
+static int CountFS_xseek (void *fd, long offset, int whence)
+{
+    return SCE_File_Seek (&((CountFile*)fd)->sub, offset, whence);
+}
+static long CountFS_xtell (void *fd)
+{
+    return SCE_File_Tell (&((CountFile*)fd)->sub);
+}
+static void CountFS_xrewind (void *fd)
+{
+    SCE_File_Rewind (&((CountFile*)fd)->sub);
+}
+static int CountFS_xflush (void *fd)
+{
+    return SCE_File_Flush (&((CountFile*)fd)->sub);
+}
+static long CountFS_xlength (void *fd)
+{
+    return SCE_File_Length (&((CountFile*)fd)->sub);
+}
+
+void CountFS_Init (CountFS *cfs)
+{
+    cfs->subfs = NULL;
+    cfs->n_reads = 0;
+    cfs->n_writes = 0;
+    cfs->bytes_read = 0;
+    cfs->bytes_written = 0;
+}
+
+/**
+ * \brief Sets up a file system counting the accesses to \p subfs
+ * \param subfs file system to count the accesses of, NULL for the default
+ * one
+ */
+void CountFS_InitFileSystem (CountFS *cfs, SCE_SFileSystem *fs,
+                             SCE_SFileSystem *subfs)
+{
+    cfs->subfs = subfs;
+    fs->xopen = CountFS_xopen;
+    fs->xclose = CountFS_xclose;
+    fs->xread = CountFS_xread;
+    fs->xwrite = CountFS_xwrite;
+    fs->xseek = CountFS_xseek;
+    fs->xtell = CountFS_xtell;
+    fs->xrewind = CountFS_xrewind;
+    fs->xflush = CountFS_xflush;
+    fs->xlength = CountFS_xlength;
+    fs->udata = cfs;
+    fs->subfs = subfs;
+}
+
+
+/* budget */
+
+static void CBudget_InitStats (CacheStats *s)
+{
+    s->max_entries = 0;
+    s->entry_size = 0;
+    s->lookups = 0;
+    s->hits = 0;
+    s->misses = 0;
+    s->evictions = 0;
+}
+
+void CBudget_Init (CacheBudget *cb)
+{
+    cb->budget = 0;
+    cb->node_share = 0.5;
+    CountFS_Init (&cb->above);
+    CountFS_Init (&cb->below);
+    CBudget_InitStats (&cb->nodes);
+    CBudget_InitStats (&cb->files);
+    cb->files.entry_size = CBUDGET_DEFAULT_FILE_SIZE;
+    cb->node_count = 0;
+    cb->last_loads = 0;
+    cb->last_misses = 0;
+    cb->last_cached = 0;
+}
+
+static SCEuint CBudget_Count (uint64_t bytes, SCEuint entry_size)
+{
+    uint64_t n = entry_size ? bytes / entry_size : 0;
+    if (n < CBUDGET_MIN_ENTRIES)
+        return CBUDGET_MIN_ENTRIES;
+    return n > 0xffffffU ? 0xffffffU : n;
+}
+
+/* returns SCE_TRUE if a limit has changed */
+static int CBudget_Resize (CacheBudget *cb, int force)
+{
+    uint64_t node_bytes = cb->budget * cb->node_share;
+    SCEuint nodes = CBudget_Count (node_bytes, cb->nodes.entry_size);
+    SCEuint files = CBudget_Count (cb->budget - node_bytes,
+                                   cb->files.entry_size);
+    SCEuint d = cb->files.max_entries / CBUDGET_HYSTERESIS;
+    int changed = SCE_FALSE;
+
+    if (force || nodes != cb->nodes.max_entries) {
+        changed = changed || nodes != cb->nodes.max_entries;
+        cb->nodes.max_entries = nodes;
+    }
+    if (force || files + d < cb->files.max_entries ||
+        files > cb->files.max_entries + d) {
+        changed = changed || files != cb->files.max_entries;
+        cb->files.max_entries = files;
+    }
+    return changed;
+}
+
+/**
+ * \brief Sets the memory the caches may use, can be called at any time
+ * \param budget size in bytes
+ * \sa CBudget_GetMaxNodes(), CBudget_GetMaxFiles()
+ */
+void CBudget_SetBudget (CacheBudget *cb, uint64_t budget)
+{
+    cb->budget = budget;
+    CBudget_Resize (cb, SCE_TRUE);
+}
+uint64_t CBudget_GetBudget (const CacheBudget *cb)
+{
+    return cb->budget;
+}
+/**
+ * \brief Sets the memory used by a node of the voxel world cache
+ */
+void CBudget_SetNodeSize (CacheBudget *cb, SCEuint size)
+{
+    cb->nodes.entry_size = size;
+    CBudget_Resize (cb, SCE_TRUE);
+}
+
+/**
+ * \brief Updates the statistics and the limits, call it once per frame
+ * \param n_cached number of files in the file cache
+ * \returns SCE_TRUE if the limits have changed and must be applied again
+ */
+int CBudget_Update (CacheBudget *cb, int n_cached)
+{
+    SCEulong loads = cb->above.n_reads - cb->last_loads;
+    SCEulong misses = cb->below.n_reads - cb->last_misses;
+    long evicted;
+
+    cb->last_loads = cb->above.n_reads;
+    cb->last_misses = cb->below.n_reads;
+
+    /* every node loaded by the voxel world missed its cache and looked
+       into the file cache */
+    cb->nodes.misses += loads;
+    cb->node_count += loads;
+    if (cb->node_count > cb->nodes.max_entries) {
+        cb->nodes.evictions += cb->node_count - cb->nodes.max_entries;
+        cb->node_count = cb->nodes.max_entries;
+    }
+
+    cb->files.lookups += loads;
+    cb->files.misses += misses;
+    cb->files.hits = cb->files.lookups > cb->files.misses ?
+        cb->files.lookups - cb->files.misses : 0;
+    evicted = (long)cb->last_cached + misses - n_cached;
+    if (evicted > 0)
+        cb->files.evictions += evicted;
+    cb->last_cached = n_cached;
+
+    if (cb->below.n_reads > 0)
+        cb->files.entry_size = cb->below.bytes_read / cb->below.n_reads;
+    return CBudget_Resize (cb, SCE_FALSE);
+}
+
+SCEuint CBudget_GetMaxNodes (const CacheBudget *cb)
+{
+    return cb->nodes.max_entries;
+}
+SCEuint CBudget_GetMaxFiles (const CacheBudget *cb)
+{
+    return cb->files.max_entries;
+}
+/**
+ * \brief Gets the part of the budget given to the file cache, for caches
+ * limited in bytes rather than in number of files
+ */
+uint64_t CBudget_GetFileBytes (const CacheBudget *cb)
+{
+    return cb->budget - (uint64_t)(cb->budget * cb->node_share);
+}
+
+/**
+ * \brief Gets the statistics of the voxel world node cache
+ *
+ * SCEngine doesn't tell us about node cache hits, only the misses and the
+ * evictions are known.
+ */
+void CBudget_GetNodeStats (const CacheBudget *cb, CacheStats *s)
+{
+    *s = cb->nodes;
+}
+/**
+ * \brief Gets the statistics of the file cache
+ */
+void CBudget_GetFileStats (const CacheBudget *cb, CacheStats *s)
+{
+    *s = cb->files;
+}
+
+static void CBudget_PrintCache (FILE *fp, const char *name,
+                                const CacheStats *s)
+{
+    fprintf (fp, "%s cache: %u entries of ~%u B (%lu kB), %lu lookups, "
+             "%lu hits, %lu misses, %lu evictions\n", name, s->max_entries,
+             s->entry_size, (unsigned long)s->max_entries * s->entry_size /
+             1024, s->lookups, s->hits, s->misses, s->evictions);
+}
+void CBudget_PrintStats (FILE *fp, const CacheBudget *cb)
+{
+    fprintf (fp, "cache budget: %lu kB\n", (unsigned long)(cb->budget >> 10));
+    CBudget_PrintCache (fp, "node", &cb->nodes);
+    CBudget_PrintCache (fp, "file", &cb->files);
+}
@@ -0,0 +1,89 @@
+/*------------------------------------------------------------------------------
+    Tune Land - Sandbox RPG
+    Copyright (C) 2012-2013
+        Antony Martin <antony(dot)martin(at)scengine(dot)org>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ -----------------------------------------------------------------------------*/
+
+#ifndef H_CACHEBUDGET
+#define H_CACHEBUDGET
+
+#include <stdio.h>
+#include <stdint.h>
+#include <SCE/utils/SCEUtils.h>
+
+/* pass-through file system counting what goes through it, used to see the
+   traffic above and below a cache */
+typedef struct countfs CountFS;
+struct countfs {
+    SCE_SFileSystem *subfs;
+    SCEulong n_reads;           /* files opened for reading */
+    SCEulong n_writes;          /* files opened for writing */
+    uint64_t bytes_read;
+    uint64_t bytes_written;
+};
+
+void CountFS_Init (CountFS*);
+void CountFS_InitFileSystem (CountFS*, SCE_SFileSystem*, SCE_SFileSystem*);
+
+typedef struct cachestats CacheStats;
+struct cachestats {
+    SCEuint max_entries;        /* current limit */
+    SCEuint entry_size;         /* estimated size of an entry (bytes) */
+    SCEulong lookups;
+    SCEulong hits;
+    SCEulong misses;
+    SCEulong evictions;         /* estimated */
+};
+
+/* sizes the voxel node cache and the file cache from a memory budget.
+   SCEngine only lets us limit the number of entries: the size of a node
+   is known, the size of a cached file is the average of what the file
+   cache has read so far.
+
+   the statistics are derived from two CountFS: one between the voxel
+   world and the file cache (node cache misses, file cache lookups), one
+   below the file cache (file cache misses) */
+typedef struct cachebudget CacheBudget;
+struct cachebudget {
+    uint64_t budget;            /* bytes */
+    float node_share;           /* part of the budget given to the nodes */
+    CountFS above;
+    CountFS below;
+    CacheStats nodes;
+    CacheStats files;
+    SCEulong node_count;        /* estimated number of cached nodes */
+    SCEulong last_loads;        /* above.n_reads at the last update */
+    SCEulong last_misses;       /* below.n_reads at the last update */
+    int last_cached;            /* number of cached files at the last
+                                   update */
+};
+
+void CBudget_Init (CacheBudget*);
+
+void CBudget_SetBudget (CacheBudget*, uint64_t);
+uint64_t CBudget_GetBudget (const CacheBudget*);
+void CBudget_SetNodeSize (CacheBudget*, SCEuint);
+
+int CBudget_Update (CacheBudget*, int);
+SCEuint CBudget_GetMaxNodes (const CacheBudget*);
+SCEuint CBudget_GetMaxFiles (const CacheBudget*);
+uint64_t CBudget_GetFileBytes (const CacheBudget*);
+
+void CBudget_GetNodeStats (const CacheBudget*, CacheStats*);
+void CBudget_GetFileStats (const CacheBudget*, CacheStats*);
+void CBudget_PrintStats (FILE*, const CacheBudget*);
+
+#endif /* guard */
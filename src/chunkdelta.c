@@ -0,0 +1,173 @@
+/*------------------------------------------------------------------------------
+    Tune Land - Sandbox RPG
+    Copyright (C) 2012-2013
+        Antony Martin <antony(dot)martin(at)scengine(dot)org>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ -----------------------------------------------------------------------------*/
+
+/* delta layout:
+     base hash: CDELTA_HASH_SIZE bytes
+     varint: size of the new version of the chunk
+     then until the end of the delta:
+       varint: number of bytes left untouched since the end of the previous
+               patch (or the beginning of the file)
+       varint: number of bytes to replace, followed by the bytes themselves */
+
+#include <stdio.h>
+#include <unistd.h>
+#include "chunkdelta.h"
+
+static int CDelta_GetVarint (const unsigned char **p, const unsigned char *end,
+                             unsigned long *v)
+{
+    int shift = 0;
+    *v = 0;
+    while (*p < end && shift < 35) {
+        unsigned char c = *(*p)++;
+        *v |= (unsigned long)(c & 0x7f) << shift;
+        if (!(c & 0x80))
+            return SCE_OK;
+        shift += 7;
+    }
+    return SCE_ERROR;
+}
+
+/**
+ * \brief Checks whether a delta applies to the given version of a chunk
+ * \param hash manifest hash of our version of the chunk
+ */
+int CDelta_CheckBase (const unsigned char *delta, size_t size,
+                      const unsigned char *hash)
+{
+    return size >= CDELTA_HASH_SIZE && !memcmp (delta, hash, CDELTA_HASH_SIZE);
+}
+
+/* walks through the patches, writing them into fp or out if not NULL */
+static int CDelta_Walk (const unsigned char *delta, size_t size, FILE *fp,
+                        unsigned char *out, unsigned long *new_size)
+{
+    const unsigned char *p = &delta[CDELTA_HASH_SIZE], *end = &delta[size];
+    unsigned long offset = 0;
+
+    if (size < CDELTA_HASH_SIZE || CDelta_GetVarint (&p, end, new_size) < 0)
+        return SCE_ERROR;
+
+    while (p < end) {
+        unsigned long skip, len;
+        if (CDelta_GetVarint (&p, end, &skip) < 0 ||
+            CDelta_GetVarint (&p, end, &len) < 0 ||
+            len > (unsigned long)(end - p))
+            return SCE_ERROR;
+        offset += skip;
+        if (offset + len > *new_size)
+            return SCE_ERROR;
+        if (fp) {
+            if (fseek (fp, offset, SEEK_SET) ||
+                fwrite (p, 1, len, fp) != len)
+                return SCE_ERROR;
+        }
+        if (out)
+            memcpy (&out[offset], p, len);
+        offset += len;
+        p += len;
+    }
+    return SCE_OK;
+}
+
+/* the file system gives no way to write in the middle of a file: rebuild
+   the whole chunk in memory */
+static int CDelta_ApplyFS (SCE_SFileSystem *fs, const char *fname,
+                           const unsigned char *delta, size_t size,
+                           unsigned long new_size)
+{
+    SCE_SFile fp;
+    unsigned char *data = NULL;
+    long len;
+    int opened = SCE_FALSE;
+
+    SCE_File_Init (&fp);
+    if (SCE_File_Open (&fp, fs, fname, SCE_FILE_READ) < 0)
+        goto fail;
+    opened = SCE_TRUE;
+    if ((len = SCE_File_Length (&fp)) < 0)
+        goto fail;
+    if (!(data = SCE_malloc (new_size + 1)))
+        goto fail;
+    memset (data, 0, new_size);
+    if ((unsigned long)len > new_size)
+        len = new_size;
+    if (SCE_File_Read (data, 1, len, &fp) != (size_t)len)
+        goto fail;
+    SCE_File_Close (&fp);
+    opened = SCE_FALSE;
+
+    CDelta_Walk (delta, size, NULL, data, &new_size);
+    if (SCE_File_Open (&fp, fs, fname, SCE_FILE_WRITE | SCE_FILE_CREATE) < 0)
+        goto fail;
+    opened = SCE_TRUE;
+    if (SCE_File_Write (data, 1, new_size, &fp) != new_size)
+        goto fail;
+    /* regions store the file when it is closed */
+    opened = SCE_FALSE;
+    if (SCE_File_Close (&fp) < 0)
+        goto fail;
+    SCE_free (data);
+    return SCE_OK;
+fail:
+    SCEE_LogSrc ();
+    SCE_free (data);
+    if (opened)
+        SCE_File_Close (&fp);
+    return SCE_ERROR;
+}
+
+/**
+ * \brief Patches a chunk file in place
+ * \param fs file system of the chunk, NULL to write directly into the file
+ * \param fname chunk file
+ * \param delta the delta, see CDelta_CheckBase()
+ * \param size size of \p delta
+ *
+ * Only the modified bytes are written. The delta is validated before the
+ * file is touched.
+ */
+int CDelta_Apply (SCE_SFileSystem *fs, const char *fname,
+                  const unsigned char *delta, size_t size)
+{
+    FILE *fp = NULL;
+    unsigned long new_size;
+
+    if (CDelta_Walk (delta, size, NULL, NULL, &new_size) < 0) {
+        SCEE_Log (SCE_INVALID_ARG);
+        SCEE_LogMsg ("chunk delta corrupted");
+        return SCE_ERROR;
+    }
+    if (fs)
+        return CDelta_ApplyFS (fs, fname, delta, size, new_size);
+
+    if (!(fp = fopen (fname, "r+b")))
+        goto fail;
+    if (CDelta_Walk (delta, size, fp, NULL, &new_size) < 0)
+        goto fail;
+    if (fflush (fp) || ftruncate (fileno (fp), new_size))
+        goto fail;
+    fclose (fp);
+    return SCE_OK;
+fail:
+    SCEE_LogErrno (fname);
+    if (fp)
+        fclose (fp);
+    return SCE_ERROR;
+}
@@ -0,0 +1,32 @@
+/*------------------------------------------------------------------------------
+    Tune Land - Sandbox RPG
+    Copyright (C) 2012-2013
+        Antony Martin <antony(dot)martin(at)scengine(dot)org>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ -----------------------------------------------------------------------------*/
+
+#ifndef H_CHUNKDELTA
+#define H_CHUNKDELTA
+
+#include <SCE/utils/SCEUtils.h>
+
+/* a chunk delta starts with the first CDELTA_HASH_SIZE bytes of the
+   manifest hash (SHA1 or xxHash64) of the version it applies to */
+#define CDELTA_HASH_SIZE 8
+
+int CDelta_CheckBase (const unsigned char*, size_t, const unsigned char*);
+int CDelta_Apply (SCE_SFileSystem*, const char*, const unsigned char*, size_t);
+
+#endif /* guard */
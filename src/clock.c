@@ -0,0 +1,75 @@
+/*------------------------------------------------------------------------------
+    Tune Land - Sandbox RPG
+    Copyright (C) 2012-2013
+        Antony Martin <antony(dot)martin(at)scengine(dot)org>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ -----------------------------------------------------------------------------*/
+
+#include <time.h>
+#include "clock.h"
+
+/**
+ * \brief Gets a time in milliseconds, only meaningful for differences
+ */
+SCEuint Clock_GetTicks (void)
+{
+    return Clock_GetMicro () / 1000;
+}
+
+/**
+ * \brief Gets a time in microseconds, only meaningful for differences
+ *
+ * The clock is monotonic, it doesn't jump when the system time is set.
+ */
+SCEulong Clock_GetMicro (void)
+{
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (SCEulong)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * \brief Gets the wall clock time in nanoseconds, like a file modification
+ * time
+ * \sa Clock_GetMTime()
+ */
+int64_t Clock_GetFileTime (void)
+{
+    struct timespec ts;
+    clock_gettime (CLOCK_REALTIME, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * \brief Gets the modification time of a file in nanoseconds
+ *
+ * Seconds are too coarse to tell two writes of a file apart.
+ */
+int64_t Clock_GetMTime (const struct stat *st)
+{
+    return (int64_t)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+}
+
+/**
+ * \brief Waits for some milliseconds
+ */
+void Clock_Sleep (SCEuint ms)
+{
+    struct timespec ts;
+
+    ts.tv_sec = ms / 1000;
+    ts.tv_nsec = (ms % 1000) * 1000000L;
+    nanosleep (&ts, NULL);
+}
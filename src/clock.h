@@ -0,0 +1,33 @@
+/*------------------------------------------------------------------------------
+    Tune Land - Sandbox RPG
+    Copyright (C) 2012-2013
+        Antony Martin <antony(dot)martin(at)scengine(dot)org>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ -----------------------------------------------------------------------------*/
+
+#ifndef H_CLOCK
+#define H_CLOCK
+
+#include <stdint.h>
+#include <sys/stat.h>
+#include <SCE/utils/SCEUtils.h>
+
+SCEuint Clock_GetTicks (void);
+SCEulong Clock_GetMicro (void);
+int64_t Clock_GetFileTime (void);
+int64_t Clock_GetMTime (const struct stat*);
+void Clock_Sleep (SCEuint);
+
+#endif /* guard */
@@ -0,0 +1,519 @@
+/*------------------------------------------------------------------------------
+    Tune Land - Sandbox RPG
+    Copyright (C) 2012-2013
+        Antony Martin <antony(dot)martin(at)scengine(dot)org>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ -----------------------------------------------------------------------------*/
+
+#include <stdint.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "clock.h"
+#include "compress.h"
+
+static const char *comp_names[COMP_NUM_CODECS] = {
+    "none", "lz", "voxrle"
+};
+
+
+/* LZ codec: LZ4 block format, so that the server is free to use liblz4 */
+
+#define LZ_HASH_LOG 12
+#define LZ_MIN_MATCH 4
+/* the format requires the last 5 bytes to be literals and the last match to
+   start at least 12 bytes before the end */
+#define LZ_LAST_LITERALS 5
+#define LZ_MFLIMIT 12
+#define LZ_MAX_OFFSET 65535
+
+static uint32_t LZ_Read32 (const unsigned char *p)
+{
+    uint32_t v;
+    memcpy (&v, p, 4);
+    return v;
+}
+static uint32_t LZ_Hash (uint32_t v)
+{
+    return (v * 2654435761U) >> (32 - LZ_HASH_LOG);
+}
+
+static unsigned char* LZ_PutLength (unsigned char *op, unsigned char *oend,
+                                    size_t len)
+{
+    while (len >= 255) {
+        if (op >= oend)
+            return NULL;
+        *op++ = 255;
+        len -= 255;
+    }
+    if (op >= oend)
+        return NULL;
+    *op++ = len;
+    return op;
+}
+
+static unsigned char* LZ_PutSequence (unsigned char *op, unsigned char *oend,
+                                      const unsigned char *lit, size_t n_lit,
+                                      size_t offset, size_t mlen)
+{
+    unsigned char *token = op++;
+    if (op > oend)
+        return NULL;
+
+    *token = (n_lit >= 15 ? 15 : n_lit) << 4;
+    if (n_lit >= 15 && !(op = LZ_PutLength (op, oend, n_lit - 15)))
+        return NULL;
+    if ((size_t)(oend - op) < n_lit)
+        return NULL;
+    memcpy (op, lit, n_lit);
+    op += n_lit;
+
+    if (mlen == 0)              /* last sequence */
+        return op;
+
+    if (oend - op < 2)
+        return NULL;
+    *op++ = offset & 0xff;
+    *op++ = offset >> 8;
+    mlen -= LZ_MIN_MATCH;
+    *token |= mlen >= 15 ? 15 : mlen;
+    if (mlen >= 15 && !(op = LZ_PutLength (op, oend, mlen - 15)))
+        return NULL;
+    return op;
+}
+
+static long LZ_Encode (const unsigned char *in, size_t n, unsigned char *out,
+                       size_t out_max)
+{
+    uint32_t table[1 << LZ_HASH_LOG];
+    unsigned char *op = out, *oend = &out[out_max];
+    size_t ip = 0, anchor = 0;
+
+    memset (table, 0, sizeof table);
+
+    if (n > LZ_MFLIMIT) {
+        size_t limit = n - LZ_MFLIMIT;
+        while (ip < limit) {
+            uint32_t seq = LZ_Read32 (&in[ip]);
+            uint32_t h = LZ_Hash (seq);
+            size_t ref = table[h];
+            table[h] = ip;
+
+            if (ref < ip && ip - ref <= LZ_MAX_OFFSET &&
+                LZ_Read32 (&in[ref]) == seq) {
+                size_t mlen = LZ_MIN_MATCH;
+                while (ip + mlen < n - LZ_LAST_LITERALS &&
+                       in[ref + mlen] == in[ip + mlen])
+                    mlen++;
+                op = LZ_PutSequence (op, oend, &in[anchor], ip - anchor,
+                                     ip - ref, mlen);
+                if (!op)
+                    return -1;
+                ip += mlen;
+                anchor = ip;
+            } else
+                ip++;
+        }
+    }
+    op = LZ_PutSequence (op, oend, &in[anchor], n - anchor, 0, 0);
+    if (!op)
+        return -1;
+    return op - out;
+}
+
+static int LZ_GetLength (const unsigned char **ip, const unsigned char *iend,
+                         size_t *len)
+{
+    unsigned char b;
+    do {
+        if (*ip >= iend)
+            return SCE_ERROR;
+        b = *(*ip)++;
+        *len += b;
+    } while (b == 255);
+    return SCE_OK;
+}
+
+static long LZ_Decode (const unsigned char *in, size_t n, unsigned char *out,
+                       size_t out_max)
+{
+    const unsigned char *ip = in, *iend = &in[n];
+    unsigned char *op = out, *oend = &out[out_max];
+
+    while (ip < iend) {
+        unsigned char token = *ip++;
+        size_t len = token >> 4, offset;
+        const unsigned char *match = NULL;
+
+        if (len == 15 && LZ_GetLength (&ip, iend, &len) < 0)
+            return -1;
+        if (len > (size_t)(iend - ip) || len > (size_t)(oend - op))
+            return -1;
+        memcpy (op, ip, len);
+        ip += len;
+        op += len;
+
+        if (ip >= iend)
+            break;              /* last sequence */
+
+        if (iend - ip < 2)
+            return -1;
+        offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > (size_t)(op - out))
+            return -1;
+
+        len = token & 15;
+        if (len == 15 && LZ_GetLength (&ip, iend, &len) < 0)
+            return -1;
+        len += LZ_MIN_MATCH;
+        if (len > (size_t)(oend - op))
+            return -1;
+
+        match = op - offset;
+        if (offset >= len)
+            memcpy (op, match, len);
+        else if (offset == 1)
+            memset (op, *match, len);
+        else {
+            size_t i;
+            /* overlapping copy, this is how runs are expressed */
+            for (i = 0; i < len; i++)
+                op[i] = match[i];
+        }
+        op += len;
+    }
+    return op - out;
+}
+
+
+/* VOXRLE codec: a sequence of operations, each starting with a varint v.
+   if v is odd, (v >> 1) + VOXRLE_MIN_RUN copies of the next byte follow,
+   otherwise (v >> 1) + 1 literal bytes follow. voxel data being mostly
+   made of long runs of empty or full material, decoding is a handful of
+   memset() per chunk */
+
+#define VOXRLE_MIN_RUN 4
+
+static size_t VoxRLE_PutVarint (unsigned char *out, size_t v)
+{
+    size_t n = 0;
+    while (v >= 0x80) {
+        out[n++] = (v & 0x7f) | 0x80;
+        v >>= 7;
+    }
+    out[n++] = v;
+    return n;
+}
+static int VoxRLE_GetVarint (const unsigned char **ip,
+                             const unsigned char *iend, size_t *v)
+{
+    int shift = 0;
+    *v = 0;
+    while (*ip < iend && shift < 64) {
+        unsigned char c = *(*ip)++;
+        *v |= (size_t)(c & 0x7f) << shift;
+        if (!(c & 0x80))
+            return SCE_OK;
+        shift += 7;
+    }
+    return SCE_ERROR;
+}
+
+/* length of the run of identical bytes starting at p */
+static size_t VoxRLE_RunLength (const unsigned char *p, size_t n)
+{
+    size_t i = 1;
+#ifdef __SSE2__
+    __m128i v = _mm_set1_epi8 (p[0]);
+    while (i + 16 <= n) {
+        __m128i d = _mm_loadu_si128 ((const __m128i*)&p[i]);
+        int mask = _mm_movemask_epi8 (_mm_cmpeq_epi8 (d, v));
+        if (mask != 0xffff)
+            return i + __builtin_ctz (~mask);
+        i += 16;
+    }
+#endif
+    while (i < n && p[i] == p[0])
+        i++;
+    return i;
+}
+
+static long VoxRLE_Encode (const unsigned char *in, size_t n,
+                           unsigned char *out, size_t out_max)
+{
+    size_t ip = 0, anchor = 0, op = 0;
+
+    while (ip <= n) {
+        size_t run = ip < n ? VoxRLE_RunLength (&in[ip], n - ip) : 0;
+
+        if (ip < n && run < VOXRLE_MIN_RUN) {
+            ip += run;
+            continue;
+        }
+        /* flush literals */
+        if (ip > anchor) {
+            size_t len = ip - anchor;
+            if (out_max - op < len + 10)
+                return -1;
+            op += VoxRLE_PutVarint (&out[op], (len - 1) << 1);
+            memcpy (&out[op], &in[anchor], len);
+            op += len;
+        }
+        if (ip == n)
+            break;
+        if (out_max - op < 11)
+            return -1;
+        op += VoxRLE_PutVarint (&out[op], ((run - VOXRLE_MIN_RUN) << 1) | 1);
+        out[op++] = in[ip];
+        ip += run;
+        anchor = ip;
+    }
+    return op;
+}
+
+static long VoxRLE_Decode (const unsigned char *in, size_t n,
+                           unsigned char *out, size_t out_max)
+{
+    const unsigned char *ip = in, *iend = &in[n];
+    size_t op = 0;
+
+    while (ip < iend) {
+        size_t v, len;
+        if (VoxRLE_GetVarint (&ip, iend, &v) < 0)
+            return -1;
+        if (v & 1) {
+            len = (v >> 1) + VOXRLE_MIN_RUN;
+            if (ip >= iend || len > out_max - op)
+                return -1;
+            memset (&out[op], *ip++, len);
+        } else {
+            len = (v >> 1) + 1;
+            if (len > (size_t)(iend - ip) || len > out_max - op)
+                return -1;
+            memcpy (&out[op], ip, len);
+            ip += len;
+        }
+        op += len;
+    }
+    return op;
+}
+
+
+/**
+ * \brief Gets the maximum size of a compressed payload, header included
+ */
+size_t Comp_GetBound (CompCodec codec, size_t size)
+{
+    switch (codec) {
+    case COMP_LZ: return COMP_HEADER_SIZE + size + size / 255 + 16;
+    case COMP_VOXRLE: return COMP_HEADER_SIZE + size + size / 2 + 16;
+    default: return COMP_HEADER_SIZE + size;
+    }
+}
+
+/**
+ * \brief Compresses a payload
+ * \param codec codec to use
+ * \param in data to compress
+ * \param size size of \p in
+ * \param out output buffer, see Comp_GetBound()
+ * \param out_max size of \p out
+ * \returns the size of the compressed payload, header included
+ */
+long Comp_Encode (CompCodec codec, const void *in, size_t size, void *out,
+                  size_t out_max)
+{
+    unsigned char *o = out;
+    long n = -1;
+
+    if (out_max < COMP_HEADER_SIZE)
+        goto fail;
+    o[0] = codec;
+    SCE_Encode_Long (size, &o[1]);
+    o = &o[COMP_HEADER_SIZE];
+    out_max -= COMP_HEADER_SIZE;
+
+    switch (codec) {
+    case COMP_NONE:
+        if (out_max >= size) {
+            memcpy (o, in, size);
+            n = size;
+        }
+        break;
+    case COMP_LZ: n = LZ_Encode (in, size, o, out_max); break;
+    case COMP_VOXRLE: n = VoxRLE_Encode (in, size, o, out_max); break;
+    default:;
+    }
+    if (n < 0)
+        goto fail;
+    return n + COMP_HEADER_SIZE;
+fail:
+    SCEE_Log (SCE_INVALID_ARG);
+    SCEE_LogMsg ("cannot compress %lu bytes with codec %d",
+                 (unsigned long)size, (int)codec);
+    return SCE_ERROR;
+}
+
+/**
+ * \brief Reads the header of a compressed payload
+ * \param codec returns the codec used
+ * \param raw_size returns the size of the decompressed data
+ */
+int Comp_GetInfo (const void *in, size_t size, CompCodec *codec,
+                  size_t *raw_size)
+{
+    const unsigned char *i = in;
+    if (size < COMP_HEADER_SIZE || i[0] >= COMP_NUM_CODECS) {
+        SCEE_Log (SCE_INVALID_ARG);
+        SCEE_LogMsg ("invalid compressed payload");
+        return SCE_ERROR;
+    }
+    *codec = i[0];
+    *raw_size = SCE_Decode_Long (&i[1]);
+    return SCE_OK;
+}
+
+/**
+ * \brief Decompresses a payload
+ * \param in compressed payload, header included
+ * \param size size of \p in
+ * \param out output buffer, at least the size given by Comp_GetInfo()
+ * \param out_max size of \p out
+ * \returns the size of the decompressed data
+ */
+long Comp_Decode (const void *in, size_t size, void *out, size_t out_max)
+{
+    const unsigned char *i = in;
+    CompCodec codec;
+    size_t raw;
+    long n = -1;
+
+    if (Comp_GetInfo (in, size, &codec, &raw) < 0)
+        goto fail;
+    if (raw > out_max)
+        goto corrupted;
+    i = &i[COMP_HEADER_SIZE];
+    size -= COMP_HEADER_SIZE;
+
+    switch (codec) {
+    case COMP_NONE:
+        if (size == raw) {
+            memcpy (out, i, size);
+            n = size;
+        }
+        break;
+    case COMP_LZ: n = LZ_Decode (i, size, out, raw); break;
+    case COMP_VOXRLE: n = VoxRLE_Decode (i, size, out, raw); break;
+    default:;
+    }
+    if (n != (long)raw)
+        goto corrupted;
+    return n;
+corrupted:
+    SCEE_Log (SCE_INVALID_ARG);
+    SCEE_LogMsg ("corrupted %s payload", comp_names[codec]);
+fail:
+    SCEE_LogSrc ();
+    return SCE_ERROR;
+}
+
+const char* Comp_GetName (CompCodec codec)
+{
+    return codec < COMP_NUM_CODECS ? comp_names[codec] : "unknown";
+}
+
+
+void Comp_InitStats (CompStats *s)
+{
+    s->n_payloads = 0;
+    s->wire_bytes = 0;
+    s->raw_bytes = 0;
+    s->decode_usec = 0;
+}
+
+void Comp_PrintStats (FILE *out, CompCodec codec, const CompStats *s)
+{
+    if (s->n_payloads == 0)
+        return;
+    fprintf (out, "%s: %lu payloads, %lu kB on the wire for %lu kB "
+             "(%.1f%%), decoded in %.2f ms (%.1f MB/s)\n", Comp_GetName (codec),
+             s->n_payloads, s->wire_bytes / 1024, s->raw_bytes / 1024,
+             100.0 * s->wire_bytes / (s->raw_bytes ? s->raw_bytes : 1),
+             s->decode_usec / 1000.0,
+             s->decode_usec ? (double)s->raw_bytes / s->decode_usec : 0.0);
+}
+
+#define COMP_BENCH_RUNS 20
+
+/**
+ * \brief Compares the codecs on the given data
+ *
+ * Prints, for each codec, the size of the compressed payload and the
+ * encoding and decoding speeds.
+ */
+int Comp_Benchmark (FILE *out, const void *data, size_t size)
+{
+    unsigned char *zbuf = NULL, *raw = NULL;
+    CompCodec codec;
+
+    if (!(zbuf = SCE_malloc (Comp_GetBound (COMP_VOXRLE, size))) ||
+        !(raw = SCE_malloc (size + 1)))
+        goto fail;
+
+    for (codec = COMP_NONE; codec < COMP_NUM_CODECS; codec++) {
+        SCEulong t, enc, dec;
+        long n = 0;
+        int i;
+
+        t = Clock_GetMicro ();
+        for (i = 0; i < COMP_BENCH_RUNS; i++) {
+            n = Comp_Encode (codec, data, size, zbuf,
+                             Comp_GetBound (codec, size));
+            if (n < 0)
+                goto fail;
+        }
+        enc = Clock_GetMicro () - t;
+
+        t = Clock_GetMicro ();
+        for (i = 0; i < COMP_BENCH_RUNS; i++) {
+            if (Comp_Decode (zbuf, n, raw, size) < 0)
+                goto fail;
+        }
+        dec = Clock_GetMicro () - t;
+
+        if (memcmp (raw, data, size)) {
+            SCEE_Log (SCE_INVALID_ARG);
+            SCEE_LogMsg ("codec %s: decoded data differs", Comp_GetName (codec));
+            goto fail;
+        }
+
+        fprintf (out, "%-8s %8lu -> %8ld bytes (%5.1f%%)  encode %8.1f MB/s  "
+                 "decode %8.1f MB/s\n", Comp_GetName (codec),
+                 (unsigned long)size, n, 100.0 * n / (size ? size : 1),
+                 enc ? (double)size * COMP_BENCH_RUNS / enc : 0.0,
+                 dec ? (double)size * COMP_BENCH_RUNS / dec : 0.0);
+    }
+
+    SCE_free (raw);
+    SCE_free (zbuf);
+    return SCE_OK;
+fail:
+    SCE_free (raw);
+    SCE_free (zbuf);
+    SCEE_LogSrc ();
+    return SCE_ERROR;
+}
@@ -0,0 +1,58 @@
+/*------------------------------------------------------------------------------
+    Tune Land - Sandbox RPG
+    Copyright (C) 2012-2013
+        Antony Martin <antony(dot)martin(at)scengine(dot)org>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ -----------------------------------------------------------------------------*/
+
+#ifndef H_COMPRESS
+#define H_COMPRESS
+
+#include <stdio.h>
+#include <SCE/utils/SCEUtils.h>
+
+/* compressed payloads start with the codec (1 byte) and the size of the
+   uncompressed data (4 bytes) */
+#define COMP_HEADER_SIZE 5
+
+typedef enum {
+    COMP_NONE = 0,
+    COMP_LZ,                    /* general purpose, LZ4 block format */
+    COMP_VOXRLE,                /* run-length coding of voxel bytes */
+    COMP_NUM_CODECS
+} CompCodec;
+
+typedef struct compstats CompStats;
+struct compstats {
+    SCEulong n_payloads;
+    SCEulong wire_bytes;        /* compressed size, header included */
+    SCEulong raw_bytes;
+    SCEulong decode_usec;
+};
+
+size_t Comp_GetBound (CompCodec, size_t);
+long Comp_Encode (CompCodec, const void*, size_t, void*, size_t);
+
+int Comp_GetInfo (const void*, size_t, CompCodec*, size_t*);
+long Comp_Decode (const void*, size_t, void*, size_t);
+
+const char* Comp_GetName (CompCodec);
+
+void Comp_InitStats (CompStats*);
+void Comp_PrintStats (FILE*, CompCodec, const CompStats*);
+
+int Comp_Benchmark (FILE*, const void*, size_t);
+
+#endif /* guard */
@@ -0,0 +1,652 @@
+/*------------------------------------------------------------------------------
+    Tune Land - Sandbox RPG
+    Copyright (C) 2012-2013
+        Antony Martin <antony(dot)martin(at)scengine(dot)org>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ -----------------------------------------------------------------------------*/
+
+#include <errno.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <utime.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include "diskcache.h"
+
+#define DCACHE_TRASH ".trash"
+/* period of the scans of the cache (s) */
+#define DCACHE_SCAN_PERIOD 30
+/* once over budget, evict down to 90% of it so that we don't go over again
+   right away */
+#define DCACHE_LOW_WATERMARK(budget) ((budget) - (budget) / 10)
+
+/* most of this runs in the thread, dont use SCE_malloc() nor the SCEE
+   error state there: its failures are counted in DiskCache::n_failed */
+
+typedef struct dcachescantree DCacheScanTree;
+struct dcachescantree {
+    DCacheTree tree;
+    int current;                /* belongs to the current server */
+    char dir[DCACHE_MAX_PATH];  /* world directory */
+};
+
+void DCache_Init (DiskCache *dc)
+{
+    dc->root[0] = 0;
+    dc->world[0] = 0;
+    dc->path[0] = 0;
+    dc->budget = 0;
+    pthread_mutex_init (&dc->mutex, NULL);
+    pthread_cond_init (&dc->cond, NULL);
+    dc->running = SCE_FALSE;
+    dc->wakeup = SCE_FALSE;
+    dc->n_trash = 0;
+    dc->touched = NULL;
+    dc->n_touched = dc->touched_cap = 0;
+    dc->n_victims = 0;
+    dc->usage = 0;
+    dc->n_evicted = 0;
+    dc->bytes_evicted = 0;
+    dc->n_purged = 0;
+    dc->n_failed = 0;
+    dc->n_reported = 0;
+}
+void DCache_Clear (DiskCache *dc)
+{
+    DCache_Stop (dc);
+    free (dc->touched);
+    pthread_cond_destroy (&dc->cond);
+    pthread_mutex_destroy (&dc->mutex);
+}
+
+/**
+ * \brief Sets where the caches are
+ * \param root directory of the caches of all the servers
+ * \param world name of the world directory in the cache of a server
+ */
+void DCache_SetRoot (DiskCache *dc, const char *root, const char *world)
+{
+    strncpy (dc->root, root, sizeof dc->root - 1);
+    strncpy (dc->world, world, sizeof dc->world - 1);
+}
+/**
+ * \brief Sets the disk space the caches of all the servers may use
+ * \param budget size in bytes, 0 for no limit
+ */
+void DCache_SetBudget (DiskCache *dc, uint64_t budget)
+{
+    dc->budget = budget;
+}
+
+/* creates path and its parents */
+static int DCache_MakeDirs (const char *path)
+{
+    char buf[DCACHE_MAX_PATH];
+    char *p = NULL;
+
+    strncpy (buf, path, sizeof buf - 1);
+    buf[sizeof buf - 1] = 0;
+    for (p = &buf[1]; *p; p++) {
+        if (*p == '/') {
+            *p = 0;
+            mkdir (buf, 0755);
+            *p = '/';
+        }
+    }
+    if (mkdir (buf, 0755) < 0 && errno != EEXIST) {
+        SCEE_LogErrno (path);
+        return SCE_ERROR;
+    }
+    return SCE_OK;
+}
+
+/**
+ * \brief Selects the cache of a server, creates it if needed
+ * \param server identity of the server, typically its address
+ * \sa DCache_GetPath()
+ */
+int DCache_Open (DiskCache *dc, const char *server)
+{
+    char key[64];
+    size_t i;
+
+    /* anything but a plain name could escape the root */
+    for (i = 0; server[i] && i < sizeof key - 1; i++) {
+        char c = server[i];
+        if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+            (c >= '0' && c <= '9') || c == '-' || (c == '.' && i > 0))
+            key[i] = c;
+        else
+            key[i] = '_';
+    }
+    key[i] = 0;
+
+    if (snprintf (dc->path, sizeof dc->path, "%s/%s/%s", dc->root, key,
+                  dc->world) >= (int)sizeof dc->path) {
+        SCEE_Log (SCE_INVALID_ARG);
+        SCEE_LogMsg ("cache path of %s too long", server);
+        return SCE_ERROR;
+    }
+    if (DCache_MakeDirs (dc->path) < 0) {
+        SCEE_LogSrc ();
+        return SCE_ERROR;
+    }
+    return SCE_OK;
+}
+/**
+ * \brief Gets the world directory of the current server
+ */
+const char* DCache_GetPath (const DiskCache *dc)
+{
+    return dc->path;
+}
+
+/* moves a file or a directory to the trash, where the thread will delete
+   it. that's only a rename(), whatever the size of the thing. errno tells
+   what went wrong */
+static int DCache_Trash (DiskCache *dc, const char *path)
+{
+    char trash[DCACHE_MAX_PATH + 32];
+    SCEuint n;
+
+    pthread_mutex_lock (&dc->mutex);
+    n = dc->n_trash++;
+    pthread_mutex_unlock (&dc->mutex);
+
+    sprintf (trash, "%s/%s", dc->root, DCACHE_TRASH);
+    mkdir (trash, 0755);
+    sprintf (trash, "%s/%s/%lu-%u", dc->root, DCACHE_TRASH,
+             (unsigned long)time (NULL), n);
+    if (rename (path, trash) < 0) {
+        if (errno == ENOENT)
+            return SCE_FALSE;
+        return SCE_ERROR;
+    }
+    return SCE_TRUE;
+}
+
+static void DCache_Wakeup (DiskCache *dc)
+{
+    pthread_mutex_lock (&dc->mutex);
+    dc->wakeup = SCE_TRUE;
+    pthread_cond_broadcast (&dc->cond);
+    pthread_mutex_unlock (&dc->mutex);
+}
+
+/**
+ * \brief Throws away the cache of the current server and starts a new one
+ *
+ * The old cache is deleted in the background.
+ */
+int DCache_Discard (DiskCache *dc)
+{
+    pthread_mutex_lock (&dc->mutex);
+    dc->n_touched = 0;
+    if (dc->touched)
+        memset (dc->touched, 0, dc->touched_cap * sizeof *dc->touched);
+    pthread_mutex_unlock (&dc->mutex);
+
+    if (DCache_Trash (dc, dc->path) < 0) {
+        SCEE_LogErrno (dc->path);
+        return SCE_ERROR;
+    }
+    if (DCache_MakeDirs (dc->path) < 0) {
+        SCEE_LogSrc ();
+        return SCE_ERROR;
+    }
+    DCache_Wakeup (dc);
+    return SCE_OK;
+}
+
+
+/* last uses of the trees, by coordinates. a slot is free when its
+   last_used is 0 */
+
+static SCEuint DCache_HashTree (long x, long y, long z)
+{
+    uint32_t h = (uint32_t)x * 0x85ebca6bU;
+    h ^= (uint32_t)y * 0xc2b2ae35U;
+    h = (h << 13) | (h >> 19);
+    h ^= (uint32_t)z * 0x27d4eb2fU;
+    h ^= h >> 16;
+    return h;
+}
+static DCacheTree* DCache_FindTouched (const DiskCache *dc, long x, long y,
+                                       long z)
+{
+    SCEuint mask = dc->touched_cap - 1;
+    SCEuint i = DCache_HashTree (x, y, z) & mask;
+
+    for (;; i = (i + 1) & mask) {
+        DCacheTree *t = &dc->touched[i];
+        if (!t->last_used || (t->x == x && t->y == y && t->z == z))
+            return t;
+    }
+}
+static int DCache_GrowTouched (DiskCache *dc)
+{
+    DCacheTree *old = dc->touched;
+    SCEuint i, old_cap = dc->touched_cap;
+    SCEuint cap = old_cap ? old_cap * 2 : 256;
+
+    if (!(dc->touched = calloc (cap, sizeof *dc->touched))) {
+        dc->touched = old;
+        return SCE_ERROR;
+    }
+    dc->touched_cap = cap;
+    for (i = 0; i < old_cap; i++) {
+        if (old[i].last_used)
+            *DCache_FindTouched (dc, old[i].x, old[i].y, old[i].z) = old[i];
+    }
+    free (old);
+    return SCE_OK;
+}
+
+/**
+ * \brief Notes that a tree of the current server is being used
+ *
+ * Cheap enough to be called every frame for the trees in view.
+ */
+void DCache_TouchTree (DiskCache *dc, long x, long y, long z)
+{
+    DCacheTree *t = NULL;
+    time_t now = time (NULL);
+
+    pthread_mutex_lock (&dc->mutex);
+    if ((dc->n_touched + 1) * 2 > dc->touched_cap &&
+        DCache_GrowTouched (dc) < 0) {
+        pthread_mutex_unlock (&dc->mutex);
+        return;
+    }
+    t = DCache_FindTouched (dc, x, y, z);
+    if (!t->last_used) {
+        t->x = x;
+        t->y = y;
+        t->z = z;
+        dc->n_touched++;
+    }
+    t->last_used = now;
+    pthread_mutex_unlock (&dc->mutex);
+}
+
+/**
+ * \brief Gets the trees of the current server the thread wants evicted
+ * \param victims output
+ * \param max size of \p victims
+ * \returns the number of trees written in \p victims
+ *
+ * Call DCache_EvictTree() on those that are not in use, and
+ * DCache_TouchTree() on the others.
+ */
+SCEuint DCache_PopVictims (DiskCache *dc, DCacheTree *victims, SCEuint max)
+{
+    SCEuint n;
+
+    pthread_mutex_lock (&dc->mutex);
+    n = dc->n_victims < max ? dc->n_victims : max;
+    memcpy (victims, &dc->victims[dc->n_victims - n], n * sizeof *victims);
+    dc->n_victims -= n;
+    pthread_mutex_unlock (&dc->mutex);
+    return n;
+}
+
+/**
+ * \brief Gets the number of failures of the thread since the last call,
+ * for the game to report them
+ */
+SCEulong DCache_PopFailures (DiskCache *dc)
+{
+    SCEulong n;
+    pthread_mutex_lock (&dc->mutex);
+    n = dc->n_failed - dc->n_reported;
+    dc->n_reported = dc->n_failed;
+    pthread_mutex_unlock (&dc->mutex);
+    return n;
+}
+
+static void DCache_GetTreePath (const char *dir, long x, long y, long z,
+                                const char *suffix, char *path)
+{
+    sprintf (path, "%s/%ld_%ld_%ld%s", dir, x, y, z, suffix);
+}
+
+/* runs in both threads, errno tells what went wrong */
+static int DCache_EvictTreeIn (DiskCache *dc, const char *dir, long x,
+                               long y, long z, uint64_t bytes)
+{
+    char path[DCACHE_MAX_PATH + 64];
+    int i;
+    const char *suffixes[] = {".octree", ".region", ""};
+
+    for (i = 0; i < 3; i++) {
+        DCache_GetTreePath (dir, x, y, z, suffixes[i], path);
+        if (DCache_Trash (dc, path) < 0)
+            return SCE_ERROR;
+    }
+    pthread_mutex_lock (&dc->mutex);
+    dc->n_evicted++;
+    dc->bytes_evicted += bytes;
+    pthread_mutex_unlock (&dc->mutex);
+    return SCE_OK;
+}
+
+/**
+ * \brief Removes a tree of the current server from the cache
+ * \param t a tree given by DCache_PopVictims()
+ *
+ * The files must not be in use: close their region before (see
+ * RegionFS_CloseDir()).
+ */
+int DCache_EvictTree (DiskCache *dc, const DCacheTree *t)
+{
+    if (DCache_EvictTreeIn (dc, dc->path, t->x, t->y, t->z, t->bytes) < 0) {
+        char path[DCACHE_MAX_PATH + 64];
+        DCache_GetTreePath (dc->path, t->x, t->y, t->z, "", path);
+        SCEE_LogErrno (path);
+        return SCE_ERROR;
+    }
+    DCache_Wakeup (dc);
+    return SCE_OK;
+}
+
+
+/* what follows runs in the thread */
+
+static uint64_t DCache_GetSize (const char *path)
+{
+    struct stat st;
+    DIR *d = NULL;
+    struct dirent *de = NULL;
+    char sub[DCACHE_MAX_PATH + 256];
+    uint64_t size = 0;
+
+    if (lstat (path, &st) < 0)
+        return 0;
+    if (!S_ISDIR (st.st_mode))
+        return st.st_size;
+    if (!(d = opendir (path)))
+        return 0;
+    while ((de = readdir (d))) {
+        if (!strcmp (de->d_name, ".") || !strcmp (de->d_name, ".."))
+            continue;
+        snprintf (sub, sizeof sub, "%s/%s", path, de->d_name);
+        size += DCache_GetSize (sub);
+    }
+    closedir (d);
+    return size;
+}
+
+static void DCache_RemoveAll (const char *path)
+{
+    struct stat st;
+    DIR *d = NULL;
+    struct dirent *de = NULL;
+    char sub[DCACHE_MAX_PATH + 256];
+
+    if (lstat (path, &st) < 0)
+        return;
+    if (S_ISDIR (st.st_mode) && (d = opendir (path))) {
+        while ((de = readdir (d))) {
+            if (!strcmp (de->d_name, ".") || !strcmp (de->d_name, ".."))
+                continue;
+            snprintf (sub, sizeof sub, "%s/%s", path, de->d_name);
+            DCache_RemoveAll (sub);
+        }
+        closedir (d);
+    }
+    remove (path);
+}
+
+static void DCache_Purge (DiskCache *dc)
+{
+    char path[DCACHE_MAX_PATH + 256];
+    DIR *d = NULL;
+    struct dirent *de = NULL;
+    SCEulong n = 0;
+
+    sprintf (path, "%s/%s", dc->root, DCACHE_TRASH);
+    if (!(d = opendir (path)))
+        return;
+    while ((de = readdir (d))) {
+        if (!strcmp (de->d_name, ".") || !strcmp (de->d_name, ".."))
+            continue;
+        snprintf (path, sizeof path, "%s/%s/%s", dc->root, DCACHE_TRASH,
+                  de->d_name);
+        DCache_RemoveAll (path);
+        n++;
+    }
+    closedir (d);
+    pthread_mutex_lock (&dc->mutex);
+    dc->n_purged += n;
+    pthread_mutex_unlock (&dc->mutex);
+}
+
+/* adds the trees of a world directory to the list */
+static int DCache_ScanWorld (DiskCache *dc, const char *dir,
+                             DCacheScanTree **trees, size_t *n_trees,
+                             size_t *cap, uint64_t *usage)
+{
+    DIR *d = NULL;
+    struct dirent *de = NULL;
+    char path[DCACHE_MAX_PATH + 64];
+    int current = !strcmp (dir, dc->path);
+
+    if (!(d = opendir (dir)))
+        return SCE_OK;
+    while ((de = readdir (d))) {
+        DCacheScanTree *t = NULL;
+        struct stat st;
+        long x, y, z;
+        int len = 0;
+
+        if (!strcmp (de->d_name, ".") || !strcmp (de->d_name, ".."))
+            continue;
+        if (sscanf (de->d_name, "%ld_%ld_%ld.octree%n", &x, &y, &z, &len) < 3
+            || len == 0 || de->d_name[len]) {
+            /* regions and chunk directories are counted with their tree */
+            size_t n = strlen (de->d_name);
+            snprintf (path, sizeof path, "%s/%s", dir, de->d_name);
+            if ((n < 7 || strcmp (&de->d_name[n - 7], ".region")) &&
+                lstat (path, &st) == 0 && !S_ISDIR (st.st_mode))
+                *usage += st.st_size;
+            continue;
+        }
+        DCache_GetTreePath (dir, x, y, z, ".octree", path);
+        if (stat (path, &st) < 0)
+            continue;
+
+        if (*n_trees == *cap) {
+            size_t c = *cap ? *cap * 2 : 256;
+            DCacheScanTree *p = realloc (*trees, c * sizeof *p);
+            if (!p) {
+                closedir (d);
+                return SCE_ERROR;
+            }
+            *trees = p;
+            *cap = c;
+        }
+        t = &(*trees)[(*n_trees)++];
+        t->tree.x = x;
+        t->tree.y = y;
+        t->tree.z = z;
+        t->tree.last_used = st.st_mtime;
+        t->tree.bytes = st.st_size;
+        DCache_GetTreePath (dir, x, y, z, ".region", path);
+        t->tree.bytes += DCache_GetSize (path);
+        DCache_GetTreePath (dir, x, y, z, "", path);
+        t->tree.bytes += DCache_GetSize (path);
+        t->current = current;
+        strcpy (t->dir, dir);
+        *usage += t->tree.bytes;
+
+        if (current) {
+            /* the last use is kept as the modification time of the
+               octree, so that it survives us */
+            DCacheTree *touched = NULL;
+            time_t last_used = 0;
+            pthread_mutex_lock (&dc->mutex);
+            if (dc->touched_cap &&
+                (touched = DCache_FindTouched (dc, x, y, z))->last_used)
+                last_used = touched->last_used;
+            pthread_mutex_unlock (&dc->mutex);
+            if (last_used > t->tree.last_used) {
+                struct utimbuf times;
+                times.actime = times.modtime = last_used;
+                DCache_GetTreePath (dir, x, y, z, ".octree", path);
+                utime (path, &times);
+                t->tree.last_used = last_used;
+            }
+        }
+    }
+    closedir (d);
+    return SCE_OK;
+}
+
+static int DCache_CompareTrees (const void *a, const void *b)
+{
+    const DCacheScanTree *x = a, *y = b;
+    return x->tree.last_used < y->tree.last_used ? -1 :
+        x->tree.last_used > y->tree.last_used;
+}
+
+static void DCache_Scan (DiskCache *dc)
+{
+    DCacheScanTree *trees = NULL;
+    size_t i, n_trees = 0, cap = 0;
+    uint64_t usage = 0, target;
+    char dir[DCACHE_MAX_PATH + 64];
+    DIR *d = NULL;
+    struct dirent *de = NULL;
+
+    if (!(d = opendir (dc->root)))
+        return;
+    while ((de = readdir (d))) {
+        if (de->d_name[0] == '.')
+            continue;
+        snprintf (dir, sizeof dir, "%s/%s/%s", dc->root, de->d_name,
+                  dc->world);
+        if (DCache_ScanWorld (dc, dir, &trees, &n_trees, &cap, &usage) < 0) {
+            pthread_mutex_lock (&dc->mutex);
+            dc->n_failed++;
+            pthread_mutex_unlock (&dc->mutex);
+            break;
+        }
+    }
+    closedir (d);
+
+    pthread_mutex_lock (&dc->mutex);
+    dc->usage = usage;
+    pthread_mutex_unlock (&dc->mutex);
+    if (!dc->budget || usage <= dc->budget) {
+        free (trees);
+        return;
+    }
+
+    target = DCACHE_LOW_WATERMARK (dc->budget);
+    qsort (trees, n_trees, sizeof *trees, DCache_CompareTrees);
+    for (i = 0; i < n_trees && usage > target; i++) {
+        DCacheScanTree *t = &trees[i];
+        if (!t->current) {
+            if (DCache_EvictTreeIn (dc, t->dir, t->tree.x, t->tree.y,
+                                    t->tree.z, t->tree.bytes) < 0) {
+                pthread_mutex_lock (&dc->mutex);
+                dc->n_failed++;
+                pthread_mutex_unlock (&dc->mutex);
+                continue;
+            }
+        } else {
+            /* the game decides, the trees it refuses are touched and
+               won't come back until they get old again */
+            pthread_mutex_lock (&dc->mutex);
+            if (dc->n_victims < DCACHE_MAX_VICTIMS)
+                dc->victims[dc->n_victims++] = t->tree;
+            pthread_mutex_unlock (&dc->mutex);
+        }
+        usage -= t->tree.bytes;
+    }
+    free (trees);
+    DCache_Purge (dc);
+}
+
+static void* DCache_Loop (void *data)
+{
+    DiskCache *dc = data;
+    struct timespec deadline;
+
+    pthread_mutex_lock (&dc->mutex);
+    for (;;) {
+        clock_gettime (CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += DCACHE_SCAN_PERIOD;
+        while (dc->running && !dc->wakeup) {
+            if (pthread_cond_timedwait (&dc->cond, &dc->mutex,
+                                        &deadline) == ETIMEDOUT)
+                break;
+        }
+        if (!dc->running)
+            break;
+        dc->wakeup = SCE_FALSE;
+        pthread_mutex_unlock (&dc->mutex);
+
+        DCache_Purge (dc);
+        DCache_Scan (dc);
+
+        pthread_mutex_lock (&dc->mutex);
+    }
+    pthread_mutex_unlock (&dc->mutex);
+    return NULL;
+}
+
+/**
+ * \brief Starts the thread, which scans the cache right away
+ */
+int DCache_Start (DiskCache *dc)
+{
+    if (dc->running)
+        return SCE_OK;
+    dc->running = SCE_TRUE;
+    dc->wakeup = SCE_TRUE;
+    if (pthread_create (&dc->thread, NULL, DCache_Loop, dc)) {
+        dc->running = SCE_FALSE;
+        SCEE_LogErrno ("pthread_create() failed");
+        return SCE_ERROR;
+    }
+    return SCE_OK;
+}
+/**
+ * \brief Stops the thread, the trash may not be empty
+ */
+void DCache_Stop (DiskCache *dc)
+{
+    if (!dc->running)
+        return;
+    pthread_mutex_lock (&dc->mutex);
+    dc->running = SCE_FALSE;
+    pthread_cond_broadcast (&dc->cond);
+    pthread_mutex_unlock (&dc->mutex);
+    pthread_join (dc->thread, NULL);
+}
+
+void DCache_PrintStats (FILE *fp, DiskCache *dc)
+{
+    pthread_mutex_lock (&dc->mutex);
+    fprintf (fp, "disk cache: %lu MB used", (unsigned long)(dc->usage >> 20));
+    if (dc->budget)
+        fprintf (fp, " of %lu MB", (unsigned long)(dc->budget >> 20));
+    fprintf (fp, ", %lu trees evicted (%lu MB), %lu entries purged, "
+             "%lu failures\n", dc->n_evicted,
+             (unsigned long)(dc->bytes_evicted >> 20), dc->n_purged,
+             dc->n_failed);
+    pthread_mutex_unlock (&dc->mutex);
+}
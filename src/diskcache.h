@@ -0,0 +1,100 @@
+/*------------------------------------------------------------------------------
+    Tune Land - Sandbox RPG
+    Copyright (C) 2012-2013
+        Antony Martin <antony(dot)martin(at)scengine(dot)org>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ -----------------------------------------------------------------------------*/
+
+#ifndef H_DISKCACHE
+#define H_DISKCACHE
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <SCE/utils/SCEUtils.h>
+
+#define DCACHE_MAX_PATH 256
+/* maximum number of eviction candidates handed to the game at once */
+#define DCACHE_MAX_VICTIMS 64
+
+typedef struct dcachetree DCacheTree;
+struct dcachetree {
+    long x, y, z;               /* origin of the tree */
+    uint64_t bytes;
+    time_t last_used;
+};
+
+/* terrain caches of every server we have been connected to:
+     <root>/<server>/<world>/            world directory (see Game)
+     <root>/<server>/<world>/x_y_z.octree  one tree
+     <root>/<server>/<world>/x_y_z.region  its chunks (see RegionFS)
+     <root>/<server>/<world>/x_y_z/        or its chunk files
+     <root>/.trash/                      waiting to be deleted
+   a background thread keeps the whole cache under a disk budget by
+   evicting the least recently used trees, and deletes the trash. the trees
+   of other servers are evicted by the thread itself, those of the current
+   server are handed to the game, which knows which ones are in use. */
+typedef struct diskcache DiskCache;
+struct diskcache {
+    char root[DCACHE_MAX_PATH];
+    char world[64];             /* name of the world directories */
+    char path[DCACHE_MAX_PATH]; /* world directory of the current server */
+    uint64_t budget;            /* bytes, 0 for no limit */
+
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int running;
+    int wakeup;                 /* the thread has work to do */
+    SCEuint n_trash;            /* to make up unique names in the trash */
+
+    DCacheTree *touched;        /* last uses of the trees of the current
+                                   server, open addressing table */
+    SCEuint n_touched, touched_cap;
+    DCacheTree victims[DCACHE_MAX_VICTIMS];
+    SCEuint n_victims;
+
+    /* statistics */
+    uint64_t usage;             /* bytes used at the last scan */
+    SCEulong n_evicted;
+    uint64_t bytes_evicted;
+    SCEulong n_purged;          /* entries deleted from the trash */
+    SCEulong n_failed;          /* scans and evictions of the thread that
+                                   failed */
+    SCEulong n_reported;        /* failures given by DCache_PopFailures() */
+};
+
+void DCache_Init (DiskCache*);
+void DCache_Clear (DiskCache*);
+
+void DCache_SetRoot (DiskCache*, const char*, const char*);
+void DCache_SetBudget (DiskCache*, uint64_t);
+
+int DCache_Open (DiskCache*, const char*);
+const char* DCache_GetPath (const DiskCache*);
+int DCache_Discard (DiskCache*);
+
+int DCache_Start (DiskCache*);
+void DCache_Stop (DiskCache*);
+
+void DCache_TouchTree (DiskCache*, long, long, long);
+SCEuint DCache_PopVictims (DiskCache*, DCacheTree*, SCEuint);
+SCEulong DCache_PopFailures (DiskCache*);
+int DCache_EvictTree (DiskCache*, const DCacheTree*);
+
+void DCache_PrintStats (FILE*, DiskCache*);
+
+#endif /* guard */
@@ -0,0 +1,155 @@
+/*------------------------------------------------------------------------------
+    Tune Land - Sandbox RPG
+    Copyright (C) 2012-2013
+        Antony Martin <antony(dot)martin(at)scengine(dot)org>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ -----------------------------------------------------------------------------*/
+
+#include "dlqueue.h"
+
+static SCEuint DLQueue_NullPriority (void *data, void *udata)
+{
+    (void)data; (void)udata;
+    return 0;
+}
+
+void DLQueue_Init (DLQueue *q)
+{
+    int i;
+    for (i = 0; i < DLQUEUE_NUM_BUCKETS; i++)
+        SCE_List_Init (&q->buckets[i]);
+    q->first = DLQUEUE_NUM_BUCKETS;
+    q->priority = DLQueue_NullPriority;
+    q->drop = NULL;
+    q->udata = NULL;
+    q->n_moved = 0;
+    q->n_dropped = 0;
+}
+void DLQueue_Clear (DLQueue *q)
+{
+    int i;
+    for (i = 0; i < DLQUEUE_NUM_BUCKETS; i++)
+        SCE_List_Clear (&q->buckets[i]);
+}
+
+void DLQueue_SetPriorityFunc (DLQueue *q, DLQueuePriorityFunc f, void *udata)
+{
+    q->priority = f;
+    q->udata = udata;
+}
+void DLQueue_SetDropFunc (DLQueue *q, DLQueueDropFunc f)
+{
+    q->drop = f;
+}
+
+/* elements are only dropped by DLQueue_Rebucket(), a newly pushed element
+   goes to the last bucket instead */
+static SCEuint DLQueue_GetBucket (DLQueue *q, SCE_SListIterator *it)
+{
+    SCEuint b = q->priority (SCE_List_GetData (it), q->udata);
+    return b < DLQUEUE_NUM_BUCKETS ? b : DLQUEUE_NUM_BUCKETS - 1;
+}
+
+/**
+ * \brief Queues an element after the elements of the same priority
+ */
+void DLQueue_Push (DLQueue *q, SCE_SListIterator *it)
+{
+    SCEuint b = DLQueue_GetBucket (q, it);
+    SCE_List_Appendl (&q->buckets[b], it);
+    if (b < q->first)
+        q->first = b;
+}
+/**
+ * \brief Queues an element before the elements of the same priority
+ */
+void DLQueue_PushFront (DLQueue *q, SCE_SListIterator *it)
+{
+    SCEuint b = DLQueue_GetBucket (q, it);
+    SCE_List_Prependl (&q->buckets[b], it);
+    if (b < q->first)
+        q->first = b;
+}
+
+int DLQueue_HasElements (DLQueue *q)
+{
+    /* elements can be removed from the outside (SCE_List_Remove()), so
+       this is where we skip the buckets that got emptied */
+    while (q->first < DLQUEUE_NUM_BUCKETS &&
+           !SCE_List_HasElements (&q->buckets[q->first]))
+        q->first++;
+    return q->first < DLQUEUE_NUM_BUCKETS;
+}
+
+/**
+ * \brief Removes the most urgent element from the queue
+ * \returns the element or NULL if the queue is empty
+ */
+SCE_SListIterator* DLQueue_Pop (DLQueue *q)
+{
+    SCE_SListIterator *it = NULL;
+
+    if (!DLQueue_HasElements (q))
+        return NULL;
+    it = SCE_List_GetFirst (&q->buckets[q->first]);
+    SCE_List_Remove (it);
+    return it;
+}
+
+SCEuint DLQueue_GetLength (const DLQueue *q)
+{
+    SCEuint i, n = 0;
+    for (i = q->first; i < DLQUEUE_NUM_BUCKETS; i++)
+        n += SCE_List_GetLength (&q->buckets[i]);
+    return n;
+}
+
+/**
+ * \brief Computes the priority of every element again, to be called when
+ * the inputs of the priority function have changed
+ *
+ * Elements stay in the order they were queued within a bucket. Elements
+ * whose priority is DLQUEUE_DROP are removed from the queue and given to
+ * the drop function.
+ */
+void DLQueue_Rebucket (DLQueue *q)
+{
+    SCEuint i, b;
+    SCE_SListIterator *it = NULL, *pro = NULL;
+
+    /* an element moved to an upper bucket is looked at again when we get
+       there, but it stays in place */
+    for (i = q->first; i < DLQUEUE_NUM_BUCKETS; i++) {
+        SCE_List_ForEachProtected (pro, it, &q->buckets[i]) {
+            b = q->priority (SCE_List_GetData (it), q->udata);
+            if (b == DLQUEUE_DROP) {
+                SCE_List_Remove (it);
+                q->n_dropped++;
+                if (q->drop)
+                    q->drop (SCE_List_GetData (it), q->udata);
+                continue;
+            }
+            if (b >= DLQUEUE_NUM_BUCKETS)
+                b = DLQUEUE_NUM_BUCKETS - 1;
+            if (b != i) {
+                SCE_List_Remove (it);
+                SCE_List_Appendl (&q->buckets[b], it);
+                if (b < q->first)
+                    q->first = b;
+                q->n_moved++;
+            }
+        }
+    }
+}
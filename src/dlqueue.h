@@ -0,0 +1,65 @@
+/*------------------------------------------------------------------------------
+    Tune Land - Sandbox RPG
+    Copyright (C) 2012-2013
+        Antony Martin <antony(dot)martin(at)scengine(dot)org>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ -----------------------------------------------------------------------------*/
+
+#ifndef H_DLQUEUE
+#define H_DLQUEUE
+
+#include <SCE/utils/SCEUtils.h>
+
+#define DLQUEUE_NUM_BUCKETS 64
+
+/* priority of the elements that are no longer needed */
+#define DLQUEUE_DROP ((SCEuint)-1)
+
+/* returns the bucket of an element, lower buckets are downloaded first */
+typedef SCEuint (*DLQueuePriorityFunc)(void*, void*);
+/* called on the elements removed by DLQueue_Rebucket() */
+typedef void (*DLQueueDropFunc)(void*, void*);
+
+/* bucketed priority queue of terrain download requests. elements are the
+   list iterators of the chunks (or trees), the data of an iterator is given
+   to the priority function. priorities are only computed when an element
+   is pushed and when DLQueue_Rebucket() is called, popping the most urgent
+   element is O(1) amortized. */
+typedef struct dlqueue DLQueue;
+struct dlqueue {
+    SCE_SList buckets[DLQUEUE_NUM_BUCKETS];
+    SCEuint first;              /* no element below this bucket */
+    DLQueuePriorityFunc priority;
+    DLQueueDropFunc drop;
+    void *udata;
+    SCEulong n_moved;           /* elements moved by DLQueue_Rebucket() */
+    SCEulong n_dropped;
+};
+
+void DLQueue_Init (DLQueue*);
+void DLQueue_Clear (DLQueue*);
+
+void DLQueue_SetPriorityFunc (DLQueue*, DLQueuePriorityFunc, void*);
+void DLQueue_SetDropFunc (DLQueue*, DLQueueDropFunc);
+
+void DLQueue_Push (DLQueue*, SCE_SListIterator*);
+void DLQueue_PushFront (DLQueue*, SCE_SListIterator*);
+int DLQueue_HasElements (DLQueue*);
+SCE_SListIterator* DLQueue_Pop (DLQueue*);
+SCEuint DLQueue_GetLength (const DLQueue*);
+
+void DLQueue_Rebucket (DLQueue*);
+
+#endif /* guard */
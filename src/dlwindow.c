@@ -0,0 +1,223 @@
+/*------------------------------------------------------------------------------
+    Tune Land - Sandbox RPG
+    Copyright (C) 2012-2013
+        Antony Martin <antony(dot)martin(at)scengine(dot)org>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ -----------------------------------------------------------------------------*/
+
+#include "dlwindow.h"
+
+/* number of requests we accept to see waiting in the queues: below ALPHA
+   the link is underused, above BETA we are only adding latency. while in
+   slow start the window doubles until GAMMA requests are queued */
+#define DLWIN_ALPHA 2.0
+#define DLWIN_BETA 4.0
+#define DLWIN_GAMMA 1.0
+
+/* the base RTT is forgotten every so often (ms) so that a route change
+   does not leave us with an unreachable reference */
+#define DLWIN_MINRTT_PERIOD 10000
+/* throughput sampling period (ms) */
+#define DLWIN_RATE_PERIOD 1000
+
+void DLWin_Init (DLWindow *w)
+{
+    w->min_size = DLWIN_DEFAULT_MIN_SIZE;
+    w->max_size = DLWIN_DEFAULT_MAX_SIZE;
+    w->size = w->min_size;
+    w->slow_start = SCE_TRUE;
+    w->n_acked = 0;
+
+    w->srtt = 0.0;
+    w->min_rtt = -1.0;
+    w->period_min_rtt = -1.0;
+    w->period_start = 0;
+
+    w->total_bytes = 0;
+    w->total_replies = 0;
+    w->rate_bytes = 0;
+    w->rate_start = 0;
+    w->throughput = 0.0;
+    w->peak_throughput = 0.0;
+    w->peak_size = w->size;
+}
+void DLWin_Clear (DLWindow *w)
+{
+    (void)w;
+}
+
+static void DLWin_Clamp (DLWindow *w)
+{
+    if (w->size < w->min_size)
+        w->size = w->min_size;
+    else if (w->size > w->max_size)
+        w->size = w->max_size;
+}
+
+void DLWin_SetLimits (DLWindow *w, SCEuint min, SCEuint max)
+{
+    w->min_size = min > 0 ? min : 1;
+    w->max_size = max > w->min_size ? max : w->min_size;
+    DLWin_Clamp (w);
+}
+
+/**
+ * \brief Gets the number of requests allowed to be in flight
+ */
+SCEuint DLWin_GetSize (const DLWindow *w)
+{
+    return w->size;
+}
+/**
+ * \brief Whether a new request can be sent
+ * \param n_flying number of requests currently waiting for a reply
+ */
+int DLWin_CanSend (const DLWindow *w, SCEuint n_flying)
+{
+    return n_flying < (SCEuint)w->size;
+}
+
+static void DLWin_UpdateRate (DLWindow *w, SCEuint now)
+{
+    SCEuint elapsed = now - w->rate_start;
+
+    if (elapsed < DLWIN_RATE_PERIOD)
+        return;
+
+    if (w->rate_start != 0) {
+        float rate = (float)w->rate_bytes * 1000.0 / elapsed;
+        if (w->throughput == 0.0)
+            w->throughput = rate;
+        else
+            w->throughput = 0.75 * w->throughput + 0.25 * rate;
+        if (w->throughput > w->peak_throughput)
+            w->peak_throughput = w->throughput;
+    }
+    w->rate_start = now;
+    w->rate_bytes = 0;
+}
+
+static void DLWin_UpdateMinRTT (DLWindow *w, float rtt, SCEuint now)
+{
+    if (w->period_min_rtt < 0.0 || rtt < w->period_min_rtt)
+        w->period_min_rtt = rtt;
+    if (w->min_rtt < 0.0 || rtt < w->min_rtt)
+        w->min_rtt = rtt;
+
+    if (now - w->period_start >= DLWIN_MINRTT_PERIOD) {
+        w->min_rtt = w->period_min_rtt;
+        w->period_min_rtt = -1.0;
+        w->period_start = now;
+    }
+}
+
+/* called once per window worth of replies */
+static void DLWin_Adjust (DLWindow *w)
+{
+    float queued;
+
+    /* estimation of the number of our requests sitting in the queues */
+    if (w->srtt < 1.0)
+        queued = 0.0;           /* below timer resolution: no queueing */
+    else
+        queued = w->size * (w->srtt - w->min_rtt) / w->srtt;
+
+    if (w->slow_start) {
+        if (queued > DLWIN_GAMMA) {
+            w->slow_start = SCE_FALSE;
+            w->size -= queued;
+        } else
+            w->size *= 2.0;
+    } else if (queued < DLWIN_ALPHA)
+        w->size += 1.0;
+    else if (queued > DLWIN_BETA)
+        w->size -= 1.0;
+
+    DLWin_Clamp (w);
+    if (w->size > w->peak_size)
+        w->peak_size = w->size;
+}
+
+/**
+ * \brief Notifies the window that a reply has been received
+ * \param sent time at which the request was sent (ms)
+ * \param now current time (ms)
+ * \param bytes size of the reply
+ */
+void DLWin_Ack (DLWindow *w, SCEuint sent, SCEuint now, size_t bytes)
+{
+    float rtt = now - sent;
+
+    if (w->total_replies == 0) {
+        w->srtt = rtt;
+        w->period_start = now;
+    } else
+        w->srtt = 0.875 * w->srtt + 0.125 * rtt;
+    DLWin_UpdateMinRTT (w, rtt, now);
+
+    w->total_bytes += bytes;
+    w->total_replies++;
+    w->rate_bytes += bytes;
+    DLWin_UpdateRate (w, now);
+
+    w->n_acked++;
+    if (w->n_acked >= (SCEuint)w->size) {
+        w->n_acked = 0;
+        DLWin_Adjust (w);
+    }
+}
+
+float DLWin_GetRTT (const DLWindow *w)
+{
+    return w->srtt;
+}
+float DLWin_GetMinRTT (const DLWindow *w)
+{
+    return w->min_rtt;
+}
+/**
+ * \brief Gets the smoothed download throughput, in bytes per second
+ */
+float DLWin_GetThroughput (const DLWindow *w)
+{
+    return w->throughput;
+}
+float DLWin_GetPeakThroughput (const DLWindow *w)
+{
+    return w->peak_throughput;
+}
+SCEuint DLWin_GetPeakSize (const DLWindow *w)
+{
+    return w->peak_size;
+}
+/**
+ * \brief Gets the bandwidth-delay product, expressed in number of requests
+ */
+float DLWin_GetBDP (const DLWindow *w)
+{
+    float avg;
+    if (w->total_replies == 0 || w->min_rtt < 0.0)
+        return 0.0;
+    avg = (float)w->total_bytes / w->total_replies;
+    return w->throughput * w->min_rtt / (1000.0 * avg);
+}
+SCEulong DLWin_GetTotalBytes (const DLWindow *w)
+{
+    return w->total_bytes;
+}
+SCEulong DLWin_GetTotalReplies (const DLWindow *w)
+{
+    return w->total_replies;
+}
@@ -0,0 +1,73 @@
+/*------------------------------------------------------------------------------
+    Tune Land - Sandbox RPG
+    Copyright (C) 2012-2013
+        Antony Martin <antony(dot)martin(at)scengine(dot)org>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ -----------------------------------------------------------------------------*/
+
+#ifndef H_DLWINDOW
+#define H_DLWINDOW
+
+#include <SCE/utils/SCEUtils.h>
+
+/* default bounds of the window, in number of outstanding requests */
+#define DLWIN_DEFAULT_MIN_SIZE 2
+#define DLWIN_DEFAULT_MAX_SIZE 256
+
+/* delay-based (Vegas-like) congestion window for terrain download requests:
+   every reply gives a RTT sample, the window grows as long as the RTT stays
+   close to the smallest RTT seen (ie. nothing is piling up in the queues)
+   and shrinks when replies start to slow down. */
+typedef struct dlwindow DLWindow;
+struct dlwindow {
+    float size;                 /* current window size, in requests */
+    SCEuint min_size, max_size;
+    int slow_start;
+    SCEuint n_acked;            /* replies since last window adjustment */
+
+    float srtt;                 /* smoothed RTT (ms) */
+    float min_rtt;              /* base RTT (ms), -1 if unknown */
+    float period_min_rtt;       /* smallest RTT of the current period */
+    SCEuint period_start;       /* beginning of the current period (ms) */
+
+    /* statistics */
+    SCEulong total_bytes;
+    SCEulong total_replies;
+    SCEulong rate_bytes;        /* bytes received since rate_start */
+    SCEuint rate_start;
+    float throughput;           /* bytes per second */
+    float peak_throughput;
+    float peak_size;
+};
+
+void DLWin_Init (DLWindow*);
+void DLWin_Clear (DLWindow*);
+
+void DLWin_SetLimits (DLWindow*, SCEuint, SCEuint);
+
+SCEuint DLWin_GetSize (const DLWindow*);
+int DLWin_CanSend (const DLWindow*, SCEuint);
+void DLWin_Ack (DLWindow*, SCEuint, SCEuint, size_t);
+
+float DLWin_GetRTT (const DLWindow*);
+float DLWin_GetMinRTT (const DLWindow*);
+float DLWin_GetThroughput (const DLWindow*);
+float DLWin_GetPeakThroughput (const DLWindow*);
+SCEuint DLWin_GetPeakSize (const DLWindow*);
+float DLWin_GetBDP (const DLWindow*);
+SCEulong DLWin_GetTotalBytes (const DLWindow*);
+SCEulong DLWin_GetTotalReplies (const DLWindow*);
+
+#endif /* guard */
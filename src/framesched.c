@@ -0,0 +1,198 @@
+/*------------------------------------------------------------------------------
+    Tune Land - Sandbox RPG
+    Copyright (C) 2012-2013
+        Antony Martin <antony(dot)martin(at)scengine(dot)org>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ -----------------------------------------------------------------------------*/
+
+#include "clock.h"
+#include "framesched.h"
+
+void FSched_Init (FrameSched *s)
+{
+    s->n_tasks = 0;
+    s->budget = 8000;
+    s->n_frames = 0;
+    s->n_over = 0;
+    s->idle_usec = 0;
+}
+void FSched_Clear (FrameSched *s)
+{
+    (void)s;
+}
+
+/**
+ * \brief Sets the time the frame tasks may take per frame (usec)
+ */
+void FSched_SetBudget (FrameSched *s, SCEuint budget)
+{
+    s->budget = budget;
+}
+
+/**
+ * \brief Adds a task, tasks of the same priority run in the order they were
+ * added
+ * \param max_delay the task runs when it has not run for that long (ms),
+ * whatever the time left, 0 to always run it
+ * \returns the index of the task, SCE_ERROR if there are too many
+ */
+int FSched_Add (FrameSched *s, const char *name, FSchedFunc fun, void *udata,
+                FSchedKind kind, int priority, SCEuint max_delay)
+{
+    FSchedTask *t = NULL;
+    SCEuint i;
+
+    if (s->n_tasks >= FSCHED_MAX_TASKS) {
+        SCEE_Log (SCE_INVALID_OPERATION);
+        SCEE_LogMsg ("too many tasks");
+        return SCE_ERROR;
+    }
+    /* keep the tasks sorted by priority */
+    for (i = s->n_tasks; i > 0 && s->tasks[i - 1].priority > priority; i--)
+        s->tasks[i] = s->tasks[i - 1];
+    t = &s->tasks[i];
+    t->name = name;
+    t->fun = fun;
+    t->udata = udata;
+    t->kind = kind;
+    t->priority = priority;
+    t->max_delay = max_delay;
+    t->last_run = Clock_GetMicro ();
+    t->pending = SCE_FALSE;
+    t->n_runs = 0;
+    t->n_deferred = 0;
+    t->n_forced = 0;
+    t->usec = 0;
+    s->n_tasks++;
+    return i;
+}
+
+static int FSched_IsStarving (const FSchedTask *t, SCEulong now)
+{
+    return now - t->last_run >= (SCEulong)t->max_delay * 1000;
+}
+
+static int FSched_RunTask (FSchedTask *t, SCEulong deadline)
+{
+    SCEulong start = Clock_GetMicro ();
+    int res = t->fun (t->udata, deadline);
+
+    t->last_run = Clock_GetMicro ();
+    t->usec += t->last_run - start;
+    t->n_runs++;
+    if (res < 0) {
+        SCEE_LogSrc ();
+        return SCE_ERROR;
+    }
+    t->pending = res;
+    return SCE_OK;
+}
+
+/**
+ * \brief Runs the frame tasks within the budget
+ *
+ * Idle tasks that have not been given any time for too long are run too.
+ */
+int FSched_RunFrame (FrameSched *s)
+{
+    SCEulong now = Clock_GetMicro ();
+    SCEulong deadline = now + s->budget;
+    SCEuint i;
+
+    s->n_frames++;
+    for (i = 0; i < s->n_tasks; i++) {
+        FSchedTask *t = &s->tasks[i];
+        int starving = FSched_IsStarving (t, now);
+
+        if (t->kind == FSCHED_IDLE && !starving)
+            continue;
+        if (now >= deadline) {
+            if (!starving) {
+                t->n_deferred++;
+                continue;
+            }
+            t->n_forced++;
+        }
+        if (FSched_RunTask (t, deadline) < 0) {
+            SCEE_LogSrc ();
+            return SCE_ERROR;
+        }
+        now = t->last_run;
+    }
+    if (now > deadline)
+        s->n_over++;
+    return SCE_OK;
+}
+
+/**
+ * \brief Gives the time left until \p deadline to the idle tasks, those
+ * that ran the longest time ago first
+ */
+int FSched_RunIdle (FrameSched *s, SCEulong deadline)
+{
+    SCEulong round = Clock_GetMicro ();
+    SCEulong now = round;
+
+    while (now < deadline) {
+        FSchedTask *oldest = NULL;
+        SCEuint i;
+
+        for (i = 0; i < s->n_tasks; i++) {
+            FSchedTask *t = &s->tasks[i];
+            /* tasks that are done get one run per call */
+            if (t->kind != FSCHED_IDLE || (t->last_run >= round && !t->pending))
+                continue;
+            if (!oldest || t->last_run < oldest->last_run)
+                oldest = t;
+        }
+        if (!oldest)
+            break;
+        if (FSched_RunTask (oldest, deadline) < 0) {
+            SCEE_LogSrc ();
+            return SCE_ERROR;
+        }
+        s->idle_usec += oldest->last_run - now;
+        now = oldest->last_run;
+    }
+    return SCE_OK;
+}
+
+/**
+ * \brief Whether a frame task was left with work to do
+ */
+int FSched_HasPending (const FrameSched *s)
+{
+    SCEuint i;
+    for (i = 0; i < s->n_tasks; i++) {
+        if (s->tasks[i].kind == FSCHED_FRAME && s->tasks[i].pending)
+            return SCE_TRUE;
+    }
+    return SCE_FALSE;
+}
+
+void FSched_PrintStats (FILE *fp, const FrameSched *s)
+{
+    SCEuint i;
+
+    fprintf (fp, "scheduler: %lu frames, %lu over budget, %lu ms of idle "
+             "work\n", s->n_frames, s->n_over, s->idle_usec / 1000);
+    for (i = 0; i < s->n_tasks; i++) {
+        const FSchedTask *t = &s->tasks[i];
+        fprintf (fp, "  %s: %lu runs, %.2f ms average, %lu deferred, "
+                 "%lu forced\n", t->name, t->n_runs,
+                 t->n_runs ? t->usec / 1000.0 / t->n_runs : 0.0,
+                 t->n_deferred, t->n_forced);
+    }
+}
@@ -0,0 +1,86 @@
+/*------------------------------------------------------------------------------
+    Tune Land - Sandbox RPG
+    Copyright (C) 2012-2013
+        Antony Martin <antony(dot)martin(at)scengine(dot)org>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ -----------------------------------------------------------------------------*/
+
+#ifndef H_FRAMESCHED
+#define H_FRAMESCHED
+
+#include <stdio.h>
+#include <SCE/utils/SCEUtils.h>
+
+#define FSCHED_MAX_TASKS 16
+
+/* does some work until deadline (Clock_GetMicro() time). returns SCE_TRUE
+   if there is more to do, SCE_FALSE if there isn't for this frame and
+   SCE_ERROR on error */
+typedef int (*FSchedFunc)(void*, SCEulong);
+
+typedef enum {
+    FSCHED_FRAME,               /* run within the frame budget */
+    FSCHED_IDLE                 /* run with the time left before the end of
+                                   the frame */
+} FSchedKind;
+
+typedef struct fschedtask FSchedTask;
+struct fschedtask {
+    const char *name;
+    FSchedFunc fun;
+    void *udata;
+    FSchedKind kind;
+    int priority;               /* lower runs first */
+    SCEuint max_delay;          /* run even without time left after that
+                                   long (ms) */
+    SCEulong last_run;          /* Clock_GetMicro() */
+    int pending;                /* work was left at the last run */
+
+    /* statistics */
+    SCEulong n_runs;
+    SCEulong n_deferred;        /* times it was skipped for lack of time */
+    SCEulong n_forced;          /* times it ran over the budget */
+    SCEulong usec;
+};
+
+/* runs the per-frame work of the game in small units within a time budget,
+   in order of priority. what doesn't fit is carried to the next frames, the
+   time left before the end of a frame goes to the idle tasks */
+typedef struct framesched FrameSched;
+struct framesched {
+    FSchedTask tasks[FSCHED_MAX_TASKS];
+    SCEuint n_tasks;
+    SCEuint budget;             /* usec */
+
+    /* statistics */
+    SCEulong n_frames;
+    SCEulong n_over;            /* frames that went over the budget */
+    SCEulong idle_usec;         /* time given to idle tasks */
+};
+
+void FSched_Init (FrameSched*);
+void FSched_Clear (FrameSched*);
+
+void FSched_SetBudget (FrameSched*, SCEuint);
+int FSched_Add (FrameSched*, const char*, FSchedFunc, void*, FSchedKind,
+                int, SCEuint);
+
+int FSched_RunFrame (FrameSched*);
+int FSched_RunIdle (FrameSched*, SCEulong);
+int FSched_HasPending (const FrameSched*);
+
+void FSched_PrintStats (FILE*, const FrameSched*);
+
+#endif /* guard */
@@ -17,10 +17,17 @@
     along with this program.  If not, see <http://www.gnu.org/licenses/>.
  -----------------------------------------------------------------------------*/
 
+#include <limits.h>
+#ifndef TL_NO_VIDEO
 #include <SDL.h>
+#endif
 #include <SCE/interface/SCEInterface.h>
 #include <tunel/common/netprotocol.h>
 #include <tunel/common/terrainbrush.h>
+#include "clock.h"
+#include "memfs.h"
+#include "chunkdelta.h"
+#include "voxcopy.h"
 #include "game.h"
 
 #define FPS 60
@@ -44,13 +51,16 @@ if (cd) {\
 typedef enum {
     TERRAIN_AVAILABLE,
     TERRAIN_UNAVAILABLE,
-    TERRAIN_QUEUED
+    TERRAIN_QUEUED,
+    TERRAIN_CANCELLED           /* requested, then cancelled */
 } TerrainStatus;
 
 typedef struct terrainchunk TerrainChunk;
 struct terrainchunk {
     TerrainStatus status;
     SCE_SVoxelOctreeNode *node;
+    SCEuint sent;               /* time at which the request was sent */
+    int prefetched;             /* queued by the prefetcher, not used yet */
     SCE_SListIterator it;
 };
 
@@ -58,7 +68,10 @@ typedef struct terraintree TerrainTree;
 struct terraintree {
     TerrainStatus status;
     SCE_SVoxelWorldTree *tree;
+    SCEuint sent;               /* time at which the request was sent */
+    int prefetched;
     SCE_SListIterator it;
+    SCE_SListIterator save_it;  /* in Game::unsaved_trees */
 };
 
 
@@ -66,12 +79,17 @@ static void TTree_Init (TerrainTree *tree)
 {
     tree->status = TERRAIN_UNAVAILABLE;
     tree->tree = NULL;
+    tree->sent = 0;
+    tree->prefetched = SCE_FALSE;
     SCE_List_InitIt (&tree->it);
     SCE_List_SetData (&tree->it, tree);
+    SCE_List_InitIt (&tree->save_it);
+    SCE_List_SetData (&tree->save_it, tree);
 }
 static void TTree_Clear (TerrainTree *tree)
 {
     SCE_List_Remove (&tree->it);
+    SCE_List_Remove (&tree->save_it);
 }
 static TerrainTree* TTree_New (void)
 {
@@ -94,6 +112,8 @@ static void TChunk_Init (TerrainChunk *chunk)
 {
     chunk->status = TERRAIN_UNAVAILABLE;
     chunk->node = NULL;
+    chunk->sent = 0;
+    chunk->prefetched = SCE_FALSE;
     SCE_List_InitIt (&chunk->it);
     SCE_List_SetData (&chunk->it, chunk);
 }
@@ -119,12 +139,480 @@ static void TChunk_Free (TerrainChunk *chunk)
 }
 
 
+/* download priorities: distance to the player in units of the size of the
+   node, so that coarse nodes come before the fine ones, and nodes ahead of
+   us come before the ones behind */
+#define GAME_SCHED_HEADING 0.5  /* weight of the direction of movement */
+#define GAME_SCHED_RESOLUTION 2 /* buckets per node size of distance */
+/* priorities are computed again when we move by half a chunk or turn by
+   more than about 30 degrees */
+#define GAME_SCHED_TURN 0.87
+#define GAME_SCHED_SMOOTH 0.3   /* weight of the last move in the heading */
+
+static SCEuint Game_Priority (Game *game, long x, long y, long z, long size)
+{
+    SCE_TVector3 d;
+    float dist, score;
+
+    SCE_Vector3_Set (d, x + size / 2, y + size / 2, z + size / 2);
+    SCE_Vector3_Operator1v (d, -=, game->sched_pos);
+    dist = SCE_Vector3_Length (d);
+    score = dist / size;
+    if (dist > 0.0)
+        score *= 1.0 - GAME_SCHED_HEADING *
+            SCE_Vector3_Dot (d, game->sched_heading) / dist;
+    return score * GAME_SCHED_RESOLUTION;
+}
+static int Game_IsInCube (const float *center, long d, long x, long y,
+                          long z, long size)
+{
+    long px = center[0], py = center[1], pz = center[2];
+
+    return x + size > px - d && x < px + d &&
+           y + size > py - d && y < py + d &&
+           z + size > pz - d && z < pz + d;
+}
+/* whether a node is still within the area Game_UpdateTerrain() downloads
+   or the one the prefetcher is after, with one chunk of margin so that we
+   don't drop what we just queued */
+static int Game_IsInView (Game *game, long x, long y, long z, long size)
+{
+    long d = game->view_distance + game->view_threshold + game->chunk_size;
+
+    return Game_IsInCube (game->sched_pos, d, x, y, z, size) ||
+           Game_IsInCube (game->prefetch_pos, d, x, y, z, size);
+}
+
+static void Game_GetChunkArea (Game *game, TerrainChunk *tc, long *x, long *y,
+                               long *z, long *size)
+{
+    SCEuint level = SCE_VOctree_GetNodeLevel (tc->node);
+
+    /* node coordinates are expressed in voxels of their level */
+    SCE_VOctree_GetNodeOriginv (tc->node, x, y, z);
+    *x *= 1L << level;
+    *y *= 1L << level;
+    *z *= 1L << level;
+    *size = (long)game->chunk_size << level;
+}
+/* only LOD 0 chunks depend on the view, the others are all downloaded */
+static int Game_IsChunkNeeded (Game *game, TerrainChunk *tc)
+{
+    long x, y, z, size;
+
+    if (SCE_VOctree_GetNodeLevel (tc->node) > 0)
+        return SCE_TRUE;
+    Game_GetChunkArea (game, tc, &x, &y, &z, &size);
+    return Game_IsInView (game, x, y, z, size);
+}
+
+static SCEuint Game_ChunkPriority (void *data, void *udata)
+{
+    TerrainChunk *tc = data;
+    Game *game = udata;
+    long x, y, z, size;
+
+    if (!Game_IsChunkNeeded (game, tc))
+        return DLQUEUE_DROP;
+    Game_GetChunkArea (game, tc, &x, &y, &z, &size);
+    return Game_Priority (game, x, y, z, size);
+}
+static SCEuint Game_TreePriority (void *data, void *udata)
+{
+    TerrainTree *tt = data;
+    Game *game = udata;
+    long x, y, z, size;
+
+    SCE_VWorld_GetTreeOriginv (tt->tree, &x, &y, &z);
+    size = (long)game->chunk_size << (game->n_lod - 1);
+    if (!Game_IsInView (game, x, y, z, size))
+        return DLQUEUE_DROP;
+    return Game_Priority (game, x, y, z, size);
+}
+
+/* keeps game->pending up to date, chunks and trees not available yet are
+   marked in it */
+static void Game_SetChunkStatus (Game *game, TerrainChunk *tc,
+                                 TerrainStatus status)
+{
+    SCEuint level = SCE_VOctree_GetNodeLevel (tc->node);
+    long x, y, z, cs = game->chunk_size;
+
+    tc->status = status;
+    SCE_VOctree_GetNodeOriginv (tc->node, &x, &y, &z);
+    if (AMap_Set (&game->pending, level, x / cs, y / cs, z / cs,
+                  status != TERRAIN_AVAILABLE) < 0) {
+        SCEE_LogSrc ();
+        SCEE_Out ();
+        SCEE_Clear ();
+    }
+}
+static void Game_SetTreeStatus (Game *game, TerrainTree *tt,
+                                TerrainStatus status)
+{
+    long x, y, z, size = (long)game->chunk_size << (game->n_lod - 1);
+
+    tt->status = status;
+    SCE_VWorld_GetTreeOriginv (tt->tree, &x, &y, &z);
+    if (AMap_Set (&game->pending, game->n_lod, x / size, y / size, z / size,
+                  status != TERRAIN_AVAILABLE) < 0) {
+        SCEE_LogSrc ();
+        SCEE_Out ();
+        SCEE_Clear ();
+    }
+}
+
+/* dropped requests can be queued again later */
+static void Game_DropChunk (void *data, void *udata)
+{
+    TerrainChunk *tc = data;
+    Game *game = udata;
+    Game_SetChunkStatus (game, tc, TERRAIN_UNAVAILABLE);
+    if (tc->prefetched) {
+        tc->prefetched = SCE_FALSE;
+        game->prefetch_chunks.dropped++;
+    }
+}
+static void Game_DropTree (void *data, void *udata)
+{
+    TerrainTree *tt = data;
+    Game *game = udata;
+    Game_SetTreeStatus (game, tt, TERRAIN_UNAVAILABLE);
+    if (tt->prefetched) {
+        tt->prefetched = SCE_FALSE;
+        game->prefetch_trees.dropped++;
+    }
+}
+
+/* tells the server to forget about the requests of the chunks we have left
+   behind. their data is still accepted if it was already on its way */
+static void Game_CancelChunks (Game *game)
+{
+    QueryBatch qb;
+    SCE_SListIterator *it = NULL, *pro = NULL;
+    const unsigned char *packet = NULL;
+    size_t size;
+    long x, y, z;
+
+    if (!(game->caps & GAME_CAP_CANCEL))
+        return;
+
+    QBatch_Init (&qb);
+    QBatch_Begin (&qb, game->chunk_size);
+    SCE_List_ForEachProtected (pro, it, &game->dl_chunks) {
+        TerrainChunk *tc = SCE_List_GetData (it);
+        if (Game_IsChunkNeeded (game, tc))
+            continue;
+
+        SCE_List_Remove (&tc->it);
+        SCE_List_Appendl (&game->cancelled_chunks, &tc->it);
+        Game_SetChunkStatus (game, tc, TERRAIN_CANCELLED);
+        game->n_cancelled++;
+        if (tc->prefetched) {
+            tc->prefetched = SCE_FALSE;
+            game->prefetch_chunks.dropped++;
+        }
+
+        SCE_VOctree_GetNodeOriginv (tc->node, &x, &y, &z);
+        QBatch_Add (&qb, SCE_VOctree_GetNodeLevel (tc->node), x, y, z, NULL);
+        if (QBatch_IsFull (&qb)) {
+            packet = QBatch_Finish (&qb, &size);
+            NetClient_SendTCP (&game->self.client, TLP_CANCEL_CHUNKS,
+                               packet, size);
+            QBatch_Begin (&qb, game->chunk_size);
+        }
+    }
+    if (QBatch_GetNumNodes (&qb) > 0) {
+        packet = QBatch_Finish (&qb, &size);
+        NetClient_SendTCP (&game->self.client, TLP_CANCEL_CHUNKS, packet, size);
+    }
+    QBatch_Clear (&qb);
+}
+
+/* weight of the last frame in the velocity estimation */
+#define GAME_VELOCITY_SMOOTH 0.2
+
+/* follows the movements of the player */
+static void Game_UpdateMotion (Game *game)
+{
+    SCE_TVector3 move;
+    SCEuint now = Clock_GetTicks ();
+    SCEuint dt = now - game->last_move;
+    float len;
+
+    if (dt == 0)
+        return;
+    game->last_move = now;
+
+    SCE_Vector3_Copy (move, game->self.pos);
+    SCE_Vector3_Operator1v (move, -=, game->last_pos);
+    SCE_Vector3_Copy (game->last_pos, game->self.pos);
+
+    /* big gaps between two frames are not movement we can learn from */
+    if (dt > 1000)
+        return;
+    SCE_Vector3_Operator1 (game->velocity, *=, 1.0 - GAME_VELOCITY_SMOOTH);
+    SCE_Vector3_Operator1 (move, *=, GAME_VELOCITY_SMOOTH / dt);
+    SCE_Vector3_Operator1v (game->velocity, +=, move);
+
+    len = SCE_Vector3_Length (move);
+    if (len > 0.0) {
+        SCE_Vector3_Operator1 (move, *=, GAME_SCHED_SMOOTH / len);
+        SCE_Vector3_Operator1 (game->heading, *=, 1.0 - GAME_SCHED_SMOOTH);
+        SCE_Vector3_Operator1v (game->heading, +=, move);
+        len = SCE_Vector3_Length (game->heading);
+        if (len > 0.0)
+            SCE_Vector3_Operator1 (game->heading, /=, len);
+    }
+}
+
+/* updates the download priorities when we have moved enough */
+static void Game_UpdatePriorities (Game *game)
+{
+    SCE_TVector3 move;
+
+    SCE_Vector3_Copy (move, game->self.pos);
+    SCE_Vector3_Operator1v (move, -=, game->sched_pos);
+    if (SCE_Vector3_Length (move) * 2.0 < game->chunk_size &&
+        SCE_Vector3_Dot (game->heading, game->sched_heading) > GAME_SCHED_TURN)
+        return;
+
+    SCE_Vector3_Copy (game->sched_pos, game->self.pos);
+    SCE_Vector3_Copy (game->sched_heading, game->heading);
+    DLQueue_Rebucket (&game->queued_trees);
+    DLQueue_Rebucket (&game->queued_chunks);
+    Game_CancelChunks (game);
+}
+
+
+
+/* the grids of the terrain levels belong to the renderer, except in
+   headless mode where the client keeps them itself */
+static void Game_GetOrigin (Game *game, SCEuint level, long *x, long *y,
+                            long *z)
+{
+    if (game->config.headless)
+        HTerrain_GetOrigin (&game->grids, level, x, y, z);
+    else
+        SCE_VTerrain_GetOrigin (game->vt, level, x, y, z);
+}
+static void Game_GetGridRectangle (Game *game, SCEuint level,
+                                   SCE_SLongRect3 *r)
+{
+    if (game->config.headless)
+        HTerrain_GetRectangle (&game->grids, level, r);
+    else
+        SCE_VTerrain_GetRectangle (game->vt, level, r);
+}
+static void Game_GetMissingSlices (Game *game, SCEuint level, long *missing)
+{
+    if (game->config.headless)
+        HTerrain_GetMissingSlices (&game->grids, level, &missing[0],
+                                   &missing[1], &missing[2]);
+    else
+        SCE_VTerrain_GetMissingSlices (game->vt, level, &missing[0],
+                                       &missing[1], &missing[2]);
+}
+static void Game_SetGridPosition (Game *game, long x, long y, long z)
+{
+    if (game->config.headless)
+        HTerrain_SetPosition (&game->grids, x, y, z);
+    else
+        SCE_VTerrain_SetPosition (game->vt, x, y, z);
+}
+static void Game_ResetGrid (Game *game, SCEuint level)
+{
+    if (game->config.headless)
+        HTerrain_UpdateGrid (&game->grids, level);
+    else
+        SCE_VTerrain_UpdateGrid (game->vt, level, SCE_FALSE);
+}
+static void Game_AppendSlice (Game *game, SCEuint level, SCE_EBoxFace f,
+                              const void *slice)
+{
+    if (game->config.headless)
+        HTerrain_AppendSlice (&game->grids, level, f, slice);
+    else
+        SCE_VTerrain_AppendSlice (game->vt, level, f, slice);
+}
+/* r is in the coordinates of the grid */
+static void Game_UpdateSubGrid (Game *game, SCEuint level,
+                                SCE_SIntRect3 *r, int first_draw)
+{
+    if (game->config.headless)
+        HTerrain_UpdateSubGrid (&game->grids, level, r);
+    else
+        SCE_VTerrain_UpdateSubGrid (game->vt, level, r, first_draw);
+}
+static void Game_GetGridSize (Game *game, long *w, long *h, long *d)
+{
+    if (game->config.headless) {
+        *w = game->grids.dims[0];
+        *h = game->grids.dims[1];
+        *d = game->grids.dims[2];
+    } else {
+        *w = SCE_VTerrain_GetWidth (game->vt);
+        *h = SCE_VTerrain_GetHeight (game->vt);
+        *d = SCE_VTerrain_GetDepth (game->vt);
+    }
+}
+/* nothing is drawn in headless mode */
+static void Game_ActivateLevel (Game *game, SCEuint level, int active)
+{
+    if (!game->config.headless)
+        SCE_VTerrain_ActivateLevel (game->vt, level, active);
+}
+
+/* describes the grid of a level to the copy kernels, which replace
+   SCE_Grid_SetRegion() on the hot path */
+static void Game_GetGridVolume (Game *game, int level, VCopyVolume *vol)
+{
+    SCE_SGrid *grid = NULL;
+    int wrap[3];
+
+    if (game->config.headless) {
+        *vol = *HTerrain_GetLevelGrid (&game->grids, level);
+        return;
+    }
+    grid = SCE_VTerrain_GetLevelGrid (game->vt, level);
+    SCE_Grid_GetWrapping (grid, &wrap[0], &wrap[1], &wrap[2]);
+    vol->data = SCE_Grid_GetRaw (grid);
+    vol->dims[0] = SCE_Grid_GetWidth (grid);
+    vol->dims[1] = SCE_Grid_GetHeight (grid);
+    vol->dims[2] = SCE_Grid_GetDepth (grid);
+    vol->wrap[0] = wrap[0];
+    vol->wrap[1] = wrap[1];
+    vol->wrap[2] = wrap[2];
+    vol->elem = SCE_Grid_GetNumComponents (grid);
+}
+
+/* reads an updated region of vw and copies it into the grid of its level */
+static int Game_CopyRegion (Game *game, int level, const SCE_SLongRect3 *r,
+                            int first_draw)
+{
+    SCE_SIntRect3 ri;
+    VCopyVolume vol;
+    size_t size = SCE_Rectangle3_GetAreal (r) * SCE_VOCTREE_VOXEL_ELEMENTS;
+    long origin_x, origin_y, origin_z;
+
+    if (size > game->region_buf_size) {
+        unsigned char *buf = SCE_realloc (game->region_buf, size);
+        if (!buf)
+            goto fail;
+        game->region_buf = buf;
+        game->region_buf_size = size;
+    }
+    /* absent nodes are not written by SCE_VWorld_GetRegion() */
+    memset (game->region_buf, 0, size);
+    if (SCE_VWorld_GetRegion (game->vw, level, r, game->region_buf) < 0)
+        goto fail;
+
+    SCE_Rectangle3_IntFromLong (&ri, r);
+    /* move the updated area in the terrain grid coordinates */
+    Game_GetOrigin (game, level, &origin_x, &origin_y, &origin_z);
+    SCE_Rectangle3_Move (&ri, -origin_x, -origin_y, -origin_z);
+    Game_GetGridVolume (game, level, &vol);
+    if (vol.elem != SCE_VOCTREE_VOXEL_ELEMENTS) {
+        /* the copy kernels don't convert the voxels, the engine does. the
+           headless grids always match */
+        SCE_Grid_SetRegion (SCE_VTerrain_GetLevelGrid (game->vt, level),
+                            &ri, SCE_VOCTREE_VOXEL_ELEMENTS, game->region_buf);
+    } else
+        VCopy_ToVolume (&vol, &ri, game->region_buf);
+    Game_UpdateSubGrid (game, level, &ri, first_draw);
+    return SCE_OK;
+fail:
+    SCEE_LogSrc ();
+    return SCE_ERROR;
+}
+static long Game_Wrap (long v, long n)
+{
+    v %= n;
+    return v < 0 ? v + n : v;
+}
+/* where the voxels of a region are stored in the grid of a level, if they
+   are contiguous there: that is when the region is made of whole z slices
+   of the grid, which is the case of the whole grid when a level gets
+   (re)built. the voxels of the grid must also be laid out like those of
+   the voxel world. returns NULL otherwise */
+static unsigned char*
+Game_GetGridStorage (Game *game, int level, const SCE_SLongRect3 *r)
+{
+    VCopyVolume vol;
+    long w, h, d;
+    long origin[3], p1[3], p2[3];
+    long z;
+
+    Game_GetGridVolume (game, level, &vol);
+    if (vol.elem != SCE_VOCTREE_VOXEL_ELEMENTS)
+        return NULL;
+    w = vol.dims[0];
+    h = vol.dims[1];
+    d = vol.dims[2];
+    SCE_Rectangle3_GetPointslv (r, p1, p2);
+    if (p2[0] - p1[0] != w || p2[1] - p1[1] != h)
+        return NULL;
+    Game_GetOrigin (game, level, &origin[0], &origin[1], &origin[2]);
+    if (Game_Wrap (p1[0] - origin[0] + vol.wrap[0], w) != 0 ||
+        Game_Wrap (p1[1] - origin[1] + vol.wrap[1], h) != 0)
+        return NULL;
+    z = Game_Wrap (p1[2] - origin[2] + vol.wrap[2], d);
+    if (z + p2[2] - p1[2] > d)
+        return NULL;
+    return &vol.data[z * w * h * vol.elem];
+}
+
+/* reads an updated region straight into the grid when its voxels are
+   contiguous there, saving the copy through a buffer. returns SCE_FALSE
+   if the region has to be copied. like Game_CopyRegion() it runs on the
+   main thread, between the regions of the frame: nothing else writes
+   into the grids meanwhile */
+static int Game_ReadRegionInPlace (Game *game, int level,
+                                   const SCE_SLongRect3 *r, int first_draw,
+                                   int *res)
+{
+    SCE_SIntRect3 terrain_ri;
+    unsigned char *dst = NULL;
+    long origin_x, origin_y, origin_z;
+
+    if (!(dst = Game_GetGridStorage (game, level, r)))
+        return SCE_FALSE;
+
+    /* absent nodes are not written by SCE_VWorld_GetRegion() */
+    memset (dst, 0, SCE_Rectangle3_GetAreal (r) * SCE_VOCTREE_VOXEL_ELEMENTS);
+    if ((*res = SCE_VWorld_GetRegion (game->vw, level, r, dst)) < 0) {
+        SCEE_LogSrc ();
+        return SCE_TRUE;
+    }
+
+    SCE_Rectangle3_IntFromLong (&terrain_ri, r);
+    Game_GetOrigin (game, level, &origin_x, &origin_y, &origin_z);
+    SCE_Rectangle3_Move (&terrain_ri, -origin_x, -origin_y, -origin_z);
+    Game_UpdateSubGrid (game, level, &terrain_ri, first_draw);
+    return SCE_TRUE;
+}
 
 void Game_InitConfig (GameConfig *config)
 {
     /* default screen resolution */
     config->screen_w = 1024;
     config->screen_h = 768;
+    config->batch_queries = SCE_TRUE;
+    config->progressive = SCE_TRUE;
+    config->regions = SCE_TRUE;
+    config->cache_budget = 1024UL << 20;
+    config->cache_memory = 64UL << 20;
+    config->cache_policy = PCACHE_MOTION;
+    config->cache_trace = NULL;
+    config->bench_teleports = 0;
+#ifdef TL_NO_VIDEO
+    config->headless = SCE_TRUE;
+#else
+    config->headless = SCE_FALSE;
+#endif
+    config->script = NULL;
+    config->caps = GAME_CAPS_COMPRESSION | GAME_CAP_DELTA | GAME_CAP_FASTHASH |
+        GAME_CAP_CANCEL | GAME_CAP_WORLDINFO | GAME_CAP_BATCH;
 }
 void Game_ClearConfig (GameConfig *config)
 {
@@ -173,6 +661,78 @@ static GameClient* Game_LocateClientByID (Game *game, int id)
 
 /**************** client callbacks ****************/
 
+/* size of an encoded client ID */
+#define GAME_ID_SIZE 4
+
+/* room left for the headers of the terrain files when bounding the size of
+   the payloads, and for each node record of an octree file */
+#define GAME_MAX_HEADER_SIZE 4096
+#define GAME_MAX_NODE_RECORD_SIZE 256
+
+/* largest chunk file or chunk delta we accept */
+static size_t Game_GetMaxChunkSize (Game *game)
+{
+    size_t cs = game->chunk_size;
+    return cs * cs * cs * SCE_VOCTREE_VOXEL_ELEMENTS + GAME_MAX_HEADER_SIZE;
+}
+/* largest octree file we accept, one record per node */
+static size_t Game_GetMaxTreeSize (Game *game)
+{
+    size_t n = 0;
+    SCEuint i;
+    for (i = 0; i < game->n_lod; i++)
+        n = n * 8 + 1;
+    return n * GAME_MAX_NODE_RECORD_SIZE + GAME_MAX_HEADER_SIZE;
+}
+
+/* decompresses a payload if the server compresses them. the size announced
+   by the payload is checked against \p max before anything is allocated.
+   the returned data is valid until the next call */
+static int Game_Decompress (Game *game, const unsigned char **data,
+                            size_t *size, size_t max)
+{
+    CompCodec codec;
+    CompStats *stats = NULL;
+    size_t raw;
+    long n;
+    SCEulong t;
+
+    if (!(game->caps & GAME_CAPS_COMPRESSION) || *size == 0)
+        return SCE_OK;
+
+    if (Comp_GetInfo (*data, *size, &codec, &raw) < 0)
+        goto fail;
+    if (raw > max) {
+        SCEE_Log (SCE_INVALID_ARG);
+        SCEE_LogMsg ("decompressed payload too large: %lu bytes, at most %lu",
+                     (unsigned long)raw, (unsigned long)max);
+        goto fail;
+    }
+    if (raw > game->zbuf_size) {
+        unsigned char *buf = SCE_realloc (game->zbuf, raw);
+        if (!buf)
+            goto fail;
+        game->zbuf = buf;
+        game->zbuf_size = raw;
+    }
+
+    t = Clock_GetMicro ();
+    if ((n = Comp_Decode (*data, *size, game->zbuf, raw)) < 0)
+        goto fail;
+    stats = &game->comp_stats[codec];
+    stats->decode_usec += Clock_GetMicro () - t;
+    stats->n_payloads++;
+    stats->wire_bytes += *size;
+    stats->raw_bytes += n;
+
+    *data = game->zbuf;
+    *size = n;
+    return SCE_OK;
+fail:
+    SCEE_LogSrc ();
+    return SCE_ERROR;
+}
+
 static void
 Game_tlp_get_client_num (NetClient *client, void *cmddata, const char *packet,
                          size_t size)
@@ -182,16 +742,60 @@ Game_tlp_get_client_num (NetClient *client, void *cmddata, const char *packet,
     (void)cmddata;
 }
 
+/* the levels index arrays of HTERRAIN_MAX_LEVELS and make 1 << n_lod
+   masks */
+static int Game_IsNumLODValid (long n_lod)
+{
+    return n_lod > 0 && n_lod <= HTERRAIN_MAX_LEVELS;
+}
+/* a chunk has to fit in the grids of the terrain */
+static int Game_IsChunkSizeValid (long chunk_size)
+{
+    return chunk_size > 0 && chunk_size <= GW;
+}
+
 static void
 Game_tlp_connect_accepted (NetClient *client, void *cmddata,
                            const char *packet, size_t size)
 {
     Game *game = NULL;
+    const unsigned char *p = packet;
     game = NetClient_GetData (client);
     game->self.id = Socket_GetID (packet);
     game->connected = SCE_TRUE;
-    SCEE_SendMsg ("connection accepted! our ID: %d\n", game->self.id);
-    (void)cmddata; (void)size;
+    /* older servers dont send the accepted capabilities */
+    game->caps = 0;
+    if (size >= GAME_ID_SIZE + 4)
+        game->caps = SCE_Decode_Long (&p[GAME_ID_SIZE]) & game->config.caps;
+    if (!game->config.batch_queries)
+        game->caps &= ~GAME_CAP_BATCH;
+    /* world parameters, saves us the TLP_CHUNK_SIZE and TLP_NUM_LOD round
+       trips */
+    if (game->caps & GAME_CAP_WORLDINFO) {
+        if (size < GAME_ID_SIZE + 12) {
+            SCEE_SendMsg ("TLP_CONNECT_ACCEPTED: world info missing\n");
+            game->caps &= ~GAME_CAP_WORLDINFO;
+        } else {
+            long chunk_size = SCE_Decode_Long (&p[GAME_ID_SIZE + 4]);
+            long n_lod = SCE_Decode_Long (&p[GAME_ID_SIZE + 8]);
+            /* ask again, Game_InitTerrain() will fail properly */
+            if (!Game_IsChunkSizeValid (chunk_size)) {
+                SCEE_SendMsg ("TLP_CONNECT_ACCEPTED: invalid chunk size "
+                              "%ld\n", chunk_size);
+                game->caps &= ~GAME_CAP_WORLDINFO;
+            } else if (!Game_IsNumLODValid (n_lod)) {
+                SCEE_SendMsg ("TLP_CONNECT_ACCEPTED: invalid number of "
+                              "levels %ld\n", n_lod);
+                game->caps &= ~GAME_CAP_WORLDINFO;
+            } else {
+                game->chunk_size = chunk_size;
+                game->n_lod = n_lod;
+            }
+        }
+    }
+    SCEE_SendMsg ("connection accepted! our ID: %d, capabilities: %x\n",
+                  game->self.id, game->caps);
+    (void)cmddata;
 }
 static void
 Game_tlp_connect_refused (NetClient *client, void *cmddata,
@@ -244,7 +848,12 @@ Game_tlp_chunk_size (NetClient *client, void *cmddata, const char *packet,
         SCEE_SendMsg ("unexpected TLP_CHUNK_SIZE packet received.\n");
     } else {
         /* NOTE: dont check packet length? */
-        game->chunk_size = SCE_Decode_Long (packet);
+        long chunk_size = SCE_Decode_Long (packet);
+        if (!Game_IsChunkSizeValid (chunk_size))
+            SCEE_SendMsg ("TLP_CHUNK_SIZE: invalid chunk size %ld\n",
+                          chunk_size);
+        else
+            game->chunk_size = chunk_size;
     }
 }
 
@@ -262,7 +871,12 @@ Game_tlp_num_lod (NetClient *client, void *cmddata, const char *packet,
         SCEE_SendMsg ("unexpected TLP_NUM_LOD packet received.\n");
     } else {
         /* NOTE: dont check packet length? */
-        game->n_lod = SCE_Decode_Long (packet);
+        long n_lod = SCE_Decode_Long (packet);
+        if (!Game_IsNumLODValid (n_lod))
+            SCEE_SendMsg ("TLP_NUM_LOD: invalid number of levels %ld\n",
+                          n_lod);
+        else
+            game->n_lod = n_lod;
     }
 }
 
@@ -304,35 +918,34 @@ Game_tlp_query_octree (NetClient *client, void *cmddata, const char *p,
     {
         SCE_SFileSystem fs;
         SCE_SFile fp;
+        MemFile mf;
+        const unsigned char *data = &packet[12];
+        size_t data_size = size - 12;
 
-        /* full in-memory file */
-        fs = sce_cachefs;
-        fs.subfs = &sce_nullfs;
-
-        SCE_File_Init (&fp);
-        if (SCE_File_Open (&fp, &fs, "foo", SCE_FILE_READ | SCE_FILE_WRITE) < 0)
+        if (Game_Decompress (game, &data, &data_size,
+                             Game_GetMaxTreeSize (game)) < 0)
             goto fail;
 
-        if (SCE_File_Write (&packet[12], 1, size - 12, &fp) != size - 12)
+        /* parse the octree straight from the packet */
+        if (MemFS_Open (&fp, &fs, &mf, data, data_size) < 0)
             goto fail;
-        /* TODO: this goto leaves fp open */
-
         vo = SCE_VWorld_GetOctree (wt);
-        SCE_File_Rewind (&fp);
         if (SCE_VOctree_LoadFile (vo, &fp) < 0) {
             SCE_File_Close (&fp);
             goto fail;
         }
-
         SCE_File_Close (&fp);
 
-        /* save the octree on disk */
-        if (SCE_VWorld_SaveTree (game->vw, x, y, z) < 0)
-            goto fail;
+        /* saved on disk later, when the frame leaves some time */
+        SCE_List_Remove (&tt->save_it);
+        SCE_List_Appendl (&game->unsaved_trees, &tt->save_it);
     }
 
-    tt->status = TERRAIN_AVAILABLE;
+    Game_SetTreeStatus (game, tt, TERRAIN_AVAILABLE);
     SCE_List_Remove (&tt->it);
+    DLWin_Ack (&game->tree_win, tt->sent, Clock_GetTicks (), size);
+    /* its chunks can now be fetched */
+    game->view_dirty = SCE_TRUE;
 
     return;
 fail:
@@ -341,83 +954,317 @@ fail:
     SCEE_Clear ();
 }
 
-static void
-Game_tlp_query_chunk (NetClient *client, void *cmddata, const char *p,
-                      size_t size)
+/* saves the received trees with SCE_VWorld_SaveTree() until the deadline
+   (usec), 0 to save them all. returns SCE_TRUE if some are left */
+static int Game_SaveTrees (Game *game, SCEulong deadline)
+{
+    SCE_SListIterator *it = NULL;
+
+    while (SCE_List_HasElements (&game->unsaved_trees)) {
+        TerrainTree *tt = NULL;
+        long x, y, z;
+
+        if (deadline && Clock_GetMicro () >= deadline)
+            return SCE_TRUE;
+        it = SCE_List_GetFirst (&game->unsaved_trees);
+        tt = SCE_List_GetData (it);
+        SCE_List_Remove (it);
+        SCE_VWorld_GetTreeOriginv (tt->tree, &x, &y, &z);
+        if (SCE_VWorld_SaveTree (game->vw, x, y, z) < 0) {
+            SCEE_LogSrc ();
+            return SCE_ERROR;
+        }
+    }
+    return SCE_FALSE;
+}
+
+/* returns the queued chunk at the given coordinates, if any */
+static TerrainChunk*
+Game_GetQueuedChunk (Game *game, SCEuint level, long x, long y, long z)
 {
-    (void)cmddata;
-    Game *game = NULL;
-    SCEuint level;
-    long x, y, z;
     SCE_SVoxelOctreeNode *node = NULL;
     TerrainChunk *tc = NULL;
-    SCE_SFile fp;
-    int expected = SCE_FALSE;
-    const unsigned char *packet = p;
-
-#define PACKET_SIZE 16
-    game = NetClient_GetData (client);
 
-    /* check if we were expecting such information */
-    level = SCE_Decode_Long (packet);
-    x = SCE_Decode_Long (&packet[4]);
-    y = SCE_Decode_Long (&packet[8]);
-    z = SCE_Decode_Long (&packet[12]);
     node = SCE_VWorld_FetchNode (game->vw, level, x, y, z);
     if (node) {
         if (!(tc = SCE_VOctree_GetNodeData (node)))
             SCEE_SendMsg ("chunk: duh, that's kinda unfortunate.\n");
-        else if (tc->status == TERRAIN_QUEUED)
-            expected = SCE_TRUE;
+        else if (tc->status == TERRAIN_QUEUED ||
+                 tc->status == TERRAIN_CANCELLED)
+            return tc;
     }
-
     /* TODO: NULL node doesnt mean we are not expecting the chunk:
        a modification to the terrain could have removed the queued node */
+    return NULL;
+}
 
-    if (!expected) {
-        SCEE_SendMsg ("unexpected TLP_QUERY_CHUNK packet received.\n");
-        return;
-    }
+/* asks for a chunk again, first */
+static void Game_RequeueChunk (Game *game, TerrainChunk *tc)
+{
+    SCE_List_Remove (&tc->it);
+    DLQueue_PushFront (&game->queued_chunks, &tc->it);
+    Game_SetChunkStatus (game, tc, TERRAIN_QUEUED);
+}
+
+/* writes down the content of a received chunk, size can be 0 if our version
+   of the chunk is up to date. on failure the chunk is queued again */
+static int Game_ReceiveChunk (Game *game, TerrainChunk *tc,
+                              const unsigned char *data, size_t size,
+                              size_t packet_size)
+{
+    const char *fname = SCE_VOctree_GetNodeFilename (tc->node);
+    SCE_SFile fp;
+    long x, y, z;
 
-    if (size > PACKET_SIZE) {
-        /* write down the file */
+    DLWin_Ack (&game->chunk_win, tc->sent, Clock_GetTicks (), packet_size);
+
+    if (Game_Decompress (game, &data, &size,
+                         Game_GetMaxChunkSize (game)) < 0)
+        goto fail;
+
+    if (size > 0) {
+        /* write down the file, below the file cache */
+        PCache_Invalidate (&game->files, fname);
         SCE_File_Init (&fp);
-        if (SCE_File_Open (&fp, NULL, SCE_VOctree_GetNodeFilename (node),
+        if (SCE_File_Open (&fp, game->chunk_fs, fname,
                            SCE_FILE_CREATE | SCE_FILE_WRITE) < 0)
             goto fail;
-
-        if (SCE_File_Write (&packet[PACKET_SIZE], size-PACKET_SIZE, 1, &fp) < 0)
+        SCE_VOctree_GetNodeOriginv (tc->node, &x, &y, &z);
+        if (SCE_File_Write (data, 1, size, &fp) != size) {
+            SCEE_LogErrno (fname);
+            SCE_File_Close (&fp);
+            goto fail_file;
+        }
+        /* regions store the file when it is closed */
+        if (SCE_File_Close (&fp) < 0)
+            goto fail_file;
+
+        /* only what is on disk goes in the manifest */
+        if (Manifest_Update (&game->manifest,
+                             SCE_VOctree_GetNodeLevel (tc->node), x, y, z,
+                             fname, data, size) < 0)
             goto fail;
-        SCE_File_Close (&fp);
     }
 
-    tc->status = TERRAIN_AVAILABLE;
+    Game_SetChunkStatus (game, tc, TERRAIN_AVAILABLE);
     SCE_List_Remove (&tc->it);
-    return;
+    return SCE_OK;
+fail_file:
+    /* whatever version we had is gone */
+    Manifest_Remove (&game->manifest, SCE_VOctree_GetNodeLevel (tc->node),
+                     x, y, z);
 fail:
+    Game_RequeueChunk (game, tc);
     SCEE_LogSrc ();
-    SCEE_Out ();
-    SCEE_Clear ();
+    return SCE_ERROR;
 }
 
+static void Game_RemoveChunkFile (Game *game, const char *fname)
+{
+    PCache_Invalidate (&game->files, fname);
+    if (!game->chunk_fs)
+        remove (fname);
+    else if (RegionFS_Remove (&game->regions, fname) < 0) {
+        SCEE_LogSrc ();
+        SCEE_Out ();
+        SCEE_Clear ();
+    }
+}
 
-static void
-Game_tlp_no_octree (NetClient *client, void *cmddata, const char *p,
-                    size_t size)
+/* patches our version of a chunk. if it is not the version the delta was
+   made against, the chunk is queued again, without a hash this time. on
+   failure it is queued again too */
+static int Game_ApplyChunkDelta (Game *game, TerrainChunk *tc,
+                                 const unsigned char *data, size_t size,
+                                 size_t packet_size)
 {
-    (void)cmddata;
-    Game *game = NULL;
+    const char *fname = SCE_VOctree_GetNodeFilename (tc->node);
+    SCEuint level = SCE_VOctree_GetNodeLevel (tc->node);
+    unsigned char hash[MANIFEST_MAX_HASH_SIZE];
     long x, y, z;
-    SCE_SVoxelWorldTree *wt = NULL;
-    SCE_SVoxelOctree *vo = NULL;
-    TerrainTree *tt = NULL;
-    int expected = SCE_FALSE;
-    const unsigned char *packet = p;
+    int have_hash;
 
-    game = NetClient_GetData (client);
+    DLWin_Ack (&game->chunk_win, tc->sent, Clock_GetTicks (), packet_size);
 
-    x = SCE_Decode_Long (packet);
-    y = SCE_Decode_Long (&packet[4]);
+    if (Game_Decompress (game, &data, &size,
+                         Game_GetMaxChunkSize (game)) < 0)
+        goto fail;
+
+    SCE_VOctree_GetNodeOriginv (tc->node, &x, &y, &z);
+    have_hash = Manifest_GetHash (&game->manifest, level, x, y, z, fname, hash);
+    if (have_hash < 0)
+        goto fail;
+    if (have_hash && CDelta_CheckBase (data, size, hash)) {
+        PCache_Invalidate (&game->files, fname);
+        if (CDelta_Apply (game->chunk_fs, fname, data, size) < 0)
+            goto fail_file;
+        if (Manifest_UpdateFile (&game->manifest, level, x, y, z, fname) < 0)
+            goto fail_file;
+        Game_SetChunkStatus (game, tc, TERRAIN_AVAILABLE);
+        SCE_List_Remove (&tc->it);
+        return SCE_OK;
+    }
+
+    SCEE_SendMsg ("chunk delta doesn't match our version, downloading the "
+                  "whole chunk.\n");
+    Game_RemoveChunkFile (game, fname);
+    Manifest_Remove (&game->manifest, level, x, y, z);
+    Game_RequeueChunk (game, tc);
+    return SCE_OK;
+fail_file:
+    /* our version may be half patched */
+    Game_RemoveChunkFile (game, fname);
+    Manifest_Remove (&game->manifest, level, x, y, z);
+fail:
+    Game_RequeueChunk (game, tc);
+    SCEE_LogSrc ();
+    return SCE_ERROR;
+}
+
+static void Game_NoChunk (Game *game, TerrainChunk *tc, size_t packet_size)
+{
+    /* TODO: not truely available, but surely the server will notify us
+             when the node gets added */
+    Game_SetChunkStatus (game, tc, TERRAIN_AVAILABLE);
+    SCE_List_Remove (&tc->it);
+    DLWin_Ack (&game->chunk_win, tc->sent, Clock_GetTicks (), packet_size);
+}
+
+static void
+Game_tlp_query_chunk (NetClient *client, void *cmddata, const char *p,
+                      size_t size)
+{
+    (void)cmddata;
+    Game *game = NULL;
+    SCEuint level;
+    long x, y, z;
+    TerrainChunk *tc = NULL;
+    const unsigned char *packet = p;
+
+#define PACKET_SIZE 16
+    game = NetClient_GetData (client);
+
+    /* check if we were expecting such information */
+    level = SCE_Decode_Long (packet);
+    x = SCE_Decode_Long (&packet[4]);
+    y = SCE_Decode_Long (&packet[8]);
+    z = SCE_Decode_Long (&packet[12]);
+
+    if (!(tc = Game_GetQueuedChunk (game, level, x, y, z))) {
+        SCEE_SendMsg ("unexpected TLP_QUERY_CHUNK packet received.\n");
+        return;
+    }
+
+    if (Game_ReceiveChunk (game, tc, &packet[PACKET_SIZE],
+                           size > PACKET_SIZE ? size - PACKET_SIZE : 0,
+                           size) < 0) {
+        SCEE_LogSrc ();
+        SCEE_Out ();
+        SCEE_Clear ();
+    }
+}
+
+static void
+Game_tlp_chunk_delta (NetClient *client, void *cmddata, const char *p,
+                      size_t size)
+{
+    (void)cmddata;
+    Game *game = NULL;
+    SCEuint level;
+    long x, y, z;
+    TerrainChunk *tc = NULL;
+    const unsigned char *packet = p;
+
+    game = NetClient_GetData (client);
+
+    if (size < PACKET_SIZE) {
+        SCEE_SendMsg ("TLP_CHUNK_DELTA: packet corrupted: invalid size\n");
+        return;
+    }
+    level = SCE_Decode_Long (packet);
+    x = SCE_Decode_Long (&packet[4]);
+    y = SCE_Decode_Long (&packet[8]);
+    z = SCE_Decode_Long (&packet[12]);
+
+    if (!(tc = Game_GetQueuedChunk (game, level, x, y, z))) {
+        SCEE_SendMsg ("unexpected TLP_CHUNK_DELTA packet received.\n");
+        return;
+    }
+
+    if (Game_ApplyChunkDelta (game, tc, &packet[PACKET_SIZE],
+                              size - PACKET_SIZE, size) < 0) {
+        SCEE_LogSrc ();
+        SCEE_Out ();
+        SCEE_Clear ();
+    }
+}
+
+static void
+Game_tlp_query_chunks (NetClient *client, void *cmddata, const char *p,
+                       size_t size)
+{
+    (void)cmddata;
+    Game *game = NULL;
+    QBatchReader reader;
+    QBatchEntry entry;
+    TerrainChunk *tc = NULL;
+    int res;
+
+    game = NetClient_GetData (client);
+
+    if (QBatch_InitReader (&reader, game->chunk_size, p, size) < 0)
+        goto fail;
+
+    while ((res = QBatch_Next (&reader, &entry)) == SCE_TRUE) {
+        tc = Game_GetQueuedChunk (game, entry.level, entry.x, entry.y,
+                                  entry.z);
+        if (!tc) {
+            SCEE_SendMsg ("unexpected chunk in TLP_QUERY_CHUNKS packet.\n");
+            continue;
+        }
+        if (entry.status == QBATCH_NO_CHUNK)
+            Game_NoChunk (game, tc, entry.size);
+        else if (entry.status == QBATCH_CHUNK_DELTA)
+            res = Game_ApplyChunkDelta (game, tc, entry.data, entry.size,
+                                        entry.size);
+        else
+            res = Game_ReceiveChunk (game, tc, entry.data, entry.size,
+                                     entry.size);
+        /* the chunk was queued again, go on with the others */
+        if (res < 0) {
+            SCEE_LogSrc ();
+            SCEE_Out ();
+            SCEE_Clear ();
+        }
+    }
+    if (res < 0)
+        goto fail;
+
+    return;
+fail:
+    SCEE_LogSrc ();
+    SCEE_Out ();
+    SCEE_Clear ();
+}
+
+
+static void
+Game_tlp_no_octree (NetClient *client, void *cmddata, const char *p,
+                    size_t size)
+{
+    (void)cmddata;
+    Game *game = NULL;
+    long x, y, z;
+    SCE_SVoxelWorldTree *wt = NULL;
+    SCE_SVoxelOctree *vo = NULL;
+    TerrainTree *tt = NULL;
+    int expected = SCE_FALSE;
+    const unsigned char *packet = p;
+
+    game = NetClient_GetData (client);
+
+    x = SCE_Decode_Long (packet);
+    y = SCE_Decode_Long (&packet[4]);
     z = SCE_Decode_Long (&packet[8]);
     wt = SCE_VWorld_GetTree (game->vw, x, y, z);
     if (wt) {
@@ -431,8 +1278,10 @@ Game_tlp_no_octree (NetClient *client, void *cmddata, const char *p,
     if (expected) {
         /* TODO: not truely available, but surely the server will notify us
                  when the tree gets added */
-        tt->status = TERRAIN_AVAILABLE;
+        Game_SetTreeStatus (game, tt, TERRAIN_AVAILABLE);
         SCE_List_Remove (&tt->it);
+        DLWin_Ack (&game->tree_win, tt->sent, Clock_GetTicks (), size);
+        game->view_dirty = SCE_TRUE;
     }
 }
 
@@ -444,10 +1293,7 @@ Game_tlp_no_chunk (NetClient *client, void *cmddata, const char *p,
     Game *game = NULL;
     SCEuint level;
     long x, y, z;
-    SCE_SVoxelOctreeNode *node = NULL;
     TerrainChunk *tc = NULL;
-    SCE_SFile fp;
-    int expected = SCE_FALSE;
     const unsigned char *packet = p;
 
     game = NetClient_GetData (client);
@@ -456,20 +1302,9 @@ Game_tlp_no_chunk (NetClient *client, void *cmddata, const char *p,
     x = SCE_Decode_Long (&packet[4]);
     y = SCE_Decode_Long (&packet[8]);
     z = SCE_Decode_Long (&packet[12]);
-    node = SCE_VWorld_FetchNode (game->vw, level, x, y, z);
-    if (node) {
-        if (!(tc = SCE_VOctree_GetNodeData (node)))
-            SCEE_SendMsg ("nochunk: duh, that's kinda unfortunate.\n");
-        else if (tc->status == TERRAIN_QUEUED)
-            expected = SCE_TRUE;
-    }
 
-    if (expected) {
-        /* TODO: not truely available, but surely the server will notify us
-                 when the node gets added */
-        tc->status = TERRAIN_AVAILABLE;
-        SCE_List_Remove (&tc->it);
-    }
+    if ((tc = Game_GetQueuedChunk (game, level, x, y, z)))
+        Game_NoChunk (game, tc, size);
 }
 
 static void
@@ -484,6 +1319,8 @@ Game_tlp_edit_terrain (NetClient *client, void *cmddata, const char *p,
     SCE_SLongRect3 rect;
     int expected = SCE_FALSE;
     const unsigned char *packet = p;
+    const unsigned char *data = NULL;
+    size_t data_size;
 
     game = NetClient_GetData (client);
 
@@ -494,14 +1331,28 @@ Game_tlp_edit_terrain (NetClient *client, void *cmddata, const char *p,
     h = SCE_Decode_Long (&packet[16]);
     d = SCE_Decode_Long (&packet[20]);
 
+    if (w <= 0 || h <= 0 || d <= 0 || w > LONG_MAX / h / d) {
+        SCEE_SendMsg ("TLP_EDIT_TERRAIN: packet corrupted: invalid area\n");
+        return;
+    }
     SCE_Rectangle3_SetFromOriginl (&rect, x, y, z, w, h, d);
 
-    if (size - 24 != SCE_Rectangle3_GetAreal (&rect)) {
+    data = &packet[24];
+    data_size = size - 24;
+    if (Game_Decompress (game, &data, &data_size,
+                         SCE_Rectangle3_GetAreal (&rect)) < 0) {
+        SCEE_LogSrc ();
+        SCEE_Out ();
+        SCEE_Clear ();
+        return;
+    }
+
+    if (data_size != SCE_Rectangle3_GetAreal (&rect)) {
         SCEE_SendMsg ("TLP_EDIT_TERRAIN: packet corrupted: invalid size\n");
         return;
     }
 
-    if (SCE_VWorld_SetRegion (game->vw, &rect, &packet[24]) < 0)
+    if (SCE_VWorld_SetRegion (game->vw, &rect, data) < 0)
         SCEE_LogSrc ();
     if (SCE_VWorld_GenerateAllLOD (game->vw, 0, &rect) < 0)
         SCEE_LogSrc ();
@@ -517,7 +1368,42 @@ Game_snp_ (NetClient *client, void *cmddata, const char *packet, size_t size)
 }
 #endif
 
-static NetClientCmd sc_tcpcmds[TLP_NUM_COMMANDS];
+/* while the network thread is running, packets are handed over to the main
+   thread instead of being handled where they are received */
+static void Game_DeferPacket (NetClient *client, NetThreadFunc fun,
+                              void *cmddata, const char *packet, size_t size)
+{
+    Game *game = NetClient_GetData (client);
+
+    if (!NetThread_IsCurrent (&game->net))
+        fun (client, cmddata, packet, size);
+    else
+        /* failures are counted, the main thread reports them */
+        NetThread_Push (&game->net, fun, packet, size);
+}
+
+#define GAME_DEFERRED(fun)                                              \
+    static void fun##_deferred (NetClient *client, void *cmddata,       \
+                                const char *packet, size_t size)        \
+    {                                                                   \
+        Game_DeferPacket (client, fun, cmddata, packet, size);          \
+    }
+GAME_DEFERRED (Game_tlp_get_client_num)
+GAME_DEFERRED (Game_tlp_connect_accepted)
+GAME_DEFERRED (Game_tlp_connect_refused)
+GAME_DEFERRED (Game_tlp_connect)
+GAME_DEFERRED (Game_tlp_num_lod)
+GAME_DEFERRED (Game_tlp_chunk_size)
+GAME_DEFERRED (Game_tlp_query_octree)
+GAME_DEFERRED (Game_tlp_query_chunk)
+GAME_DEFERRED (Game_tlp_query_chunks)
+GAME_DEFERRED (Game_tlp_chunk_delta)
+GAME_DEFERRED (Game_tlp_no_octree)
+GAME_DEFERRED (Game_tlp_no_chunk)
+GAME_DEFERRED (Game_tlp_edit_terrain)
+#undef GAME_DEFERRED
+
+static NetClientCmd sc_tcpcmds[GAME_NUM_COMMANDS];
 static size_t sc_numtcp = 0;
 
 static void Game_InitAllCommands (void)
@@ -525,11 +1411,11 @@ static void Game_InitAllCommands (void)
     size_t i = 0;
 
     /* TCP commands */
-#define SC_SETTCPCMD(id, fun) do {                     \
-        NetClient_InitCmd (&sc_tcpcmds[i]);               \
-        NetClient_SetCmdID (&sc_tcpcmds[i], id);          \
-        NetClient_SetCmdCallback (&sc_tcpcmds[i], fun);   \
-        i++;                                           \
+#define SC_SETTCPCMD(id, fun) do {                                  \
+        NetClient_InitCmd (&sc_tcpcmds[i]);                            \
+        NetClient_SetCmdID (&sc_tcpcmds[i], id);                       \
+        NetClient_SetCmdCallback (&sc_tcpcmds[i], fun##_deferred);     \
+        i++;                                                           \
     } while (0)
     SC_SETTCPCMD (TLP_GET_CLIENT_NUM, Game_tlp_get_client_num);
     SC_SETTCPCMD (TLP_CONNECT_ACCEPTED, Game_tlp_connect_accepted);
@@ -541,6 +1427,8 @@ static void Game_InitAllCommands (void)
 
     SC_SETTCPCMD (TLP_QUERY_OCTREE, Game_tlp_query_octree);
     SC_SETTCPCMD (TLP_QUERY_CHUNK, Game_tlp_query_chunk);
+    SC_SETTCPCMD (TLP_QUERY_CHUNKS, Game_tlp_query_chunks);
+    SC_SETTCPCMD (TLP_CHUNK_DELTA, Game_tlp_chunk_delta);
     SC_SETTCPCMD (TLP_NO_OCTREE, Game_tlp_no_octree);
     SC_SETTCPCMD (TLP_NO_CHUNK, Game_tlp_no_chunk);
     SC_SETTCPCMD (TLP_EDIT_TERRAIN, Game_tlp_edit_terrain);
@@ -551,6 +1439,7 @@ static void Game_InitAllCommands (void)
 int Init_Game (void)
 {
     Game_InitAllCommands ();
+    VCopy_Init ();
     return SCE_OK;
 }
 
@@ -564,10 +1453,13 @@ static void Game_AssignCommands (NetClient *client)
 
 void Game_Init (Game *game)
 {
+    int i;
+
     Game_InitConfig (&game->config);
     Game_InitClient (&game->self);
     NetClient_SetData (&game->self.client, game);
     game->connected = SCE_FALSE;
+    game->caps = 0;
     strcpy (game->server_ip, "0.0.0.0");
     Game_AssignCommands (&game->self.client);
     game->vt = NULL;
@@ -576,29 +1468,106 @@ void Game_Init (Game *game)
 
     /* fsys doesn't need to be initialized */
     SCE_FileCache_InitCache (&game->fcache);
+    CBudget_Init (&game->caches);
+    PCache_Init (&game->files);
+    RegionFS_Init (&game->regions);
+    game->chunk_fs = NULL;
     memset (game->world_path, 0, sizeof game->world_path);
     game->vw = NULL;
     game->chunk_size = 0;
     game->n_lod = 0;
-    SCE_List_Init (&game->queued_chunks);
+    DLQueue_Init (&game->queued_chunks);
+    DLQueue_SetPriorityFunc (&game->queued_chunks, Game_ChunkPriority, game);
+    DLQueue_SetDropFunc (&game->queued_chunks, Game_DropChunk);
     SCE_List_Init (&game->dl_chunks);
-    SCE_List_Init (&game->queued_trees);
+    SCE_List_Init (&game->cancelled_chunks);
+    DLQueue_Init (&game->queued_trees);
+    DLQueue_SetPriorityFunc (&game->queued_trees, Game_TreePriority, game);
+    DLQueue_SetDropFunc (&game->queued_trees, Game_DropTree);
     SCE_List_Init (&game->dl_trees);
+    SCE_Vector3_Set (game->last_pos, 0.0, 0.0, 0.0);
+    SCE_Vector3_Set (game->heading, 0.0, 0.0, 0.0);
+    SCE_Vector3_Set (game->sched_pos, 0.0, 0.0, 0.0);
+    SCE_Vector3_Set (game->sched_heading, 0.0, 0.0, 0.0);
+    game->n_cancelled = 0;
+    SCE_Vector3_Set (game->velocity, 0.0, 0.0, 0.0);
+    game->last_move = 0;
+    SCE_Vector3_Set (game->prefetch_pos, 0.0, 0.0, 0.0);
+    memset (&game->prefetch_chunks, 0, sizeof game->prefetch_chunks);
+    memset (&game->prefetch_trees, 0, sizeof game->prefetch_trees);
+    game->levels_ready = 0;
+    game->levels_check = 0;
+    game->view_dirty = SCE_TRUE;
+    game->view_refresh = 0;
+    memset (&game->recovery, 0, sizeof game->recovery);
+    FSched_Init (&game->sched);
+    HTerrain_Init (&game->grids);
+    game->script = NULL;
+    game->n_waypoints = 0;
+    game->waypoint = 0;
+    game->waypoint_start = 0;
+    SCE_Vector3_Set (game->waypoint_from, 0.0, 0.0, 0.0);
+    game->launch_time = 0;
+    game->first_frame_time = 0;
+    game->full_detail_time = 0;
     game->view_distance = 0;
     game->view_threshold = 0;
+    DLWin_Init (&game->chunk_win);
+    DLWin_Init (&game->tree_win);
+    QBatch_Init (&game->query_batch);
+    game->zbuf = NULL;
+    game->zbuf_size = 0;
+    game->region_buf = NULL;
+    game->region_buf_size = 0;
+    game->last_sync = 0;
+    for (i = 0; i < COMP_NUM_CODECS; i++)
+        Comp_InitStats (&game->comp_stats[i]);
+    NetThread_Init (&game->net);
+    SCE_List_Init (&game->unsaved_trees);
+    DCache_Init (&game->cache);
+    Manifest_Init (&game->manifest);
+    AMap_Init (&game->pending);
 }
 void Game_Clear (Game *game)
 {
+    /* stop receiving before the client goes away */
+    NetThread_Clear (&game->net);
     Game_ClearConfig (&game->config);
     Game_ClearClient (&game->self);
     SCE_VTerrain_Delete (game->vt);
     SCE_Scene_Delete (game->scene);
     SCE_Deferred_Delete (game->deferred);
 
+    FSched_Clear (&game->sched);
+    HTerrain_Clear (&game->grids);
+    SCE_free (game->script);
+
+    /* write down whatever is still pending */
+    if (game->vw && Game_SaveTrees (game, 0) < 0) {
+        SCEE_LogSrc ();
+        SCEE_Out ();
+        SCEE_Clear ();
+    }
+    SCE_List_Clear (&game->unsaved_trees);
+    DCache_Clear (&game->cache);
+    Manifest_Clear (&game->manifest);
+    AMap_Clear (&game->pending);
     SCE_FileCache_ClearCache (&game->fcache);
     SCE_VWorld_Delete (game->vw);
-    SCE_List_Clear (&game->queued_chunks);
+    if (game->files.trace)
+        fclose (game->files.trace);
+    PCache_Clear (&game->files);
+    RegionFS_Clear (&game->regions);
+    DLQueue_Clear (&game->queued_chunks);
     SCE_List_Clear (&game->dl_chunks);
+    SCE_List_Clear (&game->cancelled_chunks);
+    DLQueue_Clear (&game->queued_trees);
+    SCE_List_Clear (&game->dl_trees);
+    DLWin_Clear (&game->chunk_win);
+    DLWin_Clear (&game->tree_win);
+    QBatch_Clear (&game->query_batch);
+    SCE_free (game->zbuf);
+    SCE_free (game->region_buf);
 }
 Game* Game_New (void)
 {
@@ -622,7 +1591,16 @@ void Game_Free (Game *game)
 int Game_InitSubsystem (Game *game)
 {
     srand (time (NULL));
-    
+
+    /* only the core of the engine, initialized by the caller, is used */
+    if (game->config.headless)
+        return SCE_OK;
+
+#ifdef TL_NO_VIDEO
+    SCEE_Log (SCE_INVALID_OPERATION);
+    SCEE_LogMsg ("built without video, only the headless mode is available");
+    return SCE_ERROR;
+#else
     if (SDL_Init (SDL_INIT_VIDEO) < 0) {
         fprintf (stderr, "cannot initialize SDL: %s\n", SDL_GetError ());
         return SCE_ERROR;
@@ -643,6 +1621,7 @@ int Game_InitSubsystem (Game *game)
     SCE_OBJ_ActivateIndicesGeneration (SCE_TRUE);
 
     return SCE_OK;
+#endif
 }
 
 #define DELAY 10
@@ -659,7 +1638,17 @@ static int Game_InitConnection (Game *game)
         return SCE_ERROR;
     }
 
-    NetClient_SendTCPString (&game->self.client, TLP_CONNECT, game->self.nick);
+    /* nick, followed by the capabilities we support */
+    {
+        unsigned char packet[GAME_MAX_NICK_LENGTH + 4] = {0};
+        size_t len = strlen (game->self.nick) + 1;
+        SCEuint caps = game->config.caps;
+        if (!game->config.batch_queries)
+            caps &= ~GAME_CAP_BATCH;
+        memcpy (packet, game->self.nick, len);
+        SCE_Encode_Long (caps, &packet[len]);
+        NetClient_SendTCP (&game->self.client, TLP_CONNECT, packet, len + 4);
+    }
     if (NetClient_WaitTCPPacket (&game->self.client, TLP_CONNECT_ACCEPTED,
                                  DELAY) < 0) {
         SCEE_Log (786);
@@ -675,6 +1664,50 @@ static int Game_InitConnection (Game *game)
 #define SERVER_TERRAINS "terrains"
 #define VWORLD_PREFIX "voxeldata"
 #define VWORLD_FNAME "vworld.bin"
+#define MANIFEST_FNAME "manifest.bin"
+
+/**
+ * \brief Sets the memory the voxel node and file caches may use
+ * \param bytes size of the budget
+ *
+ * Can be called while the game runs.
+ * \sa Game_GetCacheStats()
+ */
+void Game_SetCacheMemory (Game *game, SCEulong bytes)
+{
+    game->config.cache_memory = bytes;
+    CBudget_SetBudget (&game->caches, bytes);
+    PCache_SetCapacity (&game->files, CBudget_GetFileBytes (&game->caches));
+    if (game->vw)
+        SCE_VWorld_SetMaxCachedNodes (game->vw,
+                                      CBudget_GetMaxNodes (&game->caches));
+}
+/**
+ * \brief Gets the statistics of the voxel node cache and of the file cache
+ */
+void Game_GetCacheStats (const Game *game, CacheStats *nodes,
+                         CacheStats *files)
+{
+    CBudget_GetNodeStats (&game->caches, nodes);
+    CBudget_GetFileStats (&game->caches, files);
+}
+
+/* fcache only keeps what the voxel world is using, the files share of the
+   budget goes to the file cache below it, whose policy we choose. the
+   budget still estimates how many files it holds */
+static void Game_UpdateCaches (Game *game)
+{
+    CBudget_Update (&game->caches, game->files.n_resident);
+}
+
+/* files kept by fcache: enough for the nodes being loaded */
+#define GAME_FCACHE_FILES 32
+
+static int Game_StatChunk (void *udata, const char *fname, size_t *size,
+                           int64_t *mtime)
+{
+    return RegionFS_Stat (udata, fname, size, mtime);
+}
 
 static int Game_InitTerrain (Game *game)
 {
@@ -684,21 +1717,38 @@ static int Game_InitTerrain (Game *game)
     SCEuint size;
     NetClient *client = NULL;
     SCE_SVoxelWorld *vw = NULL;
+    ManifestHash hash;
 
     client = &game->self.client;
-    /* retrieve basic terrain data */
-    NetClient_SendTCP (client, TLP_CHUNK_SIZE, NULL, 0);
-    if (NetClient_WaitTCPPacket (client, TLP_CHUNK_SIZE, DELAY) < 0) {
+    /* retrieve basic terrain data, unless the server sent it already. both
+       requests are sent at once, that's only one round trip */
+    if (!(game->caps & GAME_CAP_WORLDINFO)) {
+        NetClient_SendTCP (client, TLP_CHUNK_SIZE, NULL, 0);
+        NetClient_SendTCP (client, TLP_NUM_LOD, NULL, 0);
+    }
+    if (game->chunk_size == 0 &&
+        NetClient_WaitTCPPacket (client, TLP_CHUNK_SIZE, DELAY) < 0) {
         SCEE_Log (786);
         SCEE_LogMsg ("TLP_CHUNK_SIZE: timeout");
         return SCE_ERROR;
     }
-    NetClient_SendTCP (client, TLP_NUM_LOD, NULL, 0);
-    if (NetClient_WaitTCPPacket (client, TLP_NUM_LOD, DELAY) < 0) {
+    if (game->n_lod == 0 &&
+        NetClient_WaitTCPPacket (client, TLP_NUM_LOD, DELAY) < 0) {
         SCEE_Log (786);
         SCEE_LogMsg ("TLP_NUM_LOD: timeout");
         return SCE_ERROR;
     }
+    /* the server sent a chunk size or a number of levels we can't handle */
+    if (game->chunk_size == 0) {
+        SCEE_Log (SCE_INVALID_ARG);
+        SCEE_LogMsg ("TLP_CHUNK_SIZE: invalid chunk size");
+        return SCE_ERROR;
+    }
+    if (game->n_lod == 0) {
+        SCEE_Log (SCE_INVALID_ARG);
+        SCEE_LogMsg ("TLP_NUM_LOD: invalid number of levels");
+        return SCE_ERROR;
+    }
 
     fcache = &game->fcache;
     fsys = &game->fsys;
@@ -707,19 +1757,43 @@ static int Game_InitTerrain (Game *game)
     game->vw = vw = SCE_VWorld_Create ();
     if (!vw) goto fail;
 
-    strcpy (path, "data/"SERVER_TERRAINS"/");
-    /* TODO: with some magic (like IP address of the server or some
-       generated ID), retrieve server's specific path for terrain data */
-    strcat (path, "potager/");
-    strcat (path, VWORLD_PREFIX);
+    /* one cache per server */
+    DCache_SetRoot (&game->cache, "data/"SERVER_TERRAINS, VWORLD_PREFIX);
+    DCache_SetBudget (&game->cache, game->config.cache_budget);
+    if (DCache_Open (&game->cache, game->server_ip) < 0)
+        goto fail;
+    strcpy (path, DCache_GetPath (&game->cache));
 
     SCE_VWorld_SetPrefix (vw, path);
+    if (game->config.regions) {
+        /* chunks of a directory share a region file, the cache sits on top
+           of it */
+        RegionFS_SetRoot (&game->regions, path);
+        RegionFS_InitFileSystem (&game->regions, &game->regionfs, NULL);
+        game->chunk_fs = &game->regionfs;
+    }
+    /* count what goes in and out of the file caches, see CacheBudget */
+    CountFS_InitFileSystem (&game->caches.below, &game->below_fs,
+                            game->chunk_fs);
+    PCache_SetPolicy (&game->files, game->config.cache_policy);
+    if (game->config.cache_trace &&
+        !(game->files.trace = fopen (game->config.cache_trace, "w"))) {
+        /* not worth failing for */
+        SCEE_LogErrno (game->config.cache_trace);
+        SCEE_Out ();
+        SCEE_Clear ();
+    }
+    PCache_InitFileSystem (&game->files, &game->files_fs, &game->below_fs);
     *fsys = sce_cachefs;
     fsys->udata = fcache;
-    SCE_VWorld_SetFileSystem (vw, fsys);
-    SCE_FileCache_SetMaxCachedFiles (fcache, 256);
+    fsys->subfs = &game->files_fs;
+    CountFS_InitFileSystem (&game->caches.above, &game->above_fs, fsys);
+    SCE_VWorld_SetFileSystem (vw, &game->above_fs);
     SCE_VWorld_SetFileCache (vw, fcache);
-    SCE_VWorld_SetMaxCachedNodes (vw, 256);
+    CBudget_SetNodeSize (&game->caches, game->chunk_size * game->chunk_size *
+                         game->chunk_size * SCE_VOCTREE_VOXEL_ELEMENTS);
+    SCE_FileCache_SetMaxCachedFiles (fcache, GAME_FCACHE_FILES);
+    Game_SetCacheMemory (game, game->config.cache_memory);
 
     strcpy (game->world_path, path);
     strcat (path, "/");
@@ -728,10 +1802,7 @@ static int Game_InitTerrain (Game *game)
 
     if (SCE_VWorld_Load (vw, path) < 0) {
         SCEE_Clear ();
-        /* first connection on this server, gotta create the folder.. hmhm */
-
-        /* TODO: create server's folder */
-
+        /* first connection on this server */
         size = game->chunk_size;
         SCE_VWorld_SetDimensions (vw, size, size, size);
         SCE_VWorld_SetNumLevels (vw, game->n_lod);
@@ -743,7 +1814,10 @@ static int Game_InitTerrain (Game *game)
             game->n_lod      != SCE_VWorld_GetNumLevels (vw)) {
             SCEE_SendMsg ("server has changed number of lods and/or "
                           "chunk size.\n");
-            /* TODO: REMOVE EVERYTHING!!11 */
+            /* our chunks are useless now, they are deleted in the
+               background */
+            if (DCache_Discard (&game->cache) < 0)
+                goto fail;
             /* reset the world */
             size = game->chunk_size;
             SCE_VWorld_SetDimensions (vw, size, size, size);
@@ -754,12 +1828,32 @@ static int Game_InitTerrain (Game *game)
     if (SCE_VWorld_Build (vw) < 0)
         goto fail;
 
+    /* without the thread the cache only grows */
+    if (DCache_Start (&game->cache) < 0) {
+        SCEE_LogSrc ();
+        SCEE_Out ();
+        SCEE_Clear ();
+    }
+
+    /* not being able to keep the manifest only means more file reads */
+    sprintf (path, "%s/%s", game->world_path, MANIFEST_FNAME);
+    hash = game->caps & GAME_CAP_FASTHASH ? MANIFEST_FASTHASH : MANIFEST_SHA1;
+    if (Manifest_Open (&game->manifest, path, hash) < 0) {
+        SCEE_LogSrc ();
+        SCEE_Out ();
+        SCEE_Clear ();
+    }
+    if (game->chunk_fs)
+        Manifest_SetFileSystem (&game->manifest, game->chunk_fs,
+                                Game_StatChunk, &game->regions);
+
     return SCE_OK;
 fail:
     SCEE_LogSrc ();
     return SCE_ERROR;
 }
 
+#ifndef TL_NO_VIDEO
 static int Game_InitDeferred (Game *game)
 {
     if (!(game->deferred = SCE_Deferred_Create ()))
@@ -785,24 +1879,21 @@ fail:
     SCEE_LogSrc ();
     return SCE_ERROR;
 }
+#endif
 
 
-#define GAME_MAX_DOWNLOADING_PACKETS 5
-
-/* download a single (single really?) queued tree (if any) */
+/* download queued trees, as many as the download window allows */
 static void Game_DownloadTree (Game *game)
 {
     long x, y, z;
     unsigned char buffer[32] = {0};
     TerrainTree *tt = NULL;
 
-    /* TODO: this scheme needs to be improved, let there be a given number of
-       elements in dl_trees instead of 0 or 1 */
-    if (SCE_List_GetLength (&game->dl_trees) < GAME_MAX_DOWNLOADING_PACKETS &&
-        SCE_List_HasElements (&game->queued_trees)) {
+    while (DLWin_CanSend (&game->tree_win,
+                          SCE_List_GetLength (&game->dl_trees)) &&
+           DLQueue_HasElements (&game->queued_trees)) {
 
-        tt = SCE_List_GetData (SCE_List_GetFirst (&game->queued_trees));
-        SCE_List_Remove (&tt->it);
+        tt = SCE_List_GetData (DLQueue_Pop (&game->queued_trees));
         SCE_List_Appendl (&game->dl_trees, &tt->it);
         SCE_VWorld_GetTreeOriginv (tt->tree, &x, &y, &z);
 
@@ -811,48 +1902,112 @@ static void Game_DownloadTree (Game *game)
         SCE_Encode_Long (z, &buffer[8]);
 
         /* TODO: sha1? see server.c:tlp_query_octree() */
+        tt->sent = Clock_GetTicks ();
         NetClient_SendTCP (&game->self.client, TLP_QUERY_OCTREE, buffer, 12);
     }
 }
-/* download a single (single really?) queued chunk (if any) */
+/* download queued chunks, as many as the download window allows */
 static void Game_DownloadChunk (Game *game)
 {
     long x, y, z;
-    /* yeah sha1 sums are less than 32 bytes length but hey. */
-    unsigned char buffer[16 + 32] = {0};
+    unsigned char buffer[16 + MANIFEST_MAX_HASH_SIZE] = {0};
+    unsigned char hash[MANIFEST_MAX_HASH_SIZE];
+    size_t hash_size = Manifest_GetHashSize (game->manifest.hash_type);
     TerrainChunk *tc = NULL;
-    SCE_TSha1 sha1;
+    SCEuint level;
+    /* servers that don't know TLP_QUERY_CHUNKS get one request per chunk */
+    int batch = game->caps & GAME_CAP_BATCH;
+    QueryBatch *qb = &game->query_batch;
 
-    if (SCE_List_GetLength (&game->dl_chunks) < GAME_MAX_DOWNLOADING_PACKETS &&
-        SCE_List_HasElements (&game->queued_chunks)) {
+    if (batch)
+        QBatch_Begin (qb, game->chunk_size);
 
-        tc = SCE_List_GetData (SCE_List_GetFirst (&game->queued_chunks));
-        SCE_List_Remove (&tc->it);
+    while (DLWin_CanSend (&game->chunk_win,
+                          SCE_List_GetLength (&game->dl_chunks)) &&
+           DLQueue_HasElements (&game->queued_chunks)) {
+        int have_hash;
+
+        tc = SCE_List_GetData (DLQueue_Pop (&game->queued_chunks));
         SCE_List_Appendl (&game->dl_chunks, &tc->it);
 
         SCE_VOctree_GetNodeOriginv (tc->node, &x, &y, &z);
-        SCE_Encode_Long (SCE_VOctree_GetNodeLevel (tc->node), buffer);
+        level = SCE_VOctree_GetNodeLevel (tc->node);
+
+        tc->sent = Clock_GetTicks ();
+        have_hash = Manifest_GetHash (&game->manifest, level, x, y, z,
+                                      SCE_VOctree_GetNodeFilename (tc->node),
+                                      hash);
+        if (have_hash < 0) {
+            SCEE_LogSrc ();
+            SCEE_Out ();
+            SCEE_Clear ();
+            /* retry later, but still send what has been batched so far */
+            SCE_List_Remove (&tc->it);
+            DLQueue_PushFront (&game->queued_chunks, &tc->it);
+            break;
+        }
+
+        if (batch) {
+            QBatch_Add (qb, level, x, y, z, have_hash ? hash : NULL);
+            if (QBatch_IsFull (qb))
+                break;
+            continue;
+        }
+
+        SCE_Encode_Long (level, buffer);
         SCE_Encode_Long (x, &buffer[4]);
         SCE_Encode_Long (y, &buffer[8]);
         SCE_Encode_Long (z, &buffer[12]);
 
-        if (SCE_Sha1_FileSum (sha1,SCE_VOctree_GetNodeFilename(tc->node)) < 0) {
-            if (SCEE_GetCode () != SCE_FILE_NOT_FOUND) {
-                SCEE_LogSrc ();
-                SCEE_Out ();
-                return;         /* :} */
-            }
-            SCEE_Clear ();
+        if (!have_hash)
             NetClient_SendTCP (&game->self.client, TLP_QUERY_CHUNK, buffer, 16);
-        } else {
-            strncpy (&buffer[16], sha1, SCE_SHA1_SIZE);
+        else {
+            memcpy (&buffer[16], hash, hash_size);
             NetClient_SendTCP (&game->self.client, TLP_QUERY_CHUNK, buffer,
-                               16 + SCE_SHA1_SIZE);
+                               16 + hash_size);
         }
     }
+
+    if (batch && QBatch_GetNumNodes (qb) > 0) {
+        const unsigned char *packet = NULL;
+        size_t size;
+        packet = QBatch_Finish (qb, &size);
+        NetClient_SendTCP (&game->self.client, TLP_QUERY_CHUNKS, packet, size);
+    }
 }
 
+static void Game_PrintDownloadWindow (const char *name, const DLWindow *w)
+{
+    printf ("%s: window %u (peak %u, bdp %.1f), rtt %.1f ms (min %.1f ms), "
+            "%.1f kB/s (peak %.1f kB/s), %lu replies, %lu kB\n", name,
+            DLWin_GetSize (w), DLWin_GetPeakSize (w), DLWin_GetBDP (w),
+            DLWin_GetRTT (w), DLWin_GetMinRTT (w),
+            DLWin_GetThroughput (w) / 1024.0,
+            DLWin_GetPeakThroughput (w) / 1024.0,
+            DLWin_GetTotalReplies (w), DLWin_GetTotalBytes (w) / 1024);
+}
+
+
+/* none of the nodes of a new tree are known yet, they all are pending
+   until each of them is queried */
+static int Game_SetTreeNodesPending (Game *game, SCE_SVoxelWorldTree *wt)
+{
+    SCE_SLongRect3 r;
+    long x, y, z, size, cs = game->chunk_size;
+    SCEuint level;
 
+    SCE_VWorld_GetTreeOriginv (wt, &x, &y, &z);
+    for (level = 0; level < game->n_lod; level++) {
+        size = cs << (game->n_lod - 1 - level);
+        SCE_Rectangle3_SetFromOriginl (&r, x >> level, y >> level,
+                                       z >> level, size, size, size);
+        if (AMap_SetRegion (&game->pending, level, &r, cs, SCE_TRUE) < 0) {
+            SCEE_LogSrc ();
+            return SCE_ERROR;
+        }
+    }
+    return SCE_OK;
+}
 static int Game_query_tree (Game *game, SCE_SVoxelWorldTree *wt)
 {
     TerrainTree *tree = NULL;
@@ -866,11 +2021,15 @@ static int Game_query_tree (Game *game, SCE_SVoxelWorldTree *wt)
         tree->tree = wt;
         SCE_VOctree_SetData (SCE_VWorld_GetOctree (wt), tree);
         SCE_VOctree_SetFreeFunc (SCE_VWorld_GetOctree (wt), TTree_Free);
+        if (Game_SetTreeNodesPending (game, wt) < 0) {
+            SCEE_LogSrc ();
+            return SCE_ERROR;
+        }
     }
 
     if (tree->status == TERRAIN_UNAVAILABLE) {
-        SCE_List_Appendl (&game->queued_trees, &tree->it);
-        tree->status = TERRAIN_QUEUED;
+        DLQueue_Push (&game->queued_trees, &tree->it);
+        Game_SetTreeStatus (game, tree, TERRAIN_QUEUED);
     }
     return SCE_OK;
 }
@@ -878,13 +2037,23 @@ static int Game_query_chunk (Game *game, SCE_SVoxelOctreeNode *node)
 {
     TerrainChunk *chunk = NULL;
     SCEuint level;
-    long x, y, z;
+    long x, y, z, size;
 
     level = SCE_VOctree_GetNodeLevel (node);
     SCE_VOctree_GetNodeOriginv (node, &x, &y, &z);
 
     chunk = SCE_VOctree_GetNodeData (node);
     if (!chunk) {
+        SCE_EVoxelOctreeStatus status = SCE_VOctree_GetNodeStatus (node);
+        long cs = game->chunk_size;
+        /* empty or full nodes are never downloaded, they don't need to be
+           tracked */
+        if (status == SCE_VOCTREE_NODE_EMPTY ||
+            status == SCE_VOCTREE_NODE_FULL) {
+            AMap_Set (&game->pending, level, x / cs, y / cs, z / cs,
+                      SCE_FALSE);
+            return SCE_OK;
+        }
         if (!(chunk = TChunk_New ())) {
             SCEE_LogSrc ();
             return SCE_ERROR;
@@ -892,36 +2061,224 @@ static int Game_query_chunk (Game *game, SCE_SVoxelOctreeNode *node)
         chunk->node = node;
         SCE_VOctree_SetNodeData (node, chunk);
         SCE_VOctree_SetNodeFreeFunc (node, TChunk_Free);
+        /* the file cache evicts what is far from us */
+        Game_GetChunkArea (game, chunk, &x, &y, &z, &size);
+        if (PCache_SetPosition (&game->files,
+                                SCE_VOctree_GetNodeFilename (node),
+                                x, y, z, size) < 0) {
+            SCEE_LogSrc ();
+            return SCE_ERROR;
+        }
     }
 
-    if (chunk->status == TERRAIN_UNAVAILABLE) {
+    if (chunk->status == TERRAIN_CANCELLED) {
+        /* back in view before the server answered */
+        SCE_List_Remove (&chunk->it);
+        DLQueue_Push (&game->queued_chunks, &chunk->it);
+        Game_SetChunkStatus (game, chunk, TERRAIN_QUEUED);
+    } else if (chunk->status == TERRAIN_UNAVAILABLE) {
         SCE_EVoxelOctreeStatus status = SCE_VOctree_GetNodeStatus (node);
         /* dont query empty or full nodes */
         if (status == SCE_VOCTREE_NODE_EMPTY || status == SCE_VOCTREE_NODE_FULL)
-            chunk->status = TERRAIN_AVAILABLE;
+            Game_SetChunkStatus (game, chunk, TERRAIN_AVAILABLE);
         else {
-            SCE_List_Appendl (&game->queued_chunks, &chunk->it);
-            chunk->status = TERRAIN_QUEUED;
+            DLQueue_Push (&game->queued_chunks, &chunk->it);
+            Game_SetChunkStatus (game, chunk, TERRAIN_QUEUED);
         }
     }
     return SCE_OK;
 }
 
-/* run once at every connection to a server to download the terrain */
-static int Game_DownloadTerrain (Game *game)
+/* how far ahead we try to predict our position (ms) */
+#define GAME_PREFETCH_TIME 3000
+
+/* marks terrain requested by the prefetcher as used when it enters the
+   view. trees are also kept in the disk cache for a while */
+static void Game_UseTree (Game *game, SCE_SVoxelWorldTree *wt)
+{
+    TerrainTree *tt = SCE_VOctree_GetData (SCE_VWorld_GetOctree (wt));
+    long x, y, z;
+
+    if (tt && tt->prefetched) {
+        tt->prefetched = SCE_FALSE;
+        game->prefetch_trees.used++;
+    }
+    SCE_VWorld_GetTreeOriginv (wt, &x, &y, &z);
+    DCache_TouchTree (&game->cache, x, y, z);
+}
+static void Game_UseChunk (Game *game, SCE_SVoxelOctreeNode *node)
+{
+    TerrainChunk *tc = SCE_VOctree_GetNodeData (node);
+    if (tc && tc->prefetched) {
+        tc->prefetched = SCE_FALSE;
+        game->prefetch_chunks.used++;
+    }
+}
+
+/* number of requests we can afford to queue for the prefetcher: whatever
+   the link can download within GAME_PREFETCH_TIME once the queues are
+   empty. nothing as long as we don't know the throughput */
+static long Game_GetPrefetchBudget (Game *game)
+{
+    DLWindow *w = &game->chunk_win;
+    float avg;
+
+    if (DLWin_GetTotalReplies (w) == 0)
+        return 0;
+    avg = (float)DLWin_GetTotalBytes (w) / DLWin_GetTotalReplies (w);
+    if (avg < 1.0)
+        avg = 1.0;
+    return DLWin_GetThroughput (w) * GAME_PREFETCH_TIME / (1000.0 * avg) -
+        DLQueue_GetLength (&game->queued_chunks) -
+        SCE_List_GetLength (&game->dl_chunks);
+}
+
+/* queues the trees and LOD 0 chunks around the position we are heading
+   to, as long as the bandwidth allows it */
+static int Game_Prefetch (Game *game)
 {
     SCE_SLongRect3 rect;
-    long distance;
-    long x, y, z, d;
+    SCE_TVector3 ahead;
     SCE_SList list;
     SCE_SListIterator *it = NULL;
-    int i;
-
-    x = game->self.pos[0];
-    y = game->self.pos[1];
-    z = game->self.pos[2];
+    long budget, d;
+    float len;
+
+    /* predicted position, never further than the view distance */
+    SCE_Vector3_Copy (ahead, game->velocity);
+    SCE_Vector3_Operator1 (ahead, *=, GAME_PREFETCH_TIME);
+    len = SCE_Vector3_Length (ahead);
+    if (len > game->view_distance)
+        SCE_Vector3_Operator1 (ahead, *=, game->view_distance / len);
+    SCE_Vector3_Operator1v (ahead, +=, game->self.pos);
+    SCE_Vector3_Copy (game->prefetch_pos, ahead);
+
+    /* not moving enough to see anything new */
+    if (len < game->chunk_size)
+        return SCE_OK;
+    if ((budget = Game_GetPrefetchBudget (game)) <= 0)
+        return SCE_OK;
+
+    d = game->view_distance + game->view_threshold;
+    SCE_Rectangle3_SetFromCenterl (&rect, ahead[0], ahead[1], ahead[2],
+                                   d, d, d);
+    SCE_List_Init (&list);
+    if (SCE_VWorld_FetchTrees (game->vw, game->n_lod - 1, &rect, &list) < 0)
+        goto fail;
+    SCE_List_ForEach (it, &list) {
+        SCE_SVoxelWorldTree *wt = SCE_List_GetData (it);
+        TerrainTree *tt = SCE_VOctree_GetData (SCE_VWorld_GetOctree (wt));
+        if (tt && tt->status != TERRAIN_UNAVAILABLE)
+            continue;
+        if (Game_query_tree (game, wt) < 0)
+            goto fail;
+        tt = SCE_VOctree_GetData (SCE_VWorld_GetOctree (wt));
+        tt->prefetched = SCE_TRUE;
+        game->prefetch_trees.requested++;
+    }
+    SCE_List_Flush (&list);
+
+    SCE_List_Init (&list);
+    if (SCE_VWorld_FetchNodes (game->vw, 0, &rect, &list) < 0)
+        goto fail;
+    SCE_List_ForEach (it, &list) {
+        SCE_SVoxelOctreeNode *node = SCE_List_GetData (it);
+        TerrainChunk *tc = SCE_VOctree_GetNodeData (node);
+        if (tc && tc->status != TERRAIN_UNAVAILABLE)
+            continue;
+        if (Game_query_chunk (game, node) < 0)
+            goto fail;
+        tc = SCE_VOctree_GetNodeData (node);
+        if (tc->status == TERRAIN_QUEUED) {
+            tc->prefetched = SCE_TRUE;
+            game->prefetch_chunks.requested++;
+            if (--budget == 0)
+                break;
+        }
+    }
+    SCE_List_Flush (&list);
+
+    return SCE_OK;
+fail:
+    SCE_List_Flush (&list);
+    SCEE_LogSrc ();
+    return SCE_ERROR;
+}
+
+/* removes the trees the disk cache wants to get rid of, unless they have
+   been loaded during this session: their chunks are referenced all over
+   the place, they stay until next time */
+static void Game_EvictTrees (Game *game)
+{
+    DCacheTree victims[DCACHE_MAX_VICTIMS];
+    char dir[GAME_MAX_WORLD_PATH_LENGTH + 64];
+    SCEuint i, n;
+    SCEulong failed;
+
+    /* the thread of the cache can't report its errors itself */
+    if ((failed = DCache_PopFailures (&game->cache)))
+        SCEE_SendMsg ("disk cache: %lu scans or evictions failed\n", failed);
+
+    n = DCache_PopVictims (&game->cache, victims, DCACHE_MAX_VICTIMS);
+    for (i = 0; i < n; i++) {
+        DCacheTree *t = &victims[i];
+        SCE_SVoxelWorldTree *wt = NULL;
+        TerrainTree *tt = NULL;
+
+        if ((wt = SCE_VWorld_GetTree (game->vw, t->x, t->y, t->z)))
+            tt = SCE_VOctree_GetData (SCE_VWorld_GetOctree (wt));
+        if (tt && tt->status != TERRAIN_UNAVAILABLE) {
+            DCache_TouchTree (&game->cache, t->x, t->y, t->z);
+            continue;
+        }
+        snprintf (dir, sizeof dir, "%s/%ld_%ld_%ld", game->world_path,
+                  t->x, t->y, t->z);
+        if (RegionFS_CloseDir (&game->regions, dir) < 0 ||
+            DCache_EvictTree (&game->cache, t) < 0) {
+            SCEE_LogSrc ();
+            SCEE_Out ();
+            SCEE_Clear ();
+        }
+    }
+}
+
+/* downloads the queued chunks, before the network thread is started */
+static int Game_WaitChunks (Game *game)
+{
+    while (DLQueue_HasElements (&game->queued_chunks) ||
+           SCE_List_HasElements (&game->dl_chunks)) {
+        Game_DownloadChunk (game);
+        if (NetClient_WaitTCP (&game->self.client, 1, 0) < 0)
+            goto fail;
+        if (NetClient_TCPStep (&game->self.client, NULL) < 0)
+            goto fail;
+    }
+    return SCE_OK;
+fail:
+    SCEE_LogSrc ();
+    return SCE_ERROR;
+}
+
+/* run once at every connection to a server to download the terrain */
+static int Game_DownloadTerrain (Game *game)
+{
+    SCE_SLongRect3 rect;
+    long distance;
+    long x, y, z, d;
+    SCE_SList list;
+    SCE_SListIterator *it = NULL;
+    int i;
+
+    x = game->self.pos[0];
+    y = game->self.pos[1];
+    z = game->self.pos[2];
     distance = game->view_distance + game->view_threshold;
 
+    /* we haven't moved yet */
+    SCE_Vector3_Copy (game->last_pos, game->self.pos);
+    SCE_Vector3_Copy (game->sched_pos, game->self.pos);
+    SCE_Vector3_Copy (game->prefetch_pos, game->self.pos);
+
 #ifdef DEBUG
     SCEE_SendMsg ("Game_DownloadTerrain(): downloading trees...\n");
 #endif
@@ -943,7 +2300,7 @@ static int Game_DownloadTerrain (Game *game)
     /* download ALL the trees. */
     /* download before queuing nodes, because without the trees we wouldn't
        have any node to queue :) */
-    while (SCE_List_HasElements (&game->queued_trees) ||
+    while (DLQueue_HasElements (&game->queued_trees) ||
            SCE_List_HasElements (&game->dl_trees)) {
         Game_DownloadTree (game);
         if (NetClient_WaitTCP (&game->self.client, 1, 0) < 0)
@@ -968,18 +2325,18 @@ static int Game_DownloadTerrain (Game *game)
                 goto fail;
         }
         SCE_List_Flush (&list);
-    }
 
-    /* download ALL the chunks. */
-    while (SCE_List_HasElements (&game->queued_chunks) ||
-           SCE_List_HasElements (&game->dl_chunks)) {
-        Game_DownloadChunk (game);
-        if (NetClient_WaitTCP (&game->self.client, 1, 0) < 0)
-            goto fail;
-        if (NetClient_TCPStep (&game->self.client, NULL) < 0)
+        /* in progressive mode we only wait for the coarsest level, the
+           other ones are downloaded while the game runs */
+        if (game->config.progressive && i == game->n_lod - 1 &&
+            Game_WaitChunks (game) < 0)
             goto fail;
     }
 
+    /* download ALL the chunks. */
+    if (!game->config.progressive && Game_WaitChunks (game) < 0)
+        goto fail;
+
     return SCE_OK;
 fail:
     SCE_List_Flush (&list);
@@ -994,7 +2351,7 @@ static int Game_LOD0ChunksPls (Game *game)
     SCE_SList list;
     SCE_SListIterator *it = NULL;
 
-    SCE_VTerrain_GetRectangle (game->vt, 0, &rect);
+    Game_GetGridRectangle (game, 0, &rect);
 
     SCE_List_Init (&list);
     if (SCE_VWorld_FetchNodes (game->vw, 0, &rect, &list) < 0)
@@ -1006,15 +2363,9 @@ static int Game_LOD0ChunksPls (Game *game)
     }
     SCE_List_Flush (&list);
 
-    /* download ALL the chunks. */
-    while (SCE_List_HasElements (&game->queued_chunks) ||
-           SCE_List_HasElements (&game->dl_chunks)) {
-        Game_DownloadChunk (game);
-        if (NetClient_WaitTCP (&game->self.client, 1, 0) < 0)
-            goto fail;
-        if (NetClient_TCPStep (&game->self.client, NULL) < 0)
-            goto fail;
-    }
+    /* download ALL the chunks, unless we can render without them */
+    if (!game->config.progressive && Game_WaitChunks (game) < 0)
+        goto fail;
 
     return SCE_OK;
 fail:
@@ -1024,28 +2375,24 @@ fail:
 }
 
 
-static int Game_UpdateTerrain (Game *game)
+/* the whole view is queried every so often anyway (ms), for the chunks
+   whose download failed */
+#define GAME_VIEW_REFRESH_PERIOD 2000
+
+/* queries the trees and the LOD 0 chunks of an area */
+static int Game_QueryArea (Game *game, SCE_SLongRect3 *rect)
 {
-    SCE_SLongRect3 rect;
-    long distance;
-    long x, y, z, d;
     SCE_SList list;
     SCE_SListIterator *it = NULL;
 
-    x = game->self.pos[0];
-    y = game->self.pos[1];
-    z = game->self.pos[2];
-    distance = game->view_distance + game->view_threshold;
-
     /* get needed trees */
-    d = distance;
-    SCE_Rectangle3_SetFromCenterl (&rect, x, y, z, d, d, d);
     SCE_List_Init (&list);
-    if (SCE_VWorld_FetchTrees (game->vw, game->n_lod - 1, &rect, &list) < 0)
+    if (SCE_VWorld_FetchTrees (game->vw, game->n_lod - 1, rect, &list) < 0)
         goto fail;
     /* cycle through to queue them */
     SCE_List_ForEach (it, &list) {
         SCE_SVoxelWorldTree *wt = SCE_List_GetData (it);
+        Game_UseTree (game, wt);
         if (Game_query_tree (game, wt) < 0)
             goto fail;
         /* TODO: if we need a new tree, we should download all its content
@@ -1054,29 +2401,24 @@ static int Game_UpdateTerrain (Game *game)
     SCE_List_Flush (&list);
 
     /* get needed chunks (only LOD 0 chunks) */
-    d = distance;
-    SCE_Rectangle3_SetFromCenterl (&rect, x, y, z, d, d, d);
 #if 0
     {
         long p1[3], p2[3];
-        SCE_Rectangle3_GetPointslv (&rect, p1, p2);
+        SCE_Rectangle3_GetPointslv (rect, p1, p2);
         SCEE_SendMsg ("rect: %ld %ld %ld, %ld %ld %ld\n",
                       p1[0], p1[1], p1[2], p2[0], p2[1], p2[2]);
     }
 #endif
     SCE_List_Init (&list);
-    if (SCE_VWorld_FetchNodes (game->vw, 0, &rect, &list) < 0)
+    if (SCE_VWorld_FetchNodes (game->vw, 0, rect, &list) < 0)
         goto fail;
     /* cycle through to queue them */
     SCE_List_ForEach (it, &list) {
+        Game_UseChunk (game, SCE_List_GetData (it));
         if (Game_query_chunk (game, SCE_List_GetData (it)) < 0)
             goto fail;
     }
     SCE_List_Flush (&list);
-
-    Game_DownloadTree (game);
-    Game_DownloadChunk (game);
-
     return SCE_OK;
 fail:
     SCE_List_Flush (&list);
@@ -1084,46 +2426,107 @@ fail:
     return SCE_ERROR;
 }
 
-static int is_region_available (SCE_SVoxelWorld *vw, SCEuint level,
-                                const SCE_SLongRect3 *r)
+/* rounds down to a multiple of s */
+static long Game_Snap (long v, long s)
 {
-    SCE_SList list;
-    SCE_SListIterator *it = NULL;
+    return (v >= 0 ? v / s : -((-v + s - 1) / s)) * s;
+}
 
-    /* check if all needed octrees are available */
-    SCE_List_Init (&list);
-    SCE_VWorld_FetchTrees (vw, level, r, &list);
-    SCE_List_ForEach (it, &list) {
-        TerrainTree *tt = NULL;
-        SCE_SVoxelWorldTree *wt = SCE_List_GetData (it);
-        tt = SCE_VOctree_GetData (SCE_VWorld_GetOctree (wt));
-        if (!tt || tt->status != TERRAIN_AVAILABLE) {
-            SCE_List_Flush (&list);
-            return SCE_FALSE;
-        }
+/* queries the terrain that entered the view: the view is centered on the
+   chunk we are in, it only changes when we cross a chunk boundary and then
+   only the slabs of the new view that were not in the previous one are
+   queried */
+static int Game_UpdateView (Game *game)
+{
+    SCE_SLongRect3 rect, area;
+    long r1[3], r2[3], o1[3], o2[3], p1[3], p2[3];
+    long cs = game->chunk_size, d;
+    SCEuint now = Clock_GetTicks ();
+    int i;
+
+    d = game->view_distance + game->view_threshold;
+    SCE_Rectangle3_SetFromCenterl (
+        &rect, Game_Snap (game->self.pos[0], cs) + cs / 2,
+        Game_Snap (game->self.pos[1], cs) + cs / 2,
+        Game_Snap (game->self.pos[2], cs) + cs / 2, d, d, d);
+    SCE_Rectangle3_GetPointslv (&rect, r1, r2);
+    SCE_Rectangle3_GetPointslv (&game->view_rect, o1, o2);
+
+    if (game->view_dirty || now - game->view_refresh >=
+        GAME_VIEW_REFRESH_PERIOD ||
+        !SCE_Rectangle3_Intersectionl (&rect, &game->view_rect, &area)) {
+        game->view_dirty = SCE_FALSE;
+        game->view_refresh = now;
+        game->view_rect = rect;
+        if (Game_QueryArea (game, &rect) < 0)
+            goto fail;
+        return SCE_OK;
     }
-    SCE_List_Flush (&list);
 
-    /* check if all needed nodes are available */
-    SCE_List_Init (&list);
-    SCE_VWorld_FetchNodes (vw, level, r, &list);
-    SCE_List_ForEach (it, &list) {
-        TerrainChunk *tc = NULL;
-        SCE_SVoxelOctreeNode *node = SCE_List_GetData (it);
-        tc = SCE_VOctree_GetNodeData (node);
-        if (!tc || tc->status != TERRAIN_AVAILABLE) {
-            SCE_List_Flush (&list);
-            return SCE_FALSE;
+    /* cut off the new view one slab per face of the old one */
+    game->view_rect = rect;
+    for (i = 0; i < 3; i++) {
+        if (r1[i] < o1[i]) {
+            memcpy (p1, r1, sizeof p1);
+            memcpy (p2, r2, sizeof p2);
+            p2[i] = o1[i];
+            SCE_Rectangle3_SetFromPointslv (&area, p1, p2);
+            if (Game_QueryArea (game, &area) < 0)
+                goto fail;
+            r1[i] = o1[i];
+        }
+        if (r2[i] > o2[i]) {
+            memcpy (p1, r1, sizeof p1);
+            memcpy (p2, r2, sizeof p2);
+            p1[i] = o2[i];
+            SCE_Rectangle3_SetFromPointslv (&area, p1, p2);
+            if (Game_QueryArea (game, &area) < 0)
+                goto fail;
+            r2[i] = o2[i];
         }
     }
-    SCE_List_Flush (&list);
+    return SCE_OK;
+fail:
+    game->view_dirty = SCE_TRUE;
+    SCEE_LogSrc ();
+    return SCE_ERROR;
+}
 
-    return SCE_TRUE;
+static int Game_UpdateTerrain (Game *game)
+{
+    if (Game_UpdateView (game) < 0)
+        goto fail;
+
+    Game_UpdateMotion (game);
+    PCache_SetViewer (&game->files, game->self.pos, game->heading);
+    Game_UpdatePriorities (game);
+    Game_DownloadTree (game);
+    Game_DownloadChunk (game);
+
+    return SCE_OK;
+fail:
+    SCEE_LogSrc ();
+    return SCE_ERROR;
+}
+
+/* whether all the trees and nodes needed to fill a region of a level are
+   available, see Game_SetChunkStatus() */
+static int is_region_available (Game *game, SCEuint level,
+                                const SCE_SLongRect3 *r)
+{
+    long cs = game->chunk_size;
+
+    /* all needed octrees, tree size expressed in voxels of the level */
+    if (!AMap_IsRegionClear (&game->pending, game->n_lod, r,
+                             cs << (game->n_lod - 1 - level)))
+        return SCE_FALSE;
+    /* all needed nodes */
+    return AMap_IsRegionClear (&game->pending, level, r, cs);
 }
 
-static int update_grid (SCE_SVoxelWorld *vw, SCE_SVoxelTerrain *vt,
-                        SCEuint level, SCE_EBoxFace f)
+static int update_grid (Game *game, SCEuint level, SCE_EBoxFace f)
 {
+    SCE_SVoxelWorld *vw = game->vw;
     long x, y, z;
     long w, h, d;
     long origin_x, origin_y, origin_z;
@@ -1133,11 +2536,8 @@ static int update_grid (SCE_SVoxelWorld *vw, SCE_SVoxelTerrain *vt,
 
     SCE_SLongRect3 r;
 
-    w = SCE_VTerrain_GetWidth (vt);
-    h = SCE_VTerrain_GetHeight (vt);
-    d = SCE_VTerrain_GetDepth (vt);
-
-    SCE_VTerrain_GetOrigin (vt, level, &x, &y, &z);
+    Game_GetGridSize (game, &w, &h, &d);
+    Game_GetOrigin (game, level, &x, &y, &z);
 
     switch (f) {
     case SCE_BOX_POSX:
@@ -1161,55 +2561,480 @@ static int update_grid (SCE_SVoxelWorld *vw, SCE_SVoxelTerrain *vt,
         SCE_Rectangle3_SetFromOriginl (&r, x, y, z, w, h, 1);
     }
 
-    if (!is_region_available (vw, level, &r))
+    if (!is_region_available (game, level, &r))
         return SCE_FALSE;
 
     SCE_VWorld_GetRegion (vw, level, &r, buf);
-    SCE_VTerrain_AppendSlice (vt, level, f, buf);
+    Game_AppendSlice (game, level, f, buf);
 
     return SCE_TRUE;
 }
 
-int Game_Launch (Game *game)
+/* minimum time between two checks of the levels not rendered yet (ms) */
+#define GAME_LEVELS_CHECK_PERIOD 250
+
+/* re-centers the grid of a level and queues the whole of it for reading,
+   which is done in one SCE_VWorld_GetRegion(). returns SCE_FALSE if the
+   terrain it covers isn't available yet */
+static int Game_FillLevel (Game *game, SCEuint level)
 {
-    int loop = 1;
-    long x, y, z;
-    float angle_y = 0., angle_x = 0., back_x = 0., back_y = 0.;
-    int mouse_pressed = 0, wait, temps = 0, tm, i, j;
-    SCE_SInertVar rx, ry;
-    SDL_Event ev;
-    SCE_SCamera *cam = NULL;
-    float *matrix = NULL;
-    SCE_SShader *lodshader = NULL;
-    SCE_STexture *diffuse = NULL;
-    SCE_SLight *l = NULL;
-    SCE_SVoxelWorld *vw = NULL;
     SCE_SLongRect3 rect;
 
-    float dist = GRID_SIZE;
-    SCEubyte *buf = NULL;
-    int shadows = SCE_FALSE;
-    int first_draw = SCE_FALSE;
-    int apply_mode = SCE_FALSE;
+    Game_ResetGrid (game, level);
+    Game_GetGridRectangle (game, level, &rect);
+    if (!is_region_available (game, level, &rect))
+        return SCE_FALSE;
+    SCE_VWorld_AddUpdatedRegion (game->vw, level, &rect);
+    return SCE_TRUE;
+}
 
-    /* initialize connection */
-    if (Game_InitConnection (game) < 0)
-        goto fail;
+/* the grid of a level is rebuilt rather than updated slice by slice when
+   more than 1/GAME_REBUILD_RATIO of its width is missing */
+#define GAME_REBUILD_RATIO 4
 
-    /* initialize terrain */
-    if (Game_InitTerrain (game) < 0)
-        goto fail;
+/* replaces the grid of a level that is too far from where we are. if the
+   terrain there isn't available the level is hidden until it is, see
+   Game_UpdateLevels() */
+static void Game_RebuildLevel (Game *game, SCEuint level)
+{
+    RecoveryStats *rs = &game->recovery;
+
+    rs->n_rebuilds++;
+    if (!rs->start)
+        rs->start = Clock_GetTicks ();
+    if (!Game_FillLevel (game, level)) {
+        Game_ActivateLevel (game, level, SCE_FALSE);
+        game->levels_ready &= ~(1 << level);
+    }
+}
+static int Game_NeedsRebuild (Game *game, const long *missing)
+{
+    long w, h, d;
+    long sum = labs (missing[0]) + labs (missing[1]) + labs (missing[2]);
+    Game_GetGridSize (game, &w, &h, &d);
+    return sum * GAME_REBUILD_RATIO > w;
+}
 
-    game->view_distance = GW;
-    game->view_threshold = GW / 10;
-    /* download terrain */
-    if (Game_DownloadTerrain (game) < 0)
-        goto fail;
+/* starts rendering the levels of the terrain whose grid is complete */
+static void Game_UpdateLevels (Game *game)
+{
+    RecoveryStats *rs = &game->recovery;
+    SCEuint i, all = (1 << game->n_lod) - 1;
+    SCEuint now = Clock_GetTicks ();
+
+    if (game->levels_ready == all) {
+        if (rs->start) {
+            rs->last = now - rs->start;
+            if (rs->last > rs->max)
+                rs->max = rs->last;
+            rs->total += rs->last;
+            rs->n_recoveries++;
+            rs->start = 0;
+            SCEE_SendMsg ("full detail again after %u ms\n", rs->last);
+        }
+        return;
+    }
+    /* the levels are checked at every frame while recovering, availability
+       checks are cheap, the delay would only add to the recovery time */
+    if (!rs->start && now - game->levels_check < GAME_LEVELS_CHECK_PERIOD)
+        return;
+    game->levels_check = now;
+
+    for (i = 0; i < game->n_lod; i++) {
+        if (game->levels_ready & (1 << i))
+            continue;
+        if (!Game_FillLevel (game, i))
+            continue;
+        Game_ActivateLevel (game, i, SCE_TRUE);
+        game->levels_ready |= 1 << i;
+    }
+
+    if (game->levels_ready == all && !game->full_detail_time) {
+        game->full_detail_time = now - game->launch_time;
+        SCEE_SendMsg ("full detail after %u ms\n", game->full_detail_time);
+    }
+}
+
+/* distance of the teleports of the benchmark, in view distances */
+#define GAME_TELEPORT_DISTANCE 4
+
+/* teleports the player once the terrain has recovered from the previous
+   teleport, until config.bench_teleports have been timed. returns SCE_FALSE
+   when the benchmark is over */
+static int Game_BenchTeleport (Game *game)
+{
+    RecoveryStats *rs = &game->recovery;
+    SCEuint all = (1 << game->n_lod) - 1;
+
+    if (game->levels_ready != all || rs->start)
+        return SCE_TRUE;
+    if (rs->n_recoveries >= game->config.bench_teleports) {
+        printf ("teleports: %lu, recovery: %.1f ms average, %u ms max\n",
+                rs->n_recoveries,
+                rs->n_recoveries ? (float)rs->total / rs->n_recoveries : 0.0,
+                rs->max);
+        return SCE_FALSE;
+    }
+    game->self.pos[0] += GAME_TELEPORT_DISTANCE * game->view_distance;
+    return SCE_TRUE;
+}
+
+/**
+ * \brief Loads the movement of a headless client
+ *
+ * Each line of the script holds a waypoint: its position and the time to
+ * get there from the previous one (ms), "x y z time". Empty lines and
+ * lines starting with '#' are ignored.
+ * \sa Game_FollowScript()
+ */
+int Game_LoadScript (Game *game, const char *fname)
+{
+    FILE *fp = NULL;
+    char line[256];
+    SCEuint n = 0, line_no = 0;
+
+    if (!(fp = fopen (fname, "r"))) {
+        SCEE_LogErrno (fname);
+        return SCE_ERROR;
+    }
+    while (fgets (line, sizeof line, fp)) {
+        GameWaypoint *w = NULL;
+        char *p = line;
+
+        line_no++;
+        while (*p == ' ' || *p == '\t')
+            p++;
+        if (*p == '#' || *p == '\n' || *p == '\0')
+            continue;
+        if (!(w = SCE_realloc (game->script, (n + 1) * sizeof *w)))
+            goto fail;
+        game->script = w;
+        w = &w[n];
+        if (sscanf (p, "%f %f %f %u", &w->pos[0], &w->pos[1], &w->pos[2],
+                    &w->duration) != 4) {
+            SCEE_Log (SCE_INVALID_ARG);
+            SCEE_LogMsg ("%s:%u: expected 'x y z time'", fname, line_no);
+            goto fail;
+        }
+        n++;
+    }
+    fclose (fp);
+    game->n_waypoints = n;
+    game->waypoint = 0;
+    game->waypoint_start = Clock_GetTicks ();
+    SCE_Vector3_Copy (game->waypoint_from, game->self.pos);
+    return SCE_OK;
+fail:
+    fclose (fp);
+    SCEE_LogSrc ();
+    return SCE_ERROR;
+}
+
+/* moves the player along the script, returns SCE_FALSE once the last
+   waypoint has been reached. without a script the player stays still */
+static int Game_FollowScript (Game *game)
+{
+    SCEuint now = Clock_GetTicks ();
+    GameWaypoint *w = NULL;
+    SCE_TVector3 v;
+    float t = 1.0;
+
+    if (!game->script)
+        return SCE_TRUE;
+    if (game->waypoint >= game->n_waypoints)
+        return SCE_FALSE;
+
+    w = &game->script[game->waypoint];
+    if (w->duration > 0)
+        t = (float)(now - game->waypoint_start) / w->duration;
+    if (t >= 1.0) {
+        SCE_Vector3_Copy (game->self.pos, w->pos);
+        SCE_Vector3_Copy (game->waypoint_from, w->pos);
+        game->waypoint_start = now;
+        game->waypoint++;
+        return SCE_TRUE;
+    }
+    SCE_Vector3_Copy (v, w->pos);
+    SCE_Vector3_Operator1v (v, -=, game->waypoint_from);
+    SCE_Vector3_Operator1 (v, *=, t);
+    SCE_Vector3_Operator1v (v, +=, game->waypoint_from);
+    SCE_Vector3_Copy (game->self.pos, v);
+    return SCE_TRUE;
+}
+
+static void Game_PrintPrefetchStats (const char *name,
+                                     const PrefetchStats *st)
+{
+    printf ("prefetched %s: %lu requested, %lu used (%.1f%%), %lu dropped\n",
+            name, st->requested, st->used,
+            st->requested ? 100.0 * st->used / st->requested : 0.0,
+            st->dropped);
+}
+
+static void Game_PrintStats (Game *game)
+{
+    int i;
+
+    Game_PrintDownloadWindow ("trees", &game->tree_win);
+    Game_PrintDownloadWindow ("chunks", &game->chunk_win);
+    printf ("network: %u packets pending, %lu received, %lu stalls\n",
+            NetThread_GetNumPending (&game->net),
+            game->net.n_received, game->net.n_stalls);
+    for (i = 0; i < COMP_NUM_CODECS; i++)
+        Comp_PrintStats (stdout, i, &game->comp_stats[i]);
+    printf ("trees: %u waiting to be saved\n",
+            SCE_List_GetLength (&game->unsaved_trees));
+    printf ("manifest: %u chunks\n", Manifest_GetNumRecords (&game->manifest));
+    if (game->chunk_fs)
+        RegionFS_PrintStats (stdout, &game->regions);
+    DCache_PrintStats (stdout, &game->cache);
+    CBudget_PrintStats (stdout, &game->caches);
+    PCache_PrintStats (stdout, &game->files);
+    printf ("queues: %u trees, %u chunks, %lu requests moved\n",
+            DLQueue_GetLength (&game->queued_trees),
+            DLQueue_GetLength (&game->queued_chunks),
+            game->queued_trees.n_moved + game->queued_chunks.n_moved);
+    printf ("pruned: %lu trees, %lu chunks, %lu chunk requests cancelled\n",
+            game->queued_trees.n_dropped, game->queued_chunks.n_dropped,
+            game->n_cancelled);
+    Game_PrintPrefetchStats ("trees", &game->prefetch_trees);
+    Game_PrintPrefetchStats ("chunks", &game->prefetch_chunks);
+    printf ("startup: first frame after %u ms, full detail after %u ms\n",
+            game->first_frame_time, game->full_detail_time);
+    printf ("rebuilds: %lu levels, %lu recoveries (last %u ms, max %u ms)\n",
+            game->recovery.n_rebuilds, game->recovery.n_recoveries,
+            game->recovery.last, game->recovery.max);
+    FSched_PrintStats (stdout, &game->sched);
+    if (game->config.headless)
+        HTerrain_PrintStats (stdout, &game->grids);
+}
+
+/* time the frame tasks may take (usec), the rest of the frame goes to the
+   rendering and to the idle tasks */
+#define GAME_FRAME_BUDGET 8000
+/* time left to Clock_Sleep() at the end of the frame (usec) */
+#define GAME_IDLE_MARGIN 1000
+/* number of packets handled between two checks of the clock */
+#define GAME_NET_BATCH 8
+/* bytes of region files moved at once to reclaim their free space */
+#define GAME_COMPACT_STEP (16 * 1024)
+/* time between two commits of the region files (usec) */
+#define GAME_SYNC_PERIOD 1000000
+
+static int Game_SchedPackets (void *udata, SCEulong deadline)
+{
+    Game *game = udata;
+    while (NetThread_Process (&game->net, GAME_NET_BATCH) == GAME_NET_BATCH) {
+        if (Clock_GetMicro () >= deadline)
+            return SCE_TRUE;
+    }
+    return SCE_FALSE;
+}
+
+static int Game_SchedTerrain (void *udata, SCEulong deadline)
+{
+    (void)deadline;
+    if (Game_UpdateTerrain (udata) < 0) {
+        SCEE_LogSrc ();
+        return SCE_ERROR;
+    }
+    return SCE_FALSE;
+}
+
+/* moves the grid of a level by up to n slices along one axis, returns
+   SCE_TRUE if it stopped because of the deadline */
+static int Game_FillSlices (Game *game, SCEuint level, long n, int pos,
+                            int neg, SCEulong deadline)
+{
+    int f = n > 0 ? pos : neg;
+    long i;
+
+    for (i = labs (n); i > 0; i--) {
+        if (!update_grid (game, level, f))
+            break;
+        if (i > 1 && Clock_GetMicro () >= deadline)
+            return SCE_TRUE;
+    }
+    return SCE_FALSE;
+}
+
+/* the slices a level is missing are remembered by the terrain, those that
+   don't fit in this frame are filled during the next ones */
+static int Game_SchedGrids (void *udata, SCEulong deadline)
+{
+    Game *game = udata;
+    long missing[3], k;
+
+    Game_UpdateLevels (game);
+
+    for (k = 0; k < game->n_lod; k++) {
+        /* the whole grid is read when the level gets ready */
+        if (!(game->levels_ready & (1 << k)))
+            continue;
+        Game_GetMissingSlices (game, k, missing);
+
+        if (Game_NeedsRebuild (game, missing)) {
+            /* update the whole grid */
+            Game_RebuildLevel (game, k);
+        } else if (Game_FillSlices (game, k, missing[0], SCE_BOX_POSX,
+                                    SCE_BOX_NEGX, deadline) ||
+                   Game_FillSlices (game, k, missing[1], SCE_BOX_POSY,
+                                    SCE_BOX_NEGY, deadline) ||
+                   Game_FillSlices (game, k, missing[2], SCE_BOX_POSZ,
+                                    SCE_BOX_NEGZ, deadline))
+            return SCE_TRUE;
+    }
+    return SCE_FALSE;
+}
+
+static int Game_SchedCaches (void *udata, SCEulong deadline)
+{
+    Game *game = udata;
+
+    (void)deadline;
+    if (SCE_VWorld_UpdateCache (game->vw) < 0) {
+        SCEE_LogSrc ();
+        return SCE_ERROR;
+    }
+    SCE_FileCache_Update (&game->fcache);
+    Game_UpdateCaches (game);
+    return SCE_FALSE;
+}
+
+static int Game_SchedCompact (void *udata, SCEulong deadline)
+{
+    Game *game = udata;
+
+    if (!game->chunk_fs)
+        return SCE_FALSE;
+    do {
+        if (RegionFS_Compact (&game->regions, GAME_COMPACT_STEP) <
+            GAME_COMPACT_STEP)
+            return SCE_FALSE;
+    } while (Clock_GetMicro () < deadline);
+    return SCE_TRUE;
+}
+
+/* the chunks written since the last commit are lost on a crash, they will
+   be downloaded again */
+static int Game_SchedSync (void *udata, SCEulong deadline)
+{
+    Game *game = udata;
+    SCEulong now = Clock_GetMicro ();
+
+    (void)deadline;
+    if (!game->chunk_fs || now - game->last_sync < GAME_SYNC_PERIOD)
+        return SCE_FALSE;
+    game->last_sync = now;
+    if (RegionFS_Sync (&game->regions) < 0) {
+        SCEE_LogSrc ();
+        SCEE_Out ();
+        SCEE_Clear ();
+    }
+    return SCE_FALSE;
+}
+
+static int Game_SchedSave (void *udata, SCEulong deadline)
+{
+    int res;
+    /* the tree will be downloaded again next time, not worth quitting */
+    if ((res = Game_SaveTrees (udata, deadline)) < 0) {
+        SCEE_LogSrc ();
+        SCEE_Out ();
+        SCEE_Clear ();
+        return SCE_TRUE;
+    }
+    return res;
+}
+
+static int Game_SchedEvict (void *udata, SCEulong deadline)
+{
+    (void)deadline;
+    Game_EvictTrees (udata);
+    return SCE_FALSE;
+}
+
+static int Game_SchedPrefetch (void *udata, SCEulong deadline)
+{
+    (void)deadline;
+    if (Game_Prefetch (udata) < 0) {
+        SCEE_LogSrc ();
+        return SCE_ERROR;
+    }
+    return SCE_FALSE;
+}
+
+/* packets and terrain requests are handled every frame, the grids as long
+   as the budget allows. maintenance and prefetching use the time left at
+   the end of the frames, or get some of the budget if there is none */
+static int Game_InitSched (Game *game)
+{
+    FrameSched *s = &game->sched;
+
+    FSched_SetBudget (s, GAME_FRAME_BUDGET);
+    if (FSched_Add (s, "packets", Game_SchedPackets, game,
+                    FSCHED_FRAME, 0, 0) < 0 ||
+        FSched_Add (s, "terrain", Game_SchedTerrain, game,
+                    FSCHED_FRAME, 1, 0) < 0 ||
+        FSched_Add (s, "grids", Game_SchedGrids, game,
+                    FSCHED_FRAME, 2, 100) < 0 ||
+        FSched_Add (s, "prefetch", Game_SchedPrefetch, game,
+                    FSCHED_IDLE, 3, 250) < 0 ||
+        FSched_Add (s, "caches", Game_SchedCaches, game,
+                    FSCHED_IDLE, 4, 500) < 0 ||
+        FSched_Add (s, "evict", Game_SchedEvict, game,
+                    FSCHED_IDLE, 5, 2000) < 0 ||
+        FSched_Add (s, "compact", Game_SchedCompact, game,
+                    FSCHED_IDLE, 6, 2000) < 0 ||
+        FSched_Add (s, "save", Game_SchedSave, game,
+                    FSCHED_IDLE, 7, 1000) < 0 ||
+        FSched_Add (s, "sync", Game_SchedSync, game,
+                    FSCHED_IDLE, 8, 1000) < 0) {
+        SCEE_LogSrc ();
+        return SCE_ERROR;
+    }
+    return SCE_OK;
+}
+
+#ifndef TL_NO_VIDEO
+static void Game_Render (Game *game, SCE_SCamera *cam)
+{
+    SCE_Scene_Update (game->scene, cam, NULL, 0);
+    SCE_Scene_Render (game->scene, cam, NULL, 0);
+
+#if 1
+    {
+        SCE_TVector3 center;
+    SCE_RLoadMatrix (SCE_MAT_OBJECT, sce_matrix4_id);
+    SCE_Scene_UseCamera (cam);
+    glDisable (GL_DEPTH_TEST);
+    glPointSize (3.0);
+    glBegin (GL_POINTS);
+    glColor3f (1.0, 0.0, 0.0);
+    SCE_Vector3_Copy (center, game->self.pos);
+    SCE_Vector3_Operator1 (center, /=, 2.0);
+    glVertex3fv (center);
+    glEnd ();
+    glColor3f (1.0, 1.0, 1.0);
+    glEnable (GL_DEPTH_TEST);
+    }
+#endif
+
+    SDL_GL_SwapBuffers ();
+}
+
+/* creates the scene, the terrain renderer and the lights. returns 42 if
+   the noise texture can't be loaded */
+static int Game_InitScene (Game *game, SCE_SCamera **camp, SCE_SLight **sun)
+{
+    SCE_SCamera *cam = NULL;
+    SCE_SShader *lodshader = NULL;
+    SCE_STexture *diffuse = NULL;
+    SCE_SLight *l = NULL;
 
     /* initialize scene */
     game->scene = SCE_Scene_Create ();
     cam = SCE_Camera_Create ();
-    matrix = SCE_Camera_GetView (cam);
     SCE_Camera_SetViewport (cam, 0, 0, game->config.screen_w,
                             game->config.screen_h);
     SCE_Camera_SetProjection (cam, 70. * RAD,
@@ -1271,25 +3096,6 @@ int Game_Launch (Game *game)
 
     SCE_Scene_SetVoxelTerrain (game->scene, game->vt);
 
-    buf = SCE_malloc (GW * GH * GD * 4);
-
-    /* set position so that GetTheoreticalOrigin() can work */
-    x = game->self.pos[0];
-    y = game->self.pos[1];
-    z = game->self.pos[2];
-
-    SCE_VTerrain_SetPosition (game->vt, x, y, z);
-
-    /* query for visible LOD 0 chunks */
-    if (Game_LOD0ChunksPls (game) < 0)
-        goto fail;
-
-    for (i = 0; i < game->n_lod; i++) {
-        SCE_VTerrain_UpdateGrid (game->vt, i, SCE_FALSE);
-        SCE_VTerrain_GetRectangle (game->vt, i, &rect);
-        SCE_VWorld_AddUpdatedRegion (game->vw, i, &rect);
-    }
-
     /* sky lighting */
     l = SCE_Light_Create ();
     SCE_Light_SetColor (l, 0.7, 0.8, 1.0);
@@ -1303,11 +3109,131 @@ int Game_Launch (Game *game)
     SCE_Light_SetColor (l, 1.0, 0.9, 0.85);
     SCE_Light_SetType (l, SCE_SUN_LIGHT);
     SCE_Light_SetPosition (l, 2., 2., 2.);
-    SCE_Light_SetShadows (l, shadows);
+    SCE_Light_SetShadows (l, SCE_FALSE);
     SCE_Scene_AddLight (game->scene, l);
 
+    game->scene->state->deferred = SCE_TRUE;
+    game->scene->state->lighting = SCE_TRUE;
+    game->scene->state->frustum_culling = SCE_TRUE;
+    game->scene->state->lod = SCE_TRUE;
+    /* sky color */
+    game->scene->rclear = 0.6;
+    game->scene->gclear = 0.7;
+    game->scene->bclear = 1.0;
+
+    *camp = cam;
+    *sun = l;
+    return SCE_OK;
+fail:
+    SCEE_LogSrc ();
+    return SCE_ERROR;
+}
+#endif
+
+/* sets up the grids of the terrain for headless mode, in place of the
+   renderer */
+static int Game_InitGrids (Game *game)
+{
+    if (game->n_lod > HTERRAIN_MAX_LEVELS) {
+        SCEE_Log (SCE_INVALID_ARG);
+        SCEE_LogMsg ("%u levels of detail, the headless mode handles at "
+                     "most %d", game->n_lod, HTERRAIN_MAX_LEVELS);
+        return SCE_ERROR;
+    }
+    HTerrain_SetDimensions (&game->grids, GW, GH, GD);
+    HTerrain_SetNumLevels (&game->grids, game->n_lod);
+    if (HTerrain_Build (&game->grids, SCE_VOCTREE_VOXEL_ELEMENTS) < 0) {
+        SCEE_LogSrc ();
+        return SCE_ERROR;
+    }
+    return SCE_OK;
+}
+
+int Game_Launch (Game *game)
+{
+    int loop = 1;
+    long x, y, z;
+    int wait, temps = 0, tm, i, j;
+    SCEulong frame_start, frame_end, n_dropped;
+    SCE_SInertVar rx, ry;
+#ifndef TL_NO_VIDEO
+    float angle_y = 0., angle_x = 0., back_x = 0., back_y = 0.;
+    int mouse_pressed = 0;
+    SDL_Event ev;
+    SCE_SLight *l = NULL;
+    int shadows = SCE_FALSE;
+#endif
+    SCE_SCamera *cam = NULL;
+    float *matrix = NULL;
+    SCE_SVoxelWorld *vw = NULL;
+    SCE_SLongRect3 rect;
+
+    float dist = GRID_SIZE;
+    int first_draw = SCE_FALSE;
+    int apply_mode = SCE_FALSE;
+
+    game->launch_time = Clock_GetTicks ();
+
+    /* initialize connection */
+    if (Game_InitConnection (game) < 0)
+        goto fail;
+
+    /* initialize terrain */
+    if (Game_InitTerrain (game) < 0)
+        goto fail;
+
+    game->view_distance = GW;
+    game->view_threshold = GW / 10;
+    /* download terrain */
+    if (Game_DownloadTerrain (game) < 0)
+        goto fail;
+
+    if (game->config.headless) {
+        if (Game_InitGrids (game) < 0)
+            goto fail;
+        if (game->config.script &&
+            Game_LoadScript (game, game->config.script) < 0)
+            goto fail;
+    }
+#ifndef TL_NO_VIDEO
+    else {
+        int res = Game_InitScene (game, &cam, &l);
+        if (res < 0)
+            goto fail;
+        else if (res)
+            return res;
+        matrix = SCE_Camera_GetView (cam);
+    }
+#endif
+
+    /* set position so that GetTheoreticalOrigin() can work */
+    x = game->self.pos[0];
+    y = game->self.pos[1];
+    z = game->self.pos[2];
+
+    Game_SetGridPosition (game, x, y, z);
+
+    /* query for visible LOD 0 chunks */
+    if (Game_LOD0ChunksPls (game) < 0)
+        goto fail;
+
+    /* levels are rendered once their grid is complete, right now in
+       non-progressive mode */
+    game->levels_ready = 0;
+    game->levels_check = Clock_GetTicks () - GAME_LEVELS_CHECK_PERIOD;
+    for (i = 0; i < game->n_lod; i++)
+        Game_ActivateLevel (game, i, SCE_FALSE);
+    Game_UpdateLevels (game);
+
     verif (SCEE_HaveError ())
 
+    if (Game_InitSched (game) < 0)
+        goto fail;
+
+    /* from now on, packets are received on their own thread */
+    if (NetThread_Start (&game->net, &game->self.client) < 0)
+        goto fail;
+
     SCE_Inert_Init (&rx);
     SCE_Inert_Init (&ry);
 
@@ -1316,39 +3242,32 @@ int Game_Launch (Game *game)
     SCE_Inert_Accum (&rx, 1);
     SCE_Inert_Accum (&ry, 1);
 
-    game->scene->state->deferred = SCE_TRUE;
-    game->scene->state->lighting = SCE_TRUE;
-    game->scene->state->frustum_culling = SCE_TRUE;
-    game->scene->state->lod = SCE_TRUE;
-    /* sky color */
-    game->scene->rclear = 0.6;
-    game->scene->gclear = 0.7;
-    game->scene->bclear = 1.0;
     temps = 0;
 
     while (loop) {
-        int level, res;
+        int level;
 
-        tm = SDL_GetTicks ();
-
-        /* flush pending packets */
-        do {
-            res = NetClient_PollTCP (&game->self.client);
-            if (res < 0) {
-                SCEE_LogSrc ();
-                goto fail;
-            }
-            if (res)
-                NetClient_TCPStep (&game->self.client, NULL);
-        } while (res > 0);
+        tm = Clock_GetTicks ();
+        frame_start = Clock_GetMicro ();
+        frame_end = frame_start + 1000000 / FPS - GAME_IDLE_MARGIN;
 
+        /* handle the packets received by the network thread */
+        if (NetThread_HasFailed (&game->net)) {
+            SCEE_Log (786);
+            SCEE_LogMsg ("network thread: connection lost");
+            goto fail;
+        }
+        if ((n_dropped = NetThread_PopDropped (&game->net)))
+            SCEE_SendMsg ("network thread: %lu packets dropped, out of "
+                          "memory\n", n_dropped);
 #ifdef DEBUG
         if ((time (NULL) - NetClient_LastPacket (&game->self.client)) > 30) {
             SCEE_SendMsg ("it has been more than 30s since the last packet\n");
         }
 #endif
 
-        while (SDL_PollEvent (&ev)) {
+#ifndef TL_NO_VIDEO
+        while (!game->config.headless && SDL_PollEvent (&ev)) {
             switch (ev.type) {
             case SDL_QUIT: loop = 0; break;
 
@@ -1400,6 +3319,7 @@ int Game_Launch (Game *game)
                     printf ("fps : %.2f\n", 1000./temps);
                     printf ("update time : %d and %d ms\n", i, j);
                     printf ("total time : %d ms\n", temps);
+                    Game_PrintStats (game);
                     break;
                 case SDLK_l:
                     game->vt->trans_enabled = !game->vt->trans_enabled;
@@ -1413,6 +3333,10 @@ int Game_Launch (Game *game)
                 case SDLK_SPACE:
                     apply_mode = !apply_mode;
                     break;
+                case SDLK_j:
+                    game->self.pos[0] += GAME_TELEPORT_DISTANCE *
+                        game->view_distance;
+                    break;
                 case SDLK_v:
                 {
                     unsigned int v = SCE_VRender_GetMaxV ();
@@ -1429,14 +3353,21 @@ int Game_Launch (Game *game)
             default:;
             }
         }
+#endif
+
+        /* headless clients move by themselves */
+        if (game->config.headless && !Game_FollowScript (game))
+            loop = 0;
 
         SCE_Inert_Compute (&rx);
         SCE_Inert_Compute (&ry);
 
-        SCE_Matrix4_Translate (matrix, 0., 0., -dist);
-        SCE_Matrix4_MulRotX (matrix, -(SCE_Inert_Get (&rx) * 0.2) * RAD);
-        SCE_Matrix4_MulRotZ (matrix, -(SCE_Inert_Get (&ry) * 0.2) * RAD);
-        SCE_Matrix4_MulTranslate (matrix, 0.0, 0.0, -30.);
+        if (matrix) {
+            SCE_Matrix4_Translate (matrix, 0., 0., -dist);
+            SCE_Matrix4_MulRotX (matrix, -(SCE_Inert_Get (&rx) * 0.2) * RAD);
+            SCE_Matrix4_MulRotZ (matrix, -(SCE_Inert_Get (&ry) * 0.2) * RAD);
+            SCE_Matrix4_MulTranslate (matrix, 0.0, 0.0, -30.);
+        }
 
         /* integer version of our position */
         x = game->self.pos[0];
@@ -1455,130 +3386,65 @@ int Game_Launch (Game *game)
                                packet, 24);
         }
 
-        /* update terrain (check whether we need some parts of the terrain,
-           stuff like that) */
-        Game_UpdateTerrain (game);
-
-        i = SDL_GetTicks ();
-
-        {
-            long missing[3], k;
-
-            SCE_VTerrain_SetPosition (game->vt, x, y, z);
-
-            for (k = 0; k < SCE_VTerrain_GetNumLevels (game->vt); k++) {
-                SCE_VTerrain_GetMissingSlices (game->vt, k, &missing[0],
-                                               &missing[1], &missing[2]);
-
-                if (0 /* sum of abs(missing) is too big */) {
-                    /* update the whole grid */
-                } else {
-                    while (missing[0] > 0) {
-                        if (!update_grid (game->vw, game->vt, k, SCE_BOX_POSX))
-                            break;
-                        missing[0]--;
-                    }
-                    while (missing[0] < 0) {
-                        if (!update_grid (game->vw, game->vt, k, SCE_BOX_NEGX))
-                            break;
-                        missing[0]++;
-                    }
-                    while (missing[1] > 0) {
-                        if (!update_grid (game->vw, game->vt, k, SCE_BOX_POSY))
-                            break;
-                        missing[1]--;
-                    }
-                    while (missing[1] < 0) {
-                        if (!update_grid (game->vw, game->vt, k, SCE_BOX_NEGY))
-                            break;
-                        missing[1]++;
-                    }
-                    while (missing[2] > 0) {
-                        if (!update_grid (game->vw, game->vt, k, SCE_BOX_POSZ))
-                            break;
-                        missing[2]--;
-                    }
-                    while (missing[2] < 0) {
-                        if (!update_grid (game->vw, game->vt, k, SCE_BOX_NEGZ))
-                            break;
-                        missing[2]++;
-                    }
-                }
-            }
-        }
-
-        while ((level = SCE_VWorld_GetNextUpdatedRegion (game->vw, &rect)) >= 0) {
-            SCE_SIntRect3 terrain_ri;
-            long origin_x, origin_y, origin_z;
-            SCE_SGrid *grid = SCE_VTerrain_GetLevelGrid (game->vt, level);
-            int p1[3], p2[3];
+        if (game->config.bench_teleports && !Game_BenchTeleport (game))
+            loop = 0;
 
-            SCE_Rectangle3_IntFromLong (&terrain_ri, &rect);
+        Game_SetGridPosition (game, x, y, z);
 
-            /* move the updated area in the terrain grid coordinates */
-            SCE_VTerrain_GetOrigin (game->vt, level, &origin_x, &origin_y, &origin_z);
-            SCE_Rectangle3_Move (&terrain_ri, -origin_x, -origin_y, -origin_z);
+        i = Clock_GetTicks ();
 
-            memset (buf, 0, SCE_Rectangle3_GetAreal (&rect));
-            if (SCE_VWorld_GetRegion (game->vw, level, &rect, buf) < 0) {
-                SCEE_LogSrc ();
-                SCEE_Out ();
-                return 434;
-            }
+        /* packets, terrain requests and grids, within the frame budget */
+        if (FSched_RunFrame (&game->sched) < 0)
+            goto fail;
 
-            SCE_Grid_SetRegion (grid, &terrain_ri, SCE_VOCTREE_VOXEL_ELEMENTS, buf);
-            SCE_VTerrain_UpdateSubGrid (game->vt, level, &terrain_ri, first_draw);
+        while ((level = SCE_VWorld_GetNextUpdatedRegion (game->vw,
+                                                         &rect)) >= 0) {
+            int res = SCE_OK;
+            if (!Game_ReadRegionInPlace (game, level, &rect, first_draw, &res))
+                res = Game_CopyRegion (game, level, &rect, first_draw);
+            if (res < 0)
+                goto fail;
         }
 
-        if (SCE_VWorld_UpdateCache (game->vw) < 0)
-            goto fail;
-        if (game->fcache.n_cached > game->fcache.max_cached)
-            printf ("n_cached = %d\n", game->fcache.n_cached);
-        SCE_FileCache_Update (&game->fcache);
-
         first_draw = SCE_TRUE;
 
-        j = SDL_GetTicks ();
+        j = Clock_GetTicks ();
         i = j - i;
 
-        SCE_VTerrain_Update (game->vt);
-
-        j = SDL_GetTicks () - j;
+        if (!game->config.headless)
+            SCE_VTerrain_Update (game->vt);
 
-        SCE_Scene_Update (game->scene, cam, NULL, 0);
-        SCE_Scene_Render (game->scene, cam, NULL, 0);
+        j = Clock_GetTicks () - j;
 
-#if 1
-        {
-            SCE_TVector3 center;
-        SCE_RLoadMatrix (SCE_MAT_OBJECT, sce_matrix4_id);
-        SCE_Scene_UseCamera (cam);
-        glDisable (GL_DEPTH_TEST);
-        glPointSize (3.0);
-        glBegin (GL_POINTS);
-        glColor3f (1.0, 0.0, 0.0);
-        SCE_Vector3_Copy (center, game->self.pos);
-        SCE_Vector3_Operator1 (center, /=, 2.0);
-        glVertex3fv (center);
-        glEnd ();
-        glColor3f (1.0, 1.0, 1.0);
-        glEnable (GL_DEPTH_TEST);
-        }
+#ifndef TL_NO_VIDEO
+        if (!game->config.headless)
+            Game_Render (game, cam);
 #endif
+        if (!game->first_frame_time) {
+            game->first_frame_time = Clock_GetTicks () - game->launch_time;
+            SCEE_SendMsg ("first frame after %u ms\n", game->first_frame_time);
+        }
 
+        verif (SCEE_HaveError ())
+        temps = Clock_GetTicks () - tm;
 
-        SDL_GL_SwapBuffers ();
+        /* give the time left to the idle tasks */
+        if (Clock_GetMicro () < frame_end) {
+            if (FSched_RunIdle (&game->sched, frame_end) < 0)
+                goto fail;
+        }
 
-        verif (SCEE_HaveError ())
-        temps = SDL_GetTicks () - tm;
-        wait = (1000.0/FPS) - temps;
+        wait = (1000.0/FPS) - (Clock_GetTicks () - tm);
         if (wait > 0)
-            SDL_Delay (wait);
+            Clock_Sleep (wait);
     }
     
+    NetThread_Stop (&game->net);
     NetClient_SendTCP (&game->self.client, TLP_DISCONNECT, NULL, 0);
     NetClient_Disconnect (&game->self.client);
 
+    if (game->config.headless)
+        Game_PrintStats (game);
     SCE_Camera_Delete (cam);
 
     return SCE_OK;
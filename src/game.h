@@ -22,14 +22,99 @@
 
 #include <SCE/interface/SCEInterface.h>
 #include <tunel/common/netclient.h>
+#include "dlwindow.h"
+#include "dlqueue.h"
+#include "querybatch.h"
+#include "netthread.h"
+#include "compress.h"
+#include "manifest.h"
+#include "regionfs.h"
+#include "diskcache.h"
+#include "cachebudget.h"
+#include "pcache.h"
+#include "availmap.h"
+#include "hterrain.h"
+#include "framesched.h"
 
 #define GAME_MAX_NICK_LENGTH 128
 #define GAME_MAX_WORLD_PATH_LENGTH 256
 #define GAME_IP_LENGTH 24
 
+/* packets of the batched requests, deltas and cancellations. they are not
+   in tunel/common's netprotocol.h yet, so they are numbered after its last
+   command here; keep in sync with the server and drop this block once
+   they land upstream */
+#ifndef TLP_QUERY_CHUNKS
+#define TLP_QUERY_CHUNKS (TLP_NUM_COMMANDS)
+#define TLP_CHUNK_DELTA (TLP_NUM_COMMANDS + 1)
+#define TLP_CANCEL_CHUNKS (TLP_NUM_COMMANDS + 2)
+#define GAME_NUM_COMMANDS (TLP_NUM_COMMANDS + 3)
+#else
+#define GAME_NUM_COMMANDS TLP_NUM_COMMANDS
+#endif
+
+/* capabilities advertised at TLP_CONNECT, the server replies with the ones
+   it accepts */
+#define GAME_CAP_LZ (1 << 0)     /* payloads compressed with COMP_LZ */
+#define GAME_CAP_VOXRLE (1 << 1) /* payloads compressed with COMP_VOXRLE */
+#define GAME_CAPS_COMPRESSION (GAME_CAP_LZ | GAME_CAP_VOXRLE)
+#define GAME_CAP_DELTA (1 << 2)  /* outdated chunks can be sent as deltas */
+#define GAME_CAP_FASTHASH (1 << 3) /* chunks are named by their xxHash */
+#define GAME_CAP_CANCEL (1 << 4) /* chunk requests can be cancelled */
+#define GAME_CAP_WORLDINFO (1 << 5) /* chunk size and number of LODs are
+                                       sent along TLP_CONNECT_ACCEPTED */
+#define GAME_CAP_BATCH (1 << 6)  /* chunks can be requested in batches */
+
+/* how much of what the prefetcher requested has been useful */
+typedef struct prefetchstats PrefetchStats;
+struct prefetchstats {
+    SCEulong requested;
+    SCEulong used;              /* entered the view afterwards */
+    SCEulong dropped;           /* left the prediction before being used */
+};
+
+/* time it takes to render full detail again after the grid of a level had
+   to be rebuilt from scratch (teleport, fast move) */
+typedef struct recoverystats RecoveryStats;
+struct recoverystats {
+    SCEulong n_rebuilds;        /* levels rebuilt */
+    SCEulong n_recoveries;
+    SCEuint start;              /* time of the first rebuild not recovered
+                                   from yet, 0 if none */
+    SCEuint last;               /* recovery times (ms) */
+    SCEuint max;
+    SCEulong total;
+};
+
 typedef struct gameconfig GameConfig;
 struct gameconfig {
     int screen_w, screen_h;
+    int batch_queries;          /* send chunk requests in TLP_QUERY_CHUNKS
+                                   when the server supports it */
+    int progressive;            /* start rendering before the download of
+                                   the terrain is complete */
+    int regions;                /* pack chunk files into region files */
+    SCEulong cache_budget;      /* disk space of the terrain caches of all
+                                   the servers (bytes), 0 for no limit */
+    SCEulong cache_memory;      /* memory of the node and file caches
+                                   (bytes) */
+    PCachePolicyType cache_policy; /* eviction policy of the file cache */
+    const char *cache_trace;    /* where to record the file accesses, NULL
+                                   not to */
+    SCEuint caps;               /* capabilities to advertise */
+    SCEuint bench_teleports;    /* number of teleports to time before
+                                   quitting, 0 to play normally */
+    int headless;               /* no window: no SDL, no OpenGL, the
+                                   terrain isn't rendered */
+    const char *script;         /* waypoints to follow in headless mode,
+                                   NULL to stay still */
+};
+
+typedef struct gamewaypoint GameWaypoint;
+struct gamewaypoint {
+    SCE_TVector3 pos;
+    SCEuint duration;           /* time to get there from the previous one
+                                   (ms) */
 };
 
 typedef struct gameclient GameClient;
@@ -47,8 +132,10 @@ struct game {
 
     /* network stuff and.. stuff. */
     int connected;
+    SCEuint caps;               /* capabilities accepted by the server */
     char server_ip[GAME_IP_LENGTH];
     GameClient self;
+    NetThread net;              /* receives packets while the game runs */
 
     /* rendering stuff */
     SCE_SVoxelTerrain *vt;
@@ -58,17 +145,71 @@ struct game {
     /* terrain stuff */
     SCE_SFileCache fcache;
     SCE_SFileSystem fsys;
+    CacheBudget caches;         /* sizes fcache and the cache of vw */
+    SCE_SFileSystem above_fs;   /* counting layers around fsys */
+    SCE_SFileSystem below_fs;
+    PCache files;               /* holds the files below fcache, which only
+                                   keeps a few */
+    SCE_SFileSystem files_fs;
+    RegionFS regions;
+    SCE_SFileSystem regionfs;
+    SCE_SFileSystem *chunk_fs;  /* where chunk files are written, NULL for
+                                   plain files */
+    SCEulong last_sync;         /* last commit of the regions
+                                   (Clock_GetMicro()) */
+    SCE_SList unsaved_trees;    /* received, not saved on disk yet */
+    DiskCache cache;            /* terrain caches of the servers */
+    Manifest manifest;          /* hashes of the chunk files */
+    AvailMap pending;           /* chunks (layer: level) and trees (layer:
+                                   n_lod) that are not available yet */
     /* path of the terrain folder */
     char world_path[GAME_MAX_WORLD_PATH_LENGTH];
     SCE_SVoxelWorld *vw;
     SCEuint chunk_size;
     SCEuint n_lod;
-    SCE_SList queued_chunks;    /* queued chunks for download */
+    DLQueue queued_chunks;      /* queued chunks for download */
     SCE_SList dl_chunks;        /* downloading chunks */
-    SCE_SList queued_trees;     /* queued trees for download */
+    SCE_SList cancelled_chunks; /* cancelled while downloading */
+    DLQueue queued_trees;       /* queued trees for download */
     SCE_SList dl_trees;         /* downloading trees */
+    SCE_TVector3 last_pos;      /* position at the previous frame */
+    SCE_TVector3 heading;       /* smoothed direction of movement */
+    SCE_TVector3 velocity;      /* smoothed velocity, voxels per ms */
+    SCEuint last_move;          /* time of the previous frame */
+    SCE_TVector3 prefetch_pos;  /* predicted position */
+    SCE_TVector3 sched_pos;     /* position and heading the download */
+    SCE_TVector3 sched_heading; /* priorities were computed for */
+    SCEulong n_cancelled;       /* number of cancelled chunk requests */
+    PrefetchStats prefetch_chunks;
+    PrefetchStats prefetch_trees;
+    SCEuint levels_ready;       /* bitmask of the rendered terrain levels */
+    SCEuint levels_check;       /* time of the last check of the levels */
+    SCE_SLongRect3 view_rect;   /* area whose terrain has been queried */
+    int view_dirty;             /* view_rect must be queried again */
+    SCEuint view_refresh;       /* time of the last full query */
+    RecoveryStats recovery;
+    HTerrain grids;             /* the terrain grids in headless mode */
+    GameWaypoint *script;       /* scripted movement, see Game_LoadScript() */
+    SCEuint n_waypoints;
+    SCEuint waypoint;           /* next waypoint */
+    SCEuint waypoint_start;     /* when we left the previous one */
+    SCE_TVector3 waypoint_from; /* where we left it from */
+    FrameSched sched;           /* per-frame work of Game_Launch() */
+
+    /* startup timers (ms) */
+    SCEuint launch_time;
+    SCEuint first_frame_time;   /* time to first frame, 0 if not yet */
+    SCEuint full_detail_time;   /* time to full detail, 0 if not yet */
     SCEulong view_distance;     /* view distance in voxels */
     SCEulong view_threshold;    /* bonus to view_distance */
+    DLWindow chunk_win;         /* congestion window of chunk requests */
+    DLWindow tree_win;          /* congestion window of tree requests */
+    QueryBatch query_batch;
+    unsigned char *zbuf;        /* decompressed payloads */
+    size_t zbuf_size;
+    unsigned char *region_buf;  /* updated regions of vw */
+    size_t region_buf_size;
+    CompStats comp_stats[COMP_NUM_CODECS];
 };
 
 void Game_InitConfig (GameConfig*);
@@ -85,6 +226,10 @@ Game* Game_New (void);
 void Game_Free (Game*);
 
 int Game_InitSubsystem (Game*);
+int Game_LoadScript (Game*, const char*);
 int Game_Launch (Game*);
 
+void Game_SetCacheMemory (Game*, SCEulong);
+void Game_GetCacheStats (const Game*, CacheStats*, CacheStats*);
+
 #endif /* guard */
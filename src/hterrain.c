@@ -0,0 +1,212 @@
+/*------------------------------------------------------------------------------
+    Tune Land - Sandbox RPG
+    Copyright (C) 2012-2013
+        Antony Martin <antony(dot)martin(at)scengine(dot)org>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ -----------------------------------------------------------------------------*/
+
+#include <string.h>
+#include "hterrain.h"
+
+void HTerrain_Init (HTerrain *ht)
+{
+    SCEuint i;
+
+    for (i = 0; i < HTERRAIN_MAX_LEVELS; i++) {
+        HTerrainLevel *l = &ht->levels[i];
+        l->grid.data = NULL;
+        l->origin[0] = l->origin[1] = l->origin[2] = 0;
+        l->wanted[0] = l->wanted[1] = l->wanted[2] = 0;
+    }
+    ht->n_levels = 0;
+    ht->dims[0] = ht->dims[1] = ht->dims[2] = 0;
+    ht->elem = 0;
+    ht->n_slices = 0;
+    ht->n_resets = 0;
+    ht->n_regions = 0;
+    ht->n_voxels = 0;
+}
+void HTerrain_Clear (HTerrain *ht)
+{
+    SCEuint i;
+    for (i = 0; i < HTERRAIN_MAX_LEVELS; i++)
+        SCE_free (ht->levels[i].grid.data);
+}
+
+void HTerrain_SetDimensions (HTerrain *ht, long w, long h, long d)
+{
+    ht->dims[0] = w;
+    ht->dims[1] = h;
+    ht->dims[2] = d;
+}
+/**
+ * \brief Sets the number of levels, at most HTERRAIN_MAX_LEVELS
+ */
+void HTerrain_SetNumLevels (HTerrain *ht, SCEuint n)
+{
+    ht->n_levels = n;
+}
+
+/**
+ * \brief Allocates the grids of the levels
+ * \param elem bytes per voxel
+ */
+int HTerrain_Build (HTerrain *ht, size_t elem)
+{
+    size_t size = ht->dims[0] * ht->dims[1] * ht->dims[2] * elem;
+    SCEuint i;
+
+    ht->elem = elem;
+    for (i = 0; i < ht->n_levels; i++) {
+        VCopyVolume *v = &ht->levels[i].grid;
+
+        if (!(v->data = SCE_malloc (size))) {
+            SCEE_LogSrc ();
+            return SCE_ERROR;
+        }
+        memset (v->data, 0, size);
+        v->dims[0] = ht->dims[0];
+        v->dims[1] = ht->dims[1];
+        v->dims[2] = ht->dims[2];
+        v->wrap[0] = v->wrap[1] = v->wrap[2] = 0;
+        v->elem = elem;
+    }
+    return SCE_OK;
+}
+
+/**
+ * \brief Sets the position of the viewer, in voxels of level 0
+ *
+ * The grids don't move until their missing slices are appended or they
+ * are updated at once.
+ * \sa HTerrain_GetMissingSlices(), HTerrain_UpdateGrid()
+ */
+void HTerrain_SetPosition (HTerrain *ht, long x, long y, long z)
+{
+    SCEuint i;
+
+    for (i = 0; i < ht->n_levels; i++) {
+        HTerrainLevel *l = &ht->levels[i];
+        l->wanted[0] = (x >> i) - ht->dims[0] / 2;
+        l->wanted[1] = (y >> i) - ht->dims[1] / 2;
+        l->wanted[2] = (z >> i) - ht->dims[2] / 2;
+    }
+}
+
+void HTerrain_GetOrigin (const HTerrain *ht, SCEuint level, long *x, long *y,
+                         long *z)
+{
+    const HTerrainLevel *l = &ht->levels[level];
+    *x = l->origin[0];
+    *y = l->origin[1];
+    *z = l->origin[2];
+}
+void HTerrain_GetRectangle (const HTerrain *ht, SCEuint level,
+                            SCE_SLongRect3 *r)
+{
+    const HTerrainLevel *l = &ht->levels[level];
+    SCE_Rectangle3_SetFromOriginl (r, l->origin[0], l->origin[1],
+                                   l->origin[2], ht->dims[0], ht->dims[1],
+                                   ht->dims[2]);
+}
+/**
+ * \brief Gets the number of slices a grid has to move along each axis to
+ * be centered on the viewer, negative values toward the negative side
+ */
+void HTerrain_GetMissingSlices (const HTerrain *ht, SCEuint level, long *x,
+                                long *y, long *z)
+{
+    const HTerrainLevel *l = &ht->levels[level];
+    *x = l->wanted[0] - l->origin[0];
+    *y = l->wanted[1] - l->origin[1];
+    *z = l->wanted[2] - l->origin[2];
+}
+
+/**
+ * \brief Moves the grid of a level where it should be at once, all of
+ * its content is to be written again
+ */
+void HTerrain_UpdateGrid (HTerrain *ht, SCEuint level)
+{
+    HTerrainLevel *l = &ht->levels[level];
+    int i;
+
+    for (i = 0; i < 3; i++) {
+        l->origin[i] = l->wanted[i];
+        l->grid.wrap[i] = 0;
+    }
+    ht->n_resets++;
+}
+
+/**
+ * \brief Moves the grid of a level by one slice
+ * \param f side the grid moves to
+ * \param slice the voxels entering the grid, x first
+ */
+void HTerrain_AppendSlice (HTerrain *ht, SCEuint level, SCE_EBoxFace f,
+                           const void *slice)
+{
+    HTerrainLevel *l = &ht->levels[level];
+    SCE_SIntRect3 r;
+    int axis, dir;
+
+    switch (f) {
+    case SCE_BOX_POSX: axis = 0; dir = 1; break;
+    case SCE_BOX_NEGX: axis = 0; dir = -1; break;
+    case SCE_BOX_POSY: axis = 1; dir = 1; break;
+    case SCE_BOX_NEGY: axis = 1; dir = -1; break;
+    case SCE_BOX_POSZ: axis = 2; dir = 1; break;
+    default: axis = 2; dir = -1;
+    }
+
+    /* the slice goes just outside the grid, in the coordinates of the
+       grid, which is where the slice leaving it was stored */
+    r.p1[0] = r.p1[1] = r.p1[2] = 0;
+    r.p2[0] = ht->dims[0];
+    r.p2[1] = ht->dims[1];
+    r.p2[2] = ht->dims[2];
+    r.p1[axis] = dir > 0 ? ht->dims[axis] : -1;
+    r.p2[axis] = r.p1[axis] + 1;
+    VCopy_ToVolume (&l->grid, &r, slice);
+
+    l->origin[axis] += dir;
+    l->grid.wrap[axis] += dir;
+    ht->n_slices++;
+}
+
+/**
+ * \brief Notifies that a region of the grid of a level has been written
+ * \param r the region, in the coordinates of the grid
+ */
+void HTerrain_UpdateSubGrid (HTerrain *ht, SCEuint level,
+                             const SCE_SIntRect3 *r)
+{
+    (void)level;
+    ht->n_regions++;
+    ht->n_voxels += (SCEulong)(r->p2[0] - r->p1[0]) * (r->p2[1] - r->p1[1]) *
+        (r->p2[2] - r->p1[2]);
+}
+
+VCopyVolume* HTerrain_GetLevelGrid (HTerrain *ht, SCEuint level)
+{
+    return &ht->levels[level].grid;
+}
+
+void HTerrain_PrintStats (FILE *fp, const HTerrain *ht)
+{
+    fprintf (fp, "grids: %u levels, %lu slices appended, %lu grids reset, "
+             "%lu regions updated (%lu kvoxels)\n", ht->n_levels,
+             ht->n_slices, ht->n_resets, ht->n_regions, ht->n_voxels / 1000);
+}
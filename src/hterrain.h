@@ -0,0 +1,76 @@
+/*------------------------------------------------------------------------------
+    Tune Land - Sandbox RPG
+    Copyright (C) 2012-2013
+        Antony Martin <antony(dot)martin(at)scengine(dot)org>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ -----------------------------------------------------------------------------*/
+
+#ifndef H_HTERRAIN
+#define H_HTERRAIN
+
+#include <stdio.h>
+#include <SCE/utils/SCEUtils.h>
+#include <SCE/interface/SCEInterface.h>
+#include "voxcopy.h"
+
+#define HTERRAIN_MAX_LEVELS 16
+
+typedef struct hterrainlevel HTerrainLevel;
+struct hterrainlevel {
+    VCopyVolume grid;           /* its wrapping follows the origin */
+    long origin[3];             /* position of the grid, in voxels of the
+                                   level */
+    long wanted[3];             /* origin centered on the viewer */
+};
+
+/* grids of the levels of the terrain, kept by the client when there is no
+   renderer (and no SCE_SVoxelTerrain) to keep them. they follow the viewer
+   the same way: slices are appended on the side it moves to and regions
+   are copied in as they get updated */
+typedef struct hterrain HTerrain;
+struct hterrain {
+    HTerrainLevel levels[HTERRAIN_MAX_LEVELS];
+    SCEuint n_levels;
+    long dims[3];
+    size_t elem;
+
+    /* statistics */
+    SCEulong n_slices;          /* slices appended */
+    SCEulong n_resets;          /* grids moved at once */
+    SCEulong n_regions;         /* updated regions */
+    SCEulong n_voxels;          /* voxels of the updated regions */
+};
+
+void HTerrain_Init (HTerrain*);
+void HTerrain_Clear (HTerrain*);
+
+void HTerrain_SetDimensions (HTerrain*, long, long, long);
+void HTerrain_SetNumLevels (HTerrain*, SCEuint);
+int HTerrain_Build (HTerrain*, size_t);
+
+void HTerrain_SetPosition (HTerrain*, long, long, long);
+void HTerrain_GetOrigin (const HTerrain*, SCEuint, long*, long*, long*);
+void HTerrain_GetRectangle (const HTerrain*, SCEuint, SCE_SLongRect3*);
+void HTerrain_GetMissingSlices (const HTerrain*, SCEuint, long*, long*,
+                                long*);
+
+void HTerrain_UpdateGrid (HTerrain*, SCEuint);
+void HTerrain_AppendSlice (HTerrain*, SCEuint, SCE_EBoxFace, const void*);
+void HTerrain_UpdateSubGrid (HTerrain*, SCEuint, const SCE_SIntRect3*);
+VCopyVolume* HTerrain_GetLevelGrid (HTerrain*, SCEuint);
+
+void HTerrain_PrintStats (FILE*, const HTerrain*);
+
+#endif /* guard */
@@ -22,7 +22,11 @@
 #include <tunel/common/netclient.h>
 #include <tunel/common/netprotocol.h>
 #include "game.h"
+#include "voxcopy.h"
+#include "clock.h"
+#ifndef TL_NO_VIDEO
 #include <SDL.h>
+#endif
 
 #define PORT 13338
 
@@ -64,17 +68,148 @@ int main (int argc, char **argv)
 
 #else
 
+/* tlclient --bench-compression <chunk files...> */
+static int bench_compression (int argc, char **argv)
+{
+    int i;
+
+    for (i = 0; i < argc; i++) {
+        FILE *fp = NULL;
+        long size;
+        void *data = NULL;
+
+        if (!(fp = fopen (argv[i], "rb"))) {
+            perror (argv[i]);
+            return EXIT_FAILURE;
+        }
+        fseek (fp, 0, SEEK_END);
+        size = ftell (fp);
+        rewind (fp);
+        if (!(data = SCE_malloc (size + 1)) ||
+            fread (data, 1, size, fp) != (size_t)size) {
+            fclose (fp);
+            SCE_free (data);
+            return EXIT_FAILURE;
+        }
+        fclose (fp);
+
+        printf ("%s:\n", argv[i]);
+        if (Comp_Benchmark (stdout, data, size) < 0) {
+            SCEE_Out ();
+            SCE_free (data);
+            return EXIT_FAILURE;
+        }
+        SCE_free (data);
+    }
+    return EXIT_SUCCESS;
+}
+
+/* tlclient --migrate-regions <world directory> */
+static int migrate_regions (const char *root)
+{
+    RegionFS rfs;
+    long n;
+
+    RegionFS_Init (&rfs);
+    n = RegionFS_Migrate (&rfs, root);
+    RegionFS_PrintStats (stdout, &rfs);
+    RegionFS_Clear (&rfs);
+    if (n < 0) {
+        SCEE_Out ();
+        return EXIT_FAILURE;
+    }
+    printf ("%ld files moved into regions\n", n);
+    return EXIT_SUCCESS;
+}
+
+/* tlclient --replay-cache <trace> [capacity in kB] */
+static int replay_cache (const char *fname, const char *capacity)
+{
+    FILE *fp = NULL;
+    size_t bytes = 32UL << 20;
+    int res;
+
+    if (capacity)
+        bytes = strtoul (capacity, NULL, 10) * 1024;
+    if (!(fp = fopen (fname, "r"))) {
+        perror (fname);
+        return EXIT_FAILURE;
+    }
+    res = PCache_Replay (stdout, fp, bytes);
+    fclose (fp);
+    if (res < 0) {
+        SCEE_Out ();
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+/* tlclient --bench-copy [layouts] */
+static int bench_copy (const char *what)
+{
+    int res;
+
+    VCopy_Init ();
+    printf ("copy kernels: %s\n", VCopy_GetName (VCopy_GetISA ()));
+    if (what && !strcmp (what, "layouts"))
+        res = VCopy_BenchmarkLayouts (stdout, SCE_VOCTREE_VOXEL_ELEMENTS);
+    else
+        res = VCopy_Benchmark (stdout, SCE_VOCTREE_VOXEL_ELEMENTS);
+    if (res < 0) {
+        SCEE_Out ();
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
 int main (int argc, char **argv)
 {
     GameConfig config;
     Game *game = NULL;
 
     SCE_Init_Core (stderr, 0);
+
+    if (argv[1] && !strcmp (argv[1], "--bench-compression")) {
+        int res = bench_compression (argc - 2, &argv[2]);
+        SCE_Quit_Core ();
+        return res;
+    }
+    if (argv[1] && !strcmp (argv[1], "--migrate-regions") && argv[2]) {
+        int res = migrate_regions (argv[2]);
+        SCE_Quit_Core ();
+        return res;
+    }
+    if (argv[1] && !strcmp (argv[1], "--bench-copy")) {
+        int res = bench_copy (argv[2]);
+        SCE_Quit_Core ();
+        return res;
+    }
+    if (argv[1] && !strcmp (argv[1], "--replay-cache") && argv[2]) {
+        int res = replay_cache (argv[2], argv[3]);
+        SCE_Quit_Core ();
+        return res;
+    }
+
     Init_Game ();
 
     if (!(game = Game_New ()))
         goto fail;
 
+    /* tlclient [--headless <script|->] [--bench-teleport <n>]
+       [nick [server]] */
+    for (;;) {
+        if (argv[1] && !strcmp (argv[1], "--bench-teleport") && argv[2]) {
+            game->config.bench_teleports = strtoul (argv[2], NULL, 10);
+            argv += 2;
+        } else if (argv[1] && !strcmp (argv[1], "--headless") && argv[2]) {
+            game->config.headless = SCE_TRUE;
+            if (strcmp (argv[2], "-"))
+                game->config.script = argv[2];
+            argv += 2;
+        } else
+            break;
+    }
+
     Game_InitSubsystem (game);
     Game_InitConfig (&config);
 
@@ -87,7 +222,7 @@ int main (int argc, char **argv)
             sprintf (game->server_ip, "%s:%d", argv[2], PORT);
     }
 
-    SDL_Delay (100);
+    Clock_Sleep (100);
     if (Game_Launch (game) < 0)
         goto fail;
     Game_Free (game);
@@ -0,0 +1,591 @@
+/*------------------------------------------------------------------------------
+    Tune Land - Sandbox RPG
+    Copyright (C) 2012-2013
+        Antony Martin <antony(dot)martin(at)scengine(dot)org>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ -----------------------------------------------------------------------------*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "clock.h"
+#include "manifest.h"
+
+#define MANIFEST_MAGIC "TLMF"
+#define MANIFEST_VERSION 2
+#define MANIFEST_MIN_CAPACITY 4096
+#define MANIFEST_FASTHASH_SIZE 8
+
+#define MANIFEST_FREE 0
+#define MANIFEST_REMOVED (-1)
+
+/* 64 bits xxHash, seed 0 */
+
+#define XXH_P1 11400714785074694791ULL
+#define XXH_P2 14029467366897019727ULL
+#define XXH_P3 1609587929392839161ULL
+#define XXH_P4 9650029242287828579ULL
+#define XXH_P5 2870177450012600261ULL
+
+static uint64_t XXH_Rotl (uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+static uint64_t XXH_Read64 (const unsigned char *p)
+{
+    uint64_t v;
+    memcpy (&v, p, 8);
+    return v;
+}
+static uint32_t XXH_Read32 (const unsigned char *p)
+{
+    uint32_t v;
+    memcpy (&v, p, 4);
+    return v;
+}
+static uint64_t XXH_Round (uint64_t acc, uint64_t input)
+{
+    acc += input * XXH_P2;
+    acc = XXH_Rotl (acc, 31);
+    return acc * XXH_P1;
+}
+static uint64_t XXH_Merge (uint64_t acc, uint64_t val)
+{
+    acc ^= XXH_Round (0, val);
+    return acc * XXH_P1 + XXH_P4;
+}
+
+static uint64_t XXH_64 (const unsigned char *p, size_t len)
+{
+    const unsigned char *end = &p[len];
+    uint64_t h;
+
+    if (len >= 32) {
+        const unsigned char *limit = end - 32;
+        uint64_t v1 = XXH_P1 + XXH_P2, v2 = XXH_P2, v3 = 0, v4 = -XXH_P1;
+        do {
+            v1 = XXH_Round (v1, XXH_Read64 (p)); p += 8;
+            v2 = XXH_Round (v2, XXH_Read64 (p)); p += 8;
+            v3 = XXH_Round (v3, XXH_Read64 (p)); p += 8;
+            v4 = XXH_Round (v4, XXH_Read64 (p)); p += 8;
+        } while (p <= limit);
+        h = XXH_Rotl (v1, 1) + XXH_Rotl (v2, 7) + XXH_Rotl (v3, 12) +
+            XXH_Rotl (v4, 18);
+        h = XXH_Merge (h, v1);
+        h = XXH_Merge (h, v2);
+        h = XXH_Merge (h, v3);
+        h = XXH_Merge (h, v4);
+    } else
+        h = XXH_P5;
+
+    h += len;
+    while (p + 8 <= end) {
+        h ^= XXH_Round (0, XXH_Read64 (p));
+        h = XXH_Rotl (h, 27) * XXH_P1 + XXH_P4;
+        p += 8;
+    }
+    if (p + 4 <= end) {
+        h ^= (uint64_t)XXH_Read32 (p) * XXH_P1;
+        h = XXH_Rotl (h, 23) * XXH_P2 + XXH_P3;
+        p += 4;
+    }
+    while (p < end) {
+        h ^= *p++ * XXH_P5;
+        h = XXH_Rotl (h, 11) * XXH_P1;
+    }
+
+    h ^= h >> 33;
+    h *= XXH_P2;
+    h ^= h >> 29;
+    h *= XXH_P3;
+    h ^= h >> 32;
+    return h;
+}
+
+
+void Manifest_Init (Manifest *m)
+{
+    m->fd = -1;
+    m->header = NULL;
+    m->records = NULL;
+    m->map_size = 0;
+    m->hash_type = MANIFEST_SHA1;
+    m->fs = NULL;
+    m->stat = NULL;
+    m->stat_data = NULL;
+}
+void Manifest_Clear (Manifest *m)
+{
+    Manifest_Close (m);
+}
+
+static size_t Manifest_GetMapSize (SCEuint capacity)
+{
+    return sizeof (ManifestHeader) + capacity * sizeof (ManifestRecord);
+}
+
+static int Manifest_Map (Manifest *m, SCEuint capacity)
+{
+    size_t size = Manifest_GetMapSize (capacity);
+    void *map = NULL;
+
+    if (ftruncate (m->fd, size) < 0)
+        goto fail;
+    map = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, m->fd, 0);
+    if (map == MAP_FAILED)
+        goto fail;
+    m->header = map;
+    m->records = (ManifestRecord*)&m->header[1];
+    m->map_size = size;
+    return SCE_OK;
+fail:
+    SCEE_LogErrno ("cannot map the manifest");
+    return SCE_ERROR;
+}
+static void Manifest_Unmap (Manifest *m)
+{
+    if (m->header) {
+        munmap (m->header, m->map_size);
+        m->header = NULL;
+        m->records = NULL;
+        m->map_size = 0;
+    }
+}
+
+static void Manifest_Reset (Manifest *m, SCEuint capacity)
+{
+    memset (m->header, 0, m->map_size);
+    memcpy (m->header->magic, MANIFEST_MAGIC, 4);
+    m->header->version = MANIFEST_VERSION;
+    m->header->hash_type = m->hash_type;
+    m->header->capacity = capacity;
+}
+
+/**
+ * \brief Opens a manifest, creating it if needed
+ * \param fname manifest file
+ * \param type hash function, if the manifest was made with another one it
+ * is emptied
+ */
+int Manifest_Open (Manifest *m, const char *fname, ManifestHash type)
+{
+    struct stat st;
+    SCEuint capacity = MANIFEST_MIN_CAPACITY;
+    int valid = SCE_FALSE;
+
+    Manifest_Close (m);
+    m->hash_type = type;
+
+    if ((m->fd = open (fname, O_RDWR | O_CREAT, 0644)) < 0)
+        goto fail;
+    if (fstat (m->fd, &st) < 0)
+        goto fail;
+
+    if (st.st_size >= (off_t)sizeof (ManifestHeader)) {
+        ManifestHeader h;
+        if (pread (m->fd, &h, sizeof h, 0) == sizeof h &&
+            !memcmp (h.magic, MANIFEST_MAGIC, 4) &&
+            h.version == MANIFEST_VERSION && h.hash_type == type &&
+            h.capacity >= MANIFEST_MIN_CAPACITY &&
+            !(h.capacity & (h.capacity - 1)) &&
+            st.st_size == (off_t)Manifest_GetMapSize (h.capacity)) {
+            capacity = h.capacity;
+            valid = SCE_TRUE;
+        }
+    }
+
+    if (Manifest_Map (m, capacity) < 0) {
+        SCEE_LogSrc ();
+        Manifest_Close (m);
+        return SCE_ERROR;
+    }
+    if (!valid)
+        Manifest_Reset (m, capacity);
+    return SCE_OK;
+fail:
+    SCEE_LogErrno (fname);
+    Manifest_Close (m);
+    return SCE_ERROR;
+}
+void Manifest_Close (Manifest *m)
+{
+    Manifest_Unmap (m);
+    if (m->fd >= 0) {
+        close (m->fd);
+        m->fd = -1;
+    }
+}
+int Manifest_IsOpen (const Manifest *m)
+{
+    return m->header != NULL;
+}
+
+/**
+ * \brief Sets where the chunk files are read from
+ * \param fs file system of the chunk files, NULL for the default one
+ * \param f function giving the size and modification time of a chunk file,
+ * NULL to use stat(2)
+ */
+void Manifest_SetFileSystem (Manifest *m, SCE_SFileSystem *fs,
+                             ManifestStatFunc f, void *udata)
+{
+    m->fs = fs;
+    m->stat = f;
+    m->stat_data = udata;
+}
+
+size_t Manifest_GetHashSize (ManifestHash type)
+{
+    return type == MANIFEST_SHA1 ? SCE_SHA1_SIZE : MANIFEST_FASTHASH_SIZE;
+}
+
+/**
+ * \brief Hashes some data
+ * \param hash output, Manifest_GetHashSize() bytes
+ */
+void Manifest_Hash (ManifestHash type, const void *data, size_t size,
+                    unsigned char *hash)
+{
+    if (type == MANIFEST_SHA1)
+        SCE_Sha1_Sum (hash, data, size);
+    else {
+        uint64_t h = XXH_64 (data, size);
+        int i;
+        for (i = 0; i < MANIFEST_FASTHASH_SIZE; i++)
+            hash[i] = h >> (56 - 8 * i);
+    }
+}
+
+/**
+ * \brief Hashes a file
+ * \param fs file system of the file, NULL for the default one
+ * \returns SCE_ERROR with SCE_FILE_NOT_FOUND if the file doesn't exist
+ */
+int Manifest_HashFile (ManifestHash type, SCE_SFileSystem *fs,
+                       const char *fname, unsigned char *hash, size_t *size)
+{
+    SCE_SFile fp;
+    unsigned char *data = NULL;
+    long len;
+
+    SCE_File_Init (&fp);
+    if (SCE_File_Open (&fp, fs, fname, SCE_FILE_READ) < 0) {
+        SCEE_Clear ();
+        SCEE_Log (SCE_FILE_NOT_FOUND);
+        SCEE_LogMsg ("cannot open %s", fname);
+        return SCE_ERROR;
+    }
+    if ((len = SCE_File_Length (&fp)) < 0)
+        goto fail;
+    if (!(data = SCE_malloc (len + 1)))
+        goto fail;
+    if (SCE_File_Read (data, 1, len, &fp) != (size_t)len)
+        goto fail;
+    SCE_File_Close (&fp);
+
+    Manifest_Hash (type, data, len, hash);
+    *size = len;
+    SCE_free (data);
+    return SCE_OK;
+fail:
+    SCEE_LogErrno (fname);
+    SCE_free (data);
+    SCE_File_Close (&fp);
+    return SCE_ERROR;
+}
+
+
+static SCEuint Manifest_HashKey (SCEuint level, long x, long y, long z)
+{
+    uint32_t h = level * 0x9e3779b1U;
+    h ^= (uint32_t)x * 0x85ebca6bU;
+    h = (h << 13) | (h >> 19);
+    h ^= (uint32_t)y * 0xc2b2ae35U;
+    h = (h << 13) | (h >> 19);
+    h ^= (uint32_t)z * 0x27d4eb2fU;
+    h ^= h >> 16;
+    return h;
+}
+
+static int Manifest_IsKey (const ManifestRecord *r, SCEuint level, long x,
+                           long y, long z)
+{
+    return r->level == (int32_t)level + 1 && r->x == x && r->y == y &&
+        r->z == z;
+}
+
+/* finds the record of a node, or the slot where it should be inserted */
+static ManifestRecord* Manifest_Find (const Manifest *m, SCEuint level, long x,
+                                      long y, long z, int *found)
+{
+    SCEuint mask = m->header->capacity - 1;
+    SCEuint i = Manifest_HashKey (level, x, y, z) & mask;
+    ManifestRecord *slot = NULL;
+
+    for (;; i = (i + 1) & mask) {
+        ManifestRecord *r = &m->records[i];
+        if (r->level == MANIFEST_FREE) {
+            *found = SCE_FALSE;
+            return slot ? slot : r;
+        } else if (r->level == MANIFEST_REMOVED) {
+            if (!slot)
+                slot = r;
+        } else if (Manifest_IsKey (r, level, x, y, z)) {
+            *found = SCE_TRUE;
+            return r;
+        }
+    }
+}
+
+static int Manifest_Grow (Manifest *m)
+{
+    ManifestRecord *old = NULL;
+    SCEuint capacity = m->header->capacity, i;
+    SCEuint new_capacity = capacity;
+
+    /* only grow if tombstones are not the problem */
+    if (m->header->n_records * 2 > capacity)
+        new_capacity *= 2;
+
+    if (!(old = SCE_malloc (capacity * sizeof *old)))
+        goto fail;
+    memcpy (old, m->records, capacity * sizeof *old);
+
+    Manifest_Unmap (m);
+    if (Manifest_Map (m, new_capacity) < 0)
+        goto fail;
+    Manifest_Reset (m, new_capacity);
+
+    for (i = 0; i < capacity; i++) {
+        if (old[i].level > 0) {
+            int found;
+            ManifestRecord *r = Manifest_Find (m, old[i].level - 1, old[i].x,
+                                               old[i].y, old[i].z, &found);
+            *r = old[i];
+            m->header->n_records++;
+            m->header->n_used++;
+        }
+    }
+    SCE_free (old);
+    return SCE_OK;
+fail:
+    SCE_free (old);
+    SCEE_LogSrc ();
+    return SCE_ERROR;
+}
+
+/**
+ * \brief Gets the hash and size of a chunk
+ * \returns SCE_TRUE if the chunk is known, SCE_FALSE otherwise
+ */
+int Manifest_Lookup (const Manifest *m, SCEuint level, long x, long y, long z,
+                     unsigned char *hash, size_t *size, int64_t *mtime)
+{
+    ManifestRecord *r = NULL;
+    int found;
+
+    if (!m->header)
+        return SCE_FALSE;
+    r = Manifest_Find (m, level, x, y, z, &found);
+    if (!found)
+        return SCE_FALSE;
+    memcpy (hash, r->hash, Manifest_GetHashSize (m->hash_type));
+    if (size)
+        *size = r->size;
+    if (mtime)
+        *mtime = r->mtime;
+    return SCE_TRUE;
+}
+
+int Manifest_Set (Manifest *m, SCEuint level, long x, long y, long z,
+                  const unsigned char *hash, size_t size, int64_t mtime)
+{
+    ManifestRecord *r = NULL;
+    int found;
+
+    if (!m->header)
+        return SCE_OK;
+
+    /* keep the table at most 70% full */
+    if ((m->header->n_used + 1) * 10 > m->header->capacity * 7 &&
+        Manifest_Grow (m) < 0) {
+        SCEE_LogSrc ();
+        return SCE_ERROR;
+    }
+
+    r = Manifest_Find (m, level, x, y, z, &found);
+    if (!found) {
+        if (r->level == MANIFEST_FREE)
+            m->header->n_used++;
+        m->header->n_records++;
+        r->level = level + 1;
+        r->x = x;
+        r->y = y;
+        r->z = z;
+    }
+    r->size = size;
+    r->mtime = mtime;
+    memcpy (r->hash, hash, Manifest_GetHashSize (m->hash_type));
+    return SCE_OK;
+}
+
+static int Manifest_Stat (const Manifest *m, const char *fname,
+                         size_t *size, int64_t *mtime)
+{
+    struct stat st;
+
+    if (m->stat)
+        return m->stat (m->stat_data, fname, size, mtime);
+    if (stat (fname, &st) < 0) {
+        if (errno == ENOENT)
+            return SCE_FALSE;
+        SCEE_LogErrno (fname);
+        return SCE_ERROR;
+    }
+    *size = st.st_size;
+    *mtime = Clock_GetMTime (&st);
+    return SCE_TRUE;
+}
+
+static int Manifest_GetMTime (const Manifest *m, const char *fname,
+                              int64_t *mtime)
+{
+    size_t size;
+    int found = Manifest_Stat (m, fname, &size, mtime);
+
+    if (found == SCE_FALSE) {
+        SCEE_Log (SCE_FILE_NOT_FOUND);
+        SCEE_LogMsg ("%s not found", fname);
+    }
+    return found == SCE_TRUE ? SCE_OK : SCE_ERROR;
+}
+
+/**
+ * \brief Records the content of a chunk file that has just been written
+ * \param fname the chunk file
+ * \param data what has been written in it
+ */
+int Manifest_Update (Manifest *m, SCEuint level, long x, long y, long z,
+                     const char *fname, const void *data, size_t size)
+{
+    unsigned char hash[MANIFEST_MAX_HASH_SIZE];
+    int64_t mtime;
+
+    if (!m->header)
+        return SCE_OK;
+    if (Manifest_GetMTime (m, fname, &mtime) < 0) {
+        SCEE_LogSrc ();
+        return SCE_ERROR;
+    }
+    Manifest_Hash (m->hash_type, data, size, hash);
+    return Manifest_Set (m, level, x, y, z, hash, size, mtime);
+}
+/**
+ * \brief Records the content of a chunk file, removes its record if the
+ * file doesn't exist
+ */
+int Manifest_UpdateFile (Manifest *m, SCEuint level, long x, long y, long z,
+                         const char *fname)
+{
+    unsigned char hash[MANIFEST_MAX_HASH_SIZE];
+    size_t size;
+    int64_t mtime;
+
+    if (!m->header)
+        return SCE_OK;
+    if (Manifest_GetMTime (m, fname, &mtime) < 0 ||
+        Manifest_HashFile (m->hash_type, m->fs, fname, hash, &size) < 0) {
+        if (SCEE_GetCode () != SCE_FILE_NOT_FOUND) {
+            SCEE_LogSrc ();
+            return SCE_ERROR;
+        }
+        SCEE_Clear ();
+        Manifest_Remove (m, level, x, y, z);
+        return SCE_OK;
+    }
+    return Manifest_Set (m, level, x, y, z, hash, size, mtime);
+}
+
+/**
+ * \brief Gets the hash of a chunk file
+ *
+ * The file is only read if it has been modified since it was recorded.
+ * \returns SCE_TRUE if the file exists, SCE_FALSE if it doesn't, SCE_ERROR
+ * on error
+ */
+int Manifest_GetHash (Manifest *m, SCEuint level, long x, long y, long z,
+                      const char *fname, unsigned char *hash)
+{
+    size_t size, file_size;
+    int64_t mtime, file_mtime;
+    int found;
+
+    if ((found = Manifest_Stat (m, fname, &file_size, &file_mtime)) < 0) {
+        SCEE_LogSrc ();
+        return SCE_ERROR;
+    } else if (!found) {
+        Manifest_Remove (m, level, x, y, z);
+        return SCE_FALSE;
+    }
+
+    if (Manifest_Lookup (m, level, x, y, z, hash, &size, &mtime) &&
+        size == file_size && mtime == file_mtime)
+        return SCE_TRUE;
+
+    if (Manifest_HashFile (m->hash_type, m->fs, fname, hash, &size) < 0) {
+        if (SCEE_GetCode () != SCE_FILE_NOT_FOUND) {
+            SCEE_LogSrc ();
+            return SCE_ERROR;
+        }
+        SCEE_Clear ();
+        Manifest_Remove (m, level, x, y, z);
+        return SCE_FALSE;
+    }
+    if (Manifest_Set (m, level, x, y, z, hash, size, file_mtime) < 0) {
+        SCEE_LogSrc ();
+        return SCE_ERROR;
+    }
+    return SCE_TRUE;
+}
+
+void Manifest_Remove (Manifest *m, SCEuint level, long x, long y, long z)
+{
+    ManifestRecord *r = NULL;
+    int found;
+
+    if (!m->header)
+        return;
+    r = Manifest_Find (m, level, x, y, z, &found);
+    if (found) {
+        r->level = MANIFEST_REMOVED;
+        m->header->n_records--;
+    }
+}
+
+SCEuint Manifest_GetNumRecords (const Manifest *m)
+{
+    return m->header ? m->header->n_records : 0;
+}
+
+/**
+ * \brief Schedules the writing of the manifest on disk
+ */
+void Manifest_Sync (Manifest *m)
+{
+    if (m->header)
+        msync (m->header, m->map_size, MS_ASYNC);
+}
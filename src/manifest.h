@@ -0,0 +1,102 @@
+/*------------------------------------------------------------------------------
+    Tune Land - Sandbox RPG
+    Copyright (C) 2012-2013
+        Antony Martin <antony(dot)martin(at)scengine(dot)org>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ -----------------------------------------------------------------------------*/
+
+#ifndef H_MANIFEST
+#define H_MANIFEST
+
+#include <stdint.h>
+#include <SCE/utils/SCEUtils.h>
+
+#define MANIFEST_MAX_HASH_SIZE 20
+
+typedef enum {
+    MANIFEST_SHA1,
+    MANIFEST_FASTHASH           /* 64 bits xxHash */
+} ManifestHash;
+
+/* one fixed-size record per node, stored in an open addressing hash table */
+typedef struct manifestrecord ManifestRecord;
+struct manifestrecord {
+    int64_t mtime;              /* modification time of the file (ns) */
+    int32_t level;              /* level + 1, 0 if the slot is free, -1 if
+                                   the record has been removed */
+    int32_t x, y, z;
+    uint32_t size;
+    unsigned char hash[MANIFEST_MAX_HASH_SIZE];
+};
+
+typedef struct manifestheader ManifestHeader;
+struct manifestheader {
+    char magic[4];
+    uint32_t version;
+    uint32_t hash_type;
+    uint32_t capacity;          /* number of records, power of two */
+    uint32_t n_records;
+    uint32_t n_used;            /* records and tombstones */
+};
+
+/* gets the size and modification time of a file, returns SCE_TRUE if it
+   exists, SCE_FALSE if it doesn't and SCE_ERROR on error */
+typedef int (*ManifestStatFunc)(void*, const char*, size_t*, int64_t*);
+
+/* hash, size and modification time of the chunk files, kept in a
+   memory-mapped file so that we don't have to read every chunk again to
+   tell the server which version we have */
+typedef struct manifest Manifest;
+struct manifest {
+    int fd;
+    ManifestHeader *header;
+    ManifestRecord *records;
+    size_t map_size;
+    ManifestHash hash_type;
+    SCE_SFileSystem *fs;        /* file system of the chunk files */
+    ManifestStatFunc stat;
+    void *stat_data;
+};
+
+void Manifest_Init (Manifest*);
+void Manifest_Clear (Manifest*);
+
+int Manifest_Open (Manifest*, const char*, ManifestHash);
+void Manifest_Close (Manifest*);
+int Manifest_IsOpen (const Manifest*);
+
+void Manifest_SetFileSystem (Manifest*, SCE_SFileSystem*, ManifestStatFunc,
+                             void*);
+
+size_t Manifest_GetHashSize (ManifestHash);
+void Manifest_Hash (ManifestHash, const void*, size_t, unsigned char*);
+int Manifest_HashFile (ManifestHash, SCE_SFileSystem*, const char*,
+                       unsigned char*, size_t*);
+
+int Manifest_Lookup (const Manifest*, SCEuint, long, long, long,
+                     unsigned char*, size_t*, int64_t*);
+int Manifest_Set (Manifest*, SCEuint, long, long, long,
+                  const unsigned char*, size_t, int64_t);
+int Manifest_Update (Manifest*, SCEuint, long, long, long, const char*,
+                     const void*, size_t);
+int Manifest_UpdateFile (Manifest*, SCEuint, long, long, long, const char*);
+int Manifest_GetHash (Manifest*, SCEuint, long, long, long, const char*,
+                      unsigned char*);
+void Manifest_Remove (Manifest*, SCEuint, long, long, long);
+
+SCEuint Manifest_GetNumRecords (const Manifest*);
+void Manifest_Sync (Manifest*);
+
+#endif /* guard */
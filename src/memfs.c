@@ -0,0 +1,133 @@
+/*------------------------------------------------------------------------------
+    Tune Land - Sandbox RPG
+    Copyright (C) 2012-2013
+        Antony Martin <antony(dot)martin(at)scengine(dot)org>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ -----------------------------------------------------------------------------*/
+
+#include "memfs.h"
+
+static void* MemFS_xopen (SCE_SFileSystem *fs, const char *fname, int flags)
+{
+    MemFile *mf = fs->udata;
+    (void)fname;
+    if (flags & (SCE_FILE_WRITE | SCE_FILE_CREATE | SCE_FILE_APPEND)) {
+        SCEE_Log (SCE_INVALID_ARG);
+        SCEE_LogMsg ("memory files are read-only");
+        return NULL;
+    }
+    mf->pos = 0;
+    return mf;
+}
+static int MemFS_xclose (SCE_SFileSystem *fs, void *fd)
+{
+    (void)fs; (void)fd;
+    return 0;
+}
+static size_t MemFS_xread (void *data, size_t size, size_t nmemb, void *fd)
+{
+    MemFile *mf = fd;
+    size_t n;
+
+    if (size == 0)
+        return 0;
+    n = (mf->size - mf->pos) / size;
+    if (n > nmemb)
+        n = nmemb;
+    memcpy (data, &mf->data[mf->pos], n * size);
+    mf->pos += n * size;
+    return n;
+}
+static size_t MemFS_xwrite (const void *data, size_t size, size_t nmemb,
+                            void *fd)
+{
+    (void)data; (void)size; (void)nmemb; (void)fd;
+    return 0;
+}
+static int MemFS_xseek (void *fd, long offset, int whence)
+{
+    MemFile *mf = fd;
+    long pos;
+
+    switch (whence) {
+    case SEEK_SET: pos = offset; break;
+    case SEEK_CUR: pos = mf->pos + offset; break;
+    case SEEK_END: pos = mf->size + offset; break;
+    default: return -1;
+    }
+    if (pos < 0 || (size_t)pos > mf->size)
+        return -1;
+    mf->pos = pos;
+    return 0;
+}
+static long MemFS_xtell (void *fd)
+{
+    return ((MemFile*)fd)->pos;
+}
+static void MemFS_xrewind (void *fd)
+{
+    ((MemFile*)fd)->pos = 0;
+}
+static int MemFS_xflush (void *fd)
+{
+    (void)fd;
+    return 0;
+}
+static long MemFS_xlength (void *fd)
+{
+    return ((MemFile*)fd)->size;
+}
+
+/**
+ * \brief Sets up a file system whose only file is the given buffer
+ * \param fs file system to setup
+ * \param mf storage for the file state, must outlive \p fs
+ * \param data buffer, not copied
+ * \param size size of \p data
+ */
+void MemFS_Init (SCE_SFileSystem *fs, MemFile *mf, const void *data,
+                 size_t size)
+{
+    mf->data = data;
+    mf->size = size;
+    mf->pos = 0;
+
+    fs->xopen = MemFS_xopen;
+    fs->xclose = MemFS_xclose;
+    fs->xread = MemFS_xread;
+    fs->xwrite = MemFS_xwrite;
+    fs->xseek = MemFS_xseek;
+    fs->xtell = MemFS_xtell;
+    fs->xrewind = MemFS_xrewind;
+    fs->xflush = MemFS_xflush;
+    fs->xlength = MemFS_xlength;
+    fs->udata = mf;
+    fs->subfs = NULL;
+}
+
+/**
+ * \brief Shortcut for MemFS_Init() and SCE_File_Open()
+ */
+int MemFS_Open (SCE_SFile *fp, SCE_SFileSystem *fs, MemFile *mf,
+                const void *data, size_t size)
+{
+    MemFS_Init (fs, mf, data, size);
+    SCE_File_Init (fp);
+    if (SCE_File_Open (fp, fs, "memfile", SCE_FILE_READ) < 0) {
+        SCEE_LogSrc ();
+        return SCE_ERROR;
+    }
+    return SCE_OK;
+}
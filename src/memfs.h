@@ -0,0 +1,37 @@
+/*------------------------------------------------------------------------------
+    Tune Land - Sandbox RPG
+    Copyright (C) 2012-2013
+        Antony Martin <antony(dot)martin(at)scengine(dot)org>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ -----------------------------------------------------------------------------*/
+
+#ifndef H_MEMFS
+#define H_MEMFS
+
+#include <SCE/utils/SCEUtils.h>
+
+/* read-only file system exposing an existing buffer as a single file, so that
+   the SCE_*_LoadFile() functions can parse data without copying it first */
+typedef struct memfile MemFile;
+struct memfile {
+    const unsigned char *data;
+    size_t size;
+    size_t pos;
+};
+
+void MemFS_Init (SCE_SFileSystem*, MemFile*, const void*, size_t);
+int MemFS_Open (SCE_SFile*, SCE_SFileSystem*, MemFile*, const void*, size_t);
+
+#endif /* guard */
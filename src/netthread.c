@@ -0,0 +1,194 @@
+/*------------------------------------------------------------------------------
+    Tune Land - Sandbox RPG
+    Copyright (C) 2012-2013
+        Antony Martin <antony(dot)martin(at)scengine(dot)org>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ -----------------------------------------------------------------------------*/
+
+#include <unistd.h>
+#include "netthread.h"
+
+/* how long the thread waits for data before checking whether it has been
+   asked to stop (microseconds) */
+#define NETTHREAD_TIMEOUT 20000
+/* producer back-off when the queue is full (microseconds) */
+#define NETTHREAD_STALL_DELAY 1000
+
+#define NETTHREAD_MASK (NETTHREAD_QUEUE_SIZE - 1)
+
+#define load_acquire(p) __atomic_load_n (p, __ATOMIC_ACQUIRE)
+#define store_release(p, v) __atomic_store_n (p, v, __ATOMIC_RELEASE)
+
+
+void NetThread_Init (NetThread *nt)
+{
+    nt->client = NULL;
+    nt->running = SCE_FALSE;
+    nt->failed = SCE_FALSE;
+    memset (nt->queue, 0, sizeof nt->queue);
+    nt->head = nt->tail = 0;
+    nt->n_received = 0;
+    nt->n_stalls = 0;
+    nt->n_dropped = 0;
+    nt->n_reported = 0;
+}
+void NetThread_Clear (NetThread *nt)
+{
+    NetThread_Stop (nt);
+    /* drop whatever has not been processed */
+    while (nt->head != nt->tail) {
+        free (nt->queue[nt->head & NETTHREAD_MASK]);
+        nt->head++;
+    }
+}
+
+
+static void* NetThread_Loop (void *data)
+{
+    NetThread *nt = data;
+    int res;
+
+    while (load_acquire (&nt->running)) {
+        res = NetClient_WaitTCP (nt->client, 0, NETTHREAD_TIMEOUT);
+        if (res < 0)
+            goto fail;
+        /* the registered callbacks call NetThread_Push() */
+        if (res > 0 && NetClient_TCPStep (nt->client, NULL) < 0)
+            goto fail;
+    }
+    return NULL;
+fail:
+    store_release (&nt->failed, SCE_TRUE);
+    return NULL;
+}
+
+/**
+ * \brief Starts receiving packets of the given client on a new thread
+ */
+int NetThread_Start (NetThread *nt, NetClient *client)
+{
+    if (nt->running)
+        return SCE_OK;
+
+    nt->client = client;
+    nt->failed = SCE_FALSE;
+    store_release (&nt->running, SCE_TRUE);
+    if (pthread_create (&nt->thread, NULL, NetThread_Loop, nt)) {
+        nt->running = SCE_FALSE;
+        SCEE_LogErrno ("pthread_create() failed");
+        return SCE_ERROR;
+    }
+    return SCE_OK;
+}
+/**
+ * \brief Stops the thread, pending messages are kept
+ */
+void NetThread_Stop (NetThread *nt)
+{
+    if (nt->running) {
+        store_release (&nt->running, SCE_FALSE);
+        pthread_join (nt->thread, NULL);
+    }
+}
+
+int NetThread_IsRunning (const NetThread *nt)
+{
+    return load_acquire (&nt->running);
+}
+/**
+ * \brief Whether the caller is running on the network thread
+ */
+int NetThread_IsCurrent (const NetThread *nt)
+{
+    return NetThread_IsRunning (nt) && pthread_equal (pthread_self (),
+                                                      nt->thread);
+}
+int NetThread_HasFailed (const NetThread *nt)
+{
+    return load_acquire (&nt->failed);
+}
+/**
+ * \brief Gets the number of packets dropped by the thread since the last
+ * call, for the main thread to report them
+ */
+SCEulong NetThread_PopDropped (NetThread *nt)
+{
+    SCEulong n = load_acquire (&nt->n_dropped) - nt->n_reported;
+    nt->n_reported += n;
+    return n;
+}
+
+/**
+ * \brief Queues a packet for the main thread, must be called from the
+ * network thread
+ * \param fun function that will handle the packet
+ *
+ * Blocks while the queue is full. Packets that can't be queued are counted,
+ * see NetThread_PopDropped().
+ */
+int NetThread_Push (NetThread *nt, NetThreadFunc fun, const char *packet,
+                    size_t size)
+{
+    NetMessage *msg = NULL;
+    unsigned int tail = nt->tail;
+
+    /* not SCE_malloc(), which is not meant to be called from several threads */
+    if (!(msg = malloc (sizeof *msg + size))) {
+        __atomic_add_fetch (&nt->n_dropped, 1, __ATOMIC_RELEASE);
+        return SCE_ERROR;
+    }
+    msg->fun = fun;
+    msg->size = size;
+    memcpy (msg->data, packet, size);
+
+    while (tail - load_acquire (&nt->head) >= NETTHREAD_QUEUE_SIZE) {
+        nt->n_stalls++;
+        if (!load_acquire (&nt->running)) {
+            free (msg);
+            return SCE_OK;
+        }
+        usleep (NETTHREAD_STALL_DELAY);
+    }
+
+    nt->queue[tail & NETTHREAD_MASK] = msg;
+    store_release (&nt->tail, tail + 1);
+    nt->n_received++;
+    return SCE_OK;
+}
+
+/**
+ * \brief Handles queued packets, must be called from the main thread
+ * \param max maximum number of packets to handle
+ * \returns the number of packets handled
+ */
+SCEuint NetThread_Process (NetThread *nt, SCEuint max)
+{
+    SCEuint n = 0;
+    unsigned int tail = load_acquire (&nt->tail);
+
+    while (n < max && nt->head != tail) {
+        NetMessage *msg = nt->queue[nt->head & NETTHREAD_MASK];
+        msg->fun (nt->client, NULL, msg->data, msg->size);
+        free (msg);
+        store_release (&nt->head, nt->head + 1);
+        n++;
+    }
+    return n;
+}
+
+SCEuint NetThread_GetNumPending (const NetThread *nt)
+{
+    return load_acquire (&nt->tail) - load_acquire (&nt->head);
+}
@@ -0,0 +1,74 @@
+/*------------------------------------------------------------------------------
+    Tune Land - Sandbox RPG
+    Copyright (C) 2012-2013
+        Antony Martin <antony(dot)martin(at)scengine(dot)org>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ -----------------------------------------------------------------------------*/
+
+#ifndef H_NETTHREAD
+#define H_NETTHREAD
+
+#include <pthread.h>
+#include <SCE/utils/SCEUtils.h>
+#include <tunel/common/netclient.h>
+
+/* must be a power of two */
+#define NETTHREAD_QUEUE_SIZE 1024
+
+typedef void (*NetThreadFunc)(NetClient*, void*, const char*, size_t);
+
+typedef struct netmessage NetMessage;
+struct netmessage {
+    NetThreadFunc fun;          /* handler to call from the main thread */
+    size_t size;
+    char data[];
+};
+
+/* receives packets on its own thread and hands them over to the main thread
+   through a single producer, single consumer lock-free queue */
+typedef struct netthread NetThread;
+struct netthread {
+    NetClient *client;
+    pthread_t thread;
+    int running;
+    int failed;
+    NetMessage *queue[NETTHREAD_QUEUE_SIZE];
+    unsigned int head;          /* next message to read (consumer) */
+    unsigned int tail;          /* next free slot (producer) */
+
+    /* statistics */
+    SCEulong n_received;
+    SCEulong n_stalls;          /* times the producer found the queue full */
+    SCEulong n_dropped;         /* packets the thread failed to queue, it
+                                   doesn't touch the SCEE error state */
+    SCEulong n_reported;        /* drops given by NetThread_PopDropped() */
+};
+
+void NetThread_Init (NetThread*);
+void NetThread_Clear (NetThread*);
+
+int NetThread_Start (NetThread*, NetClient*);
+void NetThread_Stop (NetThread*);
+
+int NetThread_IsRunning (const NetThread*);
+int NetThread_IsCurrent (const NetThread*);
+int NetThread_HasFailed (const NetThread*);
+SCEulong NetThread_PopDropped (NetThread*);
+
+int NetThread_Push (NetThread*, NetThreadFunc, const char*, size_t);
+SCEuint NetThread_Process (NetThread*, SCEuint);
+SCEuint NetThread_GetNumPending (const NetThread*);
+
+#endif /* guard */
@@ -0,0 +1,770 @@
+/*------------------------------------------------------------------------------
+    Tune Land - Sandbox RPG
+    Copyright (C) 2012-2013
+        Antony Martin <antony(dot)martin(at)scengine(dot)org>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ -----------------------------------------------------------------------------*/
+
+#include <math.h>
+#include "pcache.h"
+
+#define PCACHE_MIN_TABLE 1024
+/* SLRU: part of the capacity given to the entries hit at least twice */
+#define PCACHE_PROTECTED_SHARE 0.8
+/* movement-aware policy: number of entries compared to choose a victim */
+#define PCACHE_SAMPLES 16
+/* weight of the direction of movement, as in the download priorities */
+#define PCACHE_HEADING 0.5
+/* the viewer is written in the trace when it moves that much */
+#define PCACHE_TRACE_STEP 1.0
+
+static const PCachePolicy pcache_policies[PCACHE_NUM_POLICIES];
+
+
+/* blobs */
+
+static PCacheBlob* PCache_NewBlob (size_t size)
+{
+    PCacheBlob *b = NULL;
+    if (!(b = SCE_malloc (sizeof *b)) || !(b->data = SCE_malloc (size + 1))) {
+        SCE_free (b);
+        SCEE_LogSrc ();
+        return NULL;
+    }
+    b->refs = 1;
+    b->size = size;
+    return b;
+}
+static void PCache_ReleaseBlob (PCacheBlob *b)
+{
+    if (b && --b->refs == 0) {
+        SCE_free (b->data);
+        SCE_free (b);
+    }
+}
+
+
+/* lists */
+
+static void PCache_ListRemove (PCacheList *l, PCacheEntry *e)
+{
+    if (e->prev)
+        e->prev->next = e->next;
+    else
+        l->first = e->next;
+    if (e->next)
+        e->next->prev = e->prev;
+    else
+        l->last = e->prev;
+    e->prev = e->next = NULL;
+    l->bytes -= e->bytes;
+}
+static void PCache_ListPush (PCacheList *l, PCacheEntry *e)
+{
+    e->prev = NULL;
+    e->next = l->first;
+    if (l->first)
+        l->first->prev = e;
+    else
+        l->last = e;
+    l->first = e;
+    l->bytes += e->bytes;
+}
+
+
+/* LRU */
+
+static void PCache_LRUInsert (PCache *pc, PCacheEntry *e)
+{
+    PCache_ListPush (&pc->lists[0], e);
+}
+static void PCache_LRUAccess (PCache *pc, PCacheEntry *e)
+{
+    PCache_ListRemove (&pc->lists[0], e);
+    PCache_ListPush (&pc->lists[0], e);
+}
+static void PCache_LRURemove (PCache *pc, PCacheEntry *e)
+{
+    PCache_ListRemove (&pc->lists[0], e);
+}
+static PCacheEntry* PCache_LRUVictim (PCache *pc)
+{
+    return pc->lists[0].last;
+}
+
+/* segmented LRU: new entries go to a probation segment, and only get
+   promoted to the protected one when they are hit. a burst of entries used
+   once (a teleport, a fly-over) only flushes the probation segment */
+
+#define PROBATION 0
+#define PROTECTED 1
+
+static void PCache_SLRUInsert (PCache *pc, PCacheEntry *e)
+{
+    e->protect = SCE_FALSE;
+    PCache_ListPush (&pc->lists[PROBATION], e);
+}
+static void PCache_SLRUAccess (PCache *pc, PCacheEntry *e)
+{
+    PCacheList *prot = &pc->lists[PROTECTED];
+
+    PCache_ListRemove (&pc->lists[e->protect], e);
+    e->protect = SCE_TRUE;
+    PCache_ListPush (prot, e);
+    /* demote the oldest protected entries */
+    while (prot->bytes > pc->capacity * PCACHE_PROTECTED_SHARE &&
+           prot->last != e) {
+        PCacheEntry *old = prot->last;
+        PCache_ListRemove (prot, old);
+        old->protect = SCE_FALSE;
+        PCache_ListPush (&pc->lists[PROBATION], old);
+    }
+}
+static void PCache_SLRURemove (PCache *pc, PCacheEntry *e)
+{
+    PCache_ListRemove (&pc->lists[e->protect], e);
+}
+static PCacheEntry* PCache_SLRUVictim (PCache *pc)
+{
+    if (pc->lists[PROBATION].last)
+        return pc->lists[PROBATION].last;
+    return pc->lists[PROTECTED].last;
+}
+
+/* movement-aware: among a few resident entries picked at random, evicts
+   the one the player is the least likely to need soon, ie. the farthest
+   away relative to its size, behind rather than ahead. entries we don't
+   know the position of are evicted as LRU would: once they have not been
+   used for as many accesses as there are files in the cache */
+
+static float PCache_MotionScore (const PCache *pc, const PCacheEntry *e)
+{
+    float d[3], dist, score;
+    int i;
+
+    for (i = 0; i < 3; i++)
+        d[i] = e->pos[i] - pc->viewer[i];
+    dist = sqrt (d[0] * d[0] + d[1] * d[1] + d[2] * d[2]);
+    score = dist / (e->size > 0 ? e->size : 1);
+    if (dist > 0.0)
+        score *= 1.0 - PCACHE_HEADING * (d[0] * pc->heading[0] +
+                                         d[1] * pc->heading[1] +
+                                         d[2] * pc->heading[2]) / dist;
+    return score;
+}
+static void PCache_MotionNop (PCache *pc, PCacheEntry *e)
+{
+    (void)pc; (void)e;
+}
+static PCacheEntry* PCache_MotionVictim (PCache *pc)
+{
+    PCacheEntry *victim = NULL, *oldest = NULL;
+    float best = -1.0;
+    int i;
+
+    for (i = 0; i < PCACHE_SAMPLES && pc->n_resident > 0; i++) {
+        PCacheEntry *e = NULL;
+        pc->seed = pc->seed * 1103515245U + 12345U;
+        e = pc->resident[(pc->seed >> 8) % pc->n_resident];
+        if (e->has_pos) {
+            float score = PCache_MotionScore (pc, e);
+            if (score > best) {
+                best = score;
+                victim = e;
+            }
+        } else if (!oldest || e->last_access < oldest->last_access)
+            oldest = e;
+    }
+    /* an entry without position that LRU would have evicted already */
+    if (oldest &&
+        (!victim || pc->clock - oldest->last_access > pc->n_resident))
+        return oldest;
+    return victim;
+}
+static const PCachePolicy pcache_policies[PCACHE_NUM_POLICIES] = {
+    {"lru", PCache_LRUInsert, PCache_LRUAccess, PCache_LRURemove,
+     PCache_LRUVictim},
+    {"slru", PCache_SLRUInsert, PCache_SLRUAccess, PCache_SLRURemove,
+     PCache_SLRUVictim},
+    {"motion", PCache_MotionNop, PCache_MotionNop, PCache_MotionNop,
+     PCache_MotionVictim}
+};
+
+
+void PCache_Init (PCache *pc)
+{
+    pc->policy = &pcache_policies[PCACHE_LRU];
+    pc->capacity = 0;
+    pc->bytes = 0;
+    pc->table = NULL;
+    pc->table_size = 0;
+    pc->n_entries = 0;
+    pc->resident = NULL;
+    pc->n_resident = pc->resident_cap = 0;
+    memset (pc->lists, 0, sizeof pc->lists);
+    pc->clock = 0;
+    pc->seed = 42;
+    memset (pc->viewer, 0, sizeof pc->viewer);
+    memset (pc->heading, 0, sizeof pc->heading);
+    memset (pc->traced, 0, sizeof pc->traced);
+    pc->trace = NULL;
+    pc->subfs = NULL;
+    pc->hits = 0;
+    pc->misses = 0;
+    pc->evictions = 0;
+}
+void PCache_Clear (PCache *pc)
+{
+    SCEuint i;
+    for (i = 0; i < pc->table_size; i++) {
+        PCacheEntry *e = pc->table[i], *next = NULL;
+        for (; e; e = next) {
+            next = e->hnext;
+            PCache_ReleaseBlob (e->blob);
+            SCE_free (e->name);
+            SCE_free (e);
+        }
+    }
+    SCE_free (pc->table);
+    SCE_free (pc->resident);
+}
+
+/**
+ * \brief Sets the eviction policy, must be called before anything is cached
+ */
+void PCache_SetPolicy (PCache *pc, PCachePolicyType type)
+{
+    pc->policy = &pcache_policies[type];
+}
+const char* PCache_GetPolicyName (PCachePolicyType type)
+{
+    return pcache_policies[type].name;
+}
+/**
+ * \returns the policy called \p name, SCE_ERROR if there is none
+ */
+int PCache_GetPolicyByName (const char *name)
+{
+    int i;
+    for (i = 0; i < PCACHE_NUM_POLICIES; i++) {
+        if (!strcmp (pcache_policies[i].name, name))
+            return i;
+    }
+    return SCE_ERROR;
+}
+
+static void PCache_Evict (PCache*, PCacheEntry*);
+
+/**
+ * \brief Sets the number of bytes the cache may hold, can be called at any
+ * time
+ */
+void PCache_SetCapacity (PCache *pc, size_t capacity)
+{
+    PCacheEntry *e = NULL;
+    pc->capacity = capacity;
+    while (pc->bytes > pc->capacity && (e = pc->policy->victim (pc)))
+        PCache_Evict (pc, e);
+}
+/**
+ * \brief Records the accesses into \p fp, NULL to stop
+ */
+void PCache_SetTrace (PCache *pc, FILE *fp)
+{
+    pc->trace = fp;
+}
+
+
+static SCEuint PCache_HashName (const char *name)
+{
+    SCEuint h = 2166136261U;
+    while (*name)
+        h = (h ^ (unsigned char)*name++) * 16777619U;
+    return h;
+}
+static PCacheEntry* PCache_Find (const PCache *pc, const char *name)
+{
+    PCacheEntry *e = NULL;
+    if (!pc->table_size)
+        return NULL;
+    e = pc->table[PCache_HashName (name) & (pc->table_size - 1)];
+    while (e && strcmp (e->name, name))
+        e = e->hnext;
+    return e;
+}
+static int PCache_GrowTable (PCache *pc)
+{
+    PCacheEntry **table = NULL;
+    SCEuint i, size = pc->table_size ? pc->table_size * 2 : PCACHE_MIN_TABLE;
+
+    if (!(table = SCE_malloc (size * sizeof *table))) {
+        SCEE_LogSrc ();
+        return SCE_ERROR;
+    }
+    memset (table, 0, size * sizeof *table);
+    for (i = 0; i < pc->table_size; i++) {
+        PCacheEntry *e = pc->table[i], *next = NULL;
+        for (; e; e = next) {
+            SCEuint h = PCache_HashName (e->name) & (size - 1);
+            next = e->hnext;
+            e->hnext = table[h];
+            table[h] = e;
+        }
+    }
+    SCE_free (pc->table);
+    pc->table = table;
+    pc->table_size = size;
+    return SCE_OK;
+}
+/* forgets the entries of the files that are not cached, they only hold
+   positions (PCache_SetPosition()) */
+static void PCache_Prune (PCache *pc)
+{
+    SCEuint i;
+    for (i = 0; i < pc->table_size; i++) {
+        PCacheEntry **p = &pc->table[i], *e = NULL;
+        while ((e = *p)) {
+            if (e->resident) {
+                p = &e->hnext;
+                continue;
+            }
+            *p = e->hnext;
+            SCE_free (e->name);
+            SCE_free (e);
+            pc->n_entries--;
+        }
+    }
+}
+/* gets the entry of a file, creates it if needed */
+static PCacheEntry* PCache_Get (PCache *pc, const char *name)
+{
+    PCacheEntry *e = NULL;
+    SCEuint h;
+
+    if ((e = PCache_Find (pc, name)))
+        return e;
+    /* the positions of every node of the world would pile up otherwise:
+       the table grows only when most of it is cached */
+    if (pc->n_entries >= pc->table_size &&
+        pc->n_entries - pc->n_resident > pc->table_size / 2)
+        PCache_Prune (pc);
+    if (pc->n_entries >= pc->table_size && PCache_GrowTable (pc) < 0)
+        goto fail;
+    if (!(e = SCE_malloc (sizeof *e)))
+        goto fail;
+    memset (e, 0, sizeof *e);
+    if (!(e->name = SCE_String_Dup (name))) {
+        SCE_free (e);
+        goto fail;
+    }
+    h = PCache_HashName (name) & (pc->table_size - 1);
+    e->hnext = pc->table[h];
+    pc->table[h] = e;
+    pc->n_entries++;
+    return e;
+fail:
+    SCEE_LogSrc ();
+    return NULL;
+}
+
+/**
+ * \brief Tells where the node stored in a file is
+ * \param x,y,z origin of the node, in level 0 voxels
+ * \param size size of the node, in level 0 voxels
+ */
+int PCache_SetPosition (PCache *pc, const char *name, long x, long y, long z,
+                        long size)
+{
+    PCacheEntry *e = NULL;
+
+    if (!(e = PCache_Get (pc, name))) {
+        SCEE_LogSrc ();
+        return SCE_ERROR;
+    }
+    e->has_pos = SCE_TRUE;
+    e->pos[0] = x + size / 2;
+    e->pos[1] = y + size / 2;
+    e->pos[2] = z + size / 2;
+    e->size = size;
+    if (pc->trace)
+        fprintf (pc->trace, "p %ld %ld %ld %ld %s\n", x, y, z, size, name);
+    return SCE_OK;
+}
+/**
+ * \brief Tells where the player is and where it is heading
+ * \param heading normalized direction of movement
+ */
+void PCache_SetViewer (PCache *pc, const float *pos, const float *heading)
+{
+    float d[3];
+    int i;
+
+    for (i = 0; i < 3; i++) {
+        pc->viewer[i] = pos[i];
+        pc->heading[i] = heading[i];
+        d[i] = pos[i] - pc->traced[i];
+    }
+    if (pc->trace && sqrt (d[0] * d[0] + d[1] * d[1] + d[2] * d[2]) >=
+        PCACHE_TRACE_STEP) {
+        fprintf (pc->trace, "v %.1f %.1f %.1f %.3f %.3f %.3f\n", pos[0],
+                 pos[1], pos[2], heading[0], heading[1], heading[2]);
+        memcpy (pc->traced, pos, sizeof pc->traced);
+    }
+}
+
+static void PCache_Evict (PCache *pc, PCacheEntry *e)
+{
+    PCacheEntry *last = NULL;
+
+    pc->policy->remove (pc, e);
+    last = pc->resident[--pc->n_resident];
+    pc->resident[e->index] = last;
+    last->index = e->index;
+    pc->bytes -= e->bytes;
+    e->resident = SCE_FALSE;
+    PCache_ReleaseBlob (e->blob);
+    e->blob = NULL;
+}
+
+/**
+ * \brief Looks for a file in the cache
+ * \returns its entry, NULL if it is not cached
+ */
+PCacheEntry* PCache_Lookup (PCache *pc, const char *name)
+{
+    PCacheEntry *e = PCache_Find (pc, name);
+
+    pc->clock++;
+    if (pc->trace)
+        fprintf (pc->trace, "a %s\n", name);
+    if (!e || !e->resident) {
+        pc->misses++;
+        return NULL;
+    }
+    pc->hits++;
+    e->last_access = pc->clock;
+    pc->policy->access (pc, e);
+    return e;
+}
+
+/**
+ * \brief Caches the content of a file, evicting what the policy wants
+ * \param blob content of the file, the cache takes a reference on it. can
+ * be NULL when only simulating the cache
+ * \param bytes size of the file
+ */
+int PCache_Insert (PCache *pc, const char *name, PCacheBlob *blob,
+                   size_t bytes)
+{
+    PCacheEntry *e = NULL, *victim = NULL;
+
+    if (pc->trace)
+        fprintf (pc->trace, "i %lu %s\n", (unsigned long)bytes, name);
+    if (bytes > pc->capacity)
+        return SCE_OK;
+    if (!(e = PCache_Get (pc, name)))
+        goto fail;
+    if (e->resident)
+        PCache_Evict (pc, e);
+    while (pc->bytes + bytes > pc->capacity &&
+           (victim = pc->policy->victim (pc))) {
+        PCache_Evict (pc, victim);
+        pc->evictions++;
+    }
+
+    if (pc->n_resident == pc->resident_cap) {
+        SCEuint cap = pc->resident_cap ? pc->resident_cap * 2 : 256;
+        PCacheEntry **r = SCE_realloc (pc->resident, cap * sizeof *r);
+        if (!r)
+            goto fail;
+        pc->resident = r;
+        pc->resident_cap = cap;
+    }
+    e->index = pc->n_resident;
+    pc->resident[pc->n_resident++] = e;
+    e->resident = SCE_TRUE;
+    e->bytes = bytes;
+    e->blob = blob;
+    if (blob)
+        blob->refs++;
+    e->last_access = pc->clock;
+    pc->bytes += bytes;
+    pc->policy->insert (pc, e);
+    return SCE_OK;
+fail:
+    SCEE_LogSrc ();
+    return SCE_ERROR;
+}
+
+/**
+ * \brief Forgets the content of a file, typically because it is rewritten
+ */
+void PCache_Invalidate (PCache *pc, const char *name)
+{
+    PCacheEntry *e = PCache_Find (pc, name);
+    if (e && e->resident)
+        PCache_Evict (pc, e);
+}
+
+
+/* file system */
+
+typedef struct pcachefile PCacheFile;
+struct pcachefile {
+    PCacheBlob *blob;           /* NULL if writing */
+    size_t pos;
+    SCE_SFile sub;
+};
+
+static PCacheBlob* PCache_Load (PCache *pc, const char *fname, int flags)
+{
+    SCE_SFile fp;
+    PCacheBlob *blob = NULL;
+    long len;
+
+    SCE_File_Init (&fp);
+    if (SCE_File_Open (&fp, pc->subfs, fname, flags) < 0)
+        goto fail;
+    if ((len = SCE_File_Length (&fp)) < 0 || !(blob = PCache_NewBlob (len)))
+        goto fail_close;
+    if (SCE_File_Read (blob->data, 1, len, &fp) != (size_t)len) {
+        SCEE_LogErrno (fname);
+        goto fail_close;
+    }
+    SCE_File_Close (&fp);
+    return blob;
+fail_close:
+    SCE_File_Close (&fp);
+fail:
+    PCache_ReleaseBlob (blob);
+    SCEE_LogSrc ();
+    return NULL;
+}
+
+static void* PCache_xopen (SCE_SFileSystem *fs, const char *fname, int flags)
+{
+    PCache *pc = fs->udata;
+    PCacheFile *pf = NULL;
+    PCacheEntry *e = NULL;
+
+    if (!(pf = SCE_malloc (sizeof *pf)))
+        goto fail;
+    pf->blob = NULL;
+    pf->pos = 0;
+    SCE_File_Init (&pf->sub);
+
+    if (flags & (SCE_FILE_WRITE | SCE_FILE_CREATE | SCE_FILE_APPEND)) {
+        PCache_Invalidate (pc, fname);
+        if (SCE_File_Open (&pf->sub, pc->subfs, fname, flags) < 0)
+            goto fail;
+        return pf;
+    }
+
+    if ((e = PCache_Lookup (pc, fname)) && e->blob) {
+        pf->blob = e->blob;
+        pf->blob->refs++;
+        return pf;
+    }
+    if (!(pf->blob = PCache_Load (pc, fname, flags)))
+        goto fail;
+    if (PCache_Insert (pc, fname, pf->blob, pf->blob->size) < 0)
+        goto fail;
+    return pf;
+fail:
+    if (pf)
+        PCache_ReleaseBlob (pf->blob);
+    SCE_free (pf);
+    SCEE_LogSrc ();
+    return NULL;
+}
+static int PCache_xclose (SCE_SFileSystem *fs, void *fd)
+{
+    PCacheFile *pf = fd;
+    (void)fs;
+    if (pf->blob)
+        PCache_ReleaseBlob (pf->blob);
+    else
+        SCE_File_Close (&pf->sub);
+    SCE_free (pf);
+    return 0;
+}
+static size_t PCache_xread (void *data, size_t size, size_t nmemb, void *fd)
+{
+    PCacheFile *pf = fd;
+    size_t n;
+
+    if (!pf->blob)
+        return SCE_File_Read (data, size, nmemb, &pf->sub);
+    if (size == 0)
+        return 0;
+    n = (pf->blob->size - pf->pos) / size;
+    if (n > nmemb)
+        n = nmemb;
+    memcpy (data, &pf->blob->data[pf->pos], n * size);
+    pf->pos += n * size;
+    return n;
+}
+static size_t PCache_xwrite (const void *data, size_t size, size_t nmemb,
+                             void *fd)
+{
+    PCacheFile *pf = fd;
+    if (pf->blob)
+        return 0;
+    return SCE_File_Write (data, size, nmemb, &pf->sub);
+}
+static int PCache_xseek (void *fd, long offset, int whence)
+{
+    PCacheFile *pf = fd;
+    long pos;
+
+    if (!pf->blob)
+        return SCE_File_Seek (&pf->sub, offset, whence);
+    switch (whence) {
+    case SEEK_SET: pos = offset; break;
+    case SEEK_CUR: pos = pf->pos + offset; break;
+    case SEEK_END: pos = pf->blob->size + offset; break;
+    default: return -1;
+    }
+    if (pos < 0 || (size_t)pos > pf->blob->size)
+        return -1;
+    pf->pos = pos;
+    return 0;
+}
+static long PCache_xtell (void *fd)
+{
+    PCacheFile *pf = fd;
+    return pf->blob ? (long)pf->pos : SCE_File_Tell (&pf->sub);
+}
+static void PCache_xrewind (void *fd)
+{
+    PCacheFile *pf = fd;
+    if (pf->blob)
+        pf->pos = 0;
+    else
+        SCE_File_Rewind (&pf->sub);
+}
+static int PCache_xflush (void *fd)
+{
+    PCacheFile *pf = fd;
+    return pf->blob ? 0 : SCE_File_Flush (&pf->sub);
+}
+static long PCache_xlength (void *fd)
+{
+    PCacheFile *pf = fd;
+    return pf->blob ? (long)pf->blob->size : SCE_File_Length (&pf->sub);
+}
+
+/**
+ * \brief Sets up a file system caching the files read from \p subfs
+ * \param subfs cached file system, NULL for the default one
+ */
+void PCache_InitFileSystem (PCache *pc, SCE_SFileSystem *fs,
+                            SCE_SFileSystem *subfs)
+{
+    pc->subfs = subfs;
+    fs->xopen = PCache_xopen;
+    fs->xclose = PCache_xclose;
+    fs->xread = PCache_xread;
+    fs->xwrite = PCache_xwrite;
+    fs->xseek = PCache_xseek;
+    fs->xtell = PCache_xtell;
+    fs->xrewind = PCache_xrewind;
+    fs->xflush = PCache_xflush;
+    fs->xlength = PCache_xlength;
+    fs->udata = pc;
+    fs->subfs = subfs;
+}
+
+
+float PCache_GetHitRate (const PCache *pc)
+{
+    SCEulong n = pc->hits + pc->misses;
+    return n ? (float)pc->hits / n : 0.0;
+}
+void PCache_PrintStats (FILE *fp, const PCache *pc)
+{
+    fprintf (fp, "%s cache: %lu/%lu kB, %u files, %lu hits, %lu misses "
+             "(%.1f%% hits), %lu evictions\n", pc->policy->name,
+             (unsigned long)(pc->bytes / 1024),
+             (unsigned long)(pc->capacity / 1024), pc->n_resident, pc->hits,
+             pc->misses, PCache_GetHitRate (pc) * 100.0, pc->evictions);
+}
+
+/* feeds a trace to a cache, returns the number of lines we couldn't
+   understand */
+static long PCache_Feed (PCache *pc, FILE *trace)
+{
+    char line[512], name[512];
+    long bad = 0, x, y, z, size;
+    float pos[3], heading[3];
+    unsigned long bytes;
+
+    while (fgets (line, sizeof line, trace)) {
+        if (sscanf (line, "a %511s", name) == 1) {
+            if (!PCache_Lookup (pc, name)) {
+                /* the insert line that follows tells the size, if it was
+                   not a miss when recording we must have seen it before */
+                long at = ftell (trace);
+                char next[512];
+                PCacheEntry *e = NULL;
+                if (fgets (next, sizeof next, trace) &&
+                    sscanf (next, "i %lu %511s", &bytes, name) == 2)
+                    PCache_Insert (pc, name, NULL, bytes);
+                else {
+                    fseek (trace, at, SEEK_SET);
+                    if ((e = PCache_Find (pc, name)) && e->bytes > 0)
+                        PCache_Insert (pc, name, NULL, e->bytes);
+                }
+            }
+        } else if (sscanf (line, "p %ld %ld %ld %ld %511s", &x, &y, &z,
+                           &size, name) == 5)
+            PCache_SetPosition (pc, name, x, y, z, size);
+        else if (sscanf (line, "v %f %f %f %f %f %f", &pos[0], &pos[1],
+                         &pos[2], &heading[0], &heading[1], &heading[2]) == 6)
+            PCache_SetViewer (pc, pos, heading);
+        else if (line[0] != 'i')
+            bad++;
+    }
+    return bad;
+}
+
+/**
+ * \brief Replays a trace recorded with PCache_SetTrace() with every policy
+ * \param out where to print the results
+ * \param trace the trace, must be seekable
+ * \param capacity size of the simulated caches (bytes)
+ */
+int PCache_Replay (FILE *out, FILE *trace, size_t capacity)
+{
+    int i;
+
+    fprintf (out, "replaying with %lu kB caches\n",
+             (unsigned long)(capacity / 1024));
+    for (i = 0; i < PCACHE_NUM_POLICIES; i++) {
+        PCache pc;
+        long bad;
+
+        rewind (trace);
+        PCache_Init (&pc);
+        PCache_SetPolicy (&pc, i);
+        PCache_SetCapacity (&pc, capacity);
+        bad = PCache_Feed (&pc, trace);
+        PCache_PrintStats (out, &pc);
+        PCache_Clear (&pc);
+        if (bad > 0)
+            fprintf (out, "  %ld lines ignored\n", bad);
+    }
+    return SCE_OK;
+}
@@ -0,0 +1,130 @@
+/*------------------------------------------------------------------------------
+    Tune Land - Sandbox RPG
+    Copyright (C) 2012-2013
+        Antony Martin <antony(dot)martin(at)scengine(dot)org>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ -----------------------------------------------------------------------------*/
+
+#ifndef H_PCACHE
+#define H_PCACHE
+
+#include <stdio.h>
+#include <SCE/utils/SCEUtils.h>
+
+typedef enum {
+    PCACHE_LRU,
+    PCACHE_SLRU,                /* segmented LRU, resists scans */
+    PCACHE_MOTION,              /* evicts what lies behind the player */
+    PCACHE_NUM_POLICIES
+} PCachePolicyType;
+
+/* content of a cached file, shared with the files open on it */
+typedef struct pcacheblob PCacheBlob;
+struct pcacheblob {
+    SCEuint refs;
+    size_t size;
+    unsigned char *data;
+};
+
+typedef struct pcacheentry PCacheEntry;
+struct pcacheentry {
+    char *name;
+    PCacheEntry *hnext;         /* next entry of the hash bucket */
+    int has_pos;
+    long pos[3];                /* center of the node, level 0 voxels */
+    long size;                  /* size of the node, level 0 voxels */
+
+    int resident;               /* the content is cached */
+    PCacheBlob *blob;           /* NULL when replaying a trace */
+    size_t bytes;               /* last known size of the file */
+    SCEuint index;              /* in PCache.resident */
+    SCEulong last_access;
+    PCacheEntry *prev, *next;   /* list of the policy */
+    int protect;                /* SLRU: in the protected segment */
+};
+
+typedef struct pcache PCache;
+
+/* an eviction policy: told about what enters, is hit and leaves the cache,
+   chooses what to evict */
+typedef struct pcachepolicy PCachePolicy;
+struct pcachepolicy {
+    const char *name;
+    void (*insert)(PCache*, PCacheEntry*);
+    void (*access)(PCache*, PCacheEntry*);
+    void (*remove)(PCache*, PCacheEntry*);
+    PCacheEntry* (*victim)(PCache*);
+};
+
+typedef struct pcachelist PCacheList;
+struct pcachelist {
+    PCacheEntry *first, *last;  /* most recently used first */
+    size_t bytes;
+};
+
+/* file cache with a pluggable eviction policy, sitting below sce_cachefs.
+   entries are known by their file name; the game tells where the nodes
+   are (PCache_SetPosition()) and where the player is going
+   (PCache_SetViewer()) for the movement-aware policy. the accesses can be
+   recorded into a trace and replayed with every policy, see
+   PCache_Replay() */
+struct pcache {
+    const PCachePolicy *policy;
+    size_t capacity;            /* bytes */
+    size_t bytes;
+    PCacheEntry **table;        /* every entry we know of, by name */
+    SCEuint table_size;
+    SCEuint n_entries;
+    PCacheEntry **resident;
+    SCEuint n_resident, resident_cap;
+    PCacheList lists[2];        /* used by the policies */
+    SCEulong clock;             /* number of accesses */
+    SCEuint seed;
+    float viewer[3];
+    float heading[3];
+    float traced[3];            /* viewer position last written */
+    FILE *trace;
+    SCE_SFileSystem *subfs;
+
+    /* statistics */
+    SCEulong hits;
+    SCEulong misses;
+    SCEulong evictions;
+};
+
+void PCache_Init (PCache*);
+void PCache_Clear (PCache*);
+
+void PCache_SetPolicy (PCache*, PCachePolicyType);
+const char* PCache_GetPolicyName (PCachePolicyType);
+int PCache_GetPolicyByName (const char*);
+void PCache_SetCapacity (PCache*, size_t);
+void PCache_SetTrace (PCache*, FILE*);
+
+int PCache_SetPosition (PCache*, const char*, long, long, long, long);
+void PCache_SetViewer (PCache*, const float*, const float*);
+
+PCacheEntry* PCache_Lookup (PCache*, const char*);
+int PCache_Insert (PCache*, const char*, PCacheBlob*, size_t);
+void PCache_Invalidate (PCache*, const char*);
+
+void PCache_InitFileSystem (PCache*, SCE_SFileSystem*, SCE_SFileSystem*);
+
+float PCache_GetHitRate (const PCache*);
+void PCache_PrintStats (FILE*, const PCache*);
+
+int PCache_Replay (FILE*, FILE*, size_t);
+
+#endif /* guard */
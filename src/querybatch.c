@@ -0,0 +1,242 @@
+/*------------------------------------------------------------------------------
+    Tune Land - Sandbox RPG
+    Copyright (C) 2012-2013
+        Antony Martin <antony(dot)martin(at)scengine(dot)org>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ -----------------------------------------------------------------------------*/
+
+/* TLP_QUERY_CHUNKS layout:
+
+   request: count (4 bytes), then for each node:
+     header byte: level (5 bits) | QBATCH_HAS_HASH
+     zigzag varints: x, y, z deltas against the previous node, chunk units
+     QBATCH_HASH_SIZE bytes of hash, if QBATCH_HAS_HASH
+
+   reply: count (4 bytes), then for each node:
+     header byte: level (5 bits) | status << 5
+     zigzag varints: x, y, z deltas against the previous node, chunk units
+     varint size and chunk data, if status is QBATCH_CHUNK_DATA
+     varint size and delta, if status is QBATCH_CHUNK_DELTA */
+
+#include "querybatch.h"
+
+#define QBATCH_LEVEL_MASK 0x1f
+#define QBATCH_HAS_HASH 0x20
+#define QBATCH_STATUS_SHIFT 5
+
+static size_t QBatch_PutVarint (unsigned long v, unsigned char *out)
+{
+    size_t n = 0;
+    while (v >= 0x80) {
+        out[n++] = (v & 0x7f) | 0x80;
+        v >>= 7;
+    }
+    out[n++] = v;
+    return n;
+}
+static size_t QBatch_PutSigned (long v, unsigned char *out)
+{
+    unsigned long zz = ((unsigned long)v << 1) ^ (unsigned long)(v >> 31);
+    return QBatch_PutVarint (zz & 0xffffffffUL, out);
+}
+
+static int QBatch_GetVarint (const unsigned char **p, const unsigned char *end,
+                             unsigned long *v)
+{
+    int shift = 0;
+    *v = 0;
+    while (*p < end && shift < 35) {
+        unsigned char c = *(*p)++;
+        *v |= (unsigned long)(c & 0x7f) << shift;
+        if (!(c & 0x80))
+            return SCE_OK;
+        shift += 7;
+    }
+    return SCE_ERROR;
+}
+static int QBatch_GetSigned (const unsigned char **p, const unsigned char *end,
+                             long *v)
+{
+    unsigned long zz;
+    if (QBatch_GetVarint (p, end, &zz) < 0)
+        return SCE_ERROR;
+    *v = (long)(zz >> 1) ^ -(long)(zz & 1);
+    return SCE_OK;
+}
+
+
+void QBatch_Init (QueryBatch *qb)
+{
+    qb->size = QBATCH_HEADER_SIZE;
+    qb->n_nodes = 0;
+    qb->unit = 1;
+    qb->prev[0] = qb->prev[1] = qb->prev[2] = 0;
+}
+void QBatch_Clear (QueryBatch *qb)
+{
+    (void)qb;
+}
+
+/**
+ * \brief Starts a new request
+ * \param unit size of a chunk, in voxels
+ */
+void QBatch_Begin (QueryBatch *qb, SCEuint unit)
+{
+    QBatch_Init (qb);
+    qb->unit = unit ? unit : 1;
+}
+
+/**
+ * \brief Adds a node to the request
+ * \param level level of the node
+ * \param x,y,z origin of the node, in voxels
+ * \param sha1 SHA1 sum of our version of the chunk, or NULL if we dont have it
+ * \returns SCE_ERROR if the request is full
+ */
+int QBatch_Add (QueryBatch *qb, SCEuint level, long x, long y, long z,
+                const unsigned char *sha1)
+{
+    unsigned char *out = NULL;
+    long c[3];
+    int i;
+
+    if (QBatch_IsFull (qb)) {
+        SCEE_Log (SCE_INVALID_ARG);
+        SCEE_LogMsg ("query batch is full");
+        return SCE_ERROR;
+    }
+
+    c[0] = x / (long)qb->unit;
+    c[1] = y / (long)qb->unit;
+    c[2] = z / (long)qb->unit;
+
+    out = &qb->buffer[qb->size];
+    *out = (level & QBATCH_LEVEL_MASK) | (sha1 ? QBATCH_HAS_HASH : 0);
+    out++;
+    for (i = 0; i < 3; i++) {
+        out += QBatch_PutSigned (c[i] - qb->prev[i], out);
+        qb->prev[i] = c[i];
+    }
+    if (sha1) {
+        memcpy (out, sha1, QBATCH_HASH_SIZE);
+        out += QBATCH_HASH_SIZE;
+    }
+
+    qb->size = out - qb->buffer;
+    qb->n_nodes++;
+    return SCE_OK;
+}
+
+int QBatch_IsFull (const QueryBatch *qb)
+{
+    return qb->n_nodes >= QBATCH_MAX_NODES;
+}
+SCEuint QBatch_GetNumNodes (const QueryBatch *qb)
+{
+    return qb->n_nodes;
+}
+
+/**
+ * \brief Finalizes the request
+ * \param size returns the size of the packet
+ * \returns the packet to send
+ */
+const unsigned char* QBatch_Finish (QueryBatch *qb, size_t *size)
+{
+    SCE_Encode_Long (qb->n_nodes, qb->buffer);
+    *size = qb->size;
+    return qb->buffer;
+}
+
+
+/**
+ * \brief Prepares the reading of a TLP_QUERY_CHUNKS reply
+ * \param unit size of a chunk, in voxels
+ */
+int QBatch_InitReader (QBatchReader *r, SCEuint unit, const unsigned char *p,
+                       size_t size)
+{
+    if (size < QBATCH_HEADER_SIZE) {
+        SCEE_Log (SCE_INVALID_ARG);
+        SCEE_LogMsg ("TLP_QUERY_CHUNKS: packet too small");
+        return SCE_ERROR;
+    }
+    r->n_left = SCE_Decode_Long (p);
+    r->p = &p[QBATCH_HEADER_SIZE];
+    r->end = &p[size];
+    r->unit = unit ? unit : 1;
+    r->prev[0] = r->prev[1] = r->prev[2] = 0;
+    return SCE_OK;
+}
+
+/**
+ * \brief Reads the next entry of a reply
+ * \returns SCE_TRUE if an entry has been read, SCE_FALSE at the end of the
+ * packet, SCE_ERROR if the packet is corrupted
+ */
+int QBatch_Next (QBatchReader *r, QBatchEntry *e)
+{
+    unsigned char header;
+    long c[3];
+    int i;
+
+    if (r->n_left == 0)
+        return SCE_FALSE;
+    if (r->p >= r->end)
+        goto corrupted;
+
+    header = *r->p++;
+    e->level = header & QBATCH_LEVEL_MASK;
+    e->status = header >> QBATCH_STATUS_SHIFT;
+    for (i = 0; i < 3; i++) {
+        long d;
+        if (QBatch_GetSigned (&r->p, r->end, &d) < 0)
+            goto corrupted;
+        c[i] = r->prev[i] + d;
+        r->prev[i] = c[i];
+    }
+    e->x = c[0] * (long)r->unit;
+    e->y = c[1] * (long)r->unit;
+    e->z = c[2] * (long)r->unit;
+
+    e->data = NULL;
+    e->size = 0;
+    switch (e->status) {
+    case QBATCH_CHUNK_DATA:
+    case QBATCH_CHUNK_DELTA:
+    {
+        unsigned long size;
+        if (QBatch_GetVarint (&r->p, r->end, &size) < 0 ||
+            size > (unsigned long)(r->end - r->p))
+            goto corrupted;
+        e->data = r->p;
+        e->size = size;
+        r->p += size;
+    }
+    case QBATCH_CHUNK_UNCHANGED:
+    case QBATCH_NO_CHUNK:
+        break;
+    default:
+        goto corrupted;
+    }
+
+    r->n_left--;
+    return SCE_TRUE;
+corrupted:
+    SCEE_Log (SCE_INVALID_ARG);
+    SCEE_LogMsg ("TLP_QUERY_CHUNKS: packet corrupted");
+    return SCE_ERROR;
+}
@@ -0,0 +1,86 @@
+/*------------------------------------------------------------------------------
+    Tune Land - Sandbox RPG
+    Copyright (C) 2012-2013
+        Antony Martin <antony(dot)martin(at)scengine(dot)org>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ -----------------------------------------------------------------------------*/
+
+#ifndef H_QUERYBATCH
+#define H_QUERYBATCH
+
+#include <SCE/utils/SCEUtils.h>
+
+/* maximum number of nodes in a single TLP_QUERY_CHUNKS request */
+#define QBATCH_MAX_NODES 64
+/* only the first bytes of the SHA1 sums are sent, plenty enough to tell
+   whether our version of a chunk is the right one */
+#define QBATCH_HASH_SIZE 8
+
+/* worst case of a node entry: header byte, 3 zigzag varints, hash */
+#define QBATCH_MAX_ENTRY_SIZE (1 + 3 * 5 + QBATCH_HASH_SIZE)
+#define QBATCH_HEADER_SIZE 4
+#define QBATCH_MAX_SIZE (QBATCH_HEADER_SIZE + \
+                         QBATCH_MAX_NODES * QBATCH_MAX_ENTRY_SIZE)
+
+/* status of an entry of a TLP_QUERY_CHUNKS reply */
+typedef enum {
+    QBATCH_CHUNK_DATA,          /* the chunk data follows */
+    QBATCH_CHUNK_UNCHANGED,     /* our version of the chunk is up to date */
+    QBATCH_NO_CHUNK,            /* the server doesn't have this chunk */
+    QBATCH_CHUNK_DELTA          /* a delta against our version follows */
+} QBatchStatus;
+
+/* builds a TLP_QUERY_CHUNKS request. coordinates are sent in chunk units,
+   delta-coded against the previous entry */
+typedef struct querybatch QueryBatch;
+struct querybatch {
+    unsigned char buffer[QBATCH_MAX_SIZE];
+    size_t size;
+    SCEuint n_nodes;
+    SCEuint unit;               /* chunk size */
+    long prev[3];
+};
+
+typedef struct qbatchentry QBatchEntry;
+struct qbatchentry {
+    QBatchStatus status;
+    SCEuint level;
+    long x, y, z;               /* voxel coordinates of the node */
+    const unsigned char *data;  /* chunk data or delta */
+    size_t size;
+};
+
+/* reads a TLP_QUERY_CHUNKS reply */
+typedef struct qbatchreader QBatchReader;
+struct qbatchreader {
+    const unsigned char *p, *end;
+    SCEuint n_left;
+    SCEuint unit;
+    long prev[3];
+};
+
+void QBatch_Init (QueryBatch*);
+void QBatch_Clear (QueryBatch*);
+
+void QBatch_Begin (QueryBatch*, SCEuint);
+int QBatch_Add (QueryBatch*, SCEuint, long, long, long, const unsigned char*);
+int QBatch_IsFull (const QueryBatch*);
+SCEuint QBatch_GetNumNodes (const QueryBatch*);
+const unsigned char* QBatch_Finish (QueryBatch*, size_t*);
+
+int QBatch_InitReader (QBatchReader*, SCEuint, const unsigned char*, size_t);
+int QBatch_Next (QBatchReader*, QBatchEntry*);
+
+#endif /* guard */
@@ -0,0 +1,1203 @@
+/*------------------------------------------------------------------------------
+    Tune Land - Sandbox RPG
+    Copyright (C) 2012-2013
+        Antony Martin <antony(dot)martin(at)scengine(dot)org>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ -----------------------------------------------------------------------------*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "clock.h"
+#include "regionfs.h"
+
+#define REGION_MAGIC "TLRG"
+#define REGION_VERSION 1
+#define REGION_SUFFIX ".region"
+/* extents are multiples of this many bytes, the header takes the first */
+#define REGION_ALIGN 256
+#define REGION_HEADER_SIZE REGION_ALIGN
+#define REGION_MIN_INDEX 256
+/* regions are compacted once a quarter of them is free space */
+#define REGION_COMPACT_RATIO 4
+
+typedef enum {
+    REGIONFILE_PASS,            /* file of the sub file system */
+    REGIONFILE_READ,
+    REGIONFILE_WRITE            /* written to the region when closed */
+} RegionFileMode;
+
+typedef struct regionfile RegionFile;
+struct regionfile {
+    RegionFileMode mode;
+    Region *region;
+    SCE_SFile sub;
+    char name[REGION_MAX_NAME];
+    uint64_t offset;            /* position of the data in the region */
+    unsigned char *buf;         /* content of a file being written */
+    size_t buf_size;
+    size_t size, pos;
+};
+
+static uint64_t Region_Align (uint64_t n)
+{
+    return (n + REGION_ALIGN - 1) & ~(uint64_t)(REGION_ALIGN - 1);
+}
+
+static SCEuint Region_HashName (const char *name)
+{
+    SCEuint h = 2166136261U;
+    while (*name)
+        h = (h ^ (unsigned char)*name++) * 16777619U;
+    return h;
+}
+
+
+/* name lookup table */
+
+static long Region_Find (const Region *r, const char *name)
+{
+    SCEuint mask = r->table_size - 1;
+    SCEuint i = Region_HashName (name) & mask;
+
+    for (; r->table[i]; i = (i + 1) & mask) {
+        SCEuint slot = r->table[i] - 1;
+        if (!strcmp (r->entries[slot].name, name))
+            return slot;
+    }
+    return -1;
+}
+static void Region_TableInsert (Region *r, SCEuint slot)
+{
+    SCEuint mask = r->table_size - 1;
+    SCEuint i = Region_HashName (r->entries[slot].name) & mask;
+
+    while (r->table[i])
+        i = (i + 1) & mask;
+    r->table[i] = slot + 1;
+}
+static int Region_BuildTable (Region *r)
+{
+    SCEuint i, size = 16;
+
+    while (size < r->header.index_capacity * 2)
+        size *= 2;
+    SCE_free (r->table);
+    if (!(r->table = SCE_malloc (size * sizeof *r->table))) {
+        SCEE_LogSrc ();
+        return SCE_ERROR;
+    }
+    memset (r->table, 0, size * sizeof *r->table);
+    r->table_size = size;
+    for (i = 0; i < r->header.index_capacity; i++) {
+        if (r->entries[i].name[0])
+            Region_TableInsert (r, i);
+    }
+    return SCE_OK;
+}
+
+
+/* free space */
+
+static int Region_AddFree (Region *r, uint64_t offset, uint64_t size)
+{
+    SCEuint i, j;
+
+    if (size == 0)
+        return SCE_OK;
+    r->free_bytes += size;
+
+    for (i = 0; i < r->n_free && r->free[i].offset < offset; i++);
+    /* merge with the neighbours */
+    if (i > 0 && r->free[i - 1].offset + r->free[i - 1].size == offset) {
+        r->free[i - 1].size += size;
+        if (i < r->n_free && offset + size == r->free[i].offset) {
+            r->free[i - 1].size += r->free[i].size;
+            for (j = i; j + 1 < r->n_free; j++)
+                r->free[j] = r->free[j + 1];
+            r->n_free--;
+        }
+        return SCE_OK;
+    }
+    if (i < r->n_free && offset + size == r->free[i].offset) {
+        r->free[i].offset = offset;
+        r->free[i].size += size;
+        return SCE_OK;
+    }
+
+    if (r->n_free == r->free_cap) {
+        SCEuint cap = r->free_cap ? r->free_cap * 2 : 16;
+        RegionExtent *ext = SCE_realloc (r->free, cap * sizeof *ext);
+        if (!ext) {
+            SCEE_LogSrc ();
+            return SCE_ERROR;
+        }
+        r->free = ext;
+        r->free_cap = cap;
+    }
+    for (j = r->n_free; j > i; j--)
+        r->free[j] = r->free[j - 1];
+    r->free[i].offset = offset;
+    r->free[i].size = size;
+    r->n_free++;
+    return SCE_OK;
+}
+
+/* keeps an extent the index used to point to until the next sync */
+static int Region_Release (Region *r, uint64_t offset, uint64_t size)
+{
+    if (size == 0)
+        return SCE_OK;
+    if (r->n_released == r->released_cap) {
+        SCEuint cap = r->released_cap ? r->released_cap * 2 : 16;
+        RegionExtent *ext = SCE_realloc (r->released, cap * sizeof *ext);
+        if (!ext) {
+            SCEE_LogSrc ();
+            return SCE_ERROR;
+        }
+        r->released = ext;
+        r->released_cap = cap;
+    }
+    r->released[r->n_released].offset = offset;
+    r->released[r->n_released].size = size;
+    r->n_released++;
+    return SCE_OK;
+}
+
+/* first fit, below \p limit */
+static long Region_FindFree (const Region *r, uint64_t size, uint64_t limit)
+{
+    SCEuint i;
+    for (i = 0; i < r->n_free && r->free[i].offset < limit; i++) {
+        if (r->free[i].size >= size)
+            return i;
+    }
+    return -1;
+}
+static uint64_t Region_TakeFree (Region *r, SCEuint i, uint64_t size)
+{
+    uint64_t offset = r->free[i].offset;
+
+    r->free_bytes -= size;
+    r->free[i].offset += size;
+    r->free[i].size -= size;
+    if (r->free[i].size == 0) {
+        for (; i + 1 < r->n_free; i++)
+            r->free[i] = r->free[i + 1];
+        r->n_free--;
+    }
+    return offset;
+}
+static uint64_t Region_Alloc (Region *r, uint64_t size)
+{
+    long i = Region_FindFree (r, size, r->file_size);
+    uint64_t offset;
+
+    if (i >= 0)
+        return Region_TakeFree (r, i, size);
+    offset = r->file_size;
+    r->file_size += size;
+    return offset;
+}
+
+/* gives the free space at the end of the region back to the system */
+static int Region_Trim (Region *r)
+{
+    RegionExtent *last = NULL;
+
+    if (r->n_free == 0)
+        return SCE_OK;
+    last = &r->free[r->n_free - 1];
+    if (last->offset + last->size != r->file_size)
+        return SCE_OK;
+    r->file_size = last->offset;
+    r->free_bytes -= last->size;
+    r->n_free--;
+
+    if (r->map && r->map_size > r->file_size) {
+        munmap (r->map, r->map_size);
+        r->map = NULL;
+        r->map_size = 0;
+    }
+    if (ftruncate (r->fd, r->file_size) < 0) {
+        SCEE_LogErrno (r->path);
+        return SCE_ERROR;
+    }
+    return SCE_OK;
+}
+
+
+/* disk access */
+
+static int Region_Write (Region *r, const void *data, size_t size,
+                         uint64_t offset)
+{
+    const unsigned char *p = data;
+    while (size > 0) {
+        ssize_t n = pwrite (r->fd, p, size, offset);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            SCEE_LogErrno (r->path);
+            return SCE_ERROR;
+        }
+        p += n;
+        size -= n;
+        offset += n;
+    }
+    return SCE_OK;
+}
+static void Region_MarkSlot (Region *r, SCEuint slot)
+{
+    if (!r->dirty[slot]) {
+        r->dirty[slot] = SCE_TRUE;
+        r->n_dirty++;
+    }
+}
+static int Region_WriteSlots (Region *r, SCEuint first, SCEuint n)
+{
+    return Region_Write (r, &r->entries[first], n * sizeof *r->entries,
+                         r->header.index_offset + first * sizeof *r->entries);
+}
+static int Region_WriteHeader (Region *r)
+{
+    unsigned char buf[REGION_HEADER_SIZE] = {0};
+    memcpy (buf, &r->header, sizeof r->header);
+    return Region_Write (r, buf, REGION_HEADER_SIZE, 0);
+}
+
+/* group commit: makes the data written since the last call durable, then
+   the slots pointing to it. the index on disk then no longer points to the
+   released extents, they can be reused */
+static int Region_Sync (Region *r)
+{
+    SCEuint i, j;
+
+    if (!r->n_dirty && !r->n_released)
+        return SCE_OK;
+    /* the data must be there before the index says so */
+    if (r->n_dirty) {
+        if (fdatasync (r->fd) < 0)
+            goto fail_errno;
+        for (i = 0; i < r->header.index_capacity; i = j) {
+            if (!r->dirty[i]) {
+                j = i + 1;
+                continue;
+            }
+            for (j = i; j < r->header.index_capacity && r->dirty[j]; j++);
+            if (Region_WriteSlots (r, i, j - i) < 0)
+                goto fail;
+            memset (&r->dirty[i], 0, j - i);
+        }
+        r->n_dirty = 0;
+    }
+    if (fdatasync (r->fd) < 0)
+        goto fail_errno;
+    while (r->n_released > 0) {
+        RegionExtent *ext = &r->released[r->n_released - 1];
+        if (Region_AddFree (r, ext->offset, ext->size) < 0)
+            goto fail;
+        r->n_released--;
+    }
+    if (Region_Trim (r) < 0)
+        goto fail;
+    return SCE_OK;
+fail_errno:
+    SCEE_LogErrno (r->path);
+fail:
+    SCEE_LogSrc ();
+    return SCE_ERROR;
+}
+
+/* makes sure the mapping covers [0, end) */
+static int Region_Map (Region *r, uint64_t end)
+{
+    void *map = NULL;
+
+    if (r->map && end <= r->map_size)
+        return SCE_OK;
+    if (r->map)
+        munmap (r->map, r->map_size);
+    r->map = NULL;
+    r->map_size = 0;
+    map = mmap (NULL, r->file_size, PROT_READ, MAP_SHARED, r->fd, 0);
+    if (map == MAP_FAILED) {
+        SCEE_LogErrno (r->path);
+        return SCE_ERROR;
+    }
+    r->map = map;
+    r->map_size = r->file_size;
+    return SCE_OK;
+}
+
+
+/* regions */
+
+static void Region_Delete (Region *r)
+{
+    if (r) {
+        if (r->map)
+            munmap (r->map, r->map_size);
+        if (r->fd >= 0)
+            close (r->fd);
+        SCE_free (r->path);
+        SCE_free (r->dir);
+        SCE_free (r->entries);
+        SCE_free (r->dirty);
+        SCE_free (r->table);
+        SCE_free (r->free);
+        SCE_free (r->released);
+        SCE_free (r);
+    }
+}
+
+static int Region_Create (Region *r)
+{
+    size_t size = REGION_MIN_INDEX * sizeof *r->entries;
+
+    memcpy (r->header.magic, REGION_MAGIC, 4);
+    r->header.version = REGION_VERSION;
+    r->header.index_offset = REGION_HEADER_SIZE;
+    r->header.index_capacity = REGION_MIN_INDEX;
+    if (!(r->entries = SCE_malloc (size)) ||
+        !(r->dirty = SCE_malloc (REGION_MIN_INDEX)))
+        goto fail;
+    memset (r->entries, 0, size);
+    memset (r->dirty, 0, REGION_MIN_INDEX);
+    r->file_size = REGION_HEADER_SIZE + Region_Align (size);
+
+    /* index first, so that a valid header never points to garbage */
+    if (Region_Write (r, r->entries, size, r->header.index_offset) < 0 ||
+        Region_WriteHeader (r) < 0)
+        goto fail;
+    return SCE_OK;
+fail:
+    SCEE_LogSrc ();
+    return SCE_ERROR;
+}
+
+static int Region_CompareExtents (const void *a, const void *b)
+{
+    const RegionExtent *x = a, *y = b;
+    return x->offset < y->offset ? -1 : x->offset > y->offset;
+}
+
+static int Region_Load (Region *r)
+{
+    size_t size;
+    RegionExtent *used = NULL;
+    SCEuint i, n_used = 0;
+    uint64_t end = REGION_HEADER_SIZE;
+    struct stat st;
+
+    if (pread (r->fd, &r->header, sizeof r->header, 0) != sizeof r->header ||
+        memcmp (r->header.magic, REGION_MAGIC, 4) ||
+        r->header.version != REGION_VERSION ||
+        r->header.index_capacity == 0) {
+        SCEE_Log (SCE_INVALID_ARG);
+        SCEE_LogMsg ("%s is not a valid region file", r->path);
+        return SCE_ERROR;
+    }
+    size = r->header.index_capacity * sizeof *r->entries;
+    if (!(r->entries = SCE_malloc (size)) ||
+        !(r->dirty = SCE_malloc (r->header.index_capacity)))
+        goto fail;
+    memset (r->dirty, 0, r->header.index_capacity);
+    if (pread (r->fd, r->entries, size, r->header.index_offset) != size) {
+        SCEE_Log (SCE_INVALID_ARG);
+        SCEE_LogMsg ("%s: index truncated", r->path);
+        goto fail;
+    }
+    if (fstat (r->fd, &st) < 0) {
+        SCEE_LogErrno (r->path);
+        goto fail;
+    }
+
+    /* the free space is whatever the index and the entries don't use */
+    if (!(used = SCE_malloc ((r->header.index_capacity + 1) * sizeof *used)))
+        goto fail;
+    used[n_used].offset = r->header.index_offset;
+    used[n_used++].size = Region_Align (size);
+    for (i = 0; i < r->header.index_capacity; i++) {
+        RegionEntry *e = &r->entries[i];
+        if (!e->name[0])
+            continue;
+        e->name[REGION_MAX_NAME - 1] = 0;
+        if (e->offset + e->size > (uint64_t)st.st_size) {
+            SCEE_SendMsg ("%s: %s truncated, dropping it\n", r->path, e->name);
+            e->name[0] = 0;
+            continue;
+        }
+        used[n_used].offset = e->offset;
+        used[n_used++].size = e->capacity;
+        r->n_entries++;
+    }
+    qsort (used, n_used, sizeof *used, Region_CompareExtents);
+    for (i = 0; i < n_used; i++) {
+        if (used[i].offset > end && Region_AddFree (r, end,
+                                                    used[i].offset - end) < 0)
+            goto fail;
+        if (used[i].offset + used[i].size > end)
+            end = used[i].offset + used[i].size;
+    }
+    r->file_size = end;
+    SCE_free (used);
+    return SCE_OK;
+fail:
+    SCE_free (used);
+    SCEE_LogSrc ();
+    return SCE_ERROR;
+}
+
+static Region* Region_Open (const char *dir, size_t dir_len, int create)
+{
+    Region *r = NULL;
+
+    if (!(r = SCE_malloc (sizeof *r)))
+        goto fail;
+    memset (r, 0, sizeof *r);
+    r->fd = -1;
+    if (!(r->dir = SCE_String_NDup (dir, dir_len)) ||
+        !(r->path = SCE_malloc (dir_len + sizeof REGION_SUFFIX)))
+        goto fail;
+    r->dir_len = dir_len;
+    sprintf (r->path, "%s%s", r->dir, REGION_SUFFIX);
+
+    r->fd = open (r->path, O_RDWR | (create ? O_CREAT : 0), 0644);
+    if (r->fd < 0) {
+        if (errno == ENOENT)
+            SCEE_Log (SCE_FILE_NOT_FOUND);
+        SCEE_LogErrno (r->path);
+        goto fail;
+    }
+    if (lseek (r->fd, 0, SEEK_END) == 0) {
+        if (Region_Create (r) < 0)
+            goto fail;
+    } else if (Region_Load (r) < 0)
+        goto fail;
+    if (Region_BuildTable (r) < 0)
+        goto fail;
+    return r;
+fail:
+    Region_Delete (r);
+    SCEE_LogSrc ();
+    return NULL;
+}
+
+/* doubles the size of the index */
+static int Region_GrowIndex (Region *r)
+{
+    RegionEntry *entries = NULL;
+    unsigned char *dirty = NULL;
+    SCEuint capacity = r->header.index_capacity * 2;
+    size_t old_size = r->header.index_capacity * sizeof *entries;
+    size_t size = capacity * sizeof *entries;
+    uint64_t old_offset = r->header.index_offset, offset;
+
+    /* the new index is a copy of the one on disk, bring it up to date */
+    if (Region_Sync (r) < 0)
+        goto fail;
+    if (!(entries = SCE_malloc (size)) || !(dirty = SCE_malloc (capacity)))
+        goto fail;
+    memset (entries, 0, size);
+    memcpy (entries, r->entries, old_size);
+    memset (dirty, 0, capacity);
+
+    /* the index must be there before the header says so */
+    offset = Region_Alloc (r, Region_Align (size));
+    if (Region_Write (r, entries, size, offset) < 0)
+        goto fail;
+    if (fdatasync (r->fd) < 0) {
+        SCEE_LogErrno (r->path);
+        goto fail;
+    }
+    r->header.index_offset = offset;
+    r->header.index_capacity = capacity;
+    SCE_free (r->entries);
+    SCE_free (r->dirty);
+    r->entries = entries;
+    r->dirty = dirty;
+    if (Region_WriteHeader (r) < 0 ||
+        Region_Release (r, old_offset, Region_Align (old_size)) < 0)
+        goto fail;
+    return Region_BuildTable (r);
+fail:
+    if (entries != r->entries) {
+        SCE_free (dirty);
+        SCE_free (entries);
+    }
+    SCEE_LogSrc ();
+    return SCE_ERROR;
+}
+
+static int Region_Put (Region *r, const char *name, const void *data,
+                       size_t size, int64_t mtime)
+{
+    long slot = Region_Find (r, name);
+    RegionEntry *e = NULL;
+    uint64_t capacity = Region_Align (size), offset;
+
+    if (slot < 0) {
+        if (r->n_entries * 4 >= r->header.index_capacity * 3 &&
+            Region_GrowIndex (r) < 0)
+            goto fail;
+        for (slot = 0; r->entries[slot].name[0]; slot++);
+        e = &r->entries[slot];
+        strcpy (e->name, name);
+        e->capacity = 0;
+        r->n_entries++;
+        Region_TableInsert (r, slot);
+    }
+    e = &r->entries[slot];
+
+    /* never overwrite the current version: a crash would leave neither.
+       write the new one elsewhere, the slot switches to it on disk at the
+       next sync */
+    offset = Region_Alloc (r, capacity);
+    if (Region_Write (r, data, size, offset) < 0 ||
+        Region_Release (r, e->offset, e->capacity) < 0)
+        goto fail;
+    e->offset = offset;
+    e->capacity = capacity;
+    e->size = size;
+    e->mtime = mtime;
+    Region_MarkSlot (r, slot);
+    return SCE_OK;
+fail:
+    SCEE_LogSrc ();
+    return SCE_ERROR;
+}
+
+static int Region_Remove (Region *r, SCEuint slot)
+{
+    RegionEntry *e = &r->entries[slot];
+
+    if (Region_Release (r, e->offset, e->capacity) < 0)
+        goto fail;
+    memset (e, 0, sizeof *e);
+    r->n_entries--;
+    Region_MarkSlot (r, slot);
+    if (Region_BuildTable (r) < 0)
+        goto fail;
+    return SCE_OK;
+fail:
+    SCEE_LogSrc ();
+    return SCE_ERROR;
+}
+
+/* moves the last entries into the holes, returns the number of bytes
+   moved */
+static uint64_t Region_Compact (Region *r, uint64_t max_bytes)
+{
+    uint64_t moved = 0;
+
+    while (moved < max_bytes) {
+        SCEuint i, last = 0;
+        uint64_t offset;
+        long hole;
+        RegionEntry *e = NULL;
+
+        for (i = 0; i < r->header.index_capacity; i++) {
+            if (r->entries[i].name[0] &&
+                (!e || r->entries[i].offset > e->offset)) {
+                e = &r->entries[i];
+                last = i;
+            }
+        }
+        if (!e || (hole = Region_FindFree (r, e->capacity, e->offset)) < 0)
+            break;
+        if (Region_Map (r, e->offset + e->size) < 0)
+            break;
+
+        offset = Region_TakeFree (r, hole, e->capacity);
+        if (Region_Write (r, &r->map[e->offset], e->size, offset) < 0 ||
+            Region_Release (r, e->offset, e->capacity) < 0) {
+            SCEE_LogSrc ();
+            SCEE_Out ();
+            SCEE_Clear ();
+            break;
+        }
+        e->offset = offset;
+        Region_MarkSlot (r, last);
+        moved += e->size;
+    }
+    /* the space left at the end goes back to the system at the next
+       sync */
+    return moved;
+}
+
+
+/* writes down what is pending before closing a region */
+static void Region_Close (Region *r)
+{
+    if (Region_Sync (r) < 0) {
+        SCEE_LogSrc ();
+        SCEE_Out ();
+        SCEE_Clear ();
+    }
+    Region_Delete (r);
+}
+
+
+/* region file system */
+
+void RegionFS_Init (RegionFS *rfs)
+{
+    rfs->root[0] = 0;
+    rfs->root_len = 0;
+    rfs->subfs = NULL;
+    rfs->n_regions = 0;
+    rfs->clock = 0;
+    rfs->n_reads = 0;
+    rfs->n_writes = 0;
+    rfs->bytes_compacted = 0;
+}
+void RegionFS_Clear (RegionFS *rfs)
+{
+    SCEuint i;
+    for (i = 0; i < rfs->n_regions; i++)
+        Region_Close (rfs->regions[i]);
+    rfs->n_regions = 0;
+}
+
+/**
+ * \brief Sets the directory whose subdirectories are packed in regions
+ */
+void RegionFS_SetRoot (RegionFS *rfs, const char *root)
+{
+    strncpy (rfs->root, root, sizeof rfs->root - 1);
+    rfs->root_len = strlen (rfs->root);
+    while (rfs->root_len > 0 && rfs->root[rfs->root_len - 1] == '/')
+        rfs->root[--rfs->root_len] = 0;
+}
+
+/* splits a file name into the directory of its region and its name in the
+   region, returns SCE_FALSE if the file doesn't belong to a region */
+static int RegionFS_Split (const RegionFS *rfs, const char *fname,
+                           size_t *dir_len, const char **name)
+{
+    const char *slash = strrchr (fname, '/');
+
+    if (!slash || strncmp (fname, rfs->root, rfs->root_len) ||
+        fname[rfs->root_len] != '/' || slash == &fname[rfs->root_len] ||
+        strlen (&slash[1]) >= REGION_MAX_NAME || !slash[1])
+        return SCE_FALSE;
+    *dir_len = slash - fname;
+    *name = &slash[1];
+    return SCE_TRUE;
+}
+
+static Region* RegionFS_GetRegion (RegionFS *rfs, const char *dir,
+                                   size_t dir_len, int create)
+{
+    Region *r = NULL;
+    SCEuint i, lru = 0;
+
+    for (i = 0; i < rfs->n_regions; i++) {
+        r = rfs->regions[i];
+        if (r->dir_len == dir_len && !strncmp (r->dir, dir, dir_len)) {
+            r->last_used = ++rfs->clock;
+            return r;
+        }
+    }
+
+    if (rfs->n_regions == REGIONFS_MAX_OPEN) {
+        /* close the least recently used region that has no open file */
+        for (i = 0, r = NULL; i < rfs->n_regions; i++) {
+            Region *o = rfs->regions[i];
+            if (!o->n_open && (!r || o->last_used < r->last_used)) {
+                r = o;
+                lru = i;
+            }
+        }
+        if (!r) {
+            SCEE_Log (SCE_INVALID_OPERATION);
+            SCEE_LogMsg ("too many open regions");
+            return NULL;
+        }
+        Region_Close (r);
+        rfs->regions[lru] = rfs->regions[--rfs->n_regions];
+    }
+
+    if (!(r = Region_Open (dir, dir_len, create))) {
+        SCEE_LogSrc ();
+        return NULL;
+    }
+    r->last_used = ++rfs->clock;
+    rfs->regions[rfs->n_regions++] = r;
+    return r;
+}
+
+/* gets the region of an existing file, NULL if there is none */
+static Region* RegionFS_Lookup (RegionFS *rfs, const char *fname, long *slot)
+{
+    Region *r = NULL;
+    const char *name = NULL;
+    size_t dir_len;
+
+    if (!RegionFS_Split (rfs, fname, &dir_len, &name))
+        return NULL;
+    if (!(r = RegionFS_GetRegion (rfs, fname, dir_len, SCE_FALSE))) {
+        /* no region (yet) or unreadable one: look for plain files */
+        SCEE_Clear ();
+        return NULL;
+    }
+    if ((*slot = Region_Find (r, name)) < 0)
+        return NULL;
+    return r;
+}
+
+
+static void* RegionFS_xopen (SCE_SFileSystem *fs, const char *fname, int flags)
+{
+    RegionFS *rfs = fs->udata;
+    RegionFile *rf = NULL;
+    Region *r = NULL;
+    const char *name = NULL;
+    size_t dir_len;
+    long slot = -1;
+
+    if (!(rf = SCE_malloc (sizeof *rf)))
+        goto fail;
+    memset (rf, 0, sizeof *rf);
+    SCE_File_Init (&rf->sub);
+
+    if (flags & (SCE_FILE_WRITE | SCE_FILE_CREATE | SCE_FILE_APPEND)) {
+        if (!RegionFS_Split (rfs, fname, &dir_len, &name))
+            goto pass;
+        if (!(r = RegionFS_GetRegion (rfs, fname, dir_len, SCE_TRUE)))
+            goto fail;
+        rf->mode = REGIONFILE_WRITE;
+        strcpy (rf->name, name);
+        slot = Region_Find (r, name);
+        /* keep the current content unless we are asked to start over */
+        if (slot >= 0 && (flags & (SCE_FILE_READ | SCE_FILE_APPEND))) {
+            RegionEntry *e = &r->entries[slot];
+            if (Region_Map (r, e->offset + e->size) < 0 ||
+                !(rf->buf = SCE_malloc (e->size + 1)))
+                goto fail;
+            memcpy (rf->buf, &r->map[e->offset], e->size);
+            rf->buf_size = rf->size = e->size;
+            if (flags & SCE_FILE_APPEND)
+                rf->pos = rf->size;
+        }
+    } else {
+        if (!(r = RegionFS_Lookup (rfs, fname, &slot)))
+            goto pass;
+        if (Region_Map (r, r->entries[slot].offset + r->entries[slot].size) < 0)
+            goto fail;
+        rf->mode = REGIONFILE_READ;
+        rf->offset = r->entries[slot].offset;
+        rf->size = r->entries[slot].size;
+        rfs->n_reads++;
+    }
+    rf->region = r;
+    r->n_open++;
+    return rf;
+
+pass:
+    rf->mode = REGIONFILE_PASS;
+    if (SCE_File_Open (&rf->sub, rfs->subfs, fname, flags) < 0)
+        goto fail;
+    return rf;
+fail:
+    if (rf)
+        SCE_free (rf->buf);
+    SCE_free (rf);
+    SCEE_LogSrc ();
+    return NULL;
+}
+
+static int RegionFS_xclose (SCE_SFileSystem *fs, void *fd)
+{
+    RegionFS *rfs = fs->udata;
+    RegionFile *rf = fd;
+    int code = 0;
+
+    if (rf->mode == REGIONFILE_PASS)
+        SCE_File_Close (&rf->sub);
+    else {
+        rf->region->n_open--;
+        if (rf->mode == REGIONFILE_WRITE) {
+            if (Region_Put (rf->region, rf->name, rf->buf, rf->size,
+                            Clock_GetFileTime ()) < 0) {
+                SCEE_LogSrc ();
+                code = -1;
+            }
+            rfs->n_writes++;
+        }
+    }
+    SCE_free (rf->buf);
+    SCE_free (rf);
+    return code;
+}
+
+static size_t RegionFS_xread (void *data, size_t size, size_t nmemb, void *fd)
+{
+    RegionFile *rf = fd;
+    const unsigned char *src = NULL;
+    size_t n;
+
+    if (rf->mode == REGIONFILE_PASS)
+        return SCE_File_Read (data, size, nmemb, &rf->sub);
+    if (size == 0)
+        return 0;
+    n = (rf->size - rf->pos) / size;
+    if (n > nmemb)
+        n = nmemb;
+    if (rf->mode == REGIONFILE_READ)
+        src = &rf->region->map[rf->offset];
+    else
+        src = rf->buf;
+    memcpy (data, &src[rf->pos], n * size);
+    rf->pos += n * size;
+    return n;
+}
+
+static size_t RegionFS_xwrite (const void *data, size_t size, size_t nmemb,
+                               void *fd)
+{
+    RegionFile *rf = fd;
+    size_t len = size * nmemb;
+
+    if (rf->mode == REGIONFILE_PASS)
+        return SCE_File_Write (data, size, nmemb, &rf->sub);
+    if (rf->mode != REGIONFILE_WRITE)
+        return 0;
+    if (rf->pos + len > rf->buf_size) {
+        size_t cap = rf->buf_size ? rf->buf_size : 4096;
+        unsigned char *buf = NULL;
+        while (cap < rf->pos + len)
+            cap *= 2;
+        if (!(buf = SCE_realloc (rf->buf, cap)))
+            return 0;
+        rf->buf = buf;
+        rf->buf_size = cap;
+    }
+    if (rf->pos > rf->size)
+        memset (&rf->buf[rf->size], 0, rf->pos - rf->size);
+    memcpy (&rf->buf[rf->pos], data, len);
+    rf->pos += len;
+    if (rf->pos > rf->size)
+        rf->size = rf->pos;
+    return nmemb;
+}
+
+static int RegionFS_xseek (void *fd, long offset, int whence)
+{
+    RegionFile *rf = fd;
+    long pos;
+
+    if (rf->mode == REGIONFILE_PASS)
+        return SCE_File_Seek (&rf->sub, offset, whence);
+    switch (whence) {
+    case SEEK_SET: pos = offset; break;
+    case SEEK_CUR: pos = rf->pos + offset; break;
+    case SEEK_END: pos = rf->size + offset; break;
+    default: return -1;
+    }
+    if (pos < 0 || (rf->mode == REGIONFILE_READ && (size_t)pos > rf->size))
+        return -1;
+    rf->pos = pos;
+    return 0;
+}
+static long RegionFS_xtell (void *fd)
+{
+    RegionFile *rf = fd;
+    if (rf->mode == REGIONFILE_PASS)
+        return SCE_File_Tell (&rf->sub);
+    return rf->pos;
+}
+static void RegionFS_xrewind (void *fd)
+{
+    RegionFile *rf = fd;
+    if (rf->mode == REGIONFILE_PASS)
+        SCE_File_Rewind (&rf->sub);
+    else
+        rf->pos = 0;
+}
+static int RegionFS_xflush (void *fd)
+{
+    RegionFile *rf = fd;
+    if (rf->mode == REGIONFILE_PASS)
+        return SCE_File_Flush (&rf->sub);
+    return 0;
+}
+static long RegionFS_xlength (void *fd)
+{
+    RegionFile *rf = fd;
+    if (rf->mode == REGIONFILE_PASS)
+        return SCE_File_Length (&rf->sub);
+    return rf->size;
+}
+
+/**
+ * \brief Sets up a file system on top of a RegionFS
+ * \param fs file system to setup
+ * \param subfs file system of the files that are not in regions, NULL for
+ * the default one
+ */
+void RegionFS_InitFileSystem (RegionFS *rfs, SCE_SFileSystem *fs,
+                              SCE_SFileSystem *subfs)
+{
+    rfs->subfs = subfs;
+    fs->xopen = RegionFS_xopen;
+    fs->xclose = RegionFS_xclose;
+    fs->xread = RegionFS_xread;
+    fs->xwrite = RegionFS_xwrite;
+    fs->xseek = RegionFS_xseek;
+    fs->xtell = RegionFS_xtell;
+    fs->xrewind = RegionFS_xrewind;
+    fs->xflush = RegionFS_xflush;
+    fs->xlength = RegionFS_xlength;
+    fs->udata = rfs;
+    fs->subfs = subfs;
+}
+
+/**
+ * \brief Gets the size and modification time of a file
+ * \returns SCE_TRUE if the file exists, SCE_FALSE if it doesn't, SCE_ERROR
+ * on error
+ */
+int RegionFS_Stat (RegionFS *rfs, const char *fname, size_t *size,
+                   int64_t *mtime)
+{
+    Region *r = NULL;
+    long slot;
+    struct stat st;
+
+    if ((r = RegionFS_Lookup (rfs, fname, &slot))) {
+        *size = r->entries[slot].size;
+        *mtime = r->entries[slot].mtime;
+        return SCE_TRUE;
+    }
+    if (stat (fname, &st) < 0) {
+        if (errno == ENOENT)
+            return SCE_FALSE;
+        SCEE_LogErrno (fname);
+        return SCE_ERROR;
+    }
+    *size = st.st_size;
+    *mtime = Clock_GetMTime (&st);
+    return SCE_TRUE;
+}
+
+/**
+ * \brief Removes a file from its region, or from the disk
+ */
+int RegionFS_Remove (RegionFS *rfs, const char *fname)
+{
+    Region *r = NULL;
+    long slot;
+
+    if ((r = RegionFS_Lookup (rfs, fname, &slot)) &&
+        Region_Remove (r, slot) < 0) {
+        SCEE_LogSrc ();
+        return SCE_ERROR;
+    }
+    if (remove (fname) < 0 && errno != ENOENT) {
+        SCEE_LogErrno (fname);
+        return SCE_ERROR;
+    }
+    return SCE_OK;
+}
+
+/**
+ * \brief Closes the region of a directory, if it is open
+ *
+ * Needed before the region file is moved or removed behind our back.
+ * \returns SCE_ERROR if files of the region are open
+ */
+int RegionFS_CloseDir (RegionFS *rfs, const char *dir)
+{
+    size_t len = strlen (dir);
+    SCEuint i;
+
+    for (i = 0; i < rfs->n_regions; i++) {
+        Region *r = rfs->regions[i];
+        if (r->dir_len != len || strcmp (r->dir, dir))
+            continue;
+        if (r->n_open) {
+            SCEE_Log (SCE_INVALID_OPERATION);
+            SCEE_LogMsg ("region %s is in use", r->path);
+            return SCE_ERROR;
+        }
+        Region_Close (r);
+        rfs->regions[i] = rfs->regions[--rfs->n_regions];
+        break;
+    }
+    return SCE_OK;
+}
+
+/**
+ * \brief Makes the files written to the open regions durable
+ *
+ * Writes are only committed by this function, and when a region gets
+ * closed: call it now and then. Until then, a crash loses the latest
+ * versions of the files but never leaves a region pointing to garbage.
+ */
+int RegionFS_Sync (RegionFS *rfs)
+{
+    SCEuint i;
+    for (i = 0; i < rfs->n_regions; i++) {
+        if (Region_Sync (rfs->regions[i]) < 0) {
+            SCEE_LogSrc ();
+            return SCE_ERROR;
+        }
+    }
+    return SCE_OK;
+}
+
+/**
+ * \brief Moves data of the open regions wasting too much space to fill
+ * their holes, so that their files can shrink
+ * \param max_bytes bytes to move at most
+ * \returns the number of bytes moved
+ */
+uint64_t RegionFS_Compact (RegionFS *rfs, uint64_t max_bytes)
+{
+    SCEuint i;
+    uint64_t moved = 0;
+
+    for (i = 0; i < rfs->n_regions && moved < max_bytes; i++) {
+        Region *r = rfs->regions[i];
+        /* files being read point into the region */
+        if (r->n_open || r->free_bytes * REGION_COMPACT_RATIO < r->file_size)
+            continue;
+        moved += Region_Compact (r, max_bytes - moved);
+    }
+    rfs->bytes_compacted += moved;
+    return moved;
+}
+
+static int RegionFS_Import (RegionFS *rfs, const char *fname,
+                            const struct stat *st)
+{
+    Region *r = NULL;
+    const char *name = NULL;
+    unsigned char *data = NULL;
+    size_t dir_len;
+    FILE *fp = NULL;
+
+    if (!RegionFS_Split (rfs, fname, &dir_len, &name))
+        return SCE_FALSE;
+    if (!(r = RegionFS_GetRegion (rfs, fname, dir_len, SCE_TRUE)))
+        goto fail;
+    if (!(data = SCE_malloc (st->st_size + 1)))
+        goto fail;
+    if (!(fp = fopen (fname, "rb")) ||
+        fread (data, 1, st->st_size, fp) != (size_t)st->st_size) {
+        SCEE_LogErrno (fname);
+        goto fail;
+    }
+    fclose (fp);
+    fp = NULL;
+    if (Region_Put (r, name, data, st->st_size, Clock_GetMTime (st)) < 0)
+        goto fail;
+    SCE_free (data);
+    /* the data must be safe before the original goes away */
+    if (Region_Sync (r) < 0)
+        goto fail;
+    if (remove (fname) < 0) {
+        SCEE_LogErrno (fname);
+        return SCE_ERROR;
+    }
+    return SCE_TRUE;
+fail:
+    if (fp)
+        fclose (fp);
+    SCE_free (data);
+    SCEE_LogSrc ();
+    return SCE_ERROR;
+}
+
+static long RegionFS_MigrateDir (RegionFS *rfs, const char *dir)
+{
+    DIR *d = NULL;
+    struct dirent *de = NULL;
+    struct stat st;
+    char path[512];
+    long n = 0, res;
+
+    if (!(d = opendir (dir))) {
+        SCEE_LogErrno (dir);
+        return SCE_ERROR;
+    }
+    while ((de = readdir (d))) {
+        if (!strcmp (de->d_name, ".") || !strcmp (de->d_name, ".."))
+            continue;
+        if (snprintf (path, sizeof path, "%s/%s", dir, de->d_name) >=
+            (int)sizeof path || stat (path, &st) < 0)
+            continue;
+        if (S_ISDIR (st.st_mode)) {
+            res = RegionFS_MigrateDir (rfs, path);
+            /* leaves the directory if anything is left in it */
+            rmdir (path);
+        } else if (S_ISREG (st.st_mode)) {
+            size_t len = strlen (path);
+            if (len > strlen (REGION_SUFFIX) &&
+                !strcmp (&path[len - strlen (REGION_SUFFIX)], REGION_SUFFIX))
+                continue;
+            res = RegionFS_Import (rfs, path, &st);
+        } else
+            continue;
+        if (res < 0) {
+            closedir (d);
+            SCEE_LogSrc ();
+            return SCE_ERROR;
+        }
+        n += res;
+    }
+    closedir (d);
+    return n;
+}
+
+/**
+ * \brief Moves the plain files of a world into regions
+ * \param root directory of the world, see RegionFS_SetRoot()
+ * \returns the number of files moved, SCE_ERROR on error
+ *
+ * Files that don't belong to a region (see RegionFS) are left untouched.
+ * Emptied directories are removed.
+ */
+long RegionFS_Migrate (RegionFS *rfs, const char *root)
+{
+    long n;
+
+    RegionFS_SetRoot (rfs, root);
+    if ((n = RegionFS_MigrateDir (rfs, rfs->root)) < 0)
+        SCEE_LogSrc ();
+    return n;
+}
+
+void RegionFS_PrintStats (FILE *fp, const RegionFS *rfs)
+{
+    SCEuint i, n_files = 0;
+    uint64_t size = 0, free_bytes = 0;
+
+    for (i = 0; i < rfs->n_regions; i++) {
+        n_files += rfs->regions[i]->n_entries;
+        size += rfs->regions[i]->file_size;
+        free_bytes += rfs->regions[i]->free_bytes;
+    }
+    fprintf (fp, "regions: %u open, %u files, %lu kB (%lu kB free), "
+             "%lu reads, %lu writes, %lu kB compacted\n", rfs->n_regions,
+             n_files, (unsigned long)(size / 1024),
+             (unsigned long)(free_bytes / 1024), rfs->n_reads, rfs->n_writes,
+             rfs->bytes_compacted / 1024);
+}
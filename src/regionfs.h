@@ -0,0 +1,122 @@
+/*------------------------------------------------------------------------------
+    Tune Land - Sandbox RPG
+    Copyright (C) 2012-2013
+        Antony Martin <antony(dot)martin(at)scengine(dot)org>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ -----------------------------------------------------------------------------*/
+
+#ifndef H_REGIONFS
+#define H_REGIONFS
+
+#include <stdio.h>
+#include <stdint.h>
+#include <SCE/utils/SCEUtils.h>
+
+/* longest file name stored in a region, longer ones are left as files */
+#define REGION_MAX_NAME 48
+/* maximum number of regions kept open at once */
+#define REGIONFS_MAX_OPEN 32
+
+/* region file layout:
+     RegionHeader
+     extents of REGION_ALIGN bytes multiples, one of them being the index:
+     an array of RegionEntry, one per slot */
+typedef struct regionheader RegionHeader;
+struct regionheader {
+    char magic[4];
+    uint32_t version;
+    uint64_t index_offset;
+    uint32_t index_capacity;    /* number of slots */
+    uint32_t reserved;
+};
+
+typedef struct regionentry RegionEntry;
+struct regionentry {
+    char name[REGION_MAX_NAME]; /* empty if the slot is free */
+    uint64_t offset;
+    uint32_t size;
+    uint32_t capacity;          /* size of the extent */
+    int64_t mtime;              /* nanoseconds */
+};
+
+typedef struct regionextent RegionExtent;
+struct regionextent {
+    uint64_t offset;
+    uint64_t size;
+};
+
+/* all the files of a directory packed into a single file */
+typedef struct region Region;
+struct region {
+    char *path;                 /* region file */
+    char *dir;                  /* directory whose files it holds */
+    size_t dir_len;
+    int fd;
+    unsigned char *map;         /* read-only mapping of the file */
+    size_t map_size;
+    uint64_t file_size;         /* end of the last extent */
+    RegionHeader header;
+    RegionEntry *entries;
+    SCEuint n_entries;
+    unsigned char *dirty;       /* slots to write at the next sync */
+    SCEuint n_dirty;
+    SCEuint *table;             /* slot + 1 of the entries, by name */
+    SCEuint table_size;
+    RegionExtent *free;         /* sorted free extents */
+    SCEuint n_free, free_cap;
+    uint64_t free_bytes;
+    RegionExtent *released;     /* freed, but the index on disk may still
+                                   point to them until the next sync */
+    SCEuint n_released, released_cap;
+    SCEuint n_open;             /* open files */
+    SCEuint last_used;
+};
+
+/* file system packing the files of the subdirectories of a world into one
+   region file per directory. files of the root directory, files with long
+   names and files not found in their region go to the sub file system,
+   which lets worlds be migrated lazily. not thread safe. */
+typedef struct regionfs RegionFS;
+struct regionfs {
+    char root[256];
+    size_t root_len;
+    SCE_SFileSystem *subfs;
+    Region *regions[REGIONFS_MAX_OPEN];
+    SCEuint n_regions;
+    SCEuint clock;
+
+    /* statistics */
+    SCEulong n_reads;
+    SCEulong n_writes;
+    SCEulong bytes_compacted;
+};
+
+void RegionFS_Init (RegionFS*);
+void RegionFS_Clear (RegionFS*);
+
+void RegionFS_SetRoot (RegionFS*, const char*);
+void RegionFS_InitFileSystem (RegionFS*, SCE_SFileSystem*, SCE_SFileSystem*);
+
+int RegionFS_Stat (RegionFS*, const char*, size_t*, int64_t*);
+int RegionFS_Remove (RegionFS*, const char*);
+int RegionFS_CloseDir (RegionFS*, const char*);
+
+int RegionFS_Sync (RegionFS*);
+uint64_t RegionFS_Compact (RegionFS*, uint64_t);
+long RegionFS_Migrate (RegionFS*, const char*);
+
+void RegionFS_PrintStats (FILE*, const RegionFS*);
+
+#endif /* guard */
@@ -0,0 +1,640 @@
+/*------------------------------------------------------------------------------
+    Tune Land - Sandbox RPG
+    Copyright (C) 2012-2013
+        Antony Martin <antony(dot)martin(at)scengine(dot)org>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ -----------------------------------------------------------------------------*/
+
+#include <string.h>
+#include <unistd.h>
+#include "clock.h"
+#include "voxcopy.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define VCOPY_X86
+#include <immintrin.h>
+#endif
+
+/* rows shorter than that (bytes) are copied one voxel at a time, that's
+   what the faces of the grids orthogonal to x look like */
+#define VCOPY_NARROW 16
+
+/* bytes copied per measure of VCopy_Benchmark() */
+#define VCOPY_BENCH_BYTES (32 << 20)
+/* last level cache size assumed when the system doesn't tell */
+#define VCOPY_BENCH_LLC (32 << 20)
+
+/* copies n rows of size bytes from src to dst */
+typedef void (*VCopyRowsFunc)(unsigned char*, size_t, const unsigned char*,
+                              size_t, size_t, size_t);
+/* packs the n voxels of elem bytes found every pitch bytes from src into
+   dst, reading up to end */
+typedef void (*VCopyGatherFunc)(unsigned char*, const unsigned char*, size_t,
+                                size_t, size_t, const unsigned char*);
+
+typedef struct vcopykernels VCopyKernels;
+struct vcopykernels {
+    const char *name;
+    VCopyRowsFunc rows;
+    VCopyGatherFunc gather;
+};
+
+static void VCopy_RowsScalar (unsigned char *dst, size_t dst_pitch,
+                              const unsigned char *src, size_t src_pitch,
+                              size_t size, size_t n)
+{
+    size_t i;
+    for (i = 0; i < n; i++)
+        memcpy (&dst[i * dst_pitch], &src[i * src_pitch], size);
+}
+
+/* memcpy() is a function call per voxel for narrow rows */
+static void VCopy_Narrow (unsigned char *dst, size_t dst_pitch,
+                          const unsigned char *src, size_t src_pitch,
+                          size_t size, size_t n)
+{
+    size_t i, j;
+
+    switch (size) {
+    case 1:
+        for (i = 0; i < n; i++)
+            dst[i * dst_pitch] = src[i * src_pitch];
+        break;
+    case 2:
+        for (i = 0; i < n; i++) {
+            dst[i * dst_pitch] = src[i * src_pitch];
+            dst[i * dst_pitch + 1] = src[i * src_pitch + 1];
+        }
+        break;
+    default:
+        for (i = 0; i < n; i++) {
+            for (j = 0; j < size; j++)
+                dst[i * dst_pitch + j] = src[i * src_pitch + j];
+        }
+    }
+}
+
+static void VCopy_GatherScalar (unsigned char *dst, const unsigned char *src,
+                                size_t pitch, size_t elem, size_t n,
+                                const unsigned char *end)
+{
+    (void)end;
+    VCopy_Narrow (dst, elem, src, pitch, elem, n);
+}
+
+#ifdef VCOPY_X86
+__attribute__ ((target ("sse2")))
+static void VCopy_RowsSSE2 (unsigned char *dst, size_t dst_pitch,
+                            const unsigned char *src, size_t src_pitch,
+                            size_t size, size_t n)
+{
+    size_t i, j;
+
+    for (i = 0; i < n; i++) {
+        unsigned char *d = &dst[i * dst_pitch];
+        const unsigned char *s = &src[i * src_pitch];
+
+        for (j = 0; j + 16 <= size; j += 16)
+            _mm_storeu_si128 ((__m128i*)&d[j],
+                              _mm_loadu_si128 ((const __m128i*)&s[j]));
+        /* overlap the last vector rather than finishing byte per byte */
+        if (j < size)
+            _mm_storeu_si128 ((__m128i*)&d[size - 16],
+                              _mm_loadu_si128 ((const __m128i*)&s[size - 16]));
+    }
+}
+
+__attribute__ ((target ("avx2")))
+static void VCopy_RowsAVX2 (unsigned char *dst, size_t dst_pitch,
+                            const unsigned char *src, size_t src_pitch,
+                            size_t size, size_t n)
+{
+    size_t i, j;
+
+    for (i = 0; i < n; i++) {
+        unsigned char *d = &dst[i * dst_pitch];
+        const unsigned char *s = &src[i * src_pitch];
+
+        for (j = 0; j + 32 <= size; j += 32)
+            _mm256_storeu_si256 ((__m256i*)&d[j],
+                                 _mm256_loadu_si256 ((const __m256i*)&s[j]));
+        if (size - j >= 16) {
+            _mm_storeu_si128 ((__m128i*)&d[j],
+                              _mm_loadu_si128 ((const __m128i*)&s[j]));
+            j += 16;
+        }
+        if (j < size)
+            _mm_storeu_si128 ((__m128i*)&d[size - 16],
+                              _mm_loadu_si128 ((const __m128i*)&s[size - 16]));
+    }
+}
+
+/* loads 8 voxels at once with a 32 bits gather and keeps their first elem
+   bytes, SSE2 has no gather and no scatter exists before AVX-512 */
+__attribute__ ((target ("avx2")))
+static void VCopy_GatherAVX2 (unsigned char *dst, const unsigned char *src,
+                              size_t pitch, size_t elem, size_t n,
+                              const unsigned char *end)
+{
+    __m256i index, pack, order;
+    size_t i = 0;
+
+    if ((elem != 1 && elem != 2 && elem != 4) || pitch > 0x7fffffff / 8) {
+        VCopy_Narrow (dst, elem, src, pitch, elem, n);
+        return;
+    }
+    index = _mm256_mullo_epi32 (_mm256_setr_epi32 (0, 1, 2, 3, 4, 5, 6, 7),
+                                _mm256_set1_epi32 ((int)pitch));
+    if (elem == 1) {
+        pack = _mm256_setr_epi8 (0, 4, 8, 12, -1, -1, -1, -1,
+                                 -1, -1, -1, -1, -1, -1, -1, -1,
+                                 0, 4, 8, 12, -1, -1, -1, -1,
+                                 -1, -1, -1, -1, -1, -1, -1, -1);
+        order = _mm256_setr_epi32 (0, 4, 1, 1, 1, 1, 1, 1);
+    } else {
+        pack = _mm256_setr_epi8 (0, 1, 4, 5, 8, 9, 12, 13,
+                                 -1, -1, -1, -1, -1, -1, -1, -1,
+                                 0, 1, 4, 5, 8, 9, 12, 13,
+                                 -1, -1, -1, -1, -1, -1, -1, -1);
+        order = _mm256_setr_epi32 (0, 1, 4, 5, 2, 2, 2, 2);
+    }
+
+    /* the gather reads 4 bytes per voxel, stay within the buffer */
+    for (; i + 8 <= n && &src[(i + 7) * pitch + 4] <= end; i += 8) {
+        __m256i v = _mm256_i32gather_epi32 ((const int*)&src[i * pitch],
+                                            index, 1);
+        switch (elem) {
+        case 4:
+            _mm256_storeu_si256 ((__m256i*)&dst[i * 4], v);
+            break;
+        case 2:
+            v = _mm256_permutevar8x32_epi32 (_mm256_shuffle_epi8 (v, pack),
+                                             order);
+            _mm_storeu_si128 ((__m128i*)&dst[i * 2],
+                              _mm256_castsi256_si128 (v));
+            break;
+        default:
+            v = _mm256_permutevar8x32_epi32 (_mm256_shuffle_epi8 (v, pack),
+                                             order);
+            _mm_storel_epi64 ((__m128i*)&dst[i],
+                              _mm256_castsi256_si128 (v));
+        }
+    }
+    VCopy_Narrow (&dst[i * elem], elem, &src[i * pitch], pitch, elem, n - i);
+}
+#endif
+
+static const VCopyKernels vcopy_kernels[VCOPY_NUM_ISAS] = {
+    {"scalar", VCopy_RowsScalar, VCopy_GatherScalar},
+#ifdef VCOPY_X86
+    {"sse2", VCopy_RowsSSE2, VCopy_GatherScalar},
+    {"avx2", VCopy_RowsAVX2, VCopy_GatherAVX2}
+#else
+    {"sse2", VCopy_RowsScalar, VCopy_GatherScalar},
+    {"avx2", VCopy_RowsScalar, VCopy_GatherScalar}
+#endif
+};
+
+static VCopyISA vcopy_isa = VCOPY_SCALAR;
+
+/**
+ * \brief Picks the best kernels the CPU can run, call it before starting
+ * any thread that could copy voxels
+ */
+void VCopy_Init (void)
+{
+    VCopyISA isa = VCOPY_NUM_ISAS;
+    while (isa-- > VCOPY_SCALAR) {
+        if (VCopy_IsSupported (isa))
+            break;
+    }
+    vcopy_isa = isa;
+}
+
+int VCopy_IsSupported (VCopyISA isa)
+{
+    switch (isa) {
+    case VCOPY_SCALAR: return SCE_TRUE;
+#ifdef VCOPY_X86
+    case VCOPY_SSE2: return __builtin_cpu_supports ("sse2");
+    case VCOPY_AVX2: return __builtin_cpu_supports ("avx2");
+#endif
+    default: return SCE_FALSE;
+    }
+}
+
+/**
+ * \brief Forces the kernels to use
+ * \returns SCE_ERROR if the CPU can't run them
+ */
+int VCopy_SetISA (VCopyISA isa)
+{
+    if (!VCopy_IsSupported (isa)) {
+        SCEE_Log (SCE_INVALID_ARG);
+        SCEE_LogMsg ("%s copy kernels not supported",
+                     VCopy_GetName (isa));
+        return SCE_ERROR;
+    }
+    vcopy_isa = isa;
+    return SCE_OK;
+}
+
+VCopyISA VCopy_GetISA (void)
+{
+    return vcopy_isa;
+}
+
+const char* VCopy_GetName (VCopyISA isa)
+{
+    if (isa >= VCOPY_NUM_ISAS)
+        return "unknown";
+    return vcopy_kernels[isa].name;
+}
+
+static void VCopy_Strided (unsigned char *dst, size_t dst_pitch,
+                           const unsigned char *src, size_t src_pitch,
+                           size_t size, size_t n, const unsigned char *end)
+{
+    if (size >= VCOPY_NARROW)
+        vcopy_kernels[vcopy_isa].rows (dst, dst_pitch, src, src_pitch,
+                                       size, n);
+    else if (dst_pitch == size)
+        vcopy_kernels[vcopy_isa].gather (dst, src, src_pitch, size, n, end);
+    else
+        VCopy_Narrow (dst, dst_pitch, src, src_pitch, size, n);
+}
+
+/**
+ * \brief Copies \p n rows of \p size bytes
+ * \param dst_pitch bytes between two rows of \p dst
+ * \param src_pitch bytes between two rows of \p src
+ */
+void VCopy_Rows (void *dst, size_t dst_pitch, const void *src,
+                 size_t src_pitch, size_t size, size_t n)
+{
+    const unsigned char *s = src;
+    if (n == 0)
+        return;
+    VCopy_Strided (dst, dst_pitch, s, src_pitch, size, n,
+                   &s[(n - 1) * src_pitch + size]);
+}
+
+static long VCopy_Wrap (long v, long n)
+{
+    v %= n;
+    return v < 0 ? v + n : v;
+}
+
+/* a region of a volume is at most 2 runs of contiguous rows per axis
+   because of the wrapping, buf holds the region packed */
+static void VCopy_Region (const VCopyVolume *v, const SCE_SIntRect3 *r,
+                          unsigned char *buf, int to_volume)
+{
+    size_t elem = v->elem;
+    size_t pitch = v->dims[0] * elem, slice = pitch * v->dims[1];
+    long rw = r->p2[0] - r->p1[0], rh = r->p2[1] - r->p1[1];
+    long rd = r->p2[2] - r->p1[2];
+    size_t buf_pitch = rw * elem, buf_slice = buf_pitch * rh;
+    const unsigned char *vol_end = &v->data[slice * v->dims[2]];
+    const unsigned char *buf_end = &buf[buf_slice * rd];
+    long x0, y0, z0, nx[2], ny[2];
+    long z;
+
+    x0 = VCopy_Wrap (r->p1[0] + v->wrap[0], v->dims[0]);
+    y0 = VCopy_Wrap (r->p1[1] + v->wrap[1], v->dims[1]);
+    z0 = VCopy_Wrap (r->p1[2] + v->wrap[2], v->dims[2]);
+    nx[0] = rw < v->dims[0] - x0 ? rw : v->dims[0] - x0;
+    nx[1] = rw - nx[0];
+    ny[0] = rh < v->dims[1] - y0 ? rh : v->dims[1] - y0;
+    ny[1] = rh - ny[0];
+
+    for (z = 0; z < rd; z++) {
+        unsigned char *vs = &v->data[((z0 + z) % v->dims[2]) * slice];
+        unsigned char *bs = &buf[z * buf_slice];
+        int i, j;
+
+        for (j = 0; j < 2; j++) {
+            long vy = j ? 0 : y0, by = j ? ny[0] : 0;
+
+            for (i = 0; i < 2 && ny[j]; i++) {
+                long vx = i ? 0 : x0, bx = i ? nx[0] : 0;
+                unsigned char *vp = &vs[vy * pitch + vx * elem];
+                unsigned char *bp = &bs[by * buf_pitch + bx * elem];
+
+                if (!nx[i])
+                    continue;
+                if (to_volume)
+                    VCopy_Strided (vp, pitch, bp, buf_pitch, nx[i] * elem,
+                                   ny[j], buf_end);
+                else
+                    VCopy_Strided (bp, buf_pitch, vp, pitch, nx[i] * elem,
+                                   ny[j], vol_end);
+            }
+        }
+    }
+}
+
+/**
+ * \brief Copies a packed region into a volume
+ * \param r region to write, in the coordinates of the volume before
+ * wrapping, it must not be larger than the volume
+ * \param src the voxels of the region, x first
+ * \sa VCopy_FromVolume()
+ */
+void VCopy_ToVolume (VCopyVolume *v, const SCE_SIntRect3 *r, const void *src)
+{
+    VCopy_Region (v, r, (unsigned char*)src, SCE_TRUE);
+}
+/**
+ * \brief Extracts a region of a volume, the slices of a grid in particular
+ * \sa VCopy_ToVolume()
+ */
+void VCopy_FromVolume (const VCopyVolume *v, const SCE_SIntRect3 *r,
+                       void *dst)
+{
+    VCopy_Region (v, r, dst, SCE_FALSE);
+}
+
+static SCEulong VCopy_Time (VCopyVolume *v, const SCE_SIntRect3 *r,
+                            unsigned char *buf, int to_volume, long runs)
+{
+    SCEulong t = Clock_GetMicro ();
+    long i;
+
+    for (i = 0; i < runs; i++)
+        VCopy_Region (v, r, buf, to_volume);
+    return Clock_GetMicro () - t;
+}
+
+/**
+ * \brief Measures the kernels of every supported instruction set on the
+ * faces and blocks of a grid of the size of the terrain ones
+ *
+ * The results are checked against the scalar kernels. Leaves the best
+ * kernels selected.
+ */
+int VCopy_Benchmark (FILE *out, size_t elem)
+{
+    static const char *shapes[] = {"x face", "y face", "z face", "block"};
+    static const long sizes[] = {16, 64, 128};
+    VCopyVolume v, ref;
+    unsigned char *buf = NULL, *check = NULL;
+    size_t vol_size;
+    SCEuint s, k;
+    VCopyISA isa;
+
+    v.data = ref.data = NULL;
+    v.dims[0] = v.dims[1] = v.dims[2] = 128;
+    /* so that every shape wraps around */
+    v.wrap[0] = 37; v.wrap[1] = 91; v.wrap[2] = 13;
+    v.elem = elem;
+    ref = v;
+    vol_size = v.dims[0] * v.dims[1] * v.dims[2] * elem;
+    if (!(v.data = SCE_malloc (vol_size)) ||
+        !(ref.data = SCE_malloc (vol_size)) ||
+        !(buf = SCE_malloc (vol_size)) ||
+        !(check = SCE_malloc (vol_size)))
+        goto fail;
+    for (k = 0; k < vol_size; k++)
+        v.data[k] = (k * 2654435761u) >> 13;
+    memcpy (ref.data, v.data, vol_size);
+
+    for (k = 0; k < sizeof sizes / sizeof *sizes; k++) {
+        for (s = 0; s < sizeof shapes / sizeof *shapes; s++) {
+            SCE_SIntRect3 r;
+            long n = sizes[k];
+            size_t bytes;
+            long runs;
+
+            r.p1[0] = r.p1[1] = r.p1[2] = 100;
+            r.p2[0] = r.p2[1] = r.p2[2] = 100 + n;
+            if (s < 3)
+                r.p2[s] = r.p1[s] + 1;
+            bytes = (size_t)(r.p2[0] - r.p1[0]) * (r.p2[1] - r.p1[1]) *
+                (r.p2[2] - r.p1[2]) * elem;
+            runs = VCOPY_BENCH_BYTES / bytes + 1;
+
+            VCopy_SetISA (VCOPY_SCALAR);
+            VCopy_FromVolume (&ref, &r, check);
+
+            for (isa = VCOPY_SCALAR; isa < VCOPY_NUM_ISAS; isa++) {
+                SCEulong get, set;
+
+                if (!VCopy_IsSupported (isa))
+                    continue;
+                VCopy_SetISA (isa);
+                memset (buf, 0, bytes);
+                get = VCopy_Time (&v, &r, buf, SCE_FALSE, runs);
+                if (memcmp (buf, check, bytes)) {
+                    SCEE_Log (SCE_INVALID_OPERATION);
+                    SCEE_LogMsg ("%s kernels: extracted region differs",
+                                 VCopy_GetName (isa));
+                    goto fail;
+                }
+                set = VCopy_Time (&v, &r, buf, SCE_TRUE, runs);
+                if (memcmp (v.data, ref.data, vol_size)) {
+                    SCEE_Log (SCE_INVALID_OPERATION);
+                    SCEE_LogMsg ("%s kernels: written region differs",
+                                 VCopy_GetName (isa));
+                    goto fail;
+                }
+                fprintf (out, "%-6s %3ld %-6s  get %8.1f MB/s  set %8.1f "
+                         "MB/s\n", shapes[s], n, VCopy_GetName (isa),
+                         get ? (double)bytes * runs / get : 0.0,
+                         set ? (double)bytes * runs / set : 0.0);
+            }
+        }
+    }
+
+    VCopy_Init ();
+    SCE_free (check);
+    SCE_free (buf);
+    SCE_free (ref.data);
+    SCE_free (v.data);
+    return SCE_OK;
+fail:
+    VCopy_Init ();
+    SCE_free (check);
+    SCE_free (buf);
+    SCE_free (ref.data);
+    SCE_free (v.data);
+    SCEE_LogSrc ();
+    return SCE_ERROR;
+}
+
+/* orders of the voxels compared by VCopy_BenchmarkLayouts() */
+enum {
+    VCOPY_BENCH_LINEAR,         /* x first, then y, then z */
+    VCOPY_BENCH_BRICKS,         /* linear 4x4x4 bricks, linear inside */
+    VCOPY_BENCH_MORTON,         /* bits of x, y and z interleaved */
+    VCOPY_BENCH_NUM_LAYOUTS
+};
+
+#define VCOPY_BRICK_SHIFT 2
+
+/* spreads the 10 lowest bits of v 3 bits apart */
+static size_t VCopy_Spread (size_t v)
+{
+    v &= 0x3ff;
+    v = (v | v << 16) & 0x30000ff;
+    v = (v | v << 8) & 0x300f00f;
+    v = (v | v << 4) & 0x30c30c3;
+    v = (v | v << 2) & 0x9249249;
+    return v;
+}
+
+/* in every layout the offset of a voxel is the sum of one term per axis,
+   fills off with the term of each coordinate of the axis, after wrapping.
+   the volume is a cube whose side n is a power of 2 */
+static void VCopy_MakeOffsets (int layout, int axis, long n, long wrap,
+                               size_t elem, size_t *off)
+{
+    const long m = (1 << VCOPY_BRICK_SHIFT) - 1;
+    long i;
+    int k;
+
+    for (i = 0; i <= n; i++) {
+        size_t c = (i + wrap) & (n - 1), o;
+
+        switch (layout) {
+        case VCOPY_BENCH_BRICKS:
+        {
+            size_t nb = n >> VCOPY_BRICK_SHIFT, brick = c >> VCOPY_BRICK_SHIFT;
+            for (k = 0; k < axis; k++)
+                brick *= nb;
+            o = (brick << (3 * VCOPY_BRICK_SHIFT)) +
+                ((c & m) << (axis * VCOPY_BRICK_SHIFT));
+            break;
+        }
+        case VCOPY_BENCH_MORTON:
+            o = VCopy_Spread (c) << axis;
+            break;
+        default:
+            o = c;
+            for (k = 0; k < axis; k++)
+                o *= n;
+        }
+        off[i] = o * elem;
+    }
+}
+
+/* reads the 8 corners of every cell of a volume, like a mesher does */
+static SCEulong VCopy_WalkCells (const unsigned char *data, long n,
+                                 size_t * const off[3])
+{
+    SCEulong sum = 0;
+    long x, y, z;
+
+    for (z = 0; z < n; z++) {
+        for (y = 0; y < n; y++) {
+            const unsigned char *rows[4];
+            int i;
+
+            rows[0] = &data[off[1][y] + off[2][z]];
+            rows[1] = &data[off[1][y + 1] + off[2][z]];
+            rows[2] = &data[off[1][y] + off[2][z + 1]];
+            rows[3] = &data[off[1][y + 1] + off[2][z + 1]];
+            for (x = 0; x < n; x++) {
+                for (i = 0; i < 4; i++)
+                    sum += rows[i][off[0][x]] + rows[i][off[0][x + 1]];
+            }
+        }
+    }
+    return sum;
+}
+
+static size_t VCopy_GetCacheSize (void)
+{
+#ifdef _SC_LEVEL3_CACHE_SIZE
+    long size = sysconf (_SC_LEVEL3_CACHE_SIZE);
+    if (size > 0)
+        return size;
+#endif
+    return VCOPY_BENCH_LLC;
+}
+
+/**
+ * \brief Measures the cache misses of a mesher walking a grid stored
+ * linearly, in 4x4x4 bricks and in Morton order
+ *
+ * The grid is a wrapping cube larger than the last level cache, its cells
+ * are visited in the coordinates of the terrain, the wrapping moving the
+ * origin of the storage like the terrain grids do. The layouts must find
+ * the same voxels.
+ */
+int VCopy_BenchmarkLayouts (FILE *out, size_t elem)
+{
+    static const char *names[VCOPY_BENCH_NUM_LAYOUTS] = {
+        "linear", "bricks", "morton"
+    };
+    static const long wrap[3] = {37, 91, 13};
+    unsigned char *data = NULL;
+    size_t *off[3] = {NULL, NULL, NULL};
+    size_t llc = VCopy_GetCacheSize (), vol_size;
+    SCEulong ref_sum = 0;
+    long n = 128, x, y, z;
+    int layout, i;
+
+    /* twice the cache is enough to miss, stay below 1 GB though */
+    while (n < 512 && (size_t)n * n * n * elem < 2 * llc)
+        n *= 2;
+    vol_size = (size_t)n * n * n * elem;
+    if (!(data = SCE_malloc (vol_size)))
+        goto fail;
+    for (i = 0; i < 3; i++) {
+        if (!(off[i] = SCE_malloc ((n + 1) * sizeof *off[i])))
+            goto fail;
+    }
+    fprintf (out, "%ld^3 voxels (%.0f MB), last level cache %.1f MB\n", n,
+             vol_size / 1048576.0, llc / 1048576.0);
+
+    for (layout = 0; layout < VCOPY_BENCH_NUM_LAYOUTS; layout++) {
+        SCEulong t, sum;
+
+        for (i = 0; i < 3; i++)
+            VCopy_MakeOffsets (layout, i, n, wrap[i], elem, off[i]);
+        for (z = 0; z < n; z++) {
+            for (y = 0; y < n; y++) {
+                for (x = 0; x < n; x++)
+                    data[off[0][x] + off[1][y] + off[2][z]] =
+                        ((x * 73 + y * 151 + z * 283) * 2654435761u) >> 13;
+            }
+        }
+
+        t = Clock_GetMicro ();
+        sum = VCopy_WalkCells (data, n, off);
+        t = Clock_GetMicro () - t;
+        if (layout == VCOPY_BENCH_LINEAR)
+            ref_sum = sum;
+        else if (sum != ref_sum) {
+            SCEE_Log (SCE_INVALID_OPERATION);
+            SCEE_LogMsg ("%s layout: cell walk differs", names[layout]);
+            goto fail;
+        }
+        fprintf (out, "%-7s cells %6.2f ns\n", names[layout],
+                 1000.0 * t / ((double)n * n * n));
+    }
+
+    for (i = 0; i < 3; i++)
+        SCE_free (off[i]);
+    SCE_free (data);
+    return SCE_OK;
+fail:
+    for (i = 0; i < 3; i++)
+        SCE_free (off[i]);
+    SCE_free (data);
+    SCEE_LogSrc ();
+    return SCE_ERROR;
+}
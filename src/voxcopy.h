@@ -0,0 +1,59 @@
+/*------------------------------------------------------------------------------
+    Tune Land - Sandbox RPG
+    Copyright (C) 2012-2013
+        Antony Martin <antony(dot)martin(at)scengine(dot)org>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ -----------------------------------------------------------------------------*/
+
+#ifndef H_VOXCOPY
+#define H_VOXCOPY
+
+#include <stdio.h>
+#include <SCE/utils/SCEUtils.h>
+
+/* instruction sets the copy kernels can use */
+typedef enum {
+    VCOPY_SCALAR,
+    VCOPY_SSE2,
+    VCOPY_AVX2,
+    VCOPY_NUM_ISAS
+} VCopyISA;
+
+/* 3D array of voxels. the volume wraps around: voxel (x, y, z) is stored
+   at ((x + wrap[0]) mod dims[0], ...), like the grids of the terrain */
+typedef struct vcopyvolume VCopyVolume;
+struct vcopyvolume {
+    unsigned char *data;
+    long dims[3];
+    long wrap[3];
+    size_t elem;                /* bytes per voxel */
+};
+
+void VCopy_Init (void);
+
+int VCopy_IsSupported (VCopyISA);
+int VCopy_SetISA (VCopyISA);
+VCopyISA VCopy_GetISA (void);
+const char* VCopy_GetName (VCopyISA);
+
+void VCopy_Rows (void*, size_t, const void*, size_t, size_t, size_t);
+
+void VCopy_ToVolume (VCopyVolume*, const SCE_SIntRect3*, const void*);
+void VCopy_FromVolume (const VCopyVolume*, const SCE_SIntRect3*, void*);
+
+int VCopy_Benchmark (FILE*, size_t);
+int VCopy_BenchmarkLayouts (FILE*, size_t);
+
+#endif /* guard */